@@ -32,6 +32,12 @@ const char *pbwtHtslibVersionString(void);
 
 typedef unsigned char uchar ;
 
+typedef struct PbwtBlocksStruct PbwtBlocks ; /* block compressed or mapped yz left on disk, see pbwtIO.c */
+typedef struct BlockCacheStruct BlockCache ; /* per cursor cache of uncompressed blocks */
+typedef struct PbwtStreamStruct PbwtStream ; /* columns arriving from a reader thread, see pbwtStream.c */
+typedef struct DosageIndexStruct DosageIndex ; /* sample major dosages, see pbwtDosageIndex.c */
+typedef struct PbwtPanelStruct PbwtPanel ; /* site index and cursor checkpoints of a prepared reference, see pbwtPanel.c */
+
 typedef struct PBWTstruct {
   int N ;			/* number of sites */
   int M ;			/* number of samples */
@@ -39,6 +45,9 @@ typedef struct PBWTstruct {
   Array sites ;			/* array of Site */
   Array samples ;		/* array of int index into global samples */
   Array yz ;			/* compressed PBWT array of uchar */
+  PbwtBlocks *yzBlocks ;	/* if yz is 0, read lazily from here by cursors */
+  PbwtStream *yzStream ;	/* if yz is 0, columns come from here as a cursor moves; sites and N grow */
+  PbwtPanel *panel ;		/* set if read from a prepared reference panel */
   int *aFstart, *aFend ;	/* start and end a[] index arrays for forwards cursor */
   Array zz ;			/* compressed reverse PBWT array of uchar */
   int *aRstart, *aRend ; /* start and end a[] index arrays for reverse cursor */
@@ -48,6 +57,7 @@ typedef struct PBWTstruct {
   Array missingOffset ;		/* of long, site index into zMissing, 0 if no missing data at site */
   Array zDosage ;		/* run-length compressed array of uchar in local sort order */
   Array dosageOffset ;		/* of long, site index into zDosage, 0 if no dosage data */
+  int dosageBits ;		/* codec of zDosage: 0 for the original 0.1 bins, else 8 or 16 bit */
   BOOL  isRefFreq ;		/* some flags for the whole VCF */
   BOOL  isUnphased ;
   int NoProjections;
@@ -100,6 +110,8 @@ typedef struct {		/* data structure for moving forwards - doesn't know PBWT */
   int *b ;			/* for local operations - no long term meaning */
   int *e ;			/* for local operations - no long term meaning */
   long nBlockStart ;		/* u->n at start of block encoding current u->y */
+  BlockCache *zc ;		/* if non-zero read packed bytes through this, not z */
+  PbwtStream *zs ;		/* if non-zero read packed bytes from this stream, not z */
 } PbwtCursor ;
 
 /* pbwtMain.c */
@@ -111,25 +123,44 @@ extern FILE *logFile ;  /* log file pointer */
 
 extern BOOL isCheck ;		/* when TRUE carry out various checks */
 extern BOOL isStats ;		/* when TRUE report stats in various places */
+extern long pbwtMemoryBudget ;	/* bytes that large out-of-core operations may hold in memory */
+extern int nThreads ;		/* number of threads to use in parallel sections, default 1 */
 extern DICT *variationDict ;	/* "xxx|yyy" where variation is from xxx to yyy in VCF */
 /* NB using a global DICT for variation means that identical variations use the same string */
 
 void pbwtInit (void) ;
+void pbwtParallelFor (int n, void (*func)(void *arg, int i, int thread), void *arg) ;
+  /* call func(arg, i, thread) for 0 <= i < n, spread over nThreads; thread is in [0, nThreads) */
 PBWT *pbwtCreate (int M, int N) ; /* OK to have N == 0 and set p->N later if not known now */
 void pbwtDestroy (PBWT *p) ;
 PBWT *pbwtSubSites (PBWT *pOld, double fmin, double frac) ;
 PBWT *pbwtSubRange (PBWT *pOld, int start, int end) ;
+PBWT *pbwtConcat (PBWT *p, PBWT *q) ; /* append q's later sites to p, destroying q */
+typedef struct PbwtTransformStruct PbwtTransform ; /* chain of site and sample selections run in one pass */
+PbwtTransform *pbwtTransformCreate (PBWT *p) ;
+void pbwtTransformSubSites (PbwtTransform *t, double fmin, double frac) ;
+void pbwtTransformSubRange (PbwtTransform *t, int start, int end) ;
+void pbwtTransformSelectSites (PbwtTransform *t, Array sites) ; /* takes sites */
+void pbwtTransformRemoveSites (PbwtTransform *t, Array sites) ; /* takes sites */
+void pbwtTransformSubSample (PbwtTransform *t, Array select) ;
+Array pbwtTransformSamples (PbwtTransform *t) ; /* sample ids of haplotypes at this point in the chain */
+PBWT *pbwtTransformRun (PbwtTransform *t) ; /* consumes t and the PBWT, returns the result */
 void pbwtBuildReverse (PBWT *p) ;
 uchar **pbwtHaplotypes (PBWT *p) ;
+void pbwtTranspose (PBWT *p, void (*func)(void *arg, int j, uchar *hap), void *arg) ;
+  /* call func(arg, j, hap) for each haplotype j in turn, hap[0..N) holding 0/1; uses at most
+     about pbwtMemoryBudget bytes, spilling to a temporary file if needed */
 void vcfHaplotypes (VCF *Query, PBWT *ref, char *filename);
 PBWT *pbwtSelectSites (PBWT *pOld, Array sites, BOOL isKeepOld) ;
 PBWT *pbwtSelectSitesFillMissing (PBWT *pOld, Array sites, BOOL isKeepOld) ;
 PBWT *pbwtRemoveSites (PBWT *pOld, Array sites, BOOL isKeepOld) ;
+int pbwtSitesSearch (Array sites, int i, int x) ; /* first index >= i with position >= x, sites sorted */
 
 /* operations to move forwards and backwards in the pbwt using the cursor structure */
 
 PbwtCursor *pbwtCursorCreate (PBWT *p, BOOL isForwards, BOOL isStart) ;
 PbwtCursor *pbwtNakedCursorCreate (int M, int *aInit) ;
+PbwtCursor *pbwtCursorCreateAt (PBWT *p, int *a, long n) ; /* forwards from column at yz byte n with order a; no d */
 void pbwtCursorDestroy (PbwtCursor *u) ;
 void pbwtCursorForwardsA (PbwtCursor *u) ; /* algorithm 1 in the manuscript */
 void pbwtCursorForwardsAPacked (PbwtCursor *u) ; /* faster version, when have read y and set u->nBlockStart */
@@ -162,6 +193,9 @@ int pack3 (uchar *yp, int M, uchar *yzp) ; /* pack M values from yp into yzp */
 int pack3arrayAdd (uchar *yp, int M, Array ayz) ; /* normally use this one */
 int unpack3 (uchar *yzp, int M, uchar *yp, int *n0) ; /* unpack M values from yzp into yp, return number of bytes used from yzp, if (n0) write number of 0s into *n0 */
 int packCountReverse (uchar *yzp, int M) ; /* return number of bytes to reverse one position */
+int packCountForwards (uchar *yzp, int M) ; /* return number of bytes to advance one position */
+int pack3ColumnInsert (Array col, int r, uchar v) ; /* col holds one column: insert v at r, return #0s before r */
+uchar pack3ColumnDelete (Array col, int r, int *zeros) ; /* remove and return value at r, *zeros = #0s before r */
 int extendMatchForwards (uchar *yzp, int M, uchar x, int *f, int *g) ; /* move hit interval f,g) forwards one position, matching x */
 int extendPackedForwards (uchar *yzp, int M, int *f, uchar *zp) ; /* move f forwards one position */
 int extendPackedBackwards (uchar *yzp, int M, int *f, int c, uchar *zp) ; /* move f backwards one position - write value into *zp if zp non-zero */
@@ -177,14 +211,19 @@ char* popName (Sample *s) ;	/* give back population name for sample i */
 PBWT *pbwtSubSample (PBWT *pOld, Array select) ;
 PBWT *pbwtSubSampleInterval (PBWT *pOld, int start, int Mnew) ;
 PBWT *pbwtSelectSamples (PBWT *pOld, FILE *fp) ;
+Array pbwtSelectSamplesIndex (Array oldSamples, FILE *fp) ; /* haplotype positions in oldSamples of samples in fp */
 PBWT *pbwtReadProjections (PBWT *pOld, FILE *fp) ;
 
 /* pbwtIO.c */
 
 extern int nCheckPoint ;	/* if set non-zero write pbwt and sites files every n sites when parsing external files */
+extern int pbwtBlockSize ;	/* if non-zero pbwtWrite() zlib compresses yz in blocks of about this many bytes */
+extern BOOL isWriteGzip ;	/* if TRUE the text haplotype and gen writers gzip their output */
+extern BOOL isReadLazy ;	/* if TRUE pbwtRead() leaves block compressed yz on disk for cursors to fetch */
 
 void pbwtWrite (PBWT *p, FILE *fp) ; /* just writes packed PBWT p->yz */
 void pbwtWriteSites (PBWT *p, FILE *fp) ;
+void pbwtWriteSitesBinary (PBWT *p, FILE *fp) ; /* read back transparently by pbwtReadSitesFile() */
 void pbwtWriteSamples (PBWT *p, FILE *fp) ;
 void pbwtWriteMissing (PBWT *p, FILE *fp) ;
 void pbwtWriteDosage (PBWT *p, FILE *fp) ;
@@ -193,7 +232,31 @@ void pbwtWriteAll (PBWT *p, char *fileNameRoot) ;
 void pbwtWriteGen (PBWT *p, FILE *fp) ; /* write gen file as for impute etc. */
 void pbwtWritePhase (PBWT *p, char *filename); /* Write phase file as output by impute and input for chromopainter */
 PBWT *pbwtRead (FILE *fp) ;
+PBWT *pbwtReadHeader (FILE *fp, long *nz) ; /* stop before the packed data: *nz bytes follow, or -1 if read */
+void pbwtLoadBlocks (PBWT *p) ;	/* make lazily read yz resident - needed by code that uses p->yz directly */
+void pbwtBlocksDestroy (PbwtBlocks *zb) ;
+PbwtBlocks *pbwtBlocksMap (int fd, long offset, long nz, int M) ; /* uncompressed yz mapped from fd at a page aligned offset */
+BlockCache *blockCacheCreate (PbwtBlocks *zb) ;
+void blockCacheDestroy (BlockCache *zc) ;
+long blockCacheSize (BlockCache *zc) ; /* uncompressed size of yz */
+uchar *blockCacheFetch (BlockCache *zc, long n) ; /* pointer to byte n; its whole column stays valid until the fetch after next */
+
+/* pbwtStream.c */
+
+PbwtStream *pbwtStreamCreate (PBWT *p, void (*producer)(PbwtStream *zs, void *arg), void *arg) ;
+  /* runs producer(zs, arg) in a new thread; it calls pbwtStreamPut() for each column then pbwtStreamClose() */
+BOOL pbwtStreamPut (PbwtStream *zs, uchar *z, int nz, uchar *zMissing, int nzMissing, int x, char *var) ;
+  /* packed column, packed missing or 0, position and "REF\tALT"; FALSE if the producer should stop */
+void pbwtStreamSetChrom (PbwtStream *zs, char *chrom) ;
+void pbwtStreamClose (PbwtStream *zs, char *chrom, int *aEnd) ;
+void pbwtStreamDestroy (PbwtStream *zs) ;
+void pbwtStreamStart (PbwtStream *zs) ; /* claim the stream for a cursor; dies if already claimed */
+long pbwtStreamMax (PbwtStream *zs) ; /* bytes through the next column, waiting for it */
+uchar *pbwtStreamFetch (PbwtStream *zs, long n) ; /* forwards only; current and previous column stay valid */
+void pbwtStreamMaterialize (PBWT *p) ; /* store the whole stream in p->yz */
+void pbwtStreamDrain (PBWT *p) ;	/* read the rest of the stream keeping only the sites */
 Array pbwtReadSitesFile (FILE *fp, char **chrom) ;
+BOOL pbwtReadSiteNext (FILE *fp, char **chrom, Site *s, Array varText, int *line) ; /* text sites only */
 void pbwtReadSites (PBWT *p, FILE *fp) ;
 void pbwtReadRefFreq (PBWT *p, FILE *fp) ;
 Array pbwtReadProjectionListFile (FILE *fp) ;
@@ -208,22 +271,54 @@ PBWT *pbwtReadVcfq (FILE *fp) ;	/* reduced VCF style file made by vcf query */
 PBWT *pbwtReadGen (FILE *fp, char *chrom) ;	/* gen file as used by impute2 (unphased) */
 PBWT *pbwtReadHap (FILE *fp, char *chrom) ;	/* hap file as used by impute2 (unphased) */
 PBWT *pbwtReadHapLegend (FILE *fp, FILE *lp, char *chrom) ; /* hap and legend file as used by impute2 (phased) */
+PBWT *pbwtReadBed (char *root) ; /* PLINK root.bed, .bim and .fam; unphased hets are split 0|1 */
 PBWT *pbwtReadPhase (FILE *fp) ; /* Li and Stephens PHASE file */
 void pbwtWriteHaplotypes (FILE *fp, PBWT *p) ;
 void pbwtWriteTransposedHaplotypes (PBWT *p, FILE *fp) ;
 void pbwtWriteImputeRef (PBWT *p, char *fileNameRoot) ;
 void pbwtWriteImputeHapsG (PBWT *p, FILE *fp) ;
-void pbwtCheckPoint (PbwtCursor *u, PBWT *p) ; /* need cursor to write end index */
+void pbwtCheckPoint (PbwtCursor *u, PBWT *p) ; /* need cursor to write end index; writes in background */
+void pbwtCheckPointWait (void) ; /* wait for a background checkpoint write to finish */
 
 /* pbwtHtslib.c */
 /* all these functions also read and write samples and sites */
 PBWT *pbwtReadVcfGT (char *filename) ;	/* read GTs from vcf/bcf using htslib */
+PBWT *pbwtResumeVcfGT (char *root, char *filename) ; /* continue pbwtReadVcfGT from a checkpoint */
+PBWT *pbwtStreamVcfGT (char *filename) ; /* as pbwtReadVcfGT but sites arrive as cursors move, see pbwtStream.c */
 PBWT *pbwtReadVcfPL (char *filename) ;	/* read PLs from vcf/bcf using htslib */
 // mode: wb=compressed BCF; wbu=uncompressed BCF; wz=compressed VCF; w=uncompressed VCF
 void pbwtWriteVcf (PBWT *p, char *filename, char *reference_fname, char *mode) ;  /* write vcf/bcf using htslib */
+typedef struct VcfWriterStruct VcfWriter ; /* incremental writer, records built in parallel batches */
+VcfWriter *pbwtVcfWriterOpen (PBWT *p, char *filename, char *referenceFasta, char *mode,
+			      BOOL isDosage, BOOL isRefFreq) ; /* header from p->M, samples, chrom */
+void pbwtVcfWriterAdd (VcfWriter *w, Site *s, uchar *y, int *a, double *d) ;
+  /* y, d in sort order given by a, or if a == 0 in sample order; d ignored unless isDosage */
+void pbwtVcfWriterClose (VcfWriter *w) ;
 
 /* pbwtMatch.c - functions as in Bioinformatics 2014 paper */
 
+typedef struct { int j ; int start ; int end ; } MatchSegment ;
+/* matches are semi-open [start,end) so length is end-start */
+
+typedef struct MatchBlockStruct MatchBlock ;
+typedef struct {		/* collects match segments for each of M query haplotypes */
+  int M ;
+  long n ;			/* total number of segments */
+  MatchSegment *seg ;		/* after matchLogIndex(), segments of i are seg[index[i]..index[i+1]) */
+  long *index ;
+  MatchBlock **head, **tail ;	/* before matchLogIndex(), chain of blocks for each i */
+  Array slabs ;			/* of MatchBlock*, from which blocks are allocated */
+  int slabUsed ;
+} MatchLog ;
+
+#define matchLogSegs(ml,i) ((ml)->seg + (ml)->index[i])
+#define matchLogCount(ml,i) ((int)((ml)->index[(i)+1] - (ml)->index[i]))
+
+MatchLog *matchLogCreate (int M) ;
+void matchLogAdd (MatchLog *ml, int i, int j, int start, int end) ; /* not thread safe */
+void matchLogIndex (MatchLog *ml, BOOL isSort) ; /* isSort sorts each i's segments by start */
+void matchLogDestroy (MatchLog *ml) ;
+
 void matchMaximalWithin (PBWT *p, void (*report)(int, int, int, int)) ;
 void pbwtLongMatches (PBWT *p, int L) ; /* internal matches longer than L, maximal if L=0 */
 void matchSequencesNaive (PBWT *p, FILE *fp) ; /* fp is a pbwt file of sequences to match */
@@ -243,11 +338,19 @@ void imputeExplore (PBWT *p, int test) ;
 PBWT *phase (PBWT *p, int nSparse) ;
 PBWT *referencePhase (PBWT *p, char *fileNameRoot) ;
 PBWT *referenceImpute (PBWT *p, char *fileNameRoot, int nSparse, double fSparse) ;
+PBWT *referenceImputeVcf (PBWT *p, char *fileNameRoot, int nSparse, double fSparse,
+			  char *vcfFile, char *referenceFasta, char *mode, BOOL isBuild) ;
+  /* also write imputed sites to vcfFile as made; if !isBuild returns p unchanged */
+void referenceImputeBatch (char *fileNameRoot, FILE *fp, int nSparse, double fSparse, char *referenceFasta) ;
+  /* lines of fp are "target output", each a VCF/BCF file or a pbwt root; all imputed in one reference sweep */
+extern int imputeChunkSites ;	/* if non-zero referenceImpute works in parallel windows of this many target sites */
+extern int imputeOverlapSites ;	/* extra target sites either side of each window */
 void genotypeCompare (PBWT *p, char *fileNameRoot) ;
 PBWT *imputeMissing (PBWT *p) ;
 PBWT *pbwtCorruptSites (PBWT *pOld, double pSite, double pChange) ;
 PBWT *pbwtCorruptSamples (PBWT *pOld, double pSample, double pChange) ;
 PBWT *pbwtCopySamples (PBWT *pOld, int Mnew, double meanLength) ;
+extern int dosageBits ;		/* codec for new dosage data: 0 for the original 0.1 bins, 8 or 16 bit */
 void pbwtDosageStore (PBWT *p, double *dosage, int k) ;
 double *pbwtDosageRetrieve (PBWT *p, PbwtCursor *u, double *dosage, int k) ; 
 /* if arg dosage == 0 then create and return, else fill and return; uses u->y */
@@ -265,6 +368,44 @@ void paintAncestryMatrixSparse (PBWT *p, char *fileRoot,int chunksperregion,int
 /* pbwtMerge.c */
 
 PBWT *pbwtMerge(const char **file_names, int nfiles);
+void pbwtMergeWrite(const char **file_names, int nfiles, char *root); // write root.pbwt, root.sites as it goes
+PBWT *pbwtMergeSamples(PBWT *p, PBWT *q); // union of samples over the same sites; destroys p and q
+void pbwtCheckSameSites(PBWT *p, PBWT *q, char *op); // die unless p and q have the same sites
+
+/* pbwtDynamic.c */
+
+typedef struct PbwtDynamicStruct PbwtDynamic ; /* PBWT whose columns can be edited in place */
+PbwtDynamic *pbwtDynamicCreate (PBWT *p) ; /* takes over p until pbwtDynamicFinish() */
+void pbwtDynamicInsert (PbwtDynamic *dp, uchar *x) ; /* add haplotype M with x[0..N) */
+void pbwtDynamicDelete (PbwtDynamic *dp, int h) ; /* remove haplotype h; those above move down */
+PBWT *pbwtDynamicFinish (PbwtDynamic *dp) ; /* repack, returning the edited PBWT */
+PBWT *pbwtInsertSamples (PBWT *p, PBWT *q) ; /* add the haplotypes of q, destroying q */
+PBWT *pbwtDeleteSamples (PBWT *p, FILE *fp) ; /* remove samples named in fp */
+
+/* pbwtBgen.c */
+
+PBWT *pbwtReadBgen (FILE *fp, char *region) ; /* phased BGEN 1.2 layout 2; region "chrom:start-end" or 0 */
+void pbwtWriteBgen (PBWT *p, FILE *fp) ; /* zlib compressed, with dosages if present */
+
+/* pbwtPanel.c */
+
+void pbwtWritePanel (PBWT *p, char *fileNameRoot, int checkStep) ; /* root.refpanel, plus sites and samples */
+PBWT *pbwtReadPanel (char *fileNameRoot) ; /* maps root.refpanel; 0 if there is none */
+void pbwtPanelDestroy (PbwtPanel *rp) ;
+PBWT *pbwtPanelFrame (PBWT *pRef, char *fileNameRoot, Array sites, BOOL isReverse) ;
+  /* as pbwtSelectSites (pRef, sites, TRUE), using the site index and frames cached on disk */
+PbwtCursor *pbwtCursorSeek (PBWT *p, int k) ; /* forwards cursor at site k, from the nearest checkpoint if any */
+
+/* pbwtDosageIndex.c */
+
+void pbwtWriteDosageIndex (PBWT *p, FILE *fp) ; /* dosages transposed for access by sample */
+DosageIndex *dosageIndexOpen (char *fileName) ; /* maps the file */
+void dosageIndexDestroy (DosageIndex *di) ;
+int dosageIndexSample (DosageIndex *di, char *name) ; /* sample index, -1 if not present */
+int dosageIndexSite (DosageIndex *di, int x) ; /* first site at or after position x */
+void dosageIndexGet (DosageIndex *di, int hap, int k0, int k1, double *d) ; /* haplotype hap at sites [k0,k1) */
+void dosageIndexQuery (DosageIndex *di, FILE *fp, int xFrom, int xTo, FILE *out) ;
+  /* table of genotype dosages for samples named in fp at positions [xFrom,xTo) */
 
 /* pbwtGeneticMap.c */
 
@@ -0,0 +1,431 @@
+/*  File: pbwtBgen.c
+ *  Copyright (C) Genome Research Limited, 2013-
+ *-------------------------------------------------------------------
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *-------------------------------------------------------------------
+ * Description: reading and writing phased haplotypes in BGEN 1.2 files
+ * Exported functions: pbwtReadBgen, pbwtWriteBgen
+ * HISTORY:
+ * Created: Sun Oct 18 2026
+ *-------------------------------------------------------------------
+ */
+
+#include "pbwt.h"
+#include <zlib.h>
+#include <stdint.h>
+
+/* BGEN 1.2 layout 2, as in https://www.well.ox.ac.uk/~gav/bgen_format/.  Only phased
+   biallelic diploid data are read, with allele 1 as REF and allele 2 as ALT; other
+   sites are skipped.  Each haplotype's probability of REF is stored in B bits: the
+   hard call is ALT if that is below 0.5, and if any probability is not exactly 0 or 1
+   dosages are kept as well.  Genotype blocks may be uncompressed or zlib compressed;
+   zstd would need a new library dependency so is not supported.  The .bgi index is an
+   SQLite database, so rather than use it a region read skips unwanted variants by
+   their headers without decompressing them.
+   Blocks are read serially, then decompressed and decoded in parallel a batch at a
+   time, and packed in order.  The writer builds and compresses batches the same way,
+   with 8 bits per probability, which is finer than pbwt's stored dosage.
+*/
+
+#define BGEN_BATCH_MAX 256
+
+static inline uint32_t get16 (uchar *cp) { return cp[0] | (cp[1] << 8) ; }
+static inline uint32_t get32 (uchar *cp) { return cp[0] | (cp[1] << 8) | (cp[2] << 16) | ((uint32_t)cp[3] << 24) ; }
+static inline uchar *put16 (uchar *cp, uint32_t x) { *cp++ = x & 0xff ; *cp++ = x >> 8 ; return cp ; }
+static inline uchar *put32 (uchar *cp, uint32_t x)
+{ *cp++ = x & 0xff ; *cp++ = (x >> 8) & 0xff ; *cp++ = (x >> 16) & 0xff ; *cp++ = x >> 24 ; return cp ; }
+
+static void bgenRead (FILE *fp, void *buf, long n)
+{ if (n && fread (buf, 1, n, fp) != n) die ("unexpected end of bgen file") ; }
+
+static uint32_t bgenRead16 (FILE *fp) { uchar b[2] ; bgenRead (fp, b, 2) ; return get16 (b) ; }
+static uint32_t bgenRead32 (FILE *fp) { uchar b[4] ; bgenRead (fp, b, 4) ; return get32 (b) ; }
+
+static void bgenSkip (FILE *fp, long n)
+{
+  if (!n || !fseeko (fp, n, SEEK_CUR)) return ;
+  char buf[4096] ;		/* not seekable, e.g. stdin */
+  while (n > 0) { long m = n > 4096 ? 4096 : n ; bgenRead (fp, buf, m) ; n -= m ; }
+}
+
+static char *bgenReadString (FILE *fp, int nLenBytes, Array a) /* 0 terminated in a */
+{
+  long n = (nLenBytes == 2) ? bgenRead16 (fp) : bgenRead32 (fp) ;
+  char *s = arrayBlock (a, 0, n + 1, char) ;
+  bgenRead (fp, s, n) ; s[n] = 0 ;
+  return s ;
+}
+
+typedef struct {
+  int pos ;
+  long varOffset ;		/* of REF\tALT in varText */
+  char *var ;
+  uchar *data ; long nData, dataMax ; /* genotype block as in the file */
+  uint32_t nUncompressed ;
+  uchar *buf ; long bufMax ;	/* decompressed block */
+  uchar *x ;			/* M haplotype values, in sample order */
+  uchar *xMissing ; int nMissing ;
+  double *dosage ; BOOL isDosage ; /* probability of ALT, in sample order */
+  char msg[256] ;		/* error found while decoding */
+} BgenRecord ;
+
+typedef struct {
+  BgenRecord *rec ;
+  int M ;
+  BOOL isCompressed ;
+} BgenBatch ;
+
+static void bgenDecode (void *arg, int i, int thread)
+{
+  BgenBatch *b = (BgenBatch*) arg ;
+  BgenRecord *r = &b->rec[i] ;
+  int M = b->M, nSamples = M/2, j ;
+  uchar *cp = r->data, *end = r->data + r->nData ;
+
+  *r->msg = 0 ; r->nMissing = 0 ; r->isDosage = FALSE ;
+  if (b->isCompressed)
+    { if (r->nUncompressed > r->bufMax)
+	{ free (r->buf) ; r->bufMax = r->nUncompressed ; r->buf = myalloc (r->bufMax, uchar) ; }
+      uLongf n = r->nUncompressed ;
+      if (uncompress (r->buf, &n, r->data, r->nData) != Z_OK || n != r->nUncompressed)
+	{ sprintf (r->msg, "failed to decompress genotype block") ; return ; }
+      cp = r->buf ; end = r->buf + n ;
+    }
+
+  if (end - cp < 10 + nSamples) { sprintf (r->msg, "genotype block too short") ; return ; }
+  if (get32 (cp) != nSamples) { sprintf (r->msg, "genotype block has %d samples not %d", get32 (cp), nSamples) ; return ; }
+  if (get16 (cp+4) != 2) { sprintf (r->msg, "genotype block is not biallelic") ; return ; }
+  uchar *ploidy = cp + 8 ;
+  cp += 8 + nSamples ;
+  if (!*cp++) { sprintf (r->msg, "genotypes are unphased - only phased haplotypes can be read") ; return ; }
+  int B = *cp++ ;
+  if (B < 1 || B > 32) { sprintf (r->msg, "bad number of bits per probability %d", B) ; return ; }
+  if (end - cp < ((long)M * B + 7) / 8) { sprintf (r->msg, "genotype block too short for its probabilities") ; return ; }
+  uint32_t max = (B == 32) ? 0xffffffff : (1U << B) - 1 ;
+
+  uint64_t bits = 0 ; int nBits = 0 ;
+  for (j = 0 ; j < M ; ++j)
+    { uint32_t v ;
+      if (B == 8) v = *cp++ ;
+      else
+	{ while (nBits < B) { bits |= (uint64_t)(*cp++) << nBits ; nBits += 8 ; }
+	  v = bits & max ; bits >>= B ; nBits -= B ;
+	}
+      if (!(j & 1))
+	{ if ((ploidy[j/2] & 0x3f) != 2)
+	    { sprintf (r->msg, "sample %d has ploidy %d - only diploid data can be read", j/2, ploidy[j/2] & 0x3f) ; return ; }
+	}
+      if (ploidy[j/2] & 0x80)	/* missing */
+	{ r->x[j] = 0 ; r->xMissing[j] = 1 ; ++r->nMissing ; r->dosage[j] = 0 ; continue ; }
+      r->xMissing[j] = 0 ;
+      r->x[j] = (2.0*v < max) ;
+      r->dosage[j] = 1.0 - (double)v / max ;
+      if (v && v != max) r->isDosage = TRUE ;
+    }
+}
+
+static BOOL parseRegion (char *region, char **chrom, int *start, int *end)
+{
+  static char buf[256] ;
+  *start = 0 ; *end = INT_MAX ;
+  if (!region) { *chrom = 0 ; return TRUE ; }
+  strncpy (buf, region, 255) ; buf[255] = 0 ;
+  char *cp = strchr (buf, ':') ;
+  if (cp)
+    { *cp++ = 0 ;
+      if (sscanf (cp, "%d-%d", start, end) < 1) return FALSE ;
+    }
+  *chrom = buf ;
+  return TRUE ;
+}
+
+PBWT *pbwtReadBgen (FILE *fp, char *region)
+{
+  char *chrom = 0 ; int start, end ;
+  int i, j ;
+  if (!parseRegion (region, &chrom, &start, &end)) die ("bad region %s - should be chrom:start-end", region) ;
+
+  /* header */
+  uint32_t offset = bgenRead32 (fp) ;
+  uint32_t headerLength = bgenRead32 (fp) ;
+  uint32_t nVariants = bgenRead32 (fp) ;
+  uint32_t nSamples = bgenRead32 (fp) ;
+  char magic[4] ; bgenRead (fp, magic, 4) ;
+  if (strncmp (magic, "bgen", 4) && memcmp (magic, "\0\0\0\0", 4)) die ("not a bgen file") ;
+  if (headerLength < 20 || headerLength > offset) die ("bad bgen header length %d", headerLength) ;
+  bgenSkip (fp, headerLength - 20) ; /* free data area */
+  uint32_t flags = bgenRead32 (fp) ;
+  int compression = flags & 3, layout = (flags >> 2) & 0xf ;
+  if (compression == 2) die ("zstd compressed bgen is not supported - please convert to zlib compression") ;
+  if (compression > 2) die ("unknown bgen compression type %d", compression) ;
+  if (layout != 2) die ("only bgen layout 2 (version 1.2 and later) is supported, not layout %d", layout) ;
+  if (!nSamples) die ("no samples in bgen file") ;
+
+  PBWT *p = pbwtCreate (2*nSamples, 0) ;
+  long nRead = headerLength ;
+  Array text = arrayCreate (256, char) ;
+  if (flags & 0x80000000)	/* sample identifiers */
+    { uint32_t sampleBlockLength = bgenRead32 (fp) ;
+      if (bgenRead32 (fp) != nSamples) die ("bgen sample block has the wrong number of samples") ;
+      p->samples = arrayCreate (p->M, int) ;
+      for (i = 0 ; i < nSamples ; ++i)
+	{ int k = sampleAdd (bgenReadString (fp, 2, text), 0, 0, 0) ;
+	  array(p->samples, 2*i, int) = k ;
+	  array(p->samples, 2*i+1, int) = k ;
+	}
+      nRead += sampleBlockLength ;
+    }
+  if (nRead > offset) die ("bgen header overlaps the variant data") ;
+  bgenSkip (fp, offset - nRead) ;
+  p->sites = arrayCreate (4096, Site) ;
+
+  /* variants */
+  BgenBatch b ;
+  b.M = p->M ; b.isCompressed = (compression == 1) ;
+  int nBatch = 1 + (1 << 22) / (p->M + 1) ;
+  if (nBatch > BGEN_BATCH_MAX) nBatch = BGEN_BATCH_MAX ;
+  b.rec = mycalloc (nBatch, BgenRecord) ;
+  for (i = 0 ; i < nBatch ; ++i)
+    { b.rec[i].x = myalloc (p->M, uchar) ;
+      b.rec[i].xMissing = myalloc (p->M+1, uchar) ; b.rec[i].xMissing[p->M] = Y_SENTINEL ;
+      b.rec[i].dosage = myalloc (p->M, double) ;
+    }
+  Array varText = arrayCreate (4096, char) ;
+  double *yDosage = 0, *zero = 0 ;
+  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
+  long nMultiAllelic = 0, nMissing = 0, nMissingSites = 0 ;
+  uint32_t k = 0 ;
+  BOOL isDone = FALSE ;
+
+  while (!isDone)
+    { int n = 0 ;
+      arrayMax(varText) = 0 ;
+      while (n < nBatch && k < nVariants)	/* read a batch of blocks */
+	{ BgenRecord *r = &b.rec[n] ;
+	  ++k ;
+	  bgenSkip (fp, bgenRead16 (fp)) ; /* variant id */
+	  bgenSkip (fp, bgenRead16 (fp)) ; /* rsid */
+	  char *c = bgenReadString (fp, 2, text) ;
+	  BOOL isKeep ;
+	  if (chrom) isKeep = !strcmp (c, chrom) ;
+	  else
+	    { if (!p->chrom) p->chrom = strdup (c) ;
+	      isKeep = !strcmp (c, p->chrom) ;
+	      if (!isKeep) { isDone = TRUE ; break ; } /* stop at the next chromosome, as readVcfGT */
+	    }
+	  r->pos = bgenRead32 (fp) ;
+	  if (r->pos < start || r->pos > end) isKeep = FALSE ;
+	  int K = bgenRead16 (fp), a ;
+	  long varStart = arrayMax(varText) ;
+	  for (a = 0 ; a < K ; ++a)
+	    { char *allele = bgenReadString (fp, 4, text) ;
+	      if (a < 2 && K == 2)
+		{ int len = strlen (allele) ;
+		  long max = arrayMax(varText) ;
+		  char *cp = arrayBlock (varText, max, len + 1, char) ;
+		  memcpy (cp, allele, len) ; cp[len] = a ? 0 : '\t' ;
+		  arrayMax(varText) = max + len + 1 ;
+		}
+	    }
+	  long C = bgenRead32 (fp) ;
+	  if (K != 2) { if (isKeep) ++nMultiAllelic ; isKeep = FALSE ; }
+	  if (!isKeep) { bgenSkip (fp, C) ; arrayMax(varText) = varStart ; continue ; }
+	  if (b.isCompressed) { r->nUncompressed = bgenRead32 (fp) ; C -= 4 ; }
+	  if (C > r->dataMax)
+	    { free (r->data) ; r->dataMax = C ; r->data = myalloc (C, uchar) ; }
+	  bgenRead (fp, r->data, C) ; r->nData = C ;
+	  r->varOffset = varStart ;
+	  if (chrom && !p->chrom) p->chrom = strdup (chrom) ;
+	  ++n ;
+	}
+      if (!n) break ;
+      for (i = 0 ; i < n ; ++i) b.rec[i].var = arrp(varText, b.rec[i].varOffset, char) ;
+      pbwtParallelFor (n, bgenDecode, &b) ;
+
+      for (i = 0 ; i < n ; ++i)	/* pack in order */
+	{ BgenRecord *r = &b.rec[i] ;
+	  if (*r->msg) die ("bgen variant at %s:%d: %s", p->chrom, r->pos, r->msg) ;
+	  if (r->isDosage && !p->dosageOffset) /* first fractional probabilities: earlier sites are exact */
+	    { p->dosageBits = dosageBits ;
+	      p->zDosage = arrayCreate (p->M * 4, uchar) ;
+	      p->dosageOffset = arrayCreate (p->N + 1024, long) ;
+	      yDosage = myalloc (p->M, double) ;
+	      zero = mycalloc (p->M, double) ; /* encodes as exactly the hard call */
+	      for (j = 0 ; j < p->N ; ++j) pbwtDosageStore (p, zero, j) ;
+	    }
+	  if (p->dosageOffset)
+	    for (j = 0 ; j < p->M ; ++j) yDosage[j] = r->isDosage ? r->dosage[u->a[j]] : 0 ;
+	  for (j = 0 ; j < p->M ; ++j) u->y[j] = r->x[u->a[j]] ;
+	  pbwtCursorWriteForwards (u) ;
+	  if (p->dosageOffset) pbwtDosageStore (p, yDosage, p->N) ;
+
+	  if (r->nMissing)	/* as storeMissing() in pbwtHtslib.c */
+	    { if (!p->zMissing)
+		{ p->zMissing = arrayCreate (10000, uchar) ;
+		  array(p->zMissing, 0, uchar) = 0 ; /* needed so missing[] has offset > 0 */
+		  p->missingOffset = arrayCreate (1024, long) ;
+		}
+	      array(p->missingOffset, p->N, long) = arrayMax(p->zMissing) ;
+	      pack3arrayAdd (r->xMissing, p->M, p->zMissing) ;
+	      nMissing += r->nMissing ; ++nMissingSites ;
+	    }
+	  else if (p->missingOffset)
+	    array(p->missingOffset, p->N, long) = 0 ;
+
+	  Site *s = arrayp(p->sites, p->N, Site) ;
+	  s->x = r->pos ;
+	  dictAdd (variationDict, r->var, &s->varD) ;
+	  ++p->N ;
+	  if (nCheckPoint && !(p->N % nCheckPoint)) pbwtCheckPoint (u, p) ;
+	}
+    }
+  pbwtCursorToAFend (u, p) ;
+
+  if (!p->N) die ("no variants read from bgen file%s%s", region ? " in region " : "", region ? region : "") ;
+  fprintf (logFile, "read bgen file with %d samples and %d sites on chromosome %s: M, N are %d, %d\n",
+	   p->M/2, p->N, p->chrom, p->M, p->N) ;
+  if (nMultiAllelic) fprintf (logFile, "%ld multiallelic sites skipped\n", nMultiAllelic) ;
+  if (nMissing) fprintf (logFile, "%ld missing haplotype values at %ld sites\n", nMissing, nMissingSites) ;
+  if (p->dosageOffset) fprintf (logFile, "dosages kept from haplotype probabilities\n") ;
+
+  for (i = 0 ; i < nBatch ; ++i)
+    { BgenRecord *r = &b.rec[i] ;
+      free (r->x) ; free (r->xMissing) ; free (r->dosage) ; free (r->data) ; free (r->buf) ;
+    }
+  free (b.rec) ; if (yDosage) { free (yDosage) ; free (zero) ; }
+  arrayDestroy (varText) ; arrayDestroy (text) ;
+  pbwtCursorDestroy (u) ;
+  return p ;
+}
+
+/************ writing ************/
+
+typedef struct {
+  uchar *raw ; long nRaw ;	/* uncompressed genotype block */
+  uchar *z ; uLongf nz ; long zMax ;
+} BgenOut ;
+
+static void bgenCompress (void *arg, int i, int thread)
+{
+  BgenOut *o = &((BgenOut*) arg)[i] ;
+  long bound = compressBound (o->nRaw) ;
+  if (bound > o->zMax) { free (o->z) ; o->zMax = bound ; o->z = myalloc (bound, uchar) ; }
+  o->nz = o->zMax ;
+  if (compress (o->z, &o->nz, o->raw, o->nRaw) != Z_OK) die ("zlib compression failed writing bgen") ;
+}
+
+static void bgenWrite (FILE *fp, void *buf, long n)
+{ if (n && fwrite (buf, 1, n, fp) != n) die ("write error writing bgen file") ; }
+
+static void bgenWriteString (FILE *fp, char *s, long n, int nLenBytes)
+{
+  uchar b[4] ;
+  if (nLenBytes == 2) { if (n > 0xffff) die ("string too long for bgen: %.40s...", s) ; put16 (b, n) ; }
+  else put32 (b, n) ;
+  bgenWrite (fp, b, nLenBytes) ;
+  bgenWrite (fp, s, n) ;
+}
+
+void pbwtWriteBgen (PBWT *p, FILE *fp)
+{
+  if (!p || !p->sites) die ("pbwtWriteBgen called without sites") ;
+  if (p->M & 1) die ("bgen needs diploid samples, but M is odd") ;
+  int nSamples = p->M/2, i, j, k ;
+  uchar b[32], *cp ;
+
+  /* header and sample block */
+  long sampleBlockLength = 0 ;
+  if (p->samples)
+    { sampleBlockLength = 8 ;
+      for (i = 0 ; i < nSamples ; ++i) sampleBlockLength += 2 + strlen (sampleName (sample (p, 2*i))) ;
+    }
+  cp = put32 (b, 20 + sampleBlockLength) ;	/* offset of first variant after these 4 bytes */
+  cp = put32 (cp, 20) ;
+  cp = put32 (cp, p->N) ;
+  cp = put32 (cp, nSamples) ;
+  memcpy (cp, "bgen", 4) ; cp += 4 ;
+  cp = put32 (cp, 1 | (2 << 2) | (p->samples ? 0x80000000 : 0)) ; /* zlib, layout 2 */
+  bgenWrite (fp, b, cp - b) ;
+  if (p->samples)
+    { cp = put32 (b, sampleBlockLength) ; cp = put32 (cp, nSamples) ;
+      bgenWrite (fp, b, 8) ;
+      for (i = 0 ; i < nSamples ; ++i)
+	{ char *name = sampleName (sample (p, 2*i)) ;
+	  bgenWriteString (fp, name, strlen (name), 2) ;
+	}
+    }
+
+  /* variants, built and compressed a batch at a time */
+  int nBatch = 1 + (1 << 22) / (p->M + 1) ;
+  if (nBatch > BGEN_BATCH_MAX) nBatch = BGEN_BATCH_MAX ;
+  BgenOut *out = mycalloc (nBatch, BgenOut) ;
+  long nRaw = 10 + nSamples + p->M ;	/* 8 bits per probability */
+  for (i = 0 ; i < nBatch ; ++i) out[i].raw = myalloc (nRaw, uchar) ;
+  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
+  BOOL isDosage = p->dosageOffset ? TRUE : FALSE ;
+  double *d = 0 ;
+  uchar *missing = p->missingOffset ? myalloc (p->M, uchar) : 0 ;
+  char *chrom = p->chrom ? p->chrom : "." ;
+  Array idText = arrayCreate (256, char) ;
+
+  for (k = 0 ; k < p->N ; k += nBatch)
+    { int n = (p->N - k < nBatch) ? p->N - k : nBatch ;
+      for (i = 0 ; i < n ; ++i)
+	{ uchar *raw = out[i].raw, *pl = raw + 8, *v = raw + 10 + nSamples ;
+	  put32 (raw, nSamples) ; put16 (raw+4, 2) ; raw[6] = 2 ; raw[7] = 2 ;
+	  memset (pl, 2, nSamples) ;
+	  raw[8 + nSamples] = 1 ;	/* phased */
+	  raw[9 + nSamples] = 8 ;	/* bits per probability */
+	  if (isDosage) d = pbwtDosageRetrieve (p, u, d, k+i) ;
+	  for (j = 0 ; j < p->M ; ++j)	/* probability of REF for each haplotype */
+	    v[u->a[j]] = isDosage ? (uchar)(255.0 * (1.0 - d[j]) + 0.5) : (u->y[j] ? 0 : 255) ;
+	  if (missing && arr(p->missingOffset, k+i, long))
+	    { unpack3 (arrp(p->zMissing, arr(p->missingOffset, k+i, long), uchar), p->M, missing, 0) ;
+	      for (j = 0 ; j < p->M ; ++j)
+		if (missing[j]) { pl[j/2] = 0x82 ; v[j] = 0 ; v[j^1] = 0 ; }
+	    }
+	  out[i].nRaw = nRaw ;
+	  pbwtCursorForwardsRead (u) ;
+	}
+      pbwtParallelFor (n, bgenCompress, out) ;
+
+      for (i = 0 ; i < n ; ++i)
+	{ Site *s = arrp(p->sites, k+i, Site) ;
+	  char *var = dictName (variationDict, s->varD) ;
+	  char *alt = strchr (var, '\t') ;
+	  if (!alt) die ("site %d has no tab between REF and ALT", k+i) ;
+	  int nRef = alt - var ; ++alt ;
+	  arrayMax(idText) = 0 ;	/* id and rsid are chrom:pos_REF_ALT, as -writeGen */
+	  long nId = strlen (chrom) + strlen (var) + 16 ;
+	  char *id = arrayBlock (idText, 0, nId, char) ;
+	  nId = sprintf (id, "%s:%d_%.*s_%s", chrom, s->x, nRef, var, alt) ;
+	  bgenWriteString (fp, id, nId, 2) ;
+	  bgenWriteString (fp, id, nId, 2) ;
+	  bgenWriteString (fp, chrom, strlen (chrom), 2) ;
+	  cp = put32 (b, s->x) ; cp = put16 (cp, 2) ;
+	  bgenWrite (fp, b, cp - b) ;
+	  bgenWriteString (fp, var, nRef, 4) ;
+	  bgenWriteString (fp, alt, strlen (alt), 4) ;
+	  cp = put32 (b, out[i].nz + 4) ; cp = put32 (cp, out[i].nRaw) ;
+	  bgenWrite (fp, b, 8) ;
+	  bgenWrite (fp, out[i].z, out[i].nz) ;
+	}
+    }
+
+  fprintf (logFile, "written bgen file with %d samples and %d sites%s\n", nSamples, p->N,
+	   isDosage ? ", with dosages as haplotype probabilities" : "") ;
+  for (i = 0 ; i < nBatch ; ++i) { free (out[i].raw) ; free (out[i].z) ; }
+  free (out) ; if (d) free (d) ; if (missing) free (missing) ;
+  arrayDestroy (idText) ;
+  pbwtCursorDestroy (u) ;
+}
+
+/******************* end of file *******************/
@@ -28,6 +28,7 @@
   #include <htslib/faidx.h>
 
 #include <ctype.h>
+#include <pthread.h>
 
 
 
@@ -37,6 +38,8 @@
 
 BOOL isCheck = FALSE ;
 BOOL isStats = FALSE ;
+int nThreads = 1 ;
+long pbwtMemoryBudget = 1L << 30 ;
 DICT *variationDict ;	/* "xxx|yyy" where variation is from xxx to yyy in VCF */
 
 static void pack3init (void) ;	/* forward declaration */
@@ -66,6 +69,9 @@ void pbwtDestroy (PBWT *p)
   if (p->sites) arrayDestroy (p->sites) ;
   if (p->samples) arrayDestroy (p->samples) ;
   if (p->yz) arrayDestroy (p->yz) ;
+  if (p->yzBlocks) pbwtBlocksDestroy (p->yzBlocks) ;
+  if (p->yzStream) pbwtStreamDestroy (p->yzStream) ;
+  if (p->panel) pbwtPanelDestroy (p->panel) ;
   if (p->zz) arrayDestroy (p->zz) ;
   if (p->aFstart) free (p->aFstart) ;
   if (p->aFend) free (p->aFend) ;
@@ -78,6 +84,80 @@ void pbwtDestroy (PBWT *p)
   free (p) ;
 }
 
+/*************** simple persistent thread pool ***************/
+
+/* Workers are started the first time they are needed and then sleep on a condition
+   variable between calls.  Work items are handed out one at a time under the lock,
+   so callers should make items reasonably coarse (e.g. a batch of sites or a range
+   of haplotypes) rather than one per haplotype.
+*/
+
+static struct {
+  int nWorkers ;		/* threads started so far, numbered 1..nWorkers */
+  pthread_mutex_t lock ;
+  pthread_cond_t start, done ;
+  long generation ;		/* incremented for each call */
+  int n, next, nActive ;
+  void (*func)(void*, int, int) ;
+  void *arg ;
+} pool = { 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER } ;
+
+static __thread BOOL isInPool = FALSE ;
+
+static void poolRun (int t)	/* called with pool.lock held */
+{
+  while (pool.next < pool.n && t < nThreads)
+    { int i = pool.next++ ;
+      pthread_mutex_unlock (&pool.lock) ;
+      (*pool.func)(pool.arg, i, t) ;
+      pthread_mutex_lock (&pool.lock) ;
+    }
+  if (!--pool.nActive) pthread_cond_signal (&pool.done) ;
+}
+
+static void *poolWorker (void *arg)
+{
+  int t = (int)(long) arg ;
+  long generation = 0 ;
+
+  isInPool = TRUE ;
+  pthread_mutex_lock (&pool.lock) ;
+  while (TRUE)
+    { while (pool.generation == generation) pthread_cond_wait (&pool.start, &pool.lock) ;
+      generation = pool.generation ;
+      poolRun (t) ;
+    }
+  return 0 ;
+}
+
+void pbwtParallelFor (int n, void (*func)(void *arg, int i, int thread), void *arg)
+/* call func(arg, i, thread) for 0 <= i < n on up to nThreads threads; 0 <= thread < nThreads */
+{
+  int i ;
+  if (nThreads <= 1 || n <= 1 || isInPool)	/* serial, including nested calls */
+    { for (i = 0 ; i < n ; ++i) (*func)(arg, i, 0) ;
+      return ;
+    }
+
+  pthread_mutex_lock (&pool.lock) ;
+  while (pool.nWorkers < nThreads-1)
+    { pthread_t thread ;
+      if (pthread_create (&thread, 0, poolWorker, (void*)(long)(pool.nWorkers+1)))
+	die ("failed to create thread %d", pool.nWorkers+1) ;
+      pthread_detach (thread) ;
+      ++pool.nWorkers ;
+    }
+  pool.func = func ; pool.arg = arg ; pool.n = n ; pool.next = 0 ;
+  pool.nActive = pool.nWorkers + 1 ;
+  ++pool.generation ;
+  pthread_cond_broadcast (&pool.start) ;
+  isInPool = TRUE ;
+  poolRun (0) ;
+  isInPool = FALSE ;
+  while (pool.nActive) pthread_cond_wait (&pool.done, &pool.lock) ;
+  pthread_mutex_unlock (&pool.lock) ;
+}
+
 /*************** subsites, subrange etc. **************/
 
 PBWT *pbwtSubSites (PBWT *pOld, double fmin, double frac)
@@ -90,7 +170,7 @@ PBWT *pbwtSubSites (PBWT *pOld, double fmin, double frac)
   PbwtCursor *uOld = pbwtCursorCreate (pOld, TRUE, TRUE) ;
   PbwtCursor *uNew = pbwtCursorCreate (pNew, TRUE, TRUE) ;
 
-  if (!pOld || !pOld->yz) die ("subsites without an existing pbwt") ;
+  if (!pOld || !(pOld->yz || pOld->yzBlocks)) die ("subsites without an existing pbwt") ;
   if (fmin < 0 || fmin >= 1 || frac <= 0 || frac > 1)
     die ("fmin %f, frac %f for subsites out of range\n", fmin, frac) ;
 
@@ -116,7 +196,7 @@ PBWT *pbwtSubSites (PBWT *pOld, double fmin, double frac)
   pNew->samples = pOld->samples ; pOld->samples = 0 ;
   pNew->missingOffset = pOld->missingOffset ; pOld->missingOffset = 0 ;
   pNew->zMissing = pOld->zMissing ; pOld->zMissing = 0 ;
-  pbwtDestroy (pOld) ; pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ;
+  pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ; pbwtDestroy (pOld) ;
   free(x) ;
   return pNew ;
 }
@@ -130,7 +210,7 @@ PBWT *pbwtSubRange (PBWT *pOld, int start, int end)
   PbwtCursor *uOld = pbwtCursorCreate (pOld, TRUE, TRUE) ;
   PbwtCursor *uNew = pbwtCursorCreate (pNew, TRUE, TRUE) ;
 
-  if (!pOld || !pOld->yz) die ("subrange without an existing pbwt") ;
+  if (!pOld || !(pOld->yz || pOld->yzBlocks)) die ("subrange without an existing pbwt") ;
   if (start < 0 || end > pOld->N || end <= start) 
     die ("subrange invalid start %d, end %d", start, end) ;
 
@@ -153,11 +233,92 @@ PBWT *pbwtSubRange (PBWT *pOld, int start, int end)
   pNew->samples = pOld->samples ; pOld->samples = 0 ;
   pNew->missingOffset = pOld->missingOffset ; pOld->missingOffset = 0 ;
   pNew->zMissing = pOld->zMissing ; pOld->zMissing = 0 ;
-  pbwtDestroy (pOld) ; pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ;
+  pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ; pbwtDestroy (pOld) ;
   free(x) ;
   return pNew ;
 }
 
+PBWT *pbwtConcat (PBWT *p, PBWT *q)
+/* append q, over the same haplotypes at later sites, to p; q is destroyed
+   q's columns are rethreaded from p's aFend, which is just a copy if q->aFstart matches */
+{
+  if (!p || !(p->yz || p->yzBlocks || !p->N) || !q || !(q->yz || q->yzBlocks || !q->N))
+    die ("concat called without two valid pbwts") ;
+  if (p->M != q->M) die ("concat needs the same haplotypes: M %d != %d", p->M, q->M) ;
+  if (p->chrom && q->chrom && strcmp (p->chrom, q->chrom))
+    die ("concat of different chromosomes %s and %s", p->chrom, q->chrom) ;
+  if (p->N && !p->aFend) die ("concat needs the end index of the first pbwt") ;
+  if (!p->sites != !q->sites) die ("concat needs sites for both or neither pbwt") ;
+  if (p->N && q->N && p->sites && arrp(q->sites,0,Site)->x < arrp(p->sites,p->N-1,Site)->x)
+    die ("concat needs the second pbwt's sites to follow the first's") ;
+  if (p->samples && q->samples && 
+      memcmp (arrp(p->samples,0,int), arrp(q->samples,0,int), p->M*sizeof(int)))
+    die ("concat needs the same samples in the same order") ;
+  if (p->dosageOffset || q->dosageOffset)
+    fprintf (logFile, "warning: dosage data are not carried over by concat\n") ;
+  
+  int i, j, M = p->M ;
+  int *aEnd = p->N ? p->aFend : p->aFstart ;
+  pbwtLoadBlocks (p) ; if (!p->yz) p->yz = arrayCreate (1<<20, uchar) ;
+  pbwtLoadBlocks (q) ;
+
+  if (!q->N)
+    ;
+  else if (!memcmp (aEnd, q->aFstart, M*sizeof(int))) /* same order: append the bytes */
+    { long n = arrayMax(p->yz) ;
+      memcpy (arrayBlock(p->yz, n, arrayMax(q->yz), uchar), arrp(q->yz,0,uchar), arrayMax(q->yz)) ;
+      arrayMax(p->yz) = n + arrayMax(q->yz) ;
+      if (!p->aFend) p->aFend = myalloc (M, int) ;
+      memcpy (p->aFend, q->aFend, M*sizeof(int)) ;
+    }
+  else
+    { uchar *x = myalloc (M, uchar) ;
+      PbwtCursor *uq = pbwtCursorCreate (q, TRUE, TRUE) ;
+      PbwtCursor *u = pbwtNakedCursorCreate (M, aEnd) ;
+      u->z = p->yz ;
+      for (i = 0 ; i < q->N ; ++i)
+	{ for (j = 0 ; j < M ; ++j) x[uq->a[j]] = uq->y[j] ;
+	  for (j = 0 ; j < M ; ++j) u->y[j] = x[u->a[j]] ;
+	  pbwtCursorWriteForwards (u) ;
+	  pbwtCursorForwardsRead (uq) ;
+	}
+      pbwtCursorToAFend (u, p) ;
+      free (x) ; pbwtCursorDestroy (u) ; pbwtCursorDestroy (uq) ;
+    }
+
+  if (p->missingOffset || q->missingOffset) /* zMissing is in natural order, so just append */
+    { if (!p->zMissing)
+	{ p->zMissing = arrayCreate (10000, uchar) ;
+	  array(p->zMissing, 0, uchar) = 0 ; /* so that offsets are > 0 */
+	  p->missingOffset = arrayCreate (p->N + q->N, long) ;
+	}
+      array(p->missingOffset, p->N + q->N - 1, long) = 0 ; /* fill out with zeros */
+      if (q->missingOffset)
+	{ long base = arrayMax(p->zMissing) - 1 ; /* q's offsets start at 1 */
+	  long n = arrayMax(q->zMissing) - 1 ;
+	  memcpy (arrayBlock(p->zMissing, base+1, n, uchar), arrp(q->zMissing,1,uchar), n) ;
+	  arrayMax(p->zMissing) = base + 1 + n ;
+	  for (i = 0 ; i < arrayMax(q->missingOffset) ; ++i)
+	    { long off = arr(q->missingOffset, i, long) ;
+	      arr(p->missingOffset, p->N + i, long) = off ? off + base : 0 ;
+	    }
+	}
+    }
+  if (p->dosageOffset) { arrayDestroy (p->dosageOffset) ; p->dosageOffset = 0 ; }
+  if (p->zDosage) { arrayDestroy (p->zDosage) ; p->zDosage = 0 ; }
+  if (p->zz) { arrayDestroy (p->zz) ; p->zz = 0 ; } /* reverse no longer valid */
+  if (p->aRstart) { free (p->aRstart) ; p->aRstart = 0 ; }
+  if (p->aRend) { free (p->aRend) ; p->aRend = 0 ; }
+
+  if (q->sites)
+    for (i = 0 ; i < q->N ; ++i) array(p->sites, p->N + i, Site) = arr(q->sites, i, Site) ;
+  if (!p->chrom && q->chrom) { p->chrom = q->chrom ; q->chrom = 0 ; }
+  if (!p->samples && q->samples) { p->samples = q->samples ; q->samples = 0 ; }
+  p->N += q->N ;
+  pbwtDestroy (q) ;
+  return p ;
+}
+
 /***** reverse PBWT - used for local matching to new sequences, and phasing/imputation *****/
 
 void pbwtBuildReverse (PBWT *p)
@@ -177,7 +338,7 @@ void pbwtBuildReverse (PBWT *p)
 
   /* use p->aFend also to start the reverse cursor - this gives better performance */
   if (!p->aRstart) p->aRstart = myalloc (M, int) ; memcpy (p->aRstart, uF->a, M * sizeof(int)) ;
-  p->zz = arrayReCreate (p->zz, arrayMax(p->yz), uchar) ;
+  p->zz = arrayReCreate (p->zz, p->yz ? arrayMax(p->yz) : 1<<20, uchar) ;
   PbwtCursor *uR = pbwtCursorCreate (p, FALSE, TRUE) ; /* will pick up aRstart */
   for (i = p->N ; i-- ; )
     { pbwtCursorReadBackwards (uF) ;
@@ -204,22 +365,108 @@ void pbwtBuildReverse (PBWT *p)
 
 /*************** make haplotypes ******************/
 
-uchar **pbwtHaplotypes (PBWT *p)	/* NB haplotypes can be space costly */
+/* Blocked transpose.  The cursor is swept in tiles of W*64 sites; within a tile each
+   haplotype's values are packed as bits into W words, so the tile holds M*W words laid
+   out haplotype by haplotype.  If all tiles fit in pbwtMemoryBudget they stay in memory,
+   else each is spilled to a temporary file as it fills.  Haplotypes are then rebuilt in
+   groups: for each tile the group's words are one contiguous read, and are expanded
+   8 bits at a time through a lookup table.  Memory use is bounded by the budget,
+   except that at least one word per haplotype, and one haplotype row, are needed.
+*/
+
+static void bitsExpand (uint64_t *bits, int n, uchar *x)	/* bit i -> x[i] = 0 or 1 */
 {
-  int M = p->M ;
-  int i, j, n = 0 ;
-  int *a ;
-  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
-  uchar **hap = myalloc (M, uchar*) ;
+  static uint64_t byteExpand[256] ;
+  if (!byteExpand[255])
+    { int b, k ;
+      for (b = 0 ; b < 256 ; ++b)
+	{ uchar z[8] ; for (k = 0 ; k < 8 ; ++k) z[k] = (b >> k) & 1 ;
+	  memcpy (&byteExpand[b], z, 8) ;
+	}
+    }
+  int i ;
+  for (i = 0 ; i + 8 <= n ; i += 8)
+    memcpy (x+i, &byteExpand[(bits[i >> 6] >> (i & 63)) & 0xff], 8) ;
+  for ( ; i < n ; ++i) x[i] = (bits[i >> 6] >> (i & 63)) & 1 ;
+}
 
-  for (i = 0 ; i < M ; ++i) hap[i] = myalloc (p->N, uchar) ;
+void pbwtTranspose (PBWT *p, void (*func)(void *arg, int j, uchar *hap), void *arg)
+{
+  int M = p->M, N = p->N ;
+  int i, j, k, t ;
+  long nWords = (N + 63) / 64 ;	/* words per haplotype over all sites */
+  long W = pbwtMemoryBudget / (8L * M) ;	/* words per haplotype per tile */
+  if (W < 1) W = 1 ;
+  if (W > nWords) W = nWords ;
+  int nTiles = W ? (nWords + W - 1) / W : 0 ;
+  BOOL isSpill = (nTiles > 1) ;
+  uint64_t *tile = mycalloc ((isSpill ? 1 : nTiles) * W * M + 1, uint64_t) ;
+  FILE *tmp = 0 ;
+  if (isSpill && !(tmp = tmpfile ())) die ("failed to open temporary file for transpose") ;
 
-  for (i = 0 ; i < p->N ; ++i)
-    { for (j = 0 ; j < M ; ++j) hap[u->a[j]][i] = u->y[j] ;
-      pbwtCursorForwardsRead (u) ;
+  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
+  for (t = 0 ; t < nTiles ; ++t)
+    { uint64_t *bits = isSpill ? tile : tile + t*W*M ;
+      int i0 = t*W*64, i1 = i0 + W*64 ; if (i1 > N) i1 = N ;
+      if (isSpill) memset (bits, 0, W*M*sizeof(uint64_t)) ;
+      for (i = i0 ; i < i1 ; ++i)
+	{ int w = (i - i0) >> 6, b = (i - i0) & 63 ;
+	  for (j = 0 ; j < M ; ++j) bits[u->a[j]*W + w] |= (uint64_t)u->y[j] << b ;
+	  pbwtCursorForwardsRead (u) ;
+	}
+      if (isSpill && fwrite (bits, sizeof(uint64_t), W*M, tmp) != W*M)
+	die ("failed to write temporary transpose file") ;
     }
   pbwtCursorDestroy (u) ;
-  return hap ;
+
+  long G = isSpill ? pbwtMemoryBudget / (N + 8*W) : M ; /* haplotypes per group */
+  if (G < 1) G = 1 ;
+  if (G > M) G = M ;
+  uchar *hap = myalloc ((isSpill ? G : 1) * (long)N + 8, uchar) ;
+  if (isSpill) { free (tile) ; tile = myalloc (G*W + 1, uint64_t) ; }
+  for (j = 0 ; j < M ; j += G)
+    { int g = (j + G > M) ? M - j : G ;
+      if (isSpill)
+	{ for (t = 0 ; t < nTiles ; ++t)
+	    { int i0 = t*W*64, n = (i0 + W*64 > N) ? N - i0 : W*64 ;
+	      if (fseeko (tmp, ((off_t)t*M + j)*W*sizeof(uint64_t), SEEK_SET) ||
+		  fread (tile, sizeof(uint64_t), g*W, tmp) != g*W)
+		die ("failed to read temporary transpose file") ;
+	      for (k = 0 ; k < g ; ++k) bitsExpand (tile + k*W, n, hap + (long)k*N + i0) ;
+	    }
+	  for (k = 0 ; k < g ; ++k) (*func)(arg, j+k, hap + (long)k*N) ;
+	}
+      else
+	for (k = j ; k < j+g ; ++k)
+	  { for (t = 0 ; t < nTiles ; ++t)
+	      { int i0 = t*W*64, n = (i0 + W*64 > N) ? N - i0 : W*64 ;
+		bitsExpand (tile + ((long)t*M + k)*W, n, hap + i0) ;
+	      }
+	    (*func)(arg, k, hap) ;
+	  }
+    }
+
+  free (hap) ; free (tile) ;
+  if (tmp) fclose (tmp) ;
+}
+
+typedef struct { uchar **hap ; int N ; } HapCopy ;
+
+static void copyHaplotype (void *arg, int j, uchar *x)
+{
+  HapCopy *c = (HapCopy*) arg ;
+  memcpy (c->hap[j], x, c->N) ;
+}
+
+uchar **pbwtHaplotypes (PBWT *p)	/* NB haplotypes can be space costly */
+{
+  int i ;
+  HapCopy c ;
+  c.hap = myalloc (p->M, uchar*) ; c.N = p->N ;
+
+  for (i = 0 ; i < p->M ; ++i) c.hap[i] = myalloc (p->N, uchar) ;
+  pbwtTranspose (p, copyHaplotype, &c) ;
+  return c.hap ;
 }
 
 
@@ -431,6 +678,95 @@ int packCountReverse (uchar *yzp, int M) /* return number of bytes to reverse 1
   return yzp0 - yzp ;
 }
 
+int packCountForwards (uchar *yzp, int M) /* return number of bytes to advance 1 position */
+{ 
+  int m = 0 ;
+  uchar *yzp0 = yzp ;
+
+  while (m < M)
+    m += p3decode[*yzp++ & 0x7f] ;
+  if (m != M) die ("problem in packCountForwards") ; /* checking assertion */
+  return yzp - yzp0 ;
+}
+
+/* Editing a single column held in its own Array, for the dynamic PBWT in pbwtDynamic.c.
+   Edits are local: the byte holding position r is replaced by the few bytes needed,
+   without merging with neighbouring bytes of the same value, so columns grow a little
+   until they are repacked.
+*/
+
+static long pack3Find (Array col, int r, int *start, int *zeros)
+/* return index of the byte holding position r (arrayMax if r is at the end), the position
+   that byte starts at, and the number of 0s before it */
+{
+  uchar *yz = arrp(col, 0, uchar) ;
+  long i, max = arrayMax(col) ;
+  int m = 0, n0 = 0 ;
+
+  for (i = 0 ; i < max ; ++i)
+    { int n = p3decode[yz[i] & 0x7f] ;
+      if (m + n > r) break ;
+      m += n ;
+      if (!(yz[i] & 0x80)) n0 += n ;
+    }
+  *start = m ; *zeros = n0 ;
+  return i ;
+}
+
+static void pack3Splice (Array col, long i, int nOld, uchar *yz, int nNew)
+/* replace nOld bytes at i by nNew from yz */
+{
+  long max = arrayMax(col) ;
+  if (nNew > nOld) arrayExtend (col, max + nNew - nOld) ;
+  uchar *base = arrp(col, 0, uchar) ;
+  memmove (base + i + nNew, base + i + nOld, max - i - nOld) ;
+  memcpy (base + i, yz, nNew) ;
+  arrayMax(col) = max + nNew - nOld ;
+}
+
+int pack3ColumnInsert (Array col, int r, uchar v)
+/* insert v at position r; return the number of 0s before r */
+{
+  int start, zeros, n = 0 ;
+  uchar buf[16] ;
+  long i = pack3Find (col, r, &start, &zeros) ;
+
+  if (i < arrayMax(col))
+    { uchar z = arr(col, i, uchar), w = z >> 7 ;
+      int len = p3decode[z & 0x7f], before = r - start ;
+      if (!w) zeros += before ;
+      if (w == v)
+	n = pack3Add (v, buf, len+1) ;
+      else
+	{ if (before) n += pack3Add (w, buf, before) ;
+	  n += pack3Add (v, buf+n, 1) ;
+	  n += pack3Add (w, buf+n, len-before) ;
+	}
+      pack3Splice (col, i, 1, buf, n) ;
+    }
+  else				/* r is the end of the column */
+    { n = pack3Add (v, buf, 1) ;
+      pack3Splice (col, i, 0, buf, n) ;
+    }
+  return zeros ;
+}
+
+uchar pack3ColumnDelete (Array col, int r, int *zeros)
+/* remove and return the value at position r; *zeros is set to the number of 0s before r */
+{
+  int start, n = 0 ;
+  uchar buf[8] ;
+  long i = pack3Find (col, r, &start, zeros) ;
+  if (i >= arrayMax(col)) die ("position %d off the end of column in pack3ColumnDelete", r) ;
+
+  uchar z = arr(col, i, uchar), w = z >> 7 ;
+  int len = p3decode[z & 0x7f] ;
+  if (!w) *zeros += r - start ;
+  if (len > 1) n = pack3Add (w, buf, len-1) ;
+  pack3Splice (col, i, 1, buf, n) ;
+  return w ;
+}
+
 #define EATBYTE z = *yzp++ ; n = p3decode[z & 0x7f] ; m += n ; z >>= 7 ; nc[z] += n
 
 int extendMatchForwards (uchar *yzp, int M, uchar x, int *f, int *g)    
@@ -533,20 +869,37 @@ PbwtCursor *pbwtNakedCursorCreate (int M, int *aInit)
   return u ;
 }
 
+/* packed bytes come either from the array u->z or lazily from a block cache */
+
+static inline long cursorMax (PbwtCursor *u)
+{ return u->zc ? blockCacheSize (u->zc) : u->zs ? pbwtStreamMax (u->zs) : arrayMax(u->z) ; }
+
+static inline uchar *cursorBytes (PbwtCursor *u, long n)
+{ return u->zc ? blockCacheFetch (u->zc, n) : u->zs ? pbwtStreamFetch (u->zs, n) : arrp(u->z,n,uchar) ; }
+
+static inline uchar *cursorBytesBefore (PbwtCursor *u, long n) /* for reading backwards from n */
+{ if (u->zs) die ("can't read a stream backwards") ;
+  return u->zc ? blockCacheFetch (u->zc, n-1) + 1 : arrp(u->z,n,uchar) ; }
+
 PbwtCursor *pbwtCursorCreate (PBWT *p, BOOL isForwards, BOOL isStart)
 {
-  if (isForwards && !p->yz) p->yz = arrayCreate (1<<20, uchar) ;
+  BOOL isLazy = isForwards && !p->yz && p->yzBlocks ;
+  BOOL isStream = !p->yz && p->yzStream ;
+  if (isStream && !(isForwards && isStart)) die ("a stream can only be read forwards from the start") ;
+  if (isForwards && !p->yz && !isLazy && !isStream) p->yz = arrayCreate (1<<20, uchar) ;
   if (!isForwards && !p->zz) p->zz = arrayCreate (1<<20, uchar) ;
   PbwtCursor *u ;
   if (isForwards && isStart) u = pbwtNakedCursorCreate (p->M, p->aFstart) ; 
   else if (isForwards && !isStart) u = pbwtNakedCursorCreate (p->M, p->aFend) ; 
   else if (!isForwards && isStart) u = pbwtNakedCursorCreate (p->M, p->aRstart) ;
-  else if (!isForwards && !isStart) u = pbwtNakedCursorCreate (p->M, p->aRend) ;
+  else u = pbwtNakedCursorCreate (p->M, p->aRend) ;
   if (isForwards) u->z = p->yz ; else u->z = p->zz ;
+  if (isLazy) u->zc = blockCacheCreate (p->yzBlocks) ;
+  if (isStream) { pbwtStreamStart (p->yzStream) ; u->zs = p->yzStream ; }
   if (isStart) 
-    if (arrayMax(u->z))
+    if (cursorMax (u))
       { u->nBlockStart = 0 ;
-	u->n = unpack3 (arrp(u->z,0,uchar), p->M, u->y, &u->c) ;
+	u->n = unpack3 (cursorBytes (u, 0), p->M, u->y, &u->c) ;
 	u->isBlockEnd = TRUE ;
       }
     else 
@@ -554,7 +907,28 @@ PbwtCursor *pbwtCursorCreate (PBWT *p, BOOL isForwards, BOOL isStart)
 	u->isBlockEnd = FALSE ;
       }
   else 				/* isEnd */
-    { u->n = arrayMax(u->z) ;
+    { u->n = cursorMax (u) ;
+      u->isBlockEnd = FALSE ;
+    }
+  return u ;
+}
+
+PbwtCursor *pbwtCursorCreateAt (PBWT *p, int *a, long n)
+/* forwards cursor on the column starting at byte n of yz, where the sort order is a[] - 
+   d[] is not known there, so only use for reading y and a */
+{
+  BOOL isLazy = !p->yz && p->yzBlocks ;
+  if (!p->yz && !isLazy) die ("pbwtCursorCreateAt needs a stored pbwt") ;
+  PbwtCursor *u = pbwtNakedCursorCreate (p->M, a) ;
+  u->z = p->yz ;
+  if (isLazy) u->zc = blockCacheCreate (p->yzBlocks) ;
+  u->nBlockStart = n ;
+  if (n < cursorMax (u))
+    { u->n = n + unpack3 (cursorBytes (u, n), p->M, u->y, &u->c) ;
+      u->isBlockEnd = TRUE ;
+    }
+  else
+    { u->n = n ;
       u->isBlockEnd = FALSE ;
     }
   return u ;
@@ -568,6 +942,7 @@ void pbwtCursorDestroy (PbwtCursor *u)
   free (u->d) ;
   free (u->e) ;
   free (u->u) ;
+  if (u->zc) blockCacheDestroy (u->zc) ;
   free (u) ;
 }
 
@@ -643,13 +1018,14 @@ void pbwtCursorCalculateU (PbwtCursor *x)
 void pbwtCursorForwardsRead (PbwtCursor *u) /* move forwards and read (unless at end) */
 {
   pbwtCursorForwardsAPacked (u) ;
-  if (!u->isBlockEnd && u->n < arrayMax(u->z))  /* move to end of previous block */
+  long nMax = cursorMax (u) ;
+  if (!u->isBlockEnd && u->n < nMax)  /* move to end of previous block */
     { u->nBlockStart = u->n ;
-      u->n += unpack3 (arrp(u->z,u->n,uchar), u->M, u->y, 0) ;
+      u->n += unpack3 (cursorBytes (u, u->n), u->M, u->y, 0) ;
     }
-  if (u->n < arrayMax(u->z))
+  if (u->n < nMax)
     { u->nBlockStart = u->n ;
-      u->n += unpack3 (arrp(u->z,u->n,uchar), u->M, u->y, &u->c) ; /* read this block */
+      u->n += unpack3 (cursorBytes (u, u->n), u->M, u->y, &u->c) ; /* read this block */
       u->isBlockEnd = TRUE ;
     }
   else
@@ -659,13 +1035,14 @@ void pbwtCursorForwardsRead (PbwtCursor *u) /* move forwards and read (unless at
 void pbwtCursorForwardsReadAD (PbwtCursor *u, int k) /* AD version of the above */
 {
   pbwtCursorForwardsAD (u, k) ;
-  if (!u->isBlockEnd && u->n < arrayMax(u->z))  /* move to end of previous block */
+  long nMax = cursorMax (u) ;
+  if (!u->isBlockEnd && u->n < nMax)  /* move to end of previous block */
     { u->nBlockStart = u->n ;
-      u->n += unpack3 (arrp(u->z,u->n,uchar), u->M, u->y, 0) ;
+      u->n += unpack3 (cursorBytes (u, u->n), u->M, u->y, 0) ;
     }
-  if (u->n < arrayMax(u->z))
+  if (u->n < nMax)
     { u->nBlockStart = u->n ;
-      u->n += unpack3 (arrp(u->z,u->n,uchar), u->M, u->y, &u->c) ; /* read this block */
+      u->n += unpack3 (cursorBytes (u, u->n), u->M, u->y, &u->c) ; /* read this block */
       u->isBlockEnd = TRUE ;
     }
   else
@@ -674,11 +1051,11 @@ void pbwtCursorForwardsReadAD (PbwtCursor *u, int k) /* AD version of the above
 
 void pbwtCursorReadBackwards (PbwtCursor *u) /* read and go backwards (unless at start) */
 {
-  if (u->isBlockEnd && u->n) u->n -= packCountReverse (arrp(u->z,u->n,uchar), u->M) ;
+  if (u->isBlockEnd && u->n) u->n -= packCountReverse (cursorBytesBefore (u, u->n), u->M) ;
   if (u->n)
-    { u->n -= packCountReverse (arrp(u->z,u->n,uchar), u->M) ;
+    { u->n -= packCountReverse (cursorBytesBefore (u, u->n), u->M) ;
       u->nBlockStart = u->n ;
-      unpack3 (arrp(u->z,u->n,uchar), u->M, u->y, &u->c) ;
+      unpack3 (cursorBytes (u, u->n), u->M, u->y, &u->c) ;
       pbwtCursorBackwardsA (u) ;
       u->isBlockEnd = FALSE ;
     }
@@ -688,6 +1065,7 @@ void pbwtCursorReadBackwards (PbwtCursor *u) /* read and go backwards (unless at
 
 void pbwtCursorWriteForwards (PbwtCursor *u) /* write then move forwards */
 {
+  if (u->zc || u->zs) die ("can't write to a lazily read pbwt") ;
   u->n += pack3arrayAdd (u->y, u->M, u->z) ;
   u->isBlockEnd = FALSE ;
   pbwtCursorForwardsA (u) ;
@@ -695,6 +1073,7 @@ void pbwtCursorWriteForwards (PbwtCursor *u) /* write then move forwards */
 
 void pbwtCursorWriteForwardsAD (PbwtCursor *u, int k)
 {
+  if (u->zc || u->zs) die ("can't write to a lazily read pbwt") ;
   u->n += pack3arrayAdd (u->y, u->M, u->z) ;
   u->isBlockEnd = FALSE ;
   pbwtCursorForwardsAD (u, k) ;
@@ -716,7 +1095,7 @@ void pbwtCursorForwardsAPacked (PbwtCursor *u)
 */
 {
   int c = 0, m = 0, n ;
-  uchar *zp = arrp(u->z,u->nBlockStart,uchar), *zp0 = zp, z ;
+  uchar *zp = cursorBytes (u, u->nBlockStart), *zp0 = zp, z ;
   while (m < u->M) {
     z = *zp++ ;
     n = p3decode[z & 0x7f] ; z >>= 7 ;
@@ -736,6 +1115,22 @@ void pbwtCursorForwardsAPacked (PbwtCursor *u)
 
 /***************************************************/
 
+int pbwtSitesSearch (Array sites, int i, int x)
+/* return the first index >= i whose position is >= x, or arrayMax(sites) if none;
+   gallop out from i then binary search, so short hops stay cheap */
+{
+  int n = arrayMax(sites), step = 1, hi ;
+  if (i >= n || arrp(sites,i,Site)->x >= x) return i ;
+  hi = i + 1 ;
+  while (hi < n && arrp(sites,hi,Site)->x < x) { i = hi ; step *= 2 ; hi = i + step ; }
+  if (hi > n) hi = n ;
+  while (hi - i > 1)		/* invariant: sites[i].x < x, sites[hi].x >= x or hi == n */
+    { int mid = (i + hi) / 2 ;
+      if (arrp(sites,mid,Site)->x < x) i = mid ; else hi = mid ;
+    }
+  return hi ;
+}
+
 static PBWT *selectSitesLocal (PBWT *pOld, Array sites, BOOL isKeepOld, BOOL isFillMissing)
 {
   PBWT *pNew = pbwtCreate (pOld->M, 0) ;
@@ -751,7 +1146,8 @@ static PBWT *selectSitesLocal (PBWT *pOld, Array sites, BOOL isKeepOld, BOOL isF
         { ++ip ; ++sp ;
           pbwtCursorForwardsRead (uOld) ;
         }
-      else if (sp->x > sa->x) { ++ia ; ++sa ; }
+      else if (sp->x > sa->x)
+	{ ia = pbwtSitesSearch (sites, ia+1, sp->x) ; sa = arrp(sites,ia,Site) ; }
       else 
         {
           //  char *sa_als = sa->altAllele;
@@ -783,6 +1179,7 @@ static PBWT *selectSitesLocal (PBWT *pOld, Array sites, BOOL isKeepOld, BOOL isF
 
   fprintf (logFile, "%d sites selected from %d, pbwt size for %d haplotypes is %ld\n", 
 	   pNew->N, pOld->N, pNew->M, arrayMax(pNew->yz)) ;
+  pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ; /* before pOld, whose blocks uOld may use */
 
   if (isKeepOld)
     { if (pOld->samples) pNew->samples = arrayCopy (pOld->samples) ;
@@ -799,7 +1196,7 @@ static PBWT *selectSitesLocal (PBWT *pOld, Array sites, BOOL isKeepOld, BOOL isF
 	pbwtDestroy (pOld) ;
       }
 
-  free(x) ; pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ;
+  free(x) ;
   return pNew ;
 }
 
@@ -828,7 +1225,8 @@ PBWT *pbwtRemoveSites (PBWT *pOld, Array sites, BOOL isKeepOld)
 	  for (j = 0 ; j < pNew->M ; ++j) uNew->y[j] = x[uNew->a[j]] ;
 	  pbwtCursorWriteForwards (uNew) ;
 	}
-      else if (sp->x > sa->x) { ++ia ; ++sa ; }
+      else if (sp->x > sa->x)
+	{ ia = pbwtSitesSearch (sites, ia+1, sp->x) ; sa = arrp(sites,ia,Site) ; }
       else if (sp->varD < sa->varD)
 	{ array(pNew->sites,pNew->N++,Site) = *sp ;
 	  ++ip ; ++sp ;
@@ -847,6 +1245,7 @@ PBWT *pbwtRemoveSites (PBWT *pOld, Array sites, BOOL isKeepOld)
 
   fprintf (logFile, "%d sites selected from %d, pbwt size for %d haplotypes is %ld\n", 
 	   pNew->N, pOld->N, pNew->M, arrayMax(pNew->yz)) ;
+  pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ; /* before pOld, whose blocks uOld may use */
 
   if (isKeepOld)
     { if (pOld->samples) pNew->samples = arrayCopy (pOld->samples) ;
@@ -863,7 +1262,238 @@ PBWT *pbwtRemoveSites (PBWT *pOld, Array sites, BOOL isKeepOld)
 	pbwtDestroy (pOld) ;
       }
 
-  free(x) ; pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ;
+  free(x) ;
+  return pNew ;
+}
+
+/*************** fused chains of site and sample transforms ***************/
+
+/* A chain of subsites, subrange, selectSites, removeSites and subsample steps is run
+   in one sweep: one cursor reads the old PBWT, each site is passed down the steps until
+   one rejects it, and survivors are written to one new PBWT through the composed
+   sample selection.  Each step keeps the state its standalone function would have, and
+   sees only the sites and haplotypes that earlier steps let through, so the result is
+   the same as running the functions one after another.
+*/
+
+typedef enum { T_SUBSITES, T_SUBRANGE, T_SELECT_SITES, T_REMOVE_SITES, T_SUBSAMPLE } TransformType ;
+
+typedef struct {
+  TransformType type ;
+  double fmin, frac, bit ;	/* T_SUBSITES */
+  int start, end ;		/* T_SUBRANGE */
+  Array sites ; int ia ;	/* T_SELECT_SITES, T_REMOVE_SITES */
+  int M ;			/* number of haplotypes this step sees */
+  int *select ;			/* which they are, in the original numbering; 0 if all */
+  Array newSelect ;		/* T_SUBSAMPLE: the selection after this step, owned here */
+  int nIn, nOut ;		/* sites seen and passed on */
+} TransformStep ;
+
+struct PbwtTransformStruct {
+  PBWT *p ;
+  Array steps ;			/* of TransformStep */
+  Array select ;		/* current selection in the original numbering; 0 if all */
+} ;
+
+PbwtTransform *pbwtTransformCreate (PBWT *p)
+{
+  if (!p || !(p->yz || p->yzBlocks)) die ("transform without an existing pbwt") ;
+  PbwtTransform *t = mycalloc (1, PbwtTransform) ;
+  t->p = p ;
+  t->steps = arrayCreate (8, TransformStep) ;
+  return t ;
+}
+
+static TransformStep *transformStepAdd (PbwtTransform *t, TransformType type)
+{
+  TransformStep *ts = arrayp(t->steps, arrayMax(t->steps), TransformStep) ;
+  ts->type = type ;
+  ts->M = t->select ? arrayMax(t->select) : t->p->M ;
+  if (t->select) ts->select = arrp(t->select, 0, int) ; /* stable: t->select is replaced, not changed */
+  return ts ;
+}
+
+void pbwtTransformSubSites (PbwtTransform *t, double fmin, double frac)
+{
+  if (fmin < 0 || fmin >= 1 || frac <= 0 || frac > 1)
+    die ("fmin %f, frac %f for subsites out of range\n", fmin, frac) ;
+  TransformStep *ts = transformStepAdd (t, T_SUBSITES) ;
+  ts->fmin = fmin ; ts->frac = frac ;
+}
+
+void pbwtTransformSubRange (PbwtTransform *t, int start, int end)
+{
+  if (start < 0 || end <= start) die ("subrange invalid start %d, end %d", start, end) ;
+  TransformStep *ts = transformStepAdd (t, T_SUBRANGE) ;
+  ts->start = start ; ts->end = end ;
+}
+
+void pbwtTransformSelectSites (PbwtTransform *t, Array sites) /* takes ownership of sites */
+{
+  if (!t->p->sites) die ("selectSites needs sites") ;
+  transformStepAdd (t, T_SELECT_SITES)->sites = sites ;
+}
+
+void pbwtTransformRemoveSites (PbwtTransform *t, Array sites) /* takes ownership of sites */
+{
+  if (!t->p->sites) die ("removeSites needs sites") ;
+  transformStepAdd (t, T_REMOVE_SITES)->sites = sites ;
+}
+
+void pbwtTransformSubSample (PbwtTransform *t, Array select)
+/* select[i] is the position before this step of the i'th haplotype after it */
+{
+  int i, M = t->select ? arrayMax(t->select) : t->p->M ;
+  Array new = arrayCreate (arrayMax(select), int) ;
+  for (i = 0 ; i < arrayMax(select) ; ++i)
+    { int k = arr(select, i, int) ;
+      if (k < 0 || k >= M) die ("bad haplotype %d in subsample of %d", k, M) ;
+      array(new, i, int) = t->select ? arr(t->select, k, int) : k ;
+    }
+  transformStepAdd (t, T_SUBSAMPLE)->newSelect = new ;
+  t->select = new ;		/* the old one is kept alive by steps that point into it */
+}
+
+Array pbwtTransformSamples (PbwtTransform *t) 
+/* sample ids of the current haplotypes, for selections by name; caller destroys */
+{
+  if (!t->p->samples) return 0 ;
+  if (!t->select) return arrayCopy (t->p->samples) ;
+  int j ;
+  Array a = arrayCreate (arrayMax(t->select), int) ;
+  for (j = 0 ; j < arrayMax(t->select) ; ++j)
+    array(a, j, int) = arr(t->p->samples, arr(t->select, j, int), int) ;
+  return a ;
+}
+
+static BOOL selectSitesStep (TransformStep *ts, Site *sp)
+/* same decisions as the merge in selectSitesLocal() */
+{
+  while (ts->ia < arrayMax(ts->sites))
+    { Site *sa = arrp(ts->sites, ts->ia, Site) ;
+      if (sp->x < sa->x) return FALSE ;
+      else if (sp->x > sa->x) ts->ia = pbwtSitesSearch (ts->sites, ts->ia+1, sp->x) ;
+      else
+	{ char *sa_als = dictName(variationDict, sa->varD) ;
+	  char *sp_als = dictName(variationDict, sp->varD) ;
+	  BOOL noAlt = sa_als[strlen(sa_als)-1] == '.' || sp_als[strlen(sp_als)-1] == '.' ;
+	  if (!noAlt && sp->varD < sa->varD) return FALSE ;
+	  else if (!noAlt && sp->varD > sa->varD) ++ts->ia ;
+	  else { ++ts->ia ; return TRUE ; }
+	}
+    }
+  return FALSE ;
+}
+
+static BOOL removeSitesStep (TransformStep *ts, Site *sp)
+/* same decisions as the merge in pbwtRemoveSites(), which stops at the last removed site */
+{
+  while (ts->ia < arrayMax(ts->sites))
+    { Site *sa = arrp(ts->sites, ts->ia, Site) ;
+      if (sp->x < sa->x) return TRUE ;
+      else if (sp->x > sa->x) ts->ia = pbwtSitesSearch (ts->sites, ts->ia+1, sp->x) ;
+      else if (sp->varD < sa->varD) return TRUE ;
+      else if (sp->varD > sa->varD) ++ts->ia ;
+      else { ++ts->ia ; return FALSE ; }
+    }
+  return FALSE ;
+}
+
+PBWT *pbwtTransformRun (PbwtTransform *t)
+/* destroys t and, unless the chain changes nothing, the old PBWT */
+{
+  PBWT *pOld = t->p ;
+  int i, j, k, nSteps = arrayMax(t->steps) ;
+  TransformStep *steps = arrp(t->steps, 0, TransformStep) ;
+  BOOL isSamples = (t->select != 0) ;
+  BOOL isSitesOnly = TRUE ;	/* only selectSites/removeSites, which return pOld if nothing goes */
+  BOOL isKeepMissing = !isSamples ;
+
+  for (k = 0 ; k < nSteps ; ++k)
+    if (steps[k].type != T_SELECT_SITES && steps[k].type != T_REMOVE_SITES) isSitesOnly = FALSE ;
+
+  int Mnew = isSamples ? arrayMax(t->select) : pOld->M ;
+  int *select = isSamples ? arrp(t->select, 0, int) : 0 ;
+  PBWT *pNew = pbwtCreate (Mnew, 0) ;
+  PbwtCursor *uOld = pbwtCursorCreate (pOld, TRUE, TRUE) ;
+  PbwtCursor *uNew = pbwtCursorCreate (pNew, TRUE, TRUE) ;
+  uchar *x = myalloc (pOld->M, uchar) ;
+  if (pOld->sites) pNew->sites = arrayCreate (4096, Site) ;
+
+  for (i = 0 ; i < pOld->N ; ++i)
+    { BOOL isX = FALSE, isKeep = TRUE ;
+      Site *sp = pOld->sites ? arrp(pOld->sites, i, Site) : 0 ;
+      for (k = 0 ; isKeep && k < nSteps ; ++k)
+	{ TransformStep *ts = &steps[k] ;
+	  ++ts->nIn ;
+	  switch (ts->type)
+	    {
+	    case T_SUBSITES:
+	      { int c = uOld->c, thresh = ts->M*(1-ts->fmin) ;
+		if (ts->select)	/* count 0s among the haplotypes this step sees */
+		  { if (!isX) { for (j = 0 ; j < pOld->M ; ++j) x[uOld->a[j]] = uOld->y[j] ; isX = TRUE ; }
+		    for (c = 0, j = 0 ; j < ts->M ; ++j) c += !x[ts->select[j]] ;
+		  }
+		if ((c < thresh) && ((ts->bit += ts->frac) > 1.0)) ts->bit -= 1.0 ;
+		else isKeep = FALSE ;
+	      }
+	      break ;
+	    case T_SUBRANGE: isKeep = (ts->nIn > ts->start && ts->nIn <= ts->end) ; break ;
+	    case T_SELECT_SITES: isKeep = selectSitesStep (ts, sp) ; break ;
+	    case T_REMOVE_SITES: isKeep = removeSitesStep (ts, sp) ; break ;
+	    case T_SUBSAMPLE: break ;
+	    }
+	  if (isKeep) ++ts->nOut ;
+	}
+      if (isKeep)
+	{ if (!isX) for (j = 0 ; j < pOld->M ; ++j) x[uOld->a[j]] = uOld->y[j] ;
+	  if (isSamples) for (j = 0 ; j < Mnew ; ++j) uNew->y[j] = x[select[uNew->a[j]]] ;
+	  else for (j = 0 ; j < Mnew ; ++j) uNew->y[j] = x[uNew->a[j]] ;
+	  pbwtCursorWriteForwards (uNew) ;
+	  if (pOld->sites) array(pNew->sites, pNew->N, Site) = *sp ;
+	  ++pNew->N ;
+	}
+      pbwtCursorForwardsRead (uOld) ;
+    }
+  pbwtCursorToAFend (uNew, pNew) ;
+
+  for (k = 0 ; k < nSteps ; ++k)
+    { TransformStep *ts = &steps[k] ;
+      if (ts->type == T_SUBRANGE && ts->end > ts->nIn)
+	die ("subrange invalid start %d, end %d", ts->start, ts->end) ;
+      if ((ts->type == T_SELECT_SITES || ts->type == T_REMOVE_SITES) && ts->nOut != ts->nIn)
+	isKeepMissing = FALSE ;	/* a selection that changes something drops missing data */
+    }
+  fprintf (logFile, "%d transforms in one pass leave %d sites of %d, %d haplotypes of %d\n",
+	   nSteps, pNew->N, pOld->N, pNew->M, pOld->M) ;
+  pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ; /* before pOld, whose blocks uOld may use */
+
+  if (isSitesOnly && pNew->N == pOld->N)	/* no change - keep pOld as pNew */
+    { pbwtDestroy (pNew) ;
+      pNew = pOld ;
+    }
+  else
+    { if (pOld->samples && isSamples)
+	{ pNew->samples = arrayCreate (pNew->M, int) ;
+	  for (j = 0 ; j < pNew->M ; ++j)
+	    array(pNew->samples,j,int) = arr(pOld->samples,select[j],int) ;
+	}
+      else
+	{ pNew->samples = pOld->samples ; pOld->samples = 0 ; }
+      pNew->chrom = pOld->chrom ; pOld->chrom = 0 ;
+      if (isKeepMissing)
+	{ pNew->missingOffset = pOld->missingOffset ; pOld->missingOffset = 0 ;
+	  pNew->zMissing = pOld->zMissing ; pOld->zMissing = 0 ;
+	}
+      pbwtDestroy (pOld) ;
+    }
+
+  for (k = 0 ; k < nSteps ; ++k) 
+    { if (steps[k].sites) arrayDestroy (steps[k].sites) ;
+      if (steps[k].newSelect) arrayDestroy (steps[k].newSelect) ;
+    }
+  arrayDestroy (t->steps) ; free (t) ;
+  free (x) ;
   return pNew ;
 }
 
@@ -0,0 +1,222 @@
+/*  File: pbwtDosageIndex.c
+ *  Copyright (C) Genome Research Limited, 2013-
+ *-------------------------------------------------------------------
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *-------------------------------------------------------------------
+ * Description: sample major dosage index, for dosages of a few samples over a region
+ * Exported functions: pbwtWriteDosageIndex, dosageIndexOpen/Destroy/Sample/Get, dosageIndexQuery
+ * HISTORY:
+ * Created: Sun Oct 18 2026
+ *-------------------------------------------------------------------
+ */
+
+#include "pbwt.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Dosages in a pbwt are run length encoded in the sort order of each site, so getting
+   one sample's dosages means decoding and unpermuting every site.  The index transposes
+   them into blocks of up to DOSAGE_BLOCK sites, fewer if M is so large that a block
+   would exceed DOSAGE_BUFFER bytes, within which each haplotype's dosages are
+   contiguous values in sample order, one byte each for the original codec, else two.
+   So the index is M*N or 2*M*N bytes, uncompressed, much larger than the dosages in
+   the pbwt, which trades space for direct access.  Dosages of a haplotype over sites [k0,k1)
+   are then read directly from a mapping of the file, one stretch per block.
+   The scale is chosen from the dosage codec so that its values are kept exactly, except
+   for the 16 bit codec, which is rounded to 1/65535.
+   File layout: header, positions of the N sites, M/2 sample names each 0 terminated,
+   padding to 8 bytes, then the blocks, the last padded to full size with zeros.
+*/
+
+#define DOSAGE_BLOCK 1024	/* most sites per block */
+#define DOSAGE_BUFFER (1L << 26) /* most bytes for the block being transposed */
+
+static char *indexTag = "PDX1" ;
+
+typedef struct {
+  char tag[4] ;
+  int M, N ;
+  int blockSites ;
+  int scale ;			/* dosage is value / scale */
+  int width ;			/* bytes per value, 1 or 2 */
+  long namesLen ;		/* bytes of sample names */
+  long dataOffset ;
+} DosageIndexHeader ;
+
+struct DosageIndexStruct {
+  DosageIndexHeader h ;
+  int *x ;			/* site positions, mapped */
+  DICT *names ;			/* sample names, in sample order */
+  uchar *data ;			/* mapped */
+  void *map ; long mapLen ;
+} ;
+
+void pbwtWriteDosageIndex (PBWT *p, FILE *fp)
+{
+  if (!p || !p->dosageOffset) die ("buildDosageIndex needs a pbwt with dosages, e.g. from -referenceImpute") ;
+  if (!p->sites) die ("buildDosageIndex needs sites") ;
+  if (p->M & 1) die ("buildDosageIndex needs diploid samples, but M is %d", p->M) ;
+
+  DosageIndexHeader h ;
+  memset (&h, 0, sizeof(DosageIndexHeader)) ;
+  memcpy (h.tag, indexTag, 4) ;
+  h.M = p->M ; h.N = p->N ;
+  h.scale = p->dosageBits == 16 ? 65535 : p->dosageBits == 8 ? 510 : 20 ;
+  h.width = h.scale < 256 ? 1 : 2 ;
+  long maxBuf = pbwtMemoryBudget < DOSAGE_BUFFER ? pbwtMemoryBudget : DOSAGE_BUFFER ;
+  long nb = maxBuf / ((long)p->M * h.width) ; /* fewer sites per block for large M */
+  h.blockSites = nb > DOSAGE_BLOCK ? DOSAGE_BLOCK : nb < 1 ? 1 : nb ;
+
+  int i, j, k ;
+  char name[32] ;
+  for (i = 0 ; i < p->M/2 ; ++i)
+    if (p->samples) h.namesLen += strlen (sampleName (sample (p, 2*i))) + 1 ;
+    else h.namesLen += sprintf (name, "PBWT%d", i) + 1 ;
+  long n = sizeof(DosageIndexHeader) + p->N*sizeof(int) + h.namesLen ;
+  h.dataOffset = (n + 7) & ~7L ;
+
+  fwrite (&h, sizeof(DosageIndexHeader), 1, fp) ;
+  for (k = 0 ; k < p->N ; ++k) fwrite (&arrp(p->sites,k,Site)->x, sizeof(int), 1, fp) ;
+  for (i = 0 ; i < p->M/2 ; ++i)
+    if (p->samples) fwrite (sampleName (sample (p, 2*i)), 1, strlen (sampleName (sample (p, 2*i))) + 1, fp) ;
+    else fwrite (name, 1, sprintf (name, "PBWT%d", i) + 1, fp) ;
+  for ( ; n < h.dataOffset ; ++n) putc (0, fp) ;
+
+  int B = h.blockSites ;
+  long nBuf = (long)p->M * B ;
+  uchar *buf = mycalloc (nBuf * h.width, uchar) ;
+  unsigned short *buf16 = (unsigned short*) buf ;
+  double *d = myalloc (p->M, double) ;
+  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
+  for (k = 0 ; k < p->N ; ++k)
+    { int kb = k % B ;
+      pbwtDosageRetrieve (p, u, d, k) ;
+      if (h.width == 1)
+	for (j = 0 ; j < p->M ; ++j) buf[(long)u->a[j]*B + kb] = (uchar) (d[j] * h.scale + 0.5) ;
+      else
+	for (j = 0 ; j < p->M ; ++j) buf16[(long)u->a[j]*B + kb] = (unsigned short) (d[j] * h.scale + 0.5) ;
+      if (kb == B-1 || k == p->N-1)
+	{ if (fwrite (buf, h.width, nBuf, fp) != nBuf) die ("error writing dosage index") ;
+	  memset (buf, 0, nBuf * h.width) ;
+	}
+      pbwtCursorForwardsRead (u) ;
+    }
+  if (ferror (fp)) die ("error writing dosage index") ;
+
+  fprintf (logFile, "written dosage index for %d samples at %d sites in %d blocks of %d, scale %d, %d byte values\n",
+	   p->M/2, p->N, (p->N + B - 1) / B, B, h.scale, h.width) ;
+
+  pbwtCursorDestroy (u) ; free (d) ; free (buf) ;
+}
+
+DosageIndex *dosageIndexOpen (char *fileName)
+{
+  int fd = open (fileName, O_RDONLY) ;
+  struct stat st ;
+  if (fd < 0 || fstat (fd, &st)) die ("failed to open dosage index %s", fileName) ;
+  if (st.st_size < sizeof(DosageIndexHeader)) die ("%s is too short to be a dosage index", fileName) ;
+  void *map = mmap (0, st.st_size, PROT_READ, MAP_SHARED, fd, 0) ;
+  close (fd) ;
+  if (map == MAP_FAILED) die ("failed to map dosage index %s", fileName) ;
+
+  DosageIndex *di = mycalloc (1, DosageIndex) ;
+  di->map = map ; di->mapLen = st.st_size ;
+  memcpy (&di->h, map, sizeof(DosageIndexHeader)) ;
+  DosageIndexHeader *h = &di->h ;
+  if (strncmp (h->tag, indexTag, 4)) die ("%s is not a dosage index written by pbwt", fileName) ;
+  if (h->width != 1 && h->width != 2) die ("bad value width %d in dosage index %s", h->width, fileName) ;
+  long nBlocks = (h->N + h->blockSites - 1) / h->blockSites ;
+  if (h->dataOffset + nBlocks*h->M*h->blockSites*h->width > st.st_size)
+    die ("dosage index %s is truncated", fileName) ;
+  di->x = (int*) ((char*) map + sizeof(DosageIndexHeader)) ;
+  di->data = (uchar*) map + h->dataOffset ;
+
+  di->names = dictCreate (h->M) ;
+  char *cp = (char*) (di->x + h->N) ;
+  int i ;
+  for (i = 0 ; i < h->M/2 ; ++i)
+    { if (!dictAdd (di->names, cp, 0)) die ("duplicate sample name %s in dosage index", cp) ;
+      cp += strlen (cp) + 1 ;
+    }
+
+  fprintf (logFile, "opened dosage index %s for %d samples at %d sites\n", fileName, h->M/2, h->N) ;
+  return di ;
+}
+
+void dosageIndexDestroy (DosageIndex *di)
+{
+  munmap (di->map, di->mapLen) ;
+  dictDestroy (di->names) ;
+  free (di) ;
+}
+
+int dosageIndexSample (DosageIndex *di, char *name)
+{ int i ; return dictFind (di->names, name, &i) ? i : -1 ; }
+
+int dosageIndexSite (DosageIndex *di, int x)
+{
+  int lo = 0, hi = di->h.N ;	/* first site with position >= x */
+  while (lo < hi)
+    { int mid = (lo + hi) / 2 ;
+      if (di->x[mid] < x) lo = mid + 1 ; else hi = mid ;
+    }
+  return lo ;
+}
+
+void dosageIndexGet (DosageIndex *di, int hap, int k0, int k1, double *d)
+{
+  DosageIndexHeader *h = &di->h ;
+  if (hap < 0 || hap >= h->M || k0 < 0 || k1 > h->N) die ("dosageIndexGet out of range") ;
+  double scale = 1.0 / h->scale ;
+  int k = k0 ;
+  while (k < k1)
+    { long b = k / h->blockSites ;
+      int kb = k - b*h->blockSites, kEnd = (b+1)*h->blockSites ;
+      if (kEnd > k1) kEnd = k1 ;
+      long off = (b*h->M + hap)*h->blockSites + kb ;
+      if (h->width == 1)
+	{ uchar *z = di->data + off ;
+	  for ( ; k < kEnd ; ++k) *d++ = *z++ * scale ;
+	}
+      else
+	{ unsigned short *z = (unsigned short*) di->data + off ;
+	  for ( ; k < kEnd ; ++k) *d++ = *z++ * scale ;
+	}
+    }
+}
+
+void dosageIndexQuery (DosageIndex *di, FILE *fp, int xFrom, int xTo, FILE *out)
+{
+  if (xTo < xFrom) die ("dosageQuery end %d is before start %d", xTo, xFrom) ;
+  int k0 = dosageIndexSite (di, xFrom), k1 = dosageIndexSite (di, xTo), k, n = 0 ;
+  double *d0 = myalloc (k1 - k0 + 1, double), *d1 = myalloc (k1 - k0 + 1, double) ;
+  char name[1024] ;
+
+  fprintf (out, "#sample") ;
+  for (k = k0 ; k < k1 ; ++k) fprintf (out, "\t%d", di->x[k]) ;
+  fputc ('\n', out) ;
+  while (fscanf (fp, "%1023s", name) == 1)
+    { int i = dosageIndexSample (di, name) ;
+      if (i < 0) die ("sample %s is not in the dosage index", name) ;
+      dosageIndexGet (di, 2*i, k0, k1, d0) ;
+      dosageIndexGet (di, 2*i+1, k0, k1, d1) ;
+      fputs (name, out) ;
+      for (k = 0 ; k < k1 - k0 ; ++k) fprintf (out, "\t%g", d0[k] + d1[k]) ;
+      fputc ('\n', out) ;
+      ++n ;
+    }
+  fprintf (logFile, "dosages of %d samples at %d sites from %d to %d\n", n, k1 - k0, xFrom, xTo) ;
+  free (d0) ; free (d1) ;
+}
+
+/******************* end of file *******************/
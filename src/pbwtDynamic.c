@@ -0,0 +1,248 @@
+/*  File: pbwtDynamic.c
+ *  Copyright (C) Genome Research Limited, 2013-
+ *-------------------------------------------------------------------
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *-------------------------------------------------------------------
+ * Description: inserting and deleting haplotypes in a PBWT without rebuilding it
+ * Exported functions: pbwtDynamicCreate/Insert/Delete/Finish, pbwtInsertSamples, pbwtDeleteSamples
+ * HISTORY:
+ * Created: Sun Oct 18 2026
+ *-------------------------------------------------------------------
+ */
+
+#include "pbwt.h"
+
+/* Each column is held as its own pack3 Array and edited in place.  A haplotype is
+   threaded through the columns as in the dynamic PBWT of Sanaullah et al.: if it sits
+   at position r in the sort order before column k, with value x there, then before
+   column k+1 it is at u(r) if x is 0, and at c + r - u(r) if x is 1, where u(r) is the
+   number of 0s above r in column k and c the number of 0s in the whole column.
+   Insertion puts a new haplotype at the end of the start order and threads it through,
+   deletion threads the old one out.  Each column edit costs a scan of that column's
+   bytes up to r, which is short for compressed data.  Edits do not merge runs, so a
+   column that has doubled since it was last packed is repacked.
+*/
+
+struct PbwtDynamicStruct {
+  PBWT *p ;			/* its yz is split into col[] until pbwtDynamicFinish() */
+  int M, N ;
+  Array *col ;			/* one pack3 Array per site */
+  int *c ;			/* number of 0s in each column */
+  long *packed ;		/* size of each column when last packed */
+  Array aStart, aEnd ;		/* of int, aFstart and aFend */
+  uchar *y ;			/* workspace for repacking, M+1 long */
+  int yMax ;
+} ;
+
+static void dynamicWorkspace (PbwtDynamic *dp)
+{
+  if (dp->M + 1 > dp->yMax)
+    { free (dp->y) ;
+      dp->yMax = 2*(dp->M + 1) ;
+      dp->y = myalloc (dp->yMax, uchar) ;
+    }
+}
+
+static void columnRepack (PbwtDynamic *dp, int k)
+{
+  Array col = dp->col[k] ;
+  dynamicWorkspace (dp) ;
+  unpack3 (arrp(col, 0, uchar), dp->M, dp->y, 0) ;
+  dp->y[dp->M] = Y_SENTINEL ;
+  Array new = arrayCreate (arrayMax(col), uchar) ;
+  pack3arrayAdd (dp->y, dp->M, new) ;
+  arrayDestroy (col) ;
+  dp->col[k] = new ;
+  dp->packed[k] = arrayMax(new) ;
+}
+
+static void arrayIntInsert (Array a, long i, int x)
+{
+  array(a, arrayMax(a), int) = 0 ;	/* make space */
+  int *base = arrp(a, 0, int) ;
+  memmove (base + i + 1, base + i, (arrayMax(a) - 1 - i) * sizeof(int)) ;
+  base[i] = x ;
+}
+
+static void arrayIntRemove (Array a, long i)
+{
+  int *base = arrp(a, 0, int) ;
+  memmove (base + i, base + i + 1, (arrayMax(a) - 1 - i) * sizeof(int)) ;
+  --arrayMax(a) ;
+}
+
+PbwtDynamic *pbwtDynamicCreate (PBWT *p)
+{
+  if (!p || !(p->yz || p->yzBlocks)) die ("pbwtDynamicCreate called without a valid pbwt") ;
+  pbwtLoadBlocks (p) ;
+  if (!p->aFend) die ("pbwtDynamicCreate needs the end index aFend") ;
+
+  PbwtDynamic *dp = mycalloc (1, PbwtDynamic) ;
+  int k, j ;
+  dp->p = p ; dp->M = p->M ; dp->N = p->N ;
+  dp->col = myalloc (p->N, Array) ;
+  dp->c = myalloc (p->N, int) ;
+  dp->packed = myalloc (p->N, long) ;
+  dynamicWorkspace (dp) ;
+
+  uchar *yz = arrp(p->yz, 0, uchar) ;
+  for (k = 0 ; k < p->N ; ++k)
+    { int n = unpack3 (yz, p->M, dp->y, &dp->c[k]) ;
+      dp->col[k] = arrayCreate (n + 16, uchar) ;
+      memcpy (arrayBlock(dp->col[k], 0, n, uchar), yz, n) ;
+      arrayMax(dp->col[k]) = n ;
+      dp->packed[k] = n ;
+      yz += n ;
+    }
+  arrayDestroy (p->yz) ; p->yz = 0 ;
+
+  dp->aStart = arrayCreate (p->M + 64, int) ;
+  dp->aEnd = arrayCreate (p->M + 64, int) ;
+  for (j = 0 ; j < p->M ; ++j)
+    { array(dp->aStart, j, int) = p->aFstart[j] ;
+      array(dp->aEnd, j, int) = p->aFend[j] ;
+    }
+
+  /* reverse and per-sample side data are no longer valid */
+  if (p->zz) { arrayDestroy (p->zz) ; p->zz = 0 ; }
+  if (p->aRstart) { free (p->aRstart) ; p->aRstart = 0 ; }
+  if (p->aRend) { free (p->aRend) ; p->aRend = 0 ; }
+  if (p->missingOffset || p->dosageOffset)
+    { fprintf (logFile, "warning: missing and dosage data are dropped when editing a pbwt\n") ;
+      if (p->zMissing) { arrayDestroy (p->zMissing) ; p->zMissing = 0 ; }
+      if (p->missingOffset) { arrayDestroy (p->missingOffset) ; p->missingOffset = 0 ; }
+      if (p->zDosage) { arrayDestroy (p->zDosage) ; p->zDosage = 0 ; }
+      if (p->dosageOffset) { arrayDestroy (p->dosageOffset) ; p->dosageOffset = 0 ; }
+    }
+  return dp ;
+}
+
+void pbwtDynamicInsert (PbwtDynamic *dp, uchar *x)
+{
+  int k, r = dp->M ;		/* new haplotype goes at the end of the start order */
+
+  array(dp->aStart, dp->M, int) = dp->M ;
+  ++dp->M ;
+  for (k = 0 ; k < dp->N ; ++k)
+    { int u = pack3ColumnInsert (dp->col[k], r, x[k]) ;
+      if (x[k]) r = dp->c[k] + r - u ;
+      else { ++dp->c[k] ; r = u ; }
+      if (arrayMax(dp->col[k]) > 2*dp->packed[k] + 16) columnRepack (dp, k) ;
+    }
+  arrayIntInsert (dp->aEnd, r, dp->M - 1) ;
+}
+
+void pbwtDynamicDelete (PbwtDynamic *dp, int h)
+{
+  int j, k, r ;
+
+  if (h < 0 || h >= dp->M) die ("bad haplotype %d to delete from dynamic pbwt with M %d", h, dp->M) ;
+  int *a = arrp(dp->aStart, 0, int) ;
+  for (r = 0 ; a[r] != h ; ++r) ;
+  arrayIntRemove (dp->aStart, r) ;
+  --dp->M ;
+  for (k = 0 ; k < dp->N ; ++k)
+    { int u ;
+      if (pack3ColumnDelete (dp->col[k], r, &u)) r = dp->c[k] + r - u ;
+      else { --dp->c[k] ; r = u ; }
+      if (arrayMax(dp->col[k]) > 2*dp->packed[k] + 16) columnRepack (dp, k) ;
+    }
+  if (arr(dp->aEnd, r, int) != h) die ("dynamic pbwt inconsistent deleting haplotype %d", h) ;
+  arrayIntRemove (dp->aEnd, r) ;
+
+  for (j = 0 ; j < dp->M ; ++j)	/* renumber the haplotypes above h */
+    { if (arr(dp->aStart, j, int) > h) --arr(dp->aStart, j, int) ;
+      if (arr(dp->aEnd, j, int) > h) --arr(dp->aEnd, j, int) ;
+    }
+}
+
+PBWT *pbwtDynamicFinish (PbwtDynamic *dp)
+{
+  PBWT *p = dp->p ;
+  int k ;
+  long nz = 0 ;
+
+  for (k = 0 ; k < dp->N ; ++k) nz += dp->packed[k] ;
+  p->yz = arrayCreate (nz + 1024, uchar) ;
+  dynamicWorkspace (dp) ;
+  for (k = 0 ; k < dp->N ; ++k)
+    { unpack3 (arrp(dp->col[k], 0, uchar), dp->M, dp->y, 0) ;
+      dp->y[dp->M] = Y_SENTINEL ;
+      pack3arrayAdd (dp->y, dp->M, p->yz) ;
+      arrayDestroy (dp->col[k]) ;
+    }
+
+  p->M = dp->M ;
+  free (p->aFstart) ; p->aFstart = myalloc (p->M, int) ;
+  free (p->aFend) ; p->aFend = myalloc (p->M, int) ;
+  memcpy (p->aFstart, arrp(dp->aStart, 0, int), p->M * sizeof(int)) ;
+  memcpy (p->aFend, arrp(dp->aEnd, 0, int), p->M * sizeof(int)) ;
+
+  arrayDestroy (dp->aStart) ; arrayDestroy (dp->aEnd) ;
+  free (dp->col) ; free (dp->c) ; free (dp->packed) ; free (dp->y) ;
+  free (dp) ;
+  return p ;
+}
+
+/************ sample level operations ************/
+
+typedef struct { PbwtDynamic *dp ; PBWT *p, *q ; } InsertState ;
+
+static void insertHaplotype (void *arg, int j, uchar *hap)
+{
+  InsertState *s = (InsertState*) arg ;
+  pbwtDynamicInsert (s->dp, hap) ;
+  if (s->p->samples)
+    array(s->p->samples, arrayMax(s->p->samples), int) = arr(s->q->samples, j, int) ;
+}
+
+PBWT *pbwtInsertSamples (PBWT *p, PBWT *q)
+{
+  pbwtCheckSameSites (p, q, "insertSamples") ;
+  if (p->samples && !q->samples) die ("insertSamples needs sample names for the new haplotypes") ;
+  if (!p->samples && q->samples) { arrayDestroy (q->samples) ; q->samples = 0 ; }
+
+  InsertState s ;
+  s.dp = pbwtDynamicCreate (p) ; s.p = p ; s.q = q ;
+  pbwtTranspose (q, insertHaplotype, &s) ;	/* haplotypes one at a time, in bounded memory */
+  p = pbwtDynamicFinish (s.dp) ;
+
+  fprintf (logFile, "inserted %d haplotypes: M is now %d\n", q->M, p->M) ;
+  pbwtDestroy (q) ;
+  return p ;
+}
+
+PBWT *pbwtDeleteSamples (PBWT *p, FILE *fp)
+{
+  if (!p || !p->samples) die ("pbwtDeleteSamples called without sample names") ;
+  Array names = pbwtReadSamplesFile (fp) ;
+  int i, h, nDeleted = 0 ;
+
+  Array isDelete = arrayCreate (1024, BOOL) ;
+  for (i = 0 ; i < arrayMax(names) ; ++i) array(isDelete, arr(names, i, int), BOOL) = TRUE ;
+
+  PbwtDynamic *dp = pbwtDynamicCreate (p) ;
+  for (h = p->M - 1 ; h >= 0 ; --h) /* from the top, so lower indices don't move */
+    { int k = arr(p->samples, h, int) ;
+      if (k < arrayMax(isDelete) && arr(isDelete, k, BOOL))
+	{ pbwtDynamicDelete (dp, h) ;
+	  arrayIntRemove (p->samples, h) ;
+	  ++nDeleted ;
+	}
+    }
+  p = pbwtDynamicFinish (dp) ;
+
+  fprintf (logFile, "deleted %d haplotypes: M is now %d\n", nDeleted, p->M) ;
+  arrayDestroy (isDelete) ; arrayDestroy (names) ;
+  return p ;
+}
+
+/******************* end of file *******************/
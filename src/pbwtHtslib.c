@@ -49,125 +49,388 @@ static int variation (PBWT *p, const char *ref, const char *alt)
   return var ;
 }
 
-PBWT *pbwtReadVcfGT (char *filename)  /* read GTs from vcf/bcf using htslib */
+/* VcfGTReader steps through the GT records of one chromosome, splitting multiallelic
+   records into biallelic sites.  It does not touch the global dictionaries, so several
+   can run in parallel on different regions of an indexed file.
+*/
+
+typedef struct {
+  bcf_srs_t *sr ;
+  bcf_hdr_t *hr ;
+  int M ;
+  char *chrom ;			/* of the first record read: reading stops at the next one */
+  int start, end ;		/* if end > 0 only records with start <= pos <= end */
+  int *gt ; int mgt ;
+  uchar *xAllele ;		/* allele index of each haplotype in the current record */
+  bcf1_t *line ;
+  int iAllele, nAllele ;	/* current allele of current record, and number of alleles */
+  /* results of vcfGTReaderNext() */
+  int pos ;
+  char *ref, *alt ;		/* upper case */
+  int refMax, altMax ;
+  uchar *x ;			/* M values, 1 if haplotype carries alt, in natural order */
+  uchar *xMissing ;		/* M+1, Y_SENTINEL terminated, as needed for packing */
+  int nMissing ;		/* in this record */
+  BOOL isRecordStart, isRecordEnd ; /* site is the first, last split from its record */
+} VcfGTReader ;
+
+static VcfGTReader *vcfGTReaderCreate (char *filename, char *region, int start, int end)
+/* region needs an index; returns 0 if the file can't be opened that way */
 {
-  int i, j ;
-
-  bcf_srs_t *sr = bcf_sr_init() ;
-  if (!bcf_sr_add_reader (sr, filename)) die ("failed to open good vcf file\n") ;
+  VcfGTReader *r = mycalloc (1, VcfGTReader) ;
+  r->sr = bcf_sr_init () ;
+  if (region && bcf_sr_set_regions (r->sr, region, 0) < 0) 
+    { bcf_sr_destroy (r->sr) ; free (r) ; return 0 ; }
+  if (!bcf_sr_add_reader (r->sr, filename)) 
+    { if (region) { bcf_sr_destroy (r->sr) ; free (r) ; return 0 ; }
+      die ("failed to open good vcf file\n") ;
+    }
+  r->hr = r->sr->readers[0].header ;
+  r->M = bcf_hdr_nsamples(r->hr)*2 ; /* assume diploid! */
+  r->start = start ; r->end = end ;
+  r->xAllele = myalloc (r->M, uchar) ;
+  r->x = myalloc (r->M, uchar) ;
+  r->xMissing = myalloc (r->M+1, uchar) ; r->xMissing[r->M] = Y_SENTINEL ;
+  r->refMax = r->altMax = 64 ;
+  r->ref = myalloc (r->refMax, char) ; r->alt = myalloc (r->altMax, char) ;
+  return r ;
+}
 
-  bcf_hdr_t *hr = sr->readers[0].header ;
-  PBWT *p = pbwtCreate (bcf_hdr_nsamples(hr)*2, 0) ; /* assume diploid! */
-  readVcfSamples (p, hr) ;
-  p->sites = arrayCreate (10000, Site) ;
-  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
-  uchar *x = myalloc (p->M, uchar) ;
+static void vcfGTReaderDestroy (VcfGTReader *r)
+{
+  if (r->gt) free (r->gt) ;
+  bcf_sr_destroy (r->sr) ;
+  if (r->chrom) free (r->chrom) ;
+  free (r->xAllele) ; free (r->x) ; free (r->xMissing) ; free (r->ref) ; free (r->alt) ;
+  free (r) ;
+}
 
-  uchar *xMissing = myalloc (p->M+1, uchar) ;
-  xMissing[p->M] = Y_SENTINEL ;  /* needed for efficient packing */
-  long nMissing = 0 ;
-  int nMissingSites = 0 ; 
+static char *upperCopy (char **buf, int *max, const char *s)
+{
+  int n = strlen (s) + 1 ;
+  if (n > *max) { free (*buf) ; while (*max < n) *max *= 2 ; *buf = myalloc (*max, char) ; }
+  char *cp = *buf ; while ((*cp++ = toupper (*s++))) ;
+  return *buf ;
+}
 
-  int mgt_arr = 0, *gt_arr = NULL ;
-  while (bcf_sr_next_line (sr)) 
-    { bcf1_t *line = bcf_sr_get_line(sr,0) ;
-      const char* chrom = bcf_seqname(hr,line) ;
-      if (!p->chrom) p->chrom = strdup (chrom) ;
-      else if (strcmp (chrom, p->chrom)) break ;
+static BOOL vcfGTReadRecord (VcfGTReader *r)
+{
+  int i ;
+  while (bcf_sr_next_line (r->sr)) 
+    { bcf1_t *line = bcf_sr_get_line (r->sr, 0) ;
+      const char* chrom = bcf_seqname (r->hr, line) ;
+      if (!r->chrom) r->chrom = strdup (chrom) ;
+      else if (strcmp (chrom, r->chrom)) return FALSE ;
       int pos = line->pos + 1 ;       // bcf coordinates are 0-based
-      char *ref, *REF; 
-      ref = REF = strdup(line->d.allele[0]);
-      while ( (*ref = toupper(*ref)) ) ++ref ;
+      if (r->end && (pos < r->start || pos > r->end)) continue ; /* overlaps from outside the region */
 
       // get a copy of GTs
-      int ngt = bcf_get_genotypes(hr, line, &gt_arr, &mgt_arr) ;
+      int ngt = bcf_get_genotypes (r->hr, line, &r->gt, &r->mgt) ;
       if (ngt <= 0) continue ;  // it seems that -1 is used if GT is not in the FORMAT
-      if (ngt != p->M && p->M != 2*ngt) die ("%d != %d GT values at %s:%d - not haploid or diploid?", 
-          ngt, p->M, chrom, pos) ;
-
-      memset (xMissing, 0, p->M) ;
-      long wasMissing = nMissing ;
-      /* copy the genotypes into array x[] */
-      if (p->M == 2*ngt) // all GTs haploid: treat haploid genotypes as diploid homozygous A/A
-        {
-          for (i = 0 ; i < ngt ; i++)
-            { if (gt_arr[i] == bcf_gt_missing)
-                { x[2*i] = 0 ;
-                  x[2*i+1] = 0; /* use ref for now */
-                  xMissing[2*i] = 1 ;
-                  xMissing[2*i+1] = 1;
-                  nMissing+=2 ;
-                }
-              else {
-                x[2*i] = bcf_gt_allele(gt_arr[i]) ;  // convert from BCF binary to 0 or 1
-                x[2*i+1] = x[2*i] ;  // convert from BCF binary to 0 or 1
-              }
-            }
-        }
+      if (ngt != r->M && r->M != 2*ngt) die ("%d != %d GT values at %s:%d - not haploid or diploid?", 
+					      ngt, r->M, chrom, pos) ;
+
+      memset (r->xMissing, 0, r->M) ;
+      r->nMissing = 0 ;
+      /* copy the genotypes into array xAllele[] */
+      if (r->M == 2*ngt) // all GTs haploid: treat haploid genotypes as diploid homozygous A/A
+	for (i = 0 ; i < ngt ; i++)
+	  if (r->gt[i] == bcf_gt_missing)
+	    { r->xAllele[2*i] = r->xAllele[2*i+1] = 0 ; /* use ref for now */
+	      r->xMissing[2*i] = r->xMissing[2*i+1] = 1 ;
+	      r->nMissing += 2 ;
+	    }
+	  else
+	    r->xAllele[2*i] = r->xAllele[2*i+1] = bcf_gt_allele(r->gt[i]) ; // convert from BCF binary to 0 or 1
       else
-        {
-          for (i = 0 ; i < p->M ; i++)
-            { if (gt_arr[i] == bcf_int32_vector_end) 
-                die ("unexpected end of genotype vector in VCF") ;
-              if (gt_arr[i] == bcf_gt_missing)
-                { x[i] = 0 ; /* use ref for now */
-                  xMissing[i] = 1 ;
-                  ++nMissing ;
-                }
-              else 
-                x[i] = bcf_gt_allele(gt_arr[i]) ;  // convert from BCF binary to 0 or 1
-            }
-        }
+	for (i = 0 ; i < r->M ; i++)
+	  { if (r->gt[i] == bcf_int32_vector_end) 
+	      die ("unexpected end of genotype vector in VCF") ;
+	    if (r->gt[i] == bcf_gt_missing)
+	      { r->xAllele[i] = 0 ; /* use ref for now */
+		r->xMissing[i] = 1 ;
+		++r->nMissing ;
+	      }
+	    else 
+	      r->xAllele[i] = bcf_gt_allele(r->gt[i]) ;  // convert from BCF binary to 0 or 1
+	  }
+
+      r->line = line ;
+      r->pos = pos ;
+      upperCopy (&r->ref, &r->refMax, line->d.allele[0]) ;
+      r->nAllele = (line->n_allele == 1) ? 2 : line->n_allele ; /* no ALT is written as "." */
+      r->iAllele = 0 ;
+      return TRUE ;
+    }
+  return FALSE ;
+}
 
-      BOOL no_alt = line->n_allele == 1;
-      int n_allele = no_alt ? 2 : line->n_allele;
+static BOOL vcfGTReaderNext (VcfGTReader *r)
+/* next biallelic site: split records into REF/ALT sites, one for each ALT */
+{
+  int j ;
+  if (!r->line || ++r->iAllele >= r->nAllele)
+    { if (!vcfGTReadRecord (r)) { r->line = 0 ; return FALSE ; }
+      r->iAllele = 1 ;
+    }
+  int i = r->iAllele ;
+  if (r->line->n_allele == 1) strcpy (r->alt, ".") ;
+  else upperCopy (&r->alt, &r->altMax, r->line->d.allele[i]) ;
+  for (j = 0 ; j < r->M ; ++j) r->x[j] = (r->xAllele[j] == i) ;
+  r->isRecordStart = (i == 1) ;
+  r->isRecordEnd = (i == r->nAllele - 1) ;
+  return TRUE ;
+}
 
-      /* split into biallelic sites filling in as REF ALT alleles */
-      /* not in the REF/ALT site */
-      for (i = 1 ; i < n_allele ; i++)
-        {
-          char *alt, *ALT; 
-          alt = ALT = no_alt ? "." : strdup(line->d.allele[i]) ;
-          if (!no_alt) while ( (*alt = toupper(*alt)) ) ++alt ;
-
-          /* and pack them into the PBWT */
-          for (j = 0 ; j < p->M ; ++j) u->y[j] = x[u->a[j]] == i ? 1 : 0;
-          pbwtCursorWriteForwards (u) ;
-
-          /* store missing information, if there was any */
-          if (nMissing > wasMissing)
-            { if (!wasMissing)
-                { p->zMissing = arrayCreate (10000, uchar) ;
-                  array(p->zMissing, 0, uchar) = 0 ; /* needed so missing[] has offset > 0 */
-                  p->missingOffset = arrayCreate (1024, long) ;
-                }
-              array(p->missingOffset, p->N, long) = arrayMax(p->zMissing) ;
-              pack3arrayAdd (xMissing, p->M, p->zMissing) ; /* NB original order, not pbwt sort */
-              nMissingSites++ ;
-            }
-          else if (nMissing)
-            array(p->missingOffset, p->N, long) = 0 ;
+static void storeMissing (PBWT *p, VcfGTReader *r) /* call before p->N is incremented */
+{
+  if (r->nMissing)
+    { if (!p->zMissing)
+	{ p->zMissing = arrayCreate (10000, uchar) ;
+	  array(p->zMissing, 0, uchar) = 0 ; /* needed so missing[] has offset > 0 */
+	  p->missingOffset = arrayCreate (1024, long) ;
+	}
+      array(p->missingOffset, p->N, long) = arrayMax(p->zMissing) ;
+      pack3arrayAdd (r->xMissing, p->M, p->zMissing) ; /* NB original order, not pbwt sort */
+    }
+  else if (p->missingOffset)
+    array(p->missingOffset, p->N, long) = 0 ;
+}
 
-          // add the site
-          Site *s = arrayp(p->sites, p->N++, Site) ;
-          s->x = pos ;
-          s->varD = variation (p, REF, ALT) ;          
-        }
+/* With more than one thread an indexed file is read in chunks of the chromosome in 
+   parallel, each into its own PBWT, and these are joined with pbwtConcat().  Variation
+   strings are kept as text in each chunk and only added to variationDict at the end,
+   in the main thread.
+*/
 
-      if (nCheckPoint && !(p->N % nCheckPoint))  pbwtCheckPoint (u, p) ;
+typedef struct {
+  char *filename ;
+  char region[256] ;
+  int start, end ;
+  PBWT *p ;
+  Array varText ;		/* "REF\tALT" for each site, 0 terminated, site varD is the offset */
+  long nMissing ;
+  int nMissingSites ;
+} VcfChunk ;
+
+static void readVcfChunk (void *arg, int k, int thread)
+{
+  VcfChunk *c = (VcfChunk*)arg + k ;
+  VcfGTReader *r = vcfGTReaderCreate (c->filename, c->region, c->start, c->end) ;
+  if (!r) die ("failed to open %s at %s", c->filename, c->region) ;
+  PBWT *p = c->p = pbwtCreate (r->M, 0) ;
+  p->sites = arrayCreate (4096, Site) ;
+  c->varText = arrayCreate (1<<16, char) ;
+  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
+  int j ;
+
+  while (vcfGTReaderNext (r))
+    { for (j = 0 ; j < p->M ; ++j) u->y[j] = r->x[u->a[j]] ;
+      pbwtCursorWriteForwards (u) ;
+      storeMissing (p, r) ;
+      if (r->nMissing) { ++c->nMissingSites ; if (r->isRecordStart) c->nMissing += r->nMissing ; }
+      Site *s = arrayp(p->sites, p->N++, Site) ;
+      s->x = r->pos ;
+      s->varD = arrayMax(c->varText) ;
+      int nRef = strlen (r->ref), nAlt = strlen (r->alt) ;
+      char *cp = arrayBlock(c->varText, s->varD, nRef + nAlt + 2, char) ;
+      memcpy (cp, r->ref, nRef) ; cp[nRef] = '\t' ; memcpy (cp + nRef + 1, r->alt, nAlt + 1) ;
+      arrayMax(c->varText) = s->varD + nRef + nAlt + 2 ;
     }
   pbwtCursorToAFend (u, p) ;
+  if (r->chrom) p->chrom = strdup (r->chrom) ;
+  pbwtCursorDestroy (u) ;
+  vcfGTReaderDestroy (r) ;
+}
 
-  if (gt_arr) free (gt_arr) ;
-  bcf_sr_destroy (sr) ;
-  free (x) ; pbwtCursorDestroy (u) ;  
-  free (xMissing) ;
+static PBWT *readVcfGTChunked (char *filename)
+/* returns 0 if the file can't be read in chunks, e.g. it has no index or contig length */
+{
+  VcfGTReader *r = vcfGTReaderCreate (filename, 0, 0, 0) ;
+  if (!vcfGTReaderNext (r)) { vcfGTReaderDestroy (r) ; return 0 ; }
+  int rid = bcf_hdr_id2int (r->hr, BCF_DT_CTG, r->chrom) ;
+  long length = (rid >= 0) ? (long) r->hr->id[BCF_DT_CTG][rid].val->info[0] : 0 ;
+  if (length <= 0) { vcfGTReaderDestroy (r) ; return 0 ; }
+
+  int k, i, nChunks = 4*nThreads ;
+  VcfChunk *chunks = mycalloc (nChunks, VcfChunk) ;
+  for (k = 0 ; k < nChunks ; ++k)
+    { VcfChunk *c = &chunks[k] ;
+      c->filename = filename ;
+      c->start = 1 + (length * k) / nChunks ;
+      c->end = (k == nChunks-1) ? INT_MAX-1 : (length * (k+1)) / nChunks ; /* last takes anything past length */
+      snprintf (c->region, sizeof(c->region), "%s:%d-%d", r->chrom, c->start, c->end) ;
+    }
+  VcfGTReader *r0 = vcfGTReaderCreate (filename, chunks[0].region, 0, 0) ; /* is there an index? */
+  if (!r0) { vcfGTReaderDestroy (r) ; free (chunks) ; return 0 ; }
+  vcfGTReaderDestroy (r0) ;
+
+  PBWT *p = pbwtCreate (r->M, 0) ;
+  readVcfSamples (p, r->hr) ;
+  p->sites = arrayCreate (10000, Site) ;
+  p->chrom = strdup (r->chrom) ;
+  vcfGTReaderDestroy (r) ;
+
+  pbwtParallelFor (nChunks, readVcfChunk, chunks) ;
+
+  long nMissing = 0 ; int nMissingSites = 0 ;
+  for (k = 0 ; k < nChunks ; ++k)
+    { VcfChunk *c = &chunks[k] ;
+      for (i = 0 ; i < c->p->N ; ++i)
+	{ Site *s = arrp(c->p->sites, i, Site) ;
+	  dictAdd (variationDict, arrp(c->varText, s->varD, char), &s->varD) ;
+	}
+      nMissing += c->nMissing ; nMissingSites += c->nMissingSites ;
+      p = pbwtConcat (p, c->p) ;
+      arrayDestroy (c->varText) ;
+    }
+  free (chunks) ;
+
+  fprintf (logFile, "read genotypes from %s in %d chunks with %ld sample names and %ld sites on chromosome %s: M, N are %d, %d\n", 
+	   filename, nChunks, arrayMax(p->samples)/2, arrayMax(p->sites), p->chrom, p->M, p->N) ;
+  if (p->missingOffset) fprintf (logFile, "%ld missing values at %d sites\n", 
+				 nMissing, nMissingSites) ;
+  return p ;
+}
+
+static void readVcfGTSites (PBWT *p, PbwtCursor *u, VcfGTReader *r, int skipPos, int nSkip)
+/* append sites from r to p, skipping the first nSkip at position skipPos */
+{
+  int j ;
+  long nMissing = 0 ;
+  int nMissingSites = 0 ; 
+
+  while (vcfGTReaderNext (r))
+    { if (nSkip && r->pos == skipPos) { --nSkip ; continue ; }
+      if (!p->chrom) p->chrom = strdup (r->chrom) ;
+      /* pack the site into the PBWT */
+      for (j = 0 ; j < p->M ; ++j) u->y[j] = r->x[u->a[j]] ;
+      pbwtCursorWriteForwards (u) ;
+
+      /* store missing information, if there was any */
+      storeMissing (p, r) ;
+      if (r->nMissing) { nMissingSites++ ; if (r->isRecordStart) nMissing += r->nMissing ; }
+
+      // add the site
+      Site *s = arrayp(p->sites, p->N++, Site) ;
+      s->x = r->pos ;
+      s->varD = variation (p, r->ref, r->alt) ;          
+
+      if (r->isRecordEnd && nCheckPoint && !(p->N % nCheckPoint))  pbwtCheckPoint (u, p) ;
+    }
+  if (nSkip) die ("failed to find the last checkpointed site again at position %d", skipPos) ;
+  pbwtCursorToAFend (u, p) ;
+
+  if (nMissing) fprintf (logFile, "%ld missing values at %d sites\n", 
+			 nMissing, nMissingSites) ;
+}
+
+PBWT *pbwtReadVcfGT (char *filename)  /* read GTs from vcf/bcf using htslib */
+{
+  PBWT *p ;
+
+  if (nThreads > 1 && !nCheckPoint && (p = readVcfGTChunked (filename))) return p ;
+
+  VcfGTReader *r = vcfGTReaderCreate (filename, 0, 0, 0) ;
+  p = pbwtCreate (r->M, 0) ;
+  readVcfSamples (p, r->hr) ;
+  p->sites = arrayCreate (10000, Site) ;
+  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
+
+  readVcfGTSites (p, u, r, 0, 0) ;
 
   fprintf (logFile, "read genotypes from %s with %ld sample names and %ld sites on chromosome %s: M, N are %d, %d\n", 
          filename, arrayMax(p->samples)/2, arrayMax(p->sites), p->chrom, p->M, p->N) ;
-  if (p->missingOffset) fprintf (logFile, "%ld missing values at %d sites\n", 
-         nMissing, nMissingSites) ;
 
+  vcfGTReaderDestroy (r) ;
+  pbwtCursorDestroy (u) ;  
+  return p ;
+}
+
+/* -streamVcfGT parses and packs in a producer thread, so that sweep commands on the
+   result run alongside the parsing: see pbwtStream.c.
+*/
+
+static void vcfStreamProducer (PbwtStream *zs, void *arg)
+{
+  VcfGTReader *r = (VcfGTReader*) arg ;
+  int j, M = r->M ;
+  PbwtCursor *u = pbwtNakedCursorCreate (M, 0) ;
+  Array z = arrayCreate (M+1, uchar), zm = arrayCreate (M+1, uchar) ;
+  Array var = arrayCreate (256, char) ;
+  BOOL isChrom = FALSE ;
+  u->z = z ;
+
+  while (vcfGTReaderNext (r))
+    { if (!isChrom) { pbwtStreamSetChrom (zs, r->chrom) ; isChrom = TRUE ; }
+      for (j = 0 ; j < M ; ++j) u->y[j] = r->x[u->a[j]] ;
+      arrayMax(z) = 0 ; u->n = 0 ;
+      pbwtCursorWriteForwards (u) ;
+      arrayMax(zm) = 0 ;
+      if (r->nMissing) pack3arrayAdd (r->xMissing, M, zm) ; /* NB original order, not pbwt sort */
+      int nRef = strlen (r->ref), nAlt = strlen (r->alt) ;
+      char *cp = arrayBlock(var, 0, nRef + nAlt + 2, char) ;
+      memcpy (cp, r->ref, nRef) ; cp[nRef] = '\t' ; memcpy (cp + nRef + 1, r->alt, nAlt + 1) ;
+      if (!pbwtStreamPut (zs, arrp(z,0,uchar), arrayMax(z), 
+			  arrayMax(zm) ? arrp(zm,0,uchar) : 0, arrayMax(zm), r->pos, cp))
+	break ;
+    }
+  pbwtStreamClose (zs, r->chrom, u->a) ;
+
+  arrayDestroy (z) ; arrayDestroy (zm) ; arrayDestroy (var) ;
+  pbwtCursorDestroy (u) ;
+  vcfGTReaderDestroy (r) ;
+}
+
+PBWT *pbwtStreamVcfGT (char *filename)
+{
+  VcfGTReader *r = vcfGTReaderCreate (filename, 0, 0, 0) ;
+  PBWT *p = pbwtCreate (r->M, 0) ;
+  readVcfSamples (p, r->hr) ;	/* in this thread, since it adds to sampleDict */
+  p->sites = arrayCreate (10000, Site) ;
+  pbwtStreamCreate (p, vcfStreamProducer, r) ;
+  fprintf (logFile, "streaming genotypes from %s with %ld sample names\n", filename, arrayMax(p->samples)/2) ;
+  return p ;
+}
+
+/* Checkpoints are only taken at the end of a record, so reading can restart from the
+   last checkpointed position using the index.  Several records can share a position,
+   so the sites already read there are counted and skipped again.
+*/
+
+PBWT *pbwtResumeVcfGT (char *root, char *filename)
+{
+  int i ;
+  PBWT *p = pbwtReadAll (root) ;
+  if (!p->sites || !p->N || !p->chrom) die ("checkpoint %s has no sites to resume from", root) ;
+  if (!p->aFend) die ("checkpoint %s has no end index", root) ;
+  pbwtLoadBlocks (p) ;
+  if (p->zz) { arrayDestroy (p->zz) ; p->zz = 0 ; free (p->aRstart) ; p->aRstart = 0 ; free (p->aRend) ; p->aRend = 0 ; }
+
+  int lastPos = arrp(p->sites, p->N-1, Site)->x ;
+  int nSkip = 0 ;
+  for (i = p->N-1 ; i >= 0 && arrp(p->sites, i, Site)->x == lastPos ; --i) ++nSkip ;
+  char region[256] ;
+  snprintf (region, sizeof(region), "%s:%d-%d", p->chrom, lastPos, INT_MAX-1) ;
+  VcfGTReader *r = vcfGTReaderCreate (filename, region, lastPos, INT_MAX-1) ;
+  if (!r) die ("can't resume reading %s at %s - is it indexed?", filename, region) ;
+  if (r->M != p->M) die ("checkpoint %s has M %d but %s has %d haplotypes", root, p->M, filename, r->M) ;
+  if (p->samples)
+    for (i = 0 ; i < p->M/2 ; ++i)
+      if (strcmp (sampleName (sample (p, 2*i)), r->hr->samples[i]))
+	die ("sample %d is %s in checkpoint %s but %s in %s", 
+	     i, sampleName (sample (p, 2*i)), root, r->hr->samples[i], filename) ;
+
+  int N0 = p->N ;
+  PbwtCursor *u = pbwtNakedCursorCreate (p->M, p->aFend) ;
+  u->z = p->yz ;
+  readVcfGTSites (p, u, r, lastPos, nSkip) ;
+
+  fprintf (logFile, "resumed reading genotypes from %s after %d sites: read %d more, M, N are %d, %d\n", 
+	   filename, N0, p->N - N0, p->M, p->N) ;
+
+  vcfGTReaderDestroy (r) ;
+  pbwtCursorDestroy (u) ;  
   return p ;
 }
 
@@ -234,17 +497,45 @@ static void pbwtSetContigs(bcf_hdr_t *hdr, faidx_t *fai)
     }
 }
 
-void pbwtWriteVcf (PBWT *p, char *filename, char *referenceFasta, char *mode)
+/* VCF/BCF writing is done through a VcfWriter, so that imputation etc. can also stream sites
+   out as they are made.  Sites are collected into a batch, the bcf1_t records for a batch
+   are built in parallel, then written in order; BGZF compression runs on htslib's own threads.
+*/
+
+typedef struct {
+  Site s ;
+  uchar *y ;			/* column, in sort order if a is set, else sample order */
+  int *a ;			/* copy of sort order, 0 if y is in sample order */
+  double *d ;			/* dosages in the same order as y, 0 if none */
+  bcf1_t *rec ;
+} VcfSlot ;
+
+struct VcfWriterStruct {
+  htsFile *fp ;
+  bcf_hdr_t *hdr ;
+  int M ;
+  int rid ;
+  BOOL isDosage, isRefFreq, isUnphased ;
+  int nSlots, nFull ;
+  VcfSlot *slot ;
+  uchar **hap ;			/* per thread scratch below */
+  double **ad ;
+  int32_t **gts ;
+  float **fls ;
+  long nWritten ;
+} ;
+
+VcfWriter *pbwtVcfWriterOpen (PBWT *p, char *filename, char *referenceFasta, char *mode,
+			      BOOL isDosage, BOOL isRefFreq)
 {
-  htsFile *fp = NULL ;
-  bcf_hdr_t *bcfHeader = NULL ;
+  VcfWriter *w = mycalloc (1, VcfWriter) ;
+  bcf_hdr_t *bcfHeader ;
+  int i ;
 
-  fp = hts_open(filename,mode) ;
-  if (!fp) die ("could not open file for writing: %s", filename) ;
-  if (!p) die ("pbwtWriteVcf called without a valid pbwt") ;
-  if (!p->sites) die ("pbwtWriteVcf called without sites") ;
+  w->fp = hts_open(filename,mode) ;
+  if (!w->fp) die ("could not open file for writing: %s", filename) ;
+  if (nThreads > 1) hts_set_threads (w->fp, nThreads) ;
   if (!p->samples) fprintf (logFile, "Warning: pbwtWriteVcf called without samples... using fake sample names PBWT0, PBWT1 etc...\n") ;
-  BOOL isDosage = p->dosageOffset ? TRUE : FALSE ;
 
   // write header
   bcfHeader = bcf_hdr_init("w") ;
@@ -279,7 +570,6 @@ void pbwtWriteVcf (PBWT *p, char *filename, char *referenceFasta, char *mode)
       bcf_hdr_append(bcfHeader, "##FORMAT=<ID=GP,Number=G,Type=Float,Description=\"Genotype posterior probabilities\">") ;
     }
   
-  int i, j ;
   for (i = 0 ; i < p->M/2 ; ++i)
     {
       if (p->samples)
@@ -293,106 +583,177 @@ void pbwtWriteVcf (PBWT *p, char *filename, char *referenceFasta, char *mode)
         }
     }
   bcf_hdr_add_sample(bcfHeader, 0) ; /* required to update internal structures */
-  bcf_hdr_write(fp, bcfHeader) ;
+  bcf_hdr_write(w->fp, bcfHeader) ;
+
+  w->hdr = bcfHeader ;
+  w->M = p->M ;
+  w->rid = bcf_hdr_name2id(bcfHeader, p->chrom) ;
+  w->isDosage = isDosage ; w->isRefFreq = isRefFreq ; w->isUnphased = p->isUnphased ;
+
+  /* a few batches per thread, but don't let the buffered columns take more than ~256MB */
+  long slotSize = (long)p->M * (sizeof(uchar) + sizeof(int) + (isDosage ? sizeof(double) : 0)) + 1 ;
+  w->nSlots = 4 * nThreads ;
+  if (w->nSlots * slotSize > (1L << 28)) w->nSlots = (1L << 28) / slotSize ;
+  if (w->nSlots < 1) w->nSlots = 1 ;
+  w->slot = mycalloc (w->nSlots, VcfSlot) ;
+  for (i = 0 ; i < w->nSlots ; ++i)
+    { w->slot[i].y = myalloc (p->M, uchar) ;
+      w->slot[i].a = myalloc (p->M, int) ;
+      if (isDosage) w->slot[i].d = myalloc (p->M, double) ;
+      w->slot[i].rec = bcf_init1() ;
+    }
+  w->hap = myalloc (nThreads, uchar*) ;
+  w->gts = myalloc (nThreads, int32_t*) ;
+  w->ad = mycalloc (nThreads, double*) ;
+  w->fls = mycalloc (nThreads, float*) ;
+  for (i = 0 ; i < nThreads ; ++i)
+    { w->hap[i] = myalloc (p->M, uchar) ;
+      w->gts[i] = myalloc (p->M, int32_t) ;
+      if (isDosage)
+	{ w->ad[i] = myalloc (p->M, double) ;
+	  w->fls[i] = myalloc (p->M + p->M/2 + 3*p->M/2, float) ; /* ADS, DS, GP */
+	}
+    }
+  return w ;
+}
 
-  bcf1_t *bcfRecord = bcf_init1() ;
-  uchar *hap = myalloc (p->M, uchar) ;
-  int32_t *gts = myalloc (p->M, int32_t) ;
-  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
-  double *d = 0 ;
-  double *gps = isDosage ? myalloc (3*p->M/2, double) : NULL;
-  double *ds = isDosage ? myalloc (p->M/2, double) : NULL;
-  double *ad = isDosage ? myalloc (p->M, double) : NULL;
-  float *fls = myalloc (3*p->M/2, float);
+static void vcfWriterFormat (void *arg, int i, int t) /* build record for slot i on thread t */
+{
+  VcfWriter *w = (VcfWriter*) arg ;
+  VcfSlot *v = &w->slot[i] ;
+  Site *s = &v->s ;
+  bcf_hdr_t *bcfHeader = w->hdr ;
+  bcf1_t *bcfRecord = v->rec ;
+  int j, M = w->M ;
+  uchar *hap = v->a ? w->hap[t] : v->y ;
+  double *ad = v->a ? w->ad[t] : v->d ;
+  int32_t *gts = w->gts[t] ;
+
+  bcf_clear(bcfRecord) ;
+  bcf_float_set_missing(bcfRecord->qual) ;
+  bcfRecord->rid = w->rid ;
+  bcfRecord->pos = s->x - 1 ;
+  char *als = strdup( dictName(variationDict, s->varD) ), *ss = als ;
+  while ( *ss ) { if ( *ss=='\t' ) *ss = ',' ; ss++ ; }
+  bcf_update_alleles_str(bcfHeader, bcfRecord, als) ;
+  free(als) ;
+  bcf_add_filter(bcfHeader, bcfRecord, bcf_hdr_id2int(bcfHeader, BCF_DT_ID, "PASS")) ;
+
+  if (v->a)			// map haplotypes and dosages to sample order
+    { for (j = 0 ; j < M ; ++j) hap[v->a[j]] = v->y[j] ;
+      if (w->isDosage) for (j = 0 ; j < M ; ++j) ad[v->a[j]] = v->d[j] ;
+    }
 
-  for (i = 0 ; i < p->N ; ++i)
+  int ac[2] = {0,0};
+  float raf = s->refFreq;
+  float info = s->imputeInfo;
+  float *ads = w->fls[t], *ds = ads + M, *gps = ds + M/2 ;
+  for (j = 0 ; j < M ; j+=2)
     {
-      Site *s = arrp(p->sites, i, Site) ;
-      bcf_float_set_missing(bcfRecord->qual) ;
-      bcfRecord->rid = bcf_hdr_name2id(bcfHeader, p->chrom) ;
-      bcfRecord->pos = s->x - 1 ;
-      char *als = strdup( dictName(variationDict, s->varD) ), *ss = als ;
-      while ( *ss ) { if ( *ss=='\t' ) *ss = ',' ; ss++ ; }
-      bcf_update_alleles_str(bcfHeader, bcfRecord, als) ;
-      free(als) ;
-      bcf_add_filter(bcfHeader, bcfRecord, bcf_hdr_id2int(bcfHeader, BCF_DT_ID, "PASS")) ;
-
-      if (isDosage) d = pbwtDosageRetrieve (p, u, d, i) ;
-      // map haplotypes and dosages to sample order
-      for (j = 0 ; j < p->M ; ++j)
-      {
-        hap[u->a[j]] = u->y[j] ;
-        if (isDosage) ad[u->a[j]] = d[j] ;
-      }
-      int ac[2] = {0,0};
-      float raf = s->refFreq;
-      float info = s->imputeInfo;
-      for (j = 0 ; j < p->M ; j+=2)
-        {
-          // todo: handle missing data
-          /* these are actually posterior probabilities per haplotype
-           to get dosages for a genotype, add the two values, e.g. dg[n] = d[2*n] + d[2*n+1]
-           to get genotype likelihoods 
-           gl[n][0] = (1-d[2*n]) * (1-d[2*n+1])
-           gl[n][1] = d[2*n] + d[2*n+1] - 2*d[2*n]*d[2*n+1]
-           gl[n][2] = d[2*n] * d[2*n+1]
-          */
-          if (isDosage)
-            {
-               ds[j/2] = ad[j] + ad[j+1] ;
-               gps[3*j/2] = (1-ad[j]) * (1-ad[j+1]) ;
-               gps[3*j/2+1] = ad[j] + ad[j+1] - 2*ad[j]*ad[j+1] ;
-               gps[3*j/2+2] = ad[j] * ad[j+1] ;
-            }
-          gts[j] = bcf_gt_unphased(hap[j]) ;
-          gts[j+1] = p->isUnphased ? bcf_gt_unphased(hap[j+1]) : bcf_gt_phased(hap[j+1]) ;
-          ac[hap[j]]++ ;
-          ac[hap[j+1]]++ ;
-        }
-      int an = ac[0] + ac[1] ;
+      // todo: handle missing data
+      /* these are actually posterior probabilities per haplotype
+	 to get dosages for a genotype, add the two values, e.g. dg[n] = d[2*n] + d[2*n+1]
+	 to get genotype likelihoods 
+	 gl[n][0] = (1-d[2*n]) * (1-d[2*n+1])
+	 gl[n][1] = d[2*n] + d[2*n+1] - 2*d[2*n]*d[2*n+1]
+	 gl[n][2] = d[2*n] * d[2*n+1]
+	 BCF needs floats, so convert once here as we go
+      */
+      if (w->isDosage)
+	{ double d0 = ad[j], d1 = ad[j+1] ;
+	  ads[j] = d0 ; ads[j+1] = d1 ;
+	  ds[j/2] = d0 + d1 ;
+	  gps[3*j/2] = (1-d0) * (1-d1) ;
+	  gps[3*j/2+1] = d0 + d1 - 2*d0*d1 ;
+	  gps[3*j/2+2] = d0 * d1 ;
+	}
+      gts[j] = bcf_gt_unphased(hap[j]) ;
+      gts[j+1] = w->isUnphased ? bcf_gt_unphased(hap[j+1]) : bcf_gt_phased(hap[j+1]) ;
+      ac[hap[j]]++ ;
+      ac[hap[j+1]]++ ;
+    }
+  int an = ac[0] + ac[1] ;
 
-      if ( bcf_update_genotypes(bcfHeader, bcfRecord, gts, p->M) ) die("Could not update GT field\n");
-      if (p->isRefFreq)
-          if ( bcf_update_info_float(bcfHeader, bcfRecord, "RefPanelAF", &raf, 1) ) die("Could not update INFO/RefPanelAF field\n") ;
-      if (isDosage)
-        {
-          if ( bcf_update_info_float(bcfHeader, bcfRecord, "DR2", &info, 1) ) die("Could not update INFO/DS field\n") ;
-          int k ;
-          // dosages stored as double, but BCF required floats
-          // may be a better way to handle this, but it works
-          // for the moment
-          for (k = 0 ; k < p->M ; ++k)
-            fls[k] = (float)(ad[k]) ;
-          if ( bcf_update_format_float(bcfHeader, bcfRecord, "ADS", fls, p->M) ) die("Could not update FORMAT/ADS field\n") ;
-          for (k = 0 ; k < p->M/2 ; ++k)
-            fls[k] = (float)(ds[k]) ;
-          if ( bcf_update_format_float(bcfHeader, bcfRecord, "DS", fls, p->M/2) ) die("Could not update FORMAT/DS field\n") ;
-          for (k = 0 ; k < 3*p->M/2 ; ++k)
-            fls[k] = (float)(gps[k]) ;
-          if ( bcf_update_format_float(bcfHeader, bcfRecord, "GP", fls, 3*p->M/2) ) die("Could not update FORMAT/GP field\n") ;
-        }
+  if ( bcf_update_genotypes(bcfHeader, bcfRecord, gts, M) ) die("Could not update GT field\n");
+  if (w->isRefFreq)
+    if ( bcf_update_info_float(bcfHeader, bcfRecord, "RefPanelAF", &raf, 1) ) die("Could not update INFO/RefPanelAF field\n") ;
+  if (w->isDosage)
+    {
+      if ( bcf_update_info_float(bcfHeader, bcfRecord, "DR2", &info, 1) ) die("Could not update INFO/DS field\n") ;
+      if ( bcf_update_format_float(bcfHeader, bcfRecord, "ADS", ads, M) ) die("Could not update FORMAT/ADS field\n") ;
+      if ( bcf_update_format_float(bcfHeader, bcfRecord, "DS", ds, M/2) ) die("Could not update FORMAT/DS field\n") ;
+      if ( bcf_update_format_float(bcfHeader, bcfRecord, "GP", gps, 3*M/2) ) die("Could not update FORMAT/GP field\n") ;
+    }
+
+  // example of adding INFO fields
+  bcf_update_info_int32(bcfHeader, bcfRecord, "AC", &ac[1], 1) ;
+  bcf_update_info_int32(bcfHeader, bcfRecord, "AN", &an, 1) ;
+}
+
+static void vcfWriterFlush (VcfWriter *w)
+{
+  int i ;
+  pbwtParallelFor (w->nFull, vcfWriterFormat, w) ;
+  for (i = 0 ; i < w->nFull ; ++i)	/* write in order */
+    if (bcf_write(w->fp, w->hdr, w->slot[i].rec) < 0) die ("failed to write vcf record") ;
+  w->nWritten += w->nFull ;
+  w->nFull = 0 ;
+}
 
-      // example of adding INFO fields
-      bcf_update_info_int32(bcfHeader, bcfRecord, "AC", &ac[1], 1) ;
-      bcf_update_info_int32(bcfHeader, bcfRecord, "AN", &an, 1) ;
+void pbwtVcfWriterAdd (VcfWriter *w, Site *s, uchar *y, int *a, double *d)
+{
+  VcfSlot *v = &w->slot[w->nFull++] ;
+  v->s = *s ;
+  memcpy (v->y, y, w->M*sizeof(uchar)) ;
+  if (a) memcpy (v->a, a, w->M*sizeof(int)) ;
+  else { free (v->a) ; v->a = 0 ; } /* a, or not, is the same for every call */
+  if (w->isDosage) memcpy (v->d, d, w->M*sizeof(double)) ;
+  if (w->nFull == w->nSlots) vcfWriterFlush (w) ;
+}
 
-      //write and progress
-      bcf_write(fp, bcfHeader, bcfRecord) ;
-      bcf_clear(bcfRecord) ;
+void pbwtVcfWriterClose (VcfWriter *w)
+{
+  int i ;
+  vcfWriterFlush (w) ;
 
-      pbwtCursorForwardsRead(u) ;
+  fprintf (logFile, "written vcf file: %ld records and %d samples\n", w->nWritten, w->M/2) ;
+
+  for (i = 0 ; i < w->nSlots ; ++i)
+    { free (w->slot[i].y) ; if (w->slot[i].a) free (w->slot[i].a) ;
+      if (w->slot[i].d) free (w->slot[i].d) ;
+      bcf_destroy1 (w->slot[i].rec) ;
+    }
+  for (i = 0 ; i < nThreads ; ++i)
+    { free (w->hap[i]) ; free (w->gts[i]) ;
+      if (w->ad[i]) free (w->ad[i]) ;
+      if (w->fls[i]) free (w->fls[i]) ;
     }
+  free (w->slot) ; free (w->hap) ; free (w->gts) ; free (w->ad) ; free (w->fls) ;
+  bcf_hdr_destroy (w->hdr) ;
+  hts_close (w->fp) ;
+  free (w) ;
+}
 
-  // cleanup
-  free(hap) ;
-  free(gts) ;
-  if (isDosage) { free(fls) ; free(gps) ; free(ds) ; free(ad) ; }
-  /*  pbwtCursorDestroy(u) ; */
-  bcf_hdr_destroy(bcfHeader) ;
-  bcf_destroy1(bcfRecord);
-  hts_close(fp) ;
+void pbwtWriteVcf (PBWT *p, char *filename, char *referenceFasta, char *mode)
+{
+  if (!p) die ("pbwtWriteVcf called without a valid pbwt") ;
+  if (!p->sites) die ("pbwtWriteVcf called without sites") ;
+  BOOL isDosage = p->dosageOffset ? TRUE : FALSE ;
+
+  VcfWriter *w = pbwtVcfWriterOpen (p, filename, referenceFasta, mode, isDosage, p->isRefFreq) ;
+  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
+  double *d = 0 ;
+  int i ;
+
+  for (i = 0 ; i < p->N ; ++i)
+    { if (isDosage) d = pbwtDosageRetrieve (p, u, d, i) ;
+      pbwtVcfWriterAdd (w, arrp(p->sites, i, Site), u->y, u->a, d) ;
+      pbwtCursorForwardsRead (u) ;
+    }
 
-  fprintf (logFile, "written vcf file: %d records and %d samples\n", p->N, p->M/2) ;
+  pbwtVcfWriterClose (w) ;
+  if (d) free (d) ;
+  pbwtCursorDestroy (u) ;
 }
 
 /******* end of file ********/
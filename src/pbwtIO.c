@@ -22,20 +22,101 @@
  */
 
 #include "pbwt.h"
+#include <pthread.h>
 #include <ctype.h>
+#include <unistd.h>		/* dup(), pread() */
+#include <sys/mman.h>		/* mmap() for PLINK bed files and mapped yz */
+#include <sys/stat.h>
 
 int nCheckPoint = 0 ;	/* if set non-zero write pbwt and sites files every n sites when parsing external files */
+int pbwtBlockSize = 0 ;	/* if set non-zero write yz zlib compressed in blocks of about this many bytes */
+BOOL isReadLazy = FALSE ; /* if set leave block compressed yz on disk and decompress in cursors on demand */
 
 static BOOL isWriteImputeRef = FALSE ;	/* modifies WriteSites() and WriteHaplotypes() for pbwtWriteImputeRef */
 
 /* basic function to store packed PBWT */
 
+/* Version 4 files hold yz zlib compressed in blocks that each end on a column boundary,
+   preceded by an index so that blocks can be fetched and decompressed independently.
+   A column never spans two blocks, so a cursor only ever needs the block holding n.
+*/
+
+typedef struct {
+  long start ;			/* offset of block in uncompressed yz */
+  long offset ;			/* offset of compressed block from start of data */
+  int site ;			/* index of first site in block */
+  int nIn ;			/* uncompressed size */
+  int nOut ;			/* compressed size */
+  int pad ;
+} BlockIndex ;
+
+struct PbwtBlocksStruct {
+  int M ;
+  long nz ;			/* total uncompressed size */
+  int nBlocks ;
+  BlockIndex *index ;
+  int fd ;			/* private duplicate of the file descriptor, so pread() is independent */
+  long dataStart ;		/* file offset of compressed data */
+  uchar *map ;			/* if set, yz is uncompressed and mapped here, with no blocks */
+} ;
+
+#define N_CACHE 2	/* need at least 2 so the column before the current one stays resident */
+
+struct BlockCacheStruct {
+  PbwtBlocks *zb ;		/* not owned, and may be destroyed before the cache */
+  BOOL isMapped ;		/* copy of zb->map != 0, for blockCacheDestroy */
+  int block[N_CACHE] ;		/* block held in each slot, -1 if none; slot 0 most recent */
+  Array data[N_CACHE] ;		/* uncompressed blocks */
+  Array zbuf ;			/* compressed scratch */
+} ;
+
+static void writeBlocked (PBWT *p, FILE *fp)
+{
+  int nBlocks = 0, site = 0 ;
+  long start = 0, pos = 0, nOut = 0 ;
+  Array index = arrayCreate (1024, BlockIndex) ;
+  Array zdata = arrayCreate (arrayMax(p->yz)/4 + 1024, uchar) ;
+  uchar *yz = arrp(p->yz, 0, uchar) ;
+
+  while (start < arrayMax(p->yz))
+    { BlockIndex *bi = arrayp(index, nBlocks++, BlockIndex) ;
+      bi->start = start ; bi->site = site ;
+      while (pos < arrayMax(p->yz) && (pos == start || pos - start < pbwtBlockSize))
+	{ pos += packCountForwards (yz + pos, p->M) ; ++site ; }
+      bi->nIn = pos - start ;
+      uLongf zlen = compressBound (bi->nIn) ;
+      array(zdata, nOut + zlen, uchar) = 0 ; /* make space */
+      if (compress2 (arrp(zdata, nOut, uchar), &zlen, yz + start, bi->nIn, Z_DEFAULT_COMPRESSION) != Z_OK)
+	die ("zlib failure compressing block %d in pbwtWrite", nBlocks-1) ;
+      bi->offset = nOut ; bi->nOut = zlen ;
+      nOut += zlen ;
+      start = pos ;
+    }
+  if (site != p->N) die ("site count %d != N %d while blocking pbwt", site, p->N) ;
+
+  long nz = arrayMax(p->yz) ;
+  if (fwrite (&nz, sizeof(long), 1, fp) != 1 ||
+      fwrite (&nBlocks, sizeof(int), 1, fp) != 1 ||
+      fwrite (&pbwtBlockSize, sizeof(int), 1, fp) != 1)
+    die ("error writing block header in pbwtWrite") ;
+  if (fwrite (arrp(index, 0, BlockIndex), sizeof(BlockIndex), nBlocks, fp) != nBlocks)
+    die ("error writing block index in pbwtWrite") ;
+  if (fwrite (arrp(zdata, 0, uchar), 1, nOut, fp) != nOut)
+    die ("error writing block data in pbwtWrite") ;
+
+  fprintf (logFile, "written %ld chars pbwt as %d blocks compressed to %ld: M, N are %d, %d\n",
+	   nz, nBlocks, nOut, p->M, p->N) ;
+
+  arrayDestroy (index) ; arrayDestroy (zdata) ;
+}
+
 void pbwtWrite (PBWT *p, FILE *fp) /* just writes compressed pbwt in yz */
 {
+  if (p && !p->yz && p->yzBlocks) pbwtLoadBlocks (p) ;
   if (!p || !p->yz) die ("pbwtWrite called without a valid pbwt") ;
   if (!p->aFstart || !p->aFend) die ("pbwtWrite called without start and end indexes") ;
   /* version 2 added start and end indexes */
-  if (fwrite ("PBW3", 1, 4, fp) != 4) /* version 3 with 8 byte pbwt size */
+  if (fwrite (pbwtBlockSize ? "PBW4" : "PBW3", 1, 4, fp) != 4) /* version 3 with 8 byte pbwt size */
     die ("error writing PBWT in pbwtWrite") ;
   if (fwrite (&p->M, sizeof(int), 1, fp) != 1)
     die ("error writing M in pbwtWrite") ;
@@ -45,6 +126,7 @@ void pbwtWrite (PBWT *p, FILE *fp) /* just writes compressed pbwt in yz */
     die ("error writing aFstart in pbwtWrite") ;
   if (fwrite (p->aFend, sizeof(int), p->M, fp) != p->M)
     die ("error writing aFend in pbwtWrite") ;
+  if (pbwtBlockSize) { writeBlocked (p, fp) ; return ; }
   long n = arrayMax(p->yz) ;
   if (fwrite (&n, sizeof(long), 1, fp) != 1)
     die ("error writing n in pbwtWrite") ;
@@ -56,10 +138,9 @@ void pbwtWrite (PBWT *p, FILE *fp) /* just writes compressed pbwt in yz */
   fprintf (logFile, "written %ld chars pbwt: M, N are %d, %d\n", arrayMax(p->yz), p->M, p->N) ;
 }
 
-void pbwtWriteSites (PBWT *p, FILE *fp)
+static void writeSiteLines (PBWT *p, FILE *fp, char **varNames)
+/* varNames[i] if given, else looked up in variationDict */
 {
-  if (!p || !p->sites) die ("pbwtWriteSites called without sites") ;
-
   int i ;
   for (i = 0 ; i < p->N ; ++i)
     { Site *s = arrp(p->sites, i, Site) ;
@@ -67,15 +148,146 @@ void pbwtWriteSites (PBWT *p, FILE *fp)
 	fprintf (fp, "site%d\t%d", i+1, s->x) ;
       else
 	fprintf (fp, "%s\t%d", p->chrom ? p->chrom : ".", s->x) ;
-      fprintf (fp, "\t%s", dictName (variationDict, s->varD)) ;
+      fprintf (fp, "\t%s", varNames ? varNames[i] : dictName (variationDict, s->varD)) ;
       fputc ('\n', fp) ;
     }
+}
+
+void pbwtWriteSites (PBWT *p, FILE *fp)
+{
+  if (!p || !p->sites) die ("pbwtWriteSites called without sites") ;
+
+  writeSiteLines (p, fp, 0) ;
   if (ferror (fp)) die ("error writing sites file") ;
 
-  fprintf (logFile, "written %d sites from %d to %d\n", p->N, 
+  fprintf (logFile, "written %d sites from %d to %d\n", p->N,
 	   arrp(p->sites, 0, Site)->x, arrp(p->sites, p->N-1, Site)->x) ;
 }
 
+/* binary sites file: tag, N, chrom, then a pool of the distinct variation strings,
+   then a column of delta encoded positions and a column of pool indices, both as varints.
+   Text sites files never start with '#', so pbwtReadSitesFile() can recognise these.
+*/
+
+static char *binarySitesTag = "#PS1" ;
+
+static void putVarint (unsigned long n, FILE *fp)
+{
+  while (n >= 0x80) { putc ((n & 0x7f) | 0x80, fp) ; n >>= 7 ; }
+  putc (n, fp) ;
+}
+
+static inline unsigned long getVarint (uchar **pcp, uchar *end)
+{
+  unsigned long n = 0 ;
+  int shift = 0 ;
+  uchar *cp = *pcp ;
+  while (cp < end && (*cp & 0x80)) { n |= (unsigned long)(*cp++ & 0x7f) << shift ; shift += 7 ; }
+  if (cp == end) die ("truncated binary sites file") ;
+  n |= (unsigned long)(*cp++) << shift ;
+  *pcp = cp ;
+  return n ;
+}
+
+void pbwtWriteSitesBinary (PBWT *p, FILE *fp)
+{
+  if (!p || !p->sites) die ("pbwtWriteSitesBinary called without sites") ;
+
+  int i, nPool = 0 ;
+  int *poolIndex = myalloc (dictMax(variationDict), int) ;
+  for (i = 0 ; i < dictMax(variationDict) ; ++i) poolIndex[i] = -1 ;
+  Array pool = arrayCreate (1024, int) ; /* of varD */
+  for (i = 0 ; i < p->N ; ++i)
+    { int varD = arrp(p->sites, i, Site)->varD ;
+      if (poolIndex[varD] < 0)
+	{ poolIndex[varD] = nPool++ ; array(pool, arrayMax(pool), int) = varD ; }
+    }
+
+  fwrite (binarySitesTag, 1, 4, fp) ;
+  putVarint (p->N, fp) ;
+  char *chrom = p->chrom ? p->chrom : "." ;
+  putVarint (strlen (chrom), fp) ; fputs (chrom, fp) ;
+  putVarint (nPool, fp) ;
+  for (i = 0 ; i < nPool ; ++i)
+    { char *var = dictName (variationDict, arr(pool, i, int)) ;
+      putVarint (strlen (var), fp) ; fputs (var, fp) ;
+    }
+  int xLast = 0 ;
+  for (i = 0 ; i < p->N ; ++i)	/* zigzag so that unsorted input still round trips */
+    { long dx = (long) arrp(p->sites, i, Site)->x - xLast ;
+      putVarint (dx >= 0 ? 2*dx : -2*dx - 1, fp) ;
+      xLast = arrp(p->sites, i, Site)->x ;
+    }
+  for (i = 0 ; i < p->N ; ++i)
+    putVarint (poolIndex[arrp(p->sites, i, Site)->varD], fp) ;
+  if (ferror (fp)) die ("error writing binary sites file") ;
+
+  fprintf (logFile, "written %d sites with %d distinct variations in binary sites file\n",
+	   p->N, nPool) ;
+
+  free (poolIndex) ; arrayDestroy (pool) ;
+}
+
+static Array readSitesBinary (FILE *fp, char **chrom)
+{
+  Array buf = arrayCreate (1 << 20, uchar) ;
+  long n, nBuf = 0 ;
+  while (TRUE)			/* slurp the whole file: it is compact */
+    { array(buf, nBuf + (1 << 20) - 1, uchar) = 0 ; /* make space */
+      if (!(n = fread (arrp(buf, nBuf, uchar), 1, 1 << 20, fp))) break ;
+      nBuf += n ;
+    }
+  arrayMax(buf) = nBuf ;
+  if (ferror (fp)) die ("error reading binary sites file") ;
+
+  uchar *cp = arrp(buf, 0, uchar), *end = cp + arrayMax(buf) ;
+  if (end - cp < 4 || strncmp ((char*)cp, binarySitesTag, 4)) die ("bad tag in binary sites file") ;
+  cp += 4 ;
+  int i, N = getVarint (&cp, end) ;
+
+  int len = getVarint (&cp, end) ;
+  if (cp + len > end) die ("truncated binary sites file") ;
+  char *newChrom = myalloc (len+1, char) ; memcpy (newChrom, cp, len) ; newChrom[len] = 0 ; cp += len ;
+  if (strcmp (newChrom, "."))
+    { if (!*chrom) *chrom = strdup (newChrom) ;
+      else if (strcmp (newChrom, *chrom))
+	die ("failed to match chromosome %s in binary sites file", newChrom) ;
+    }
+  free (newChrom) ;
+
+  int nPool = getVarint (&cp, end) ;
+  int *poolVarD = myalloc (nPool, int) ;
+  Array varText = arrayCreate (256, char) ;
+  for (i = 0 ; i < nPool ; ++i)
+    { len = getVarint (&cp, end) ;
+      if (cp + len > end) die ("truncated binary sites file") ;
+      array(varText, len, char) = 0 ;
+      memcpy (arrp(varText, 0, char), cp, len) ; cp += len ;
+      dictAdd (variationDict, arrp(varText, 0, char), &poolVarD[i]) ;
+    }
+
+  Array sites = arrayCreate (N, Site) ;
+  if (N) array(sites, N-1, Site).x = 0 ; /* sets arrayMax */
+  Site *s = arrp(sites, 0, Site) ;
+  long x = 0 ;
+  for (i = 0 ; i < N ; ++i, ++s)
+    { unsigned long z = getVarint (&cp, end) ;
+      x += (z & 1) ? -(long)((z+1) >> 1) : (long)(z >> 1) ;
+      s->x = x ;
+    }
+  for (i = 0, s = arrp(sites, 0, Site) ; i < N ; ++i, ++s)
+    { unsigned long k = getVarint (&cp, end) ;
+      if (k >= nPool) die ("bad variation index %lu at site %d in binary sites file", k, i) ;
+      s->varD = poolVarD[k] ;
+    }
+
+  fprintf (logFile, "read %ld sites with %d distinct variations on chromosome %s from binary file\n",
+	   arrayMax(sites), nPool, *chrom) ;
+
+  free (poolVarD) ; arrayDestroy (varText) ; arrayDestroy (buf) ;
+  return sites ;
+}
+
 void pbwtWriteSamples (PBWT *p, FILE *fp)
 {
   if (!p || !p->samples) die ("pbwtWriteSamples called without samples") ;
@@ -94,12 +306,15 @@ void pbwtWriteSamples (PBWT *p, FILE *fp)
   fprintf (logFile, "written %d samples\n", p->M/2) ;
 }
 
-void writeDataOffset (FILE *fp, char *name, Array data, Array offset, int N)
+void writeDataOffset (FILE *fp, char *name, Array data, Array offset, int N, int codec)
+/* codec 0 gives the format before codecs were added */
 {
   if (!offset || !data) die ("write %s called without data", name) ;
-  int dummy = -1 ;	/* ugly hack to mark that we now use longs not ints */
+  int dummy = codec ? -2 : -1 ;	/* ugly hack to mark that we now use longs not ints, and -2 a codec */
   if (fwrite (&dummy, sizeof(int), 1, fp) != 1)
     die ("error writing marker in write %s", name) ;
+  if (codec && fwrite (&codec, sizeof(int), 1, fp) != 1)
+    die ("error writing codec in write %s", name) ;
   long n = arrayMax(data) ;
   if (fwrite (&n, sizeof(long), 1, fp) != 1)
     die ("error writing n in write %s", name) ;
@@ -112,10 +327,10 @@ void writeDataOffset (FILE *fp, char *name, Array data, Array offset, int N)
 }
 
 void pbwtWriteMissing (PBWT *p, FILE *fp)
-{ writeDataOffset (fp, "missing", p->zMissing, p->missingOffset, p->N) ; }
+{ writeDataOffset (fp, "missing", p->zMissing, p->missingOffset, p->N, 0) ; }
 
 void pbwtWriteDosage (PBWT *p, FILE *fp)
-{ writeDataOffset (fp, "dosage", p->zDosage, p->dosageOffset, p->N) ; }
+{ writeDataOffset (fp, "dosage", p->zDosage, p->dosageOffset, p->N, p->dosageBits) ; }
 
 void pbwtWriteReverse (PBWT *p, FILE *fp)
 {
@@ -143,43 +358,253 @@ void pbwtWriteAll (PBWT *p, char *root)
   if (p->zz) { FOPEN_W("reverse") ; pbwtWriteReverse (p, fp) ; fclose (fp) ; }
 }
 
-void pbwtWritePhase (PBWT *p, char *filename)
+/* Checkpoints are written from a snapshot by a background thread, so that reading can
+   carry on.  The snapshot copies the growing arrays, and takes the variation strings
+   from variationDict now because the dictionary is not safe to read while the main
+   thread adds to it.  At most one checkpoint is in flight: the next one waits for it.
+*/
+
+typedef struct {
+  PBWT *p ;
+  char **varNames ;
+  char root[20] ;
+} CheckPoint ;
+
+static pthread_t checkPointThread ;
+static CheckPoint *checkPointRunning = 0 ;
+
+static void *checkPointWrite (void *arg)
 {
+  CheckPoint *c = (CheckPoint*) arg ;
+  PBWT *p = c->p ;
   FILE *fp ;
-  if (!(fp = fopen (filename, "w"))) die ("failed to open %s",filename);
-  fprintf(fp,"%i\n",p->M);
-  fprintf(fp,"%i\nP",p->N);
-  int i ; for (i = 0 ; i < p->N ; i++) fprintf(fp," %i",arrayp(p->sites,i,Site)->x);
-  fprintf(fp,"\n");
+#define FOPEN_C(tag)  if (!(fp = fopenTag (c->root, tag, "w"))) die ("failed to open %s.%s", c->root, tag)
+  FOPEN_C("pbwt") ; pbwtWrite (p, fp) ; fclose (fp) ;
+  FOPEN_C("sites") ; writeSiteLines (p, fp, c->varNames) ; 
+  if (ferror (fp)) die ("error writing checkpoint sites file") ; 
+  fclose (fp) ;
+  if (p->samples) { FOPEN_C("samples") ; pbwtWriteSamples (p, fp) ; fclose (fp) ; }
+  if (p->missingOffset) { FOPEN_C("missing") ; pbwtWriteMissing (p, fp) ; fclose (fp) ; }
+  if (p->dosageOffset) { FOPEN_C("dosage") ; pbwtWriteDosage (p, fp) ; fclose (fp) ; }
+  fprintf (logFile, "checkpoint %s written at %d sites\n", c->root, p->N) ;
+  return 0 ;
+}
 
-  pbwtWriteTransposedHaplotypes(p,fp);
+static void checkPointDestroy (CheckPoint *c)
+{ pbwtDestroy (c->p) ; free (c->varNames) ; free (c) ; }
+
+void pbwtCheckPointWait (void)	/* snapshot is freed here, in the main thread */
+{
+  if (checkPointRunning) 
+    { pthread_join (checkPointThread, 0) ; 
+      checkPointDestroy (checkPointRunning) ;
+      checkPointRunning = 0 ;
+    }
 }
 
 void pbwtCheckPoint (PbwtCursor *u, PBWT *p)
 {
   static BOOL isA = TRUE ;
-  char fileNameRoot[20] ;
+  static BOOL isFirst = TRUE ;
+  int i ;
+
+  if (!p->sites) die ("pbwtCheckPoint needs sites") ;
+  pbwtCheckPointWait () ;
+  if (isFirst) { atexit (pbwtCheckPointWait) ; isFirst = FALSE ; }
 
   pbwtCursorToAFend (u, p) ;
-  sprintf (fileNameRoot, "check_%c", isA ? 'A' : 'B') ;
-  pbwtWriteAll (p, fileNameRoot) ;
+  CheckPoint *c = mycalloc (1, CheckPoint) ;
+  sprintf (c->root, "check_%c", isA ? 'A' : 'B') ;
+  PBWT *q = c->p = pbwtCreate (p->M, p->N) ;
+  q->yz = arrayCopy (p->yz) ;
+  memcpy (q->aFstart, p->aFstart, p->M*sizeof(int)) ;
+  q->aFend = myalloc (p->M, int) ; memcpy (q->aFend, p->aFend, p->M*sizeof(int)) ;
+  if (p->chrom) q->chrom = strdup (p->chrom) ;
+  q->sites = arrayCopy (p->sites) ;
+  c->varNames = myalloc (p->N, char*) ;	/* the strings themselves never move */
+  for (i = 0 ; i < p->N ; ++i) c->varNames[i] = dictName (variationDict, arrp(p->sites, i, Site)->varD) ;
+  if (p->samples) q->samples = arrayCopy (p->samples) ;
+  if (p->missingOffset) { q->missingOffset = arrayCopy (p->missingOffset) ; q->zMissing = arrayCopy (p->zMissing) ; }
+  if (p->dosageOffset) 
+    { q->dosageOffset = arrayCopy (p->dosageOffset) ; q->zDosage = arrayCopy (p->zDosage) ;
+      q->dosageBits = p->dosageBits ;
+    }
+
+  if (pthread_create (&checkPointThread, 0, checkPointWrite, c)) 
+    { checkPointWrite (c) ; checkPointDestroy (c) ; } /* no thread, so write it now */
+  else
+    checkPointRunning = c ;
 
   isA = !isA ;
 }
 
 /*******************************/
 
-PBWT *pbwtRead (FILE *fp) 
+static void blockLoad (PbwtBlocks *zb, int i, uchar *zbuf, uchar *out, FILE *fp)
+/* decompress block i into out, reading from fp if given else from zb->fd */
+{
+  BlockIndex *bi = &zb->index[i] ;
+  if (fp)
+    { if (fread (zbuf, 1, bi->nOut, fp) != bi->nOut) die ("error reading block %d in pbwt file", i) ; }
+  else if (pread (zb->fd, zbuf, bi->nOut, zb->dataStart + bi->offset) != bi->nOut)
+    die ("error reading block %d of lazy pbwt", i) ;
+  uLongf len = bi->nIn ;
+  if (uncompress (out, &len, zbuf, bi->nOut) != Z_OK || len != bi->nIn)
+    die ("zlib failure uncompressing block %d in pbwt file", i) ;
+}
+
+static PBWT *readBlocked (PBWT *p, FILE *fp)
+{
+  PbwtBlocks *zb = mycalloc (1, PbwtBlocks) ;
+  int i, blockSize, maxOut = 0 ;
+
+  zb->M = p->M ;
+  if (fread (&zb->nz, sizeof(long), 1, fp) != 1 ||
+      fread (&zb->nBlocks, sizeof(int), 1, fp) != 1 ||
+      fread (&blockSize, sizeof(int), 1, fp) != 1)
+    die ("error reading block header in pbwt file") ;
+  zb->index = myalloc (zb->nBlocks, BlockIndex) ;
+  if (fread (zb->index, sizeof(BlockIndex), zb->nBlocks, fp) != zb->nBlocks)
+    die ("error reading block index in pbwt file") ;
+  for (i = 0 ; i < zb->nBlocks ; ++i)
+    if (zb->index[i].nOut > maxOut) maxOut = zb->index[i].nOut ;
+
+  if (isReadLazy && (zb->dataStart = ftell (fp)) >= 0 && (zb->fd = dup (fileno (fp))) >= 0)
+    { p->yzBlocks = zb ;
+      fprintf (logFile, "opened pbwt PBW4 file lazily with %ld bytes in %d blocks: M, N are %d, %d\n",
+	       zb->nz, zb->nBlocks, p->M, p->N) ;
+      return p ;
+    }
+				/* else read it all now */
+  uchar *zbuf = myalloc (maxOut, uchar) ;
+  p->yz = arrayCreate (zb->nz, uchar) ;
+  if (zb->nz) array(p->yz, zb->nz-1, uchar) = 0 ; /* sets arrayMax */
+  for (i = 0 ; i < zb->nBlocks ; ++i)
+    blockLoad (zb, i, zbuf, arrp(p->yz, zb->index[i].start, uchar), fp) ;
+  fprintf (logFile, "read pbwt PBW4 file with %ld bytes in %d blocks: M, N are %d, %d\n",
+	   zb->nz, zb->nBlocks, p->M, p->N) ;
+  free (zbuf) ; free (zb->index) ; free (zb) ;
+  return p ;
+}
+
+void pbwtBlocksDestroy (PbwtBlocks *zb)
+{
+  if (zb->map) munmap (zb->map, zb->nz) ;
+  else close (zb->fd) ;
+  free (zb->index) ;
+  free (zb) ;
+}
+
+PbwtBlocks *pbwtBlocksMap (int fd, long offset, long nz, int M)
+/* uncompressed yz held in a file at offset, which must be page aligned; 0 if it can't be mapped */
+{
+  if (!nz) return 0 ;
+  uchar *map = mmap (0, nz, PROT_READ, MAP_SHARED, fd, offset) ;
+  if (map == MAP_FAILED) return 0 ;
+  PbwtBlocks *zb = mycalloc (1, PbwtBlocks) ;
+  zb->M = M ; zb->nz = nz ; zb->map = map ; zb->fd = -1 ;
+  return zb ;
+}
+
+void pbwtLoadBlocks (PBWT *p)
+{
+  if (p->yz || !p->yzBlocks) return ;
+  PbwtBlocks *zb = p->yzBlocks ;
+  int i, maxOut = 0 ;
+  if (zb->map)
+    { p->yz = arrayCreate (zb->nz, uchar) ;
+      array(p->yz, zb->nz-1, uchar) = 0 ; /* sets arrayMax */
+      memcpy (arrp(p->yz, 0, uchar), zb->map, zb->nz) ;
+      pbwtBlocksDestroy (zb) ; p->yzBlocks = 0 ;
+      return ;
+    }
+  for (i = 0 ; i < zb->nBlocks ; ++i)
+    if (zb->index[i].nOut > maxOut) maxOut = zb->index[i].nOut ;
+  uchar *zbuf = myalloc (maxOut, uchar) ;
+  p->yz = arrayCreate (zb->nz, uchar) ;
+  if (zb->nz) array(p->yz, zb->nz-1, uchar) = 0 ; /* sets arrayMax */
+  for (i = 0 ; i < zb->nBlocks ; ++i)
+    blockLoad (zb, i, zbuf, arrp(p->yz, zb->index[i].start, uchar), 0) ;
+  free (zbuf) ;
+  pbwtBlocksDestroy (zb) ; p->yzBlocks = 0 ;
+}
+
+BlockCache *blockCacheCreate (PbwtBlocks *zb)
+{
+  BlockCache *zc = mycalloc (1, BlockCache) ;
+  int i ;
+  zc->zb = zb ;
+  zc->isMapped = (zb->map != 0) ;
+  if (zc->isMapped) return zc ;	/* nothing to cache */
+  for (i = 0 ; i < N_CACHE ; ++i) { zc->block[i] = -1 ; zc->data[i] = arrayCreate (1<<20, uchar) ; }
+  zc->zbuf = arrayCreate (1<<20, uchar) ;
+  return zc ;
+}
+
+void blockCacheDestroy (BlockCache *zc)
+{
+  int i ;
+  if (!zc->isMapped)
+    { for (i = 0 ; i < N_CACHE ; ++i) arrayDestroy (zc->data[i]) ;
+      arrayDestroy (zc->zbuf) ;
+    }
+  free (zc) ;
+}
+
+long blockCacheSize (BlockCache *zc) { return zc->zb->nz ; }
+
+uchar *blockCacheFetch (BlockCache *zc, long n)
+{
+  PbwtBlocks *zb = zc->zb ;
+  int i, lo, hi ;
+  BlockIndex *bi ;
+
+  if (zb->map)
+    { if (n < 0 || n >= zb->nz) die ("blockCacheFetch position %ld out of range", n) ;
+      return zb->map + n ;
+    }
+  for (i = 0 ; i < N_CACHE ; ++i)
+    if (zc->block[i] >= 0)
+      { bi = &zb->index[zc->block[i]] ;
+	if (n >= bi->start && n < bi->start + bi->nIn) break ;
+      }
+  if (i == N_CACHE)		/* not cached: find the block and load it into the oldest slot */
+    { if (n < 0 || n >= zb->nz) die ("blockCacheFetch position %ld out of range", n) ;
+      lo = 0 ; hi = zb->nBlocks ;
+      while (hi - lo > 1)
+	{ int mid = (lo + hi) / 2 ;
+	  if (zb->index[mid].start <= n) lo = mid ; else hi = mid ;
+	}
+      i = N_CACHE - 1 ; bi = &zb->index[lo] ;
+      array(zc->zbuf, bi->nOut, uchar) = 0 ;
+      array(zc->data[i], bi->nIn, uchar) = 0 ;
+      blockLoad (zb, lo, arrp(zc->zbuf, 0, uchar), arrp(zc->data[i], 0, uchar), 0) ;
+      zc->block[i] = lo ;
+    }
+  if (i)			/* move to front */
+    { int tb = zc->block[i] ; Array td = zc->data[i] ;
+      for ( ; i ; --i) { zc->block[i] = zc->block[i-1] ; zc->data[i] = zc->data[i-1] ; }
+      zc->block[0] = tb ; zc->data[0] = td ;
+    }
+  return arrp(zc->data[0], n - zb->index[zc->block[0]].start, uchar) ;
+}
+
+static char readTag[5] = "test" ;
+
+PBWT *pbwtReadHeader (FILE *fp, long *nzp)
+/* reads up to the packed data, which if *nzp >= 0 is the next *nzp bytes of fp, 
+   else p came from a version 4 file and holds its yz or yzBlocks itself */
 {
   int m, n ;
   long nz ;
   PBWT *p ;
-  static char tag[5] = "test" ;
+  char *tag = readTag ;
   char pad[4] ;
   int version ;
 
   if (fread (tag, 1, 4, fp) != 4) die ("failed to read 4 char tag - is file readable?") ;
-  if (!strcmp (tag, "PBW3")) version = 3 ; /* current version */
+  if (!strcmp (tag, "PBW4")) version = 4 ; /* block compressed */
+  else if (!strcmp (tag, "PBW3")) version = 3 ; /* current version */
   else if (!strcmp (tag, "PBW2")) version = 2 ; /* with 4 byte count */
   else if (!strcmp (tag, "PBWT")) version = 1 ; /* without start, end indexes */
   else if (!strcmp (tag, "GBWT")) version = 0 ; /* earliest version */
@@ -199,6 +624,8 @@ PBWT *pbwtRead (FILE *fp)
       int i ; for (i = 0 ; i < m ; ++i) p->aFstart[i] = i ;
     }
 
+  if (version == 4) { *nzp = -1 ; return readBlocked (p, fp) ; }
+
   if (version <= 2)
     { if (fread (&n, sizeof(int), 1, fp) != 1) die ("error reading pbwt file") ;
       nz = n ;
@@ -207,12 +634,22 @@ PBWT *pbwtRead (FILE *fp)
     if (fread (&nz, sizeof(long), 1, fp) != 1 ||
 	fread (pad, 1, 4, fp) != 4) die ("error reading pbwt file") ;
 
+  *nzp = nz ;
+  return p ;
+}
+
+PBWT *pbwtRead (FILE *fp) 
+{
+  long nz ;
+  PBWT *p = pbwtReadHeader (fp, &nz) ;
+  if (nz < 0) return p ;	/* version 4, already read */
+
   p->yz = arrayCreate (nz, uchar) ;
   array(p->yz, nz-1, uchar) = 0 ; /* sets arrayMax */
   if (fread (arrp(p->yz, 0, uchar), sizeof(uchar), nz, fp) != nz)
     die ("error reading data in pbwt file") ;
 
-  fprintf (logFile, "read pbwt %s file with %ld bytes: M, N are %d, %d\n", tag, nz, p->M, p->N) ;
+  fprintf (logFile, "read pbwt %s file with %ld bytes: M, N are %d, %d\n", readTag, nz, p->M, p->N) ;
   return p ;
 }
 
@@ -232,23 +669,20 @@ static BOOL readMatchChrom (char **pChrom, FILE *fp)
   return TRUE ;
 }
 
-Array pbwtReadSitesFile (FILE *fp, char **chrom)
+BOOL pbwtReadSiteNext (FILE *fp, char **chrom, Site *s, Array varTextArray, int *line)
+/* read one line of a text sites file into s, returning FALSE at end of file; *line starts at 1 */
 {
   char c ;
-  Site *s ;
-  int line = 1 ;
-  Array varTextArray = arrayCreate (256, char) ;
-  Array sites = arrayCreate (4096, Site) ;
 
   while (!feof(fp))
     if (readMatchChrom (chrom, fp))	/* if p->chrom then match, else set if not "." */
     { if (feof(fp)) break ;
-      s = arrayp(sites, arrayMax(sites), Site) ;
+      memset (s, 0, sizeof(Site)) ;
       s->x = 0 ; while (isdigit(c = fgetc(fp))) s->x = s->x*10 + (c-'0') ;
       if (!feof(fp) && c != '\n')
-      { if (!isspace (c)) die ("bad position line %d in sites file", line) ;
+      { if (!isspace (c)) die ("bad position line %d in sites file", *line) ;
         while (isspace(c = fgetc(fp)) && c != '\n') ;
-        if (c == '\n') die ("bad end of line at line %d in sites file", line) ;
+        if (c == '\n') die ("bad end of line at line %d in sites file", *line) ;
         int i = 0 ; array(varTextArray, i++, char) = c ;
         while ((c = fgetc(fp)) && c != '\n')
           array(varTextArray, i++, char) = c ;
@@ -256,12 +690,30 @@ Array pbwtReadSitesFile (FILE *fp, char **chrom)
         dictAdd (variationDict, arrayp(varTextArray,0,char), &s->varD) ;
         while (c != '\n' && !feof(fp)) c = fgetc(fp) ;
       }
-      ++line ;
+      ++*line ;
+      return TRUE ;
     }
     else if (!feof(fp))
-      die ("failed to match chromosome in sites file: line %d", line) ;
+      die ("failed to match chromosome in sites file: line %d", *line) ;
 
   if (ferror (fp)) die ("error reading sites file") ;
+  return FALSE ;
+}
+
+Array pbwtReadSitesFile (FILE *fp, char **chrom)
+{
+  Site s ;
+  int line = 1 ;
+
+  int c0 = getc (fp) ;		/* binary sites files start with '#' */
+  if (c0 != EOF) ungetc (c0, fp) ;
+  if (c0 == '#') return readSitesBinary (fp, chrom) ;
+
+  Array varTextArray = arrayCreate (256, char) ;
+  Array sites = arrayCreate (4096, Site) ;
+
+  while (pbwtReadSiteNext (fp, chrom, &s, varTextArray, &line))
+    array(sites, arrayMax(sites), Site) = s ;
   
   fprintf (logFile, "read %ld sites on chromosome %s from file\n", arrayMax(sites), *chrom) ;
 
@@ -392,12 +844,20 @@ void pbwtReadSamples (PBWT *p, FILE *fp)
   arrayDestroy (samples) ;
 }
 
-static void readDataOffset (FILE *fp, char *name, Array *data, Array *offset, int N)
+static void readDataOffset (FILE *fp, char *name, Array *data, Array *offset, int N, int *codec)
 {
   long n ;			/* size of data file */
   int dummy ; 
   if (fread (&dummy, sizeof(int), 1, fp) != 1) 
     die ("read error in read %s", name) ;
+  if (codec) *codec = 0 ;
+  if (dummy == -2)		/* with a codec */
+    { int c ;
+      if (fread (&c, sizeof(int), 1, fp) != 1) die ("read error in read %s", name) ;
+      if (!codec) die ("unexpected codec %d in read %s", c, name) ;
+      *codec = c ;
+      dummy = -1 ;
+    }
   if (dummy != -1) n = dummy ;	/* old version with ints not longs */
   else if (fread (&n, sizeof(long), 1, fp) != 1) 
     die ("read error in read %s", name) ;
@@ -423,16 +883,20 @@ static void readDataOffset (FILE *fp, char *name, Array *data, Array *offset, in
 }
 
 void pbwtReadMissing (PBWT *p, FILE *fp)
-{ readDataOffset (fp, "missing", &p->zMissing, &p->missingOffset, p->N) ; }
+{ readDataOffset (fp, "missing", &p->zMissing, &p->missingOffset, p->N, 0) ; }
 
 void pbwtReadDosage (PBWT *p, FILE *fp)
-{ readDataOffset (fp, "dosage", &p->zDosage, &p->dosageOffset, p->N) ; }
+{ readDataOffset (fp, "dosage", &p->zDosage, &p->dosageOffset, p->N, &p->dosageBits) ;
+  if (p->dosageBits && p->dosageBits != 8 && p->dosageBits != 16)
+    die ("unknown dosage codec %d in dosage file", p->dosageBits) ;
+}
 
 void pbwtReadReverse (PBWT *p, FILE *fp)
 {
   if (!p) die ("pbwtReadReverse called without a valid pbwt") ;
 
   PBWT *q = pbwtRead (fp) ;
+  pbwtLoadBlocks (q) ;		/* zz is always held in memory */
   if (q->M != p->M || q->N != p->N)
     die ("M %d or N %d in reverse don't match %, %d in forward", q->M, q->N, p->M, p->N) ;
   p->zz = q->yz ; q->yz = 0 ;
@@ -471,326 +935,398 @@ static void parseMacsHeader (FILE *fp, int *M, double *L)	/* parse MACS file hea
   while (fgetc(fp) != '\n') ;	/* ignore rest of line */
 }
 
-static BOOL parseMacsSite (FILE *fp, Site *s, int M, double L, uchar *yp) /* parse MACS site line */
-{
-  static uchar conv[256] ;
-  static BOOL isFirst = TRUE ;
-  int number ;
+/************* line based text formats ***************/
 
-  if (isFirst) { conv['0'] = 0 ; conv['1'] = 1 ; isFirst = FALSE ; }
-  if (feof (fp)) return FALSE ;
+/* MaCS, vcfq, gen, hap and hap-legend files are read a large buffer at a time.  Lines
+   are found with memchr(), and a batch of them is parsed in parallel into haplotype
+   values, position and variation text, writing 0s into the buffer to terminate strings
+   in place.  The main thread then packs the batch in order and adds the variation
+   strings to the dictionary.  Parsers report problems through the status field rather
+   than dying, so that the first problem in file order is the one reported.
+   As before, a final line without a newline is ignored.
+*/
 
-  if (strcmp (fgetword (fp), "SITE:")) return FALSE;
+typedef struct {
+  FILE *fp ;
+  char *buf ;
+  long size, start, end ;	/* unread data is buf[start..end) */
+  BOOL isEOF ;
+} LineBuffer ;
 
-  number = atoi(fgetword(fp)) ;	/* this is the site number */
-  s->x = (int) (L * atof(fgetword(fp))) ;
-  atof(fgetword(fp)) ;		/* ignore the time */
-  while (M--)
-    *yp++ = conv[getc(fp)] ;
-  if (feof (fp)) return FALSE ;
-  if (getc(fp) != '\n') die ("end of line error for MaCS SITE %d", number) ;
+static LineBuffer *lineBufferCreate (FILE *fp)
+{
+  LineBuffer *lb = mycalloc (1, LineBuffer) ;
+  lb->fp = fp ;
+  lb->size = 1 << 24 ;
+  lb->buf = myalloc (lb->size, char) ;
+  return lb ;
+}
 
-  return TRUE ;
+static void lineBufferDestroy (LineBuffer *lb) { free (lb->buf) ; free (lb) ; }
+
+static char *lineBufferNext (LineBuffer *lb, char **pEnd)
+/* next complete line, or 0 if there is none in the buffer; *pEnd is set to its '\n' */
+{
+  char *cp = lb->buf + lb->start ;
+  char *nl = memchr (cp, '\n', lb->end - lb->start) ;
+  if (!nl) return 0 ;
+  lb->start = nl + 1 - lb->buf ;
+  *pEnd = nl ;
+  return cp ;
 }
 
-PBWT *pbwtReadMacs (FILE *fp)
+static BOOL lineBufferFill (LineBuffer *lb)
+/* move any partial line to the front and read more: invalidates lines given out so far */
 {
-  PBWT *p ;
-  int M ;
-  double L ;
-  int i,j, nxPack, nyPack, nUnpack, n0 ;
-  int nxTot = 0, nyTot = 0 ;
-  uchar *x ;
-  int *a ;
-  PbwtCursor *u ;
+  if (lb->isEOF) return FALSE ;
+  long n = lb->end - lb->start ;
+  memmove (lb->buf, lb->buf + lb->start, n) ;
+  lb->start = 0 ; lb->end = n ;
+  if (lb->end == lb->size)	/* a line longer than the buffer */
+    { char *new = myalloc (2*lb->size, char) ;
+      memcpy (new, lb->buf, lb->end) ; free (lb->buf) ;
+      lb->buf = new ; lb->size *= 2 ;
+    }
+  long nRead = fread (lb->buf + lb->end, 1, lb->size - lb->end, lb->fp) ;
+  if (nRead <= 0) { lb->isEOF = TRUE ; return FALSE ; }
+  lb->end += nRead ;
+  return TRUE ;
+}
 
-  parseMacsHeader (fp, &M, &L) ;
-  p = pbwtCreate (M, 0) ;
-  p->sites = arrayCreate(4096, Site) ;
-  u = pbwtCursorCreate (p, TRUE, TRUE) ;
-  x = myalloc (M+1, uchar) ; x[M] = Y_SENTINEL ;	/* sentinel required for packing */
+enum { LINE_OK, LINE_STOP, LINE_WARN, LINE_DIE } ; /* STOP is silent end of data, WARN ends with a warning */
 
-  while (parseMacsSite (fp, arrayp(p->sites,p->N,Site), M, L, x))
-    { for (j = 0 ; j < M ; ++j) u->y[j] = x[u->a[j]] ; /* next character in sort order: BWT */
-      pbwtCursorWriteForwards (u) ;
-      p->N++ ;
-      if (nCheckPoint && !(p->N % nCheckPoint)) pbwtCheckPoint (u, p) ;
-    }
-  pbwtCursorToAFend (u, p) ;
+typedef struct {
+  char *line, *end ;		/* end is the '\n' */
+  char *line2, *end2 ;		/* the legend line for hap-legend */
+  char *chrom ;			/* vcfq only */
+  int pos ;
+  char *var ;			/* "REF\tALT", or 0 if none */
+  uchar *x ; int m ;		/* haplotype values; only the first mMax are stored */
+  long nMissing ;
+  int status ;
+  char msg[256] ;
+} ParsedLine ;
 
-  fprintf (logFile, "read MaCS file: M, N are\t%d\t%d\n", M, p->N) ;
-  if (isStats)
-    fprintf (logFile, "                xtot, ytot are\t%d\t%d\n", nxTot, nyTot) ;
+typedef void (*ParseLineFunc)(ParsedLine *pl, int mMax, void *arg) ;
 
-  free(x) ; pbwtCursorDestroy (u) ;
+static inline BOOL isSpaceChar (char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f' ; }
 
-  return p ;
-}
+static inline char *skipSpace (char *cp, char *end) { while (cp < end && isSpaceChar (*cp)) ++cp ; return cp ; }
 
-/************* read vcfq files, made with vcf query ... ***************/
+static inline char *nextWord (char **pcp, char *end) /* as fgetword(): word, then skip spaces */
+{
+  char *w = *pcp, *cp = w ;
+  while (cp < end && !isSpaceChar (*cp)) ++cp ;
+  char *wEnd = cp ;
+  *pcp = skipSpace (cp, end) ;
+  *wEnd = 0 ;			/* at most the final '\n' */
+  return w ;
+}
 
-static char* getVariation (FILE *fp)
+static inline int parseInt (char *cp, char *end) /* as atoi() */
 {
-  static Array a = 0 ;
-  char c ;
-  int i = 0 ;
+  int n = 0, sign = 1 ;
+  if (cp < end && (*cp == '-' || *cp == '+')) { if (*cp == '-') sign = -1 ; ++cp ; }
+  while (cp < end && (unsigned)(*cp - '0') < 10) n = 10*n + (*cp++ - '0') ;
+  return sign * n ;
+}
 
-  if (!a) a = arrayCreate (64, char) ;
-  while (!isspace(c = getc(fp)) && !feof(fp)) array(a,i++,char) = c ;
-  array(a,i++,char) = c ;
-  while (!isspace(c = getc(fp)) && !feof(fp)) array(a,i++,char) = c ;
-  array(a,i++,char) = 0 ;
+static inline BOOL parseFloat (char **pcp, char *end, float *f) /* as fscanf ("%f") */
+{
+  char *cp = skipSpace (*pcp, end) ;
+  if (cp == end) return FALSE ;
+  if ((*cp == '0' || *cp == '1') && (cp+1 == end || isSpaceChar (cp[1]))) /* the common case */
+    { *f = *cp - '0' ; *pcp = cp + 1 ; return TRUE ; }
+  char c = *end ; *end = 0 ;	/* so strtof() stops at the end of the line */
+  char *e ;
+  *f = strtof (cp, &e) ;
+  *end = c ;
+  if (e == cp) return FALSE ;
+  *pcp = e ;
+  return TRUE ;
+}
 
-  return arrp(a,0,char) ;
+static BOOL parseVariation (ParsedLine *pl, char **pcp, char *end, BOOL isSpaceSep)
+/* as getVariation(): REF, the separator, ALT; the separator must be ' ' if isSpaceSep and
+   then becomes '\t', as impute2 files are space separated */
+{
+  char *cp = *pcp ;
+  pl->var = cp ;
+  while (cp < end && !isSpaceChar (*cp)) ++cp ;
+  if (cp == end) { sprintf (pl->msg, "missing separator at position %d", pl->pos) ; pl->status = LINE_DIE ; return FALSE ; }
+  if (isSpaceSep)
+    { if (*cp != ' ') { sprintf (pl->msg, "missing separator at position %d", pl->pos) ; pl->status = LINE_DIE ; return FALSE ; }
+      *cp = '\t' ;
+    }
+  ++cp ;
+  while (cp < end && !isSpaceChar (*cp)) ++cp ;
+  if (cp < end) { *cp = 0 ; ++cp ; }
+  else *end = 0 ;		/* ALT ends the line; parsers use end, not the 0, from here */
+  *pcp = cp ;
+  return TRUE ;
 }
 
-static BOOL parseVcfqLine (PBWT **pp, FILE *fp, Array x)
+static void parseMacsLine (ParsedLine *pl, int mMax, void *arg) /* MaCS SITE line */
 {
-  char c, *chrom, *var ;
-  int pos, m, len ;
-  Site *s ;
-  PBWT *p = *pp ;
+  double L = *(double*)arg ;
+  char *cp = pl->line, *end = pl->end ;
+  char *word = nextWord (&cp, end) ;
+  if (strcmp (word, "SITE:")) { pl->status = LINE_STOP ; return ; }
+  int number = parseInt (nextWord (&cp, end), end) ; /* this is the site number */
+  pl->pos = (int) (L * atof (nextWord (&cp, end))) ;
+  nextWord (&cp, end) ;		/* ignore the time */
+  if (end - cp != mMax)
+    { sprintf (pl->msg, "end of line error for MaCS SITE %d", number) ; pl->status = LINE_DIE ; return ; }
+  uchar *x = pl->x ;
+  while (cp < end) *x++ = (*cp++ == '1') ;
+  pl->m = mMax ;
+}
 
-  if (!p)			/* first call on a file - don't know M yet */
-    chrom = strdup (fgetword (fp)) ;
-  else
-    while (!feof (fp) && !readMatchChrom (&p->chrom, fp))
-      while (!feof (fp) && (getc (fp) != '\n')) ; /* ignore rest of line */
-  if (feof (fp)) return 0 ;
-
-  pos = atoi (fgetword (fp)) ;
-  var = getVariation (fp) ;
-
-  m = 0 ;
-  while ((c = getc (fp)))
-    switch (c)
-      { case EOF: return 0 ;
-      case '\n': goto endOfLine ; /* -1 is EOF */
-      case '0': array(x,m++,uchar) = 0 ; break ;
-      case '1': array(x,m++,uchar) = 1 ; break ;
+static void parseVcfqLine (ParsedLine *pl, int mMax, void *arg)
+{
+  char *cp = pl->line, *end = pl->end ;
+  pl->chrom = nextWord (&cp, end) ;
+  pl->pos = parseInt (nextWord (&cp, end), end) ;
+  if (!parseVariation (pl, &cp, end, FALSE)) return ;
+  int m = 0 ;
+  for ( ; cp < end ; ++cp)
+    switch (*cp)
+      { 
+      case '0': if (m < mMax) pl->x[m] = 0 ; ++m ; break ;
+      case '1': if (m < mMax) pl->x[m] = 1 ; ++m ; break ;
       case '|': case '/': case '\\': case '\t': break ; /* could check ploidy here */
-      default: die ("unexpected character %d in vcfq file genotype section") ;
+      default: 
+	sprintf (pl->msg, "unexpected character %d in vcfq file genotype section", *cp) ;
+	pl->status = LINE_DIE ; return ;
       }
- endOfLine:
-  if (feof (fp)) return FALSE ;
-  if (p && m != p->M) die ("length mismatch reading vcfq line") ;
+  pl->m = m ;
+}
 
-  if (!*pp)
-    { p = *pp = pbwtCreate (m, 0) ;
-      if (strcmp (chrom, ".")) p->chrom = chrom ;
-      p->sites = arrayCreate(4096, Site) ;
-      array(x,p->M,uchar) = Y_SENTINEL ; /* sentinel required for packing */
+static void parseGenLine (ParsedLine *pl, int mMax, void *arg)
+{
+  char *cp = pl->line, *end = pl->end ;
+  if (skipSpace (cp, end) == end) { pl->status = LINE_STOP ; return ; }
+  nextWord (&cp, end) ; nextWord (&cp, end) ; /* ignore first two name fields */
+  pl->pos = parseInt (nextWord (&cp, end), end) ;
+  if (!parseVariation (pl, &cp, end, TRUE)) return ;
+
+  int m = 0 ;
+  float f0, f1, f2 ;
+  while (skipSpace (cp, end) < end)
+    { if (!parseFloat (&cp, end, &f0) || !parseFloat (&cp, end, &f1) || !parseFloat (&cp, end, &f2))
+	{ sprintf (pl->msg, "bad line, m %d, pos %d, var %.100s", m, pl->pos, pl->var) ; 
+	  pl->status = LINE_DIE ; return ;
+	}
+      if (f0 + f1 + f2 == 0)	/* missing genotype */
+	{ f0 = 1 ; ++pl->nMissing ; }
+      if (f0 + f1 + f2 < 0.98) 
+	{ sprintf (pl->msg, "inconsistent genotype in gen file: %f %f %f at %d position %d", f0, f1, f2, m, pl->pos) ;
+	  pl->status = LINE_DIE ; return ;
+	}
+      uchar x0, x1 ;
+      if (f0 > f1 && f0 > f2) { x0 = 0 ; x1 = 0 ; }
+      else if (f1 > f2) { x0 = 0 ; x1 = 1 ; }
+      else /* f2 is largest */ { x0 = 1 ; x1 = 1 ; }
+      if (m+1 < mMax) { pl->x[m] = x0 ; pl->x[m+1] = x1 ; }
+      m += 2 ;
     }
-  s = arrayp(p->sites, arrayMax(p->sites), Site) ;
-  s->x = pos ;
-  dictAdd (variationDict, var, &s->varD) ;
-
-  ++p->N ;
-  return TRUE ;
+  pl->m = m ;
 }
 
-typedef BOOL (*ParseLineFunc)(PBWT** pp, FILE *f, Array a) ;
-
-static PBWT *pbwtReadLineFile (FILE *fp, char* type, ParseLineFunc parseLine)
+static void parseHapValues (ParsedLine *pl, char *cp, char *end, int mMax)
 {
-  PBWT *p = 0 ;
-  int j ;
-  uchar *x ;		/* original, sorted, compressed */
-  int *a ;
-  Array xArray = arrayCreate (10000, uchar) ;
-  PbwtCursor *u ;
-
-  while ((*parseLine) (&p, fp, xArray)) /* create p first time round */
-    { if (!p->yz)		/* first line; p was just made! */
-	{ p->yz = arrayCreate(4096*32, uchar) ;
-	  u = pbwtCursorCreate (p, TRUE, TRUE) ;
+  int m = 0 ;
+  float f0, f1 ;
+  while (skipSpace (cp, end) < end)
+    { if (!parseFloat (&cp, end, &f0) || !parseFloat (&cp, end, &f1))
+	{ sprintf (pl->msg, "bad line, m %d, pos %d, var %.100s - aborting", m, pl->pos, pl->var) ; 
+	  pl->status = LINE_WARN ; return ;
 	}
-      x = arrp(xArray,0,uchar) ;
-      for (j = 0 ; j < p->M ; ++j) u->y[j] = x[u->a[j]] ;
-      pbwtCursorWriteForwards (u) ;
-      if (nCheckPoint && !(p->N % nCheckPoint))	pbwtCheckPoint (u, p) ;
+      if (m+1 < mMax) { pl->x[m] = f0 ; pl->x[m+1] = f1 ; } /* haps are phased, put straight in as is */
+      m += 2 ;
     }
-  pbwtCursorToAFend (u, p) ;
+  pl->m = m ;
+}
 
-  fprintf (logFile, "read %s file", type) ;
-  if (p->chrom) fprintf (logFile, " for chromosome %s", p->chrom) ;
-  fprintf (logFile, ": M, N are\t%d\t%d; yz length is %ld\n", p->M, p->N, arrayMax(p->yz)) ;
+static void parseHapLine (ParsedLine *pl, int mMax, void *arg)
+{
+  char *cp = pl->line, *end = pl->end ;
+  if (skipSpace (cp, end) == end) { pl->status = LINE_STOP ; return ; }
+  nextWord (&cp, end) ; nextWord (&cp, end) ; /* ignore first two name fields */
+  pl->pos = parseInt (nextWord (&cp, end), end) ;
+  if (!parseVariation (pl, &cp, end, TRUE)) return ;
+  parseHapValues (pl, cp, end, mMax) ;
+}
+
+static void parseHapLegendLine (ParsedLine *pl, int mMax, void *arg)
+{
+  char *cp = pl->line2, *end = pl->end2 ;
+  if (skipSpace (cp, end) == end) { pl->status = LINE_STOP ; return ; }
+  nextWord (&cp, end) ;		/* ignore first name field */
+  pl->pos = parseInt (nextWord (&cp, end), end) ;
+  if (!parseVariation (pl, &cp, end, TRUE)) return ; /* rest of legend line is ignored */
+  parseHapValues (pl, pl->line, pl->end, mMax) ;
+}
 
-  arrayDestroy(xArray) ; pbwtCursorDestroy (u) ;
+typedef struct {
+  ParsedLine *pl ;
+  ParseLineFunc parse ;
+  int mMax ;
+  void *arg ;
+} LineBatch ;
 
-  return p ;
+static void parseBatchLine (void *arg, int i, int thread)
+{
+  LineBatch *lb = (LineBatch*) arg ;
+  (*lb->parse) (&lb->pl[i], lb->mMax, lb->arg) ;
 }
 
-typedef BOOL (*ParseTwoLineFunc)(PBWT** pp, FILE *f, FILE *l, Array a) ;
+static int lineBatchGather (LineBuffer *fb, LineBuffer *lb, ParsedLine *pl, int nMax)
+/* up to nMax lines from fb, paired with lines from lb if given; 0 at end of data */
+{
+  int n = 0 ;
+  while (n < nMax)
+    { long fStart = fb->start ;
+      char *line, *end, *line2 = 0, *end2 = 0 ;
+      if (!(line = lineBufferNext (fb, &end)))
+	{ if (n || !lineBufferFill (fb)) break ; else continue ; }
+      if (lb && !(line2 = lineBufferNext (lb, &end2)))
+	{ fb->start = fStart ;	/* put the line back */
+	  if (n || !lineBufferFill (lb)) break ; else continue ;
+	}
+      memset (&pl[n], 0, sizeof(ParsedLine) - sizeof(pl->msg)) ;
+      pl[n].line = line ; pl[n].end = end ;
+      pl[n].line2 = line2 ; pl[n].end2 = end2 ;
+      ++n ;
+    }
+  return n ;
+}
 
-static PBWT *pbwtReadLineTwoFile (FILE *fp, FILE *lp, char* type, ParseTwoLineFunc parseLine)
+static PBWT *readLines (PBWT *p, FILE *fp, FILE *lp, char *type, ParseLineFunc parse, void *arg, long *nMissing)
+/* if p is given its M is used and its sites are extended, else it is made from the first line */
 {
-  PBWT *p = 0 ;
-  int j ;
-  uchar *x ;		/* original, sorted, compressed */
-  int *a ;
-  Array xArray = arrayCreate (10000, uchar) ;
-  PbwtCursor *u ;
+  LineBuffer *fb = lineBufferCreate (fp), *lb = lp ? lineBufferCreate (lp) : 0 ;
+  PbwtCursor *u = 0 ;
+  LineBatch batch ;
+  int nBatch = 0, n, i, j ;
+  uchar *xBuf = 0 ;
+  BOOL isDone = FALSE, isVcfq = (parse == parseVcfqLine) ;
+
+  batch.parse = parse ; batch.arg = arg ;
+  batch.pl = myalloc (4096, ParsedLine) ;
+  if (p) 
+    { u = pbwtCursorCreate (p, TRUE, TRUE) ;
+      nBatch = 1 + (1<<24) / (p->M + 1) ; if (nBatch > 4096) nBatch = 4096 ;
+      xBuf = myalloc ((long)nBatch * p->M, uchar) ;
+    }
 
-  /* skip header of legend file */
-  while (!feof(lp))
-  {  char c = getc(lp) ; if (c == '\n') break ;
-     }
+  while (!isDone)
+    { if (!p)			/* first line on its own, to find M */
+	{ if (!(n = lineBatchGather (fb, lb, batch.pl, 1))) break ;
+	  batch.mMax = batch.pl->end - batch.pl->line + 1 ;
+	  batch.pl->x = xBuf = myalloc (batch.mMax, uchar) ;
+	  parseBatchLine (&batch, 0, 0) ;
+	}
+      else
+	{ if (!(n = lineBatchGather (fb, lb, batch.pl, nBatch))) break ;
+	  batch.mMax = p->M ;
+	  for (i = 0 ; i < n ; ++i) batch.pl[i].x = xBuf + (long)i * p->M ;
+	  pbwtParallelFor (n, parseBatchLine, &batch) ;
+	}
 
-  while ((*parseLine) (&p, fp, lp, xArray)) /* create p first time round */
-    { if (!p->yz)		/* first line; p was just made! */
-	{ p->yz = arrayCreate(4096*32, uchar) ;
-	  u = pbwtCursorCreate (p, TRUE, TRUE) ;
+      for (i = 0 ; i < n ; ++i)
+	{ ParsedLine *pl = &batch.pl[i] ;
+	  if (isVcfq && p && pl->status != LINE_STOP && strcmp (pl->chrom, "."))
+	    { if (!p->chrom) p->chrom = strdup (pl->chrom) ;
+	      else if (strcmp (pl->chrom, p->chrom)) continue ; /* skip other chromosomes */
+	    }
+	  if (pl->status == LINE_STOP) { isDone = TRUE ; break ; }
+	  if (pl->status == LINE_WARN) { warn ("%s line %d: %s", type, p ? p->N+1 : 1, pl->msg) ; isDone = TRUE ; break ; }
+	  if (pl->status == LINE_DIE) die ("%s line %d: %s", type, p ? p->N+1 : 1, pl->msg) ;
+
+	  if (!p)
+	    { p = pbwtCreate (pl->m, 0) ;
+	      if (isVcfq && strcmp (pl->chrom, ".")) p->chrom = strdup (pl->chrom) ;
+	      u = pbwtCursorCreate (p, TRUE, TRUE) ;
+	      nBatch = 1 + (1<<24) / (p->M + 1) ; if (nBatch > 4096) nBatch = 4096 ;
+	      uchar *x = xBuf ;
+	      xBuf = myalloc ((long)nBatch * p->M, uchar) ;
+	      memcpy (xBuf, x, p->M) ; free (x) ; pl->x = xBuf ;
+	    }
+	  if (!p->sites) p->sites = arrayCreate (4096, Site) ;
+	  if (pl->m != p->M) die ("length mismatch reading %s line %d", type, p->N+1) ;
+
+	  for (j = 0 ; j < p->M ; ++j) u->y[j] = pl->x[u->a[j]] ;
+	  pbwtCursorWriteForwards (u) ;
+	  Site *s = arrayp(p->sites, p->N, Site) ;
+	  s->x = pl->pos ;
+	  if (pl->var) dictAdd (variationDict, pl->var, &s->varD) ;
+	  if (nMissing) *nMissing += pl->nMissing ;
+	  ++p->N ;
+	  if (nCheckPoint && !(p->N % nCheckPoint)) pbwtCheckPoint (u, p) ;
 	}
-      x = arrp(xArray,0,uchar) ;
-      for (j = 0 ; j < p->M ; ++j) u->y[j] = x[u->a[j]] ;
-      pbwtCursorWriteForwards (u) ;
-      if (nCheckPoint && !(p->N % nCheckPoint))	pbwtCheckPoint (u, p) ;
     }
+  if (!p) die ("no data found in %s file", type) ;
   pbwtCursorToAFend (u, p) ;
 
-  fprintf (stderr, "read %s file", type) ;
-  if (p->chrom) fprintf (stderr, " for chromosome %s", p->chrom) ;
-  fprintf (stderr, ": M, N are\t%d\t%d; yz length is %ld\n", p->M, p->N, arrayMax(p->yz)) ;
-
-  arrayDestroy(xArray) ; pbwtCursorDestroy (u) ;
-
+  free (xBuf) ; free (batch.pl) ; pbwtCursorDestroy (u) ;
+  lineBufferDestroy (fb) ; if (lb) lineBufferDestroy (lb) ;
   return p ;
 }
 
-PBWT *pbwtReadVcfq (FILE *fp) { return pbwtReadLineFile (fp, "vcfq", parseVcfqLine) ; }
-
-/*************** read impute2 .gen format - contains sites not samples **********/
-
-static long int nGenMissing ;
-
-static BOOL parseGenLine (PBWT **pp, FILE *fp, Array x) /* based on parseVcfqLine() */
+PBWT *pbwtReadMacs (FILE *fp)
 {
-  PBWT *p = *pp ;
-
-  fgetword(fp) ; fgetword(fp) ;	/* ignore first two name fields */
-
-  int pos = atoi (fgetword (fp)) ;
-  char *var = getVariation (fp) ; /* but need to change ' ' separator to '\t' */
-  if (feof (fp)) return FALSE ;
-  char *cp = var ; while (*cp && *cp != ' ') ++cp ; if (*cp == ' ') *cp = '\t' ; else die ("missing separator in line %d, var is %d", p?p->N:0, var) ;
-
-  int m = 0, nscan ;
-  while (!feof(fp))
-    { char c = getc(fp) ; if (c == '\n') break ; else if (!isspace(c)) ungetc (c, fp) ;
-      float f0, f1, f2 ;
-      if ((nscan = fscanf (fp, "%f %f %f", &f0, &f1, &f2) != 3)) 
-	die ("bad line %d, %d floats found, m %d, pos %d, var %s", p ? p->N : 0, nscan, m, pos, var) ;
-      if (f0 + f1 + f2 == 0)	/* missing genotype */
-	{ f0 = 1 ; ++nGenMissing ; }
-      if (f0 + f1 + f2 < 0.98) 
-	die ("inconsistent genotype in gen file: %f %f %f at %d line %d", 
-	     f0, f1, f2, m, p ? p->N : 0) ;
-      if (f0 > f1 && f0 > f2) { array(x,m++,uchar) = 0 ; array(x,m++,uchar) = 0 ; }
-      else if (f1 > f2) { array(x,m++,uchar) = 0 ; array(x,m++,uchar) = 1 ; }
-      else /* f2 is largest */ { array(x,m++,uchar) = 1 ; array(x,m++,uchar) = 1 ; }
-    }
+  PBWT *p ;
+  int M ;
+  double L ;
 
-  if (feof (fp)) return FALSE ;
-  if (p && m != p->M) die ("length mismatch reading vcfq line") ;
+  parseMacsHeader (fp, &M, &L) ;
+  p = pbwtCreate (M, 0) ;
+  p->sites = arrayCreate(4096, Site) ;
+  p = readLines (p, fp, 0, "MaCS", parseMacsLine, &L, 0) ;
 
-  if (!*pp)
-    { p = *pp = pbwtCreate (m, 0) ;
-      p->sites = arrayCreate(4096, Site) ;
-      array(x,p->M,uchar) = Y_SENTINEL ; /* sentinel required for packing */
-    }
-  Site *s = arrayp(p->sites, arrayMax(p->sites), Site) ;
-  s->x = pos ;
-  dictAdd (variationDict, var, &s->varD) ;
+  fprintf (logFile, "read MaCS file: M, N are\t%d\t%d\n", M, p->N) ;
 
-  ++p->N ;
-  return TRUE ;
+  return p ;
 }
 
-static BOOL parseHapLine (PBWT **pp, FILE *fp, Array x) /* same as parseGenLine - slightly simpler */
+/************* read vcfq files, made with vcf query ... ***************/
+
+static PBWT *pbwtReadLineFile (FILE *fp, char* type, ParseLineFunc parseLine, long *nMissing)
 {
-  PBWT *p = *pp ;
-  
-  fgetword(fp) ;	fgetword(fp) ;	/* ignore first two name fields */
-  
-  int pos = atoi (fgetword (fp)) ;
-  char *var = getVariation (fp) ; /* but need to change ' ' separator to '\t' */
-  if (feof (fp)) return FALSE ;
-  char *cp = var ; while (*cp && *cp != ' ') ++cp ; if (*cp == ' ') *cp = '\t' ; else die ("missing separator in line %d, var is %d", p?p->N:0, var) ;
+  PBWT *p = readLines (0, fp, 0, type, parseLine, 0, nMissing) ;
 
-  int m = 0, nscan ;
-  while (!feof(fp))
-  { char c = getc(fp) ; if (c == '\n') break ; else if (!isspace(c)) ungetc (c, fp) ;
-    float f0, f1 ;
-    if ((nscan = fscanf (fp, "%f %f", &f0, &f1) != 2))
-      { warn ("bad line %d, %d floats found, m %d, pos %d, var %s - aborting", p ? p->N : 0, nscan, m, pos, var) ;
-	return FALSE ;
-      }
-    array(x,m++,uchar) = f0 ; array(x,m++,uchar) = f1 ; /* haps are phased, put straight in as is */
-  }
-  
-  if (feof (fp)) return FALSE ;
-  if (p && m != p->M) die ("length mismatch reading haps line") ;
-  
-  if (!*pp)
-  { p = *pp = pbwtCreate (m, 0) ;
-    p->sites = arrayCreate(4096, Site) ;
-    array(x,p->M,uchar) = Y_SENTINEL ; /* sentinel required for packing */
-  }
-  Site *s = arrayp(p->sites, arrayMax(p->sites), Site) ;
-  s->x = pos ;
-  dictAdd (variationDict, var, &s->varD) ;
-  
-  ++p->N ;
-  return TRUE ;
-}
+  fprintf (logFile, "read %s file", type) ;
+  if (p->chrom) fprintf (logFile, " for chromosome %s", p->chrom) ;
+  fprintf (logFile, ": M, N are\t%d\t%d; yz length is %ld\n", p->M, p->N, arrayMax(p->yz)) ;
 
+  return p ;
+}
 
-static BOOL parseHapLegendLine (PBWT **pp, FILE *fp, FILE *lp, Array x) /* same as parseGenLine - slightly simpler */
+static PBWT *pbwtReadLineTwoFile (FILE *fp, FILE *lp, char* type, ParseLineFunc parseLine)
 {
-  PBWT *p = *pp ;
-  
-  fgetword(lp) ;	/* ignore first name field */
-  
-  int pos = atoi (fgetword (lp)) ;
-  char *var = getVariation (lp) ; /* but need to change ' ' separator to '\t' */
-  if (feof (lp)) return FALSE ;
-  char *cp = var ; while (*cp && *cp != ' ') ++cp ; if (*cp == ' ') *cp = '\t' ; else die ("missing separator in line %d, var is %d", p?p->N:0, var) ;
+  /* skip header of legend file */
   while (!feof(lp))
   {  char c = getc(lp) ; if (c == '\n') break ;
      }
 
-  int m = 0, nscan ;
-  while (!feof(fp))
-  { char c = getc(fp) ; if (c == '\n') break ; else if (!isspace(c)) ungetc (c, fp) ;
-    float f0, f1 ;
-    if ((nscan = fscanf (fp, "%f %f", &f0, &f1) != 2))
-      { warn ("bad line %d, %d floats found, m %d, pos %d, var %s - aborting", p ? p->N : 0, nscan, m, pos, var) ;
-	return FALSE ;
-      }
-    array(x,m++,uchar) = f0 ; array(x,m++,uchar) = f1 ; /* haps are phased, put straight in as is */
-  }
-  
-  if (feof (fp)) return FALSE ;
-  if (p && m != p->M) die ("length mismatch reading haps line") ;
-  
-  if (!*pp)
-  { p = *pp = pbwtCreate (m, 0) ;
-    p->sites = arrayCreate(4096, Site) ;
-    array(x,p->M,uchar) = Y_SENTINEL ; /* sentinel required for packing */
-  }
-  Site *s = arrayp(p->sites, arrayMax(p->sites), Site) ;
-  s->x = pos ;
-  dictAdd (variationDict, var, &s->varD) ;
-  
-  ++p->N ;
-  return TRUE ;
+  PBWT *p = readLines (0, fp, lp, type, parseLine, 0, 0) ;
+
+  fprintf (logFile, "read %s file", type) ;
+  if (p->chrom) fprintf (logFile, " for chromosome %s", p->chrom) ;
+  fprintf (logFile, ": M, N are\t%d\t%d; yz length is %ld\n", p->M, p->N, arrayMax(p->yz)) ;
+
+  return p ;
 }
 
+PBWT *pbwtReadVcfq (FILE *fp) { return pbwtReadLineFile (fp, "vcfq", parseVcfqLine, 0) ; }
+
+/*************** read impute2 .gen format - contains sites not samples **********/
+
 PBWT *pbwtReadGen (FILE *fp, char *chrom) 
 { 
-  nGenMissing = 0 ;
-  PBWT *p = pbwtReadLineFile (fp, "gen", parseGenLine) ;
+  long nGenMissing = 0 ;
+  PBWT *p = pbwtReadLineFile (fp, "gen", parseGenLine, &nGenMissing) ;
   p->chrom = strdup (chrom) ;
   if (nGenMissing) fprintf (logFile, "%ld missing genotypes set to 00\n", nGenMissing) ;
   return p ;
@@ -798,7 +1334,7 @@ PBWT *pbwtReadGen (FILE *fp, char *chrom)
 
 PBWT *pbwtReadHap (FILE *fp, char *chrom)
 {
-  PBWT *p = pbwtReadLineFile (fp, "hap", parseHapLine) ;
+  PBWT *p = pbwtReadLineFile (fp, "hap", parseHapLine, 0) ;
   p->chrom = strdup (chrom) ;
   return p ;
 }
@@ -810,6 +1346,148 @@ PBWT *pbwtReadHapLegend (FILE *fp, FILE *lp, char *chrom)
   return p ;
 }
 
+/************* read PLINK binary .bed, .bim and .fam files ***************/
+
+/* The .bed file is mapped into memory and each variant's 2-bit genotypes are decoded
+   four samples a byte through a table.  PLINK codes count copies of the first allele
+   on the .bim line (A1), so sites are made with A2 as REF and A1 as ALT.  Genotypes
+   are unphased, so a heterozygote is given 0 on its first haplotype and 1 on its
+   second: this reader is meant for homozygous, inbred or haploid-coded data.  Missing
+   genotypes are set to 0 and recorded as missing.  As with -readVcfGT only the first
+   chromosome is read.
+*/
+
+static uchar bedHap[256][8] ;	/* haplotype values for the four samples in a byte */
+static uchar bedNhet[256], bedNmissing[256] ;
+
+static void bedTableInit (void)
+{
+  static const uchar hap[4][2] = { {1,1}, {0,0}, {0,1}, {0,0} } ; /* A1/A1, missing, het, A2/A2 */
+  int b, k ;
+  for (b = 0 ; b < 256 ; ++b)
+    for (k = 0 ; k < 4 ; ++k)
+      { int g = (b >> 2*k) & 3 ;
+	bedHap[b][2*k] = hap[g][0] ; bedHap[b][2*k+1] = hap[g][1] ;
+	if (g == 1) ++bedNmissing[b] ;
+	if (g == 2) ++bedNhet[b] ;
+      }
+}
+
+static Array readFamSamples (FILE *fp)
+{
+  Array samples = arrayCreate (1024, int) ;
+  while (TRUE)
+    { char *word = fgetword (fp) ;	/* family id */
+      if (!*word) { if (feof (fp)) break ; getc (fp) ; continue ; } /* blank line */
+      word = fgetword (fp) ;		/* individual id */
+      if (!*word) die ("no individual id on line %ld of fam file", arrayMax(samples)+1) ;
+      array(samples, arrayMax(samples), int) = sampleAdd (word, 0, 0, 0) ;
+      while (!feof (fp) && getc (fp) != '\n') ; /* ignore parents, sex and phenotype */
+    }
+  return samples ;
+}
+
+PBWT *pbwtReadBed (char *root)
+{
+  FILE *fp ;
+  int i, j ;
+
+  if (!(fp = fopenTag (root, "fam", "r"))) die ("failed to open %s.fam", root) ;
+  Array samples = readFamSamples (fp) ;
+  fclose (fp) ;
+  if (!arrayMax(samples)) die ("no samples in %s.fam", root) ;
+
+  if (!(fp = fopenTag (root, "bed", "r"))) die ("failed to open %s.bed", root) ;
+  struct stat st ;
+  if (fstat (fileno (fp), &st)) die ("failed to stat %s.bed", root) ;
+  if (st.st_size < 3) die ("%s.bed is too short", root) ;
+  uchar *bed = mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fileno (fp), 0) ;
+  if (bed == MAP_FAILED) die ("failed to map %s.bed", root) ;
+  fclose (fp) ;			/* the mapping stays valid */
+  if (bed[0] != 0x6c || bed[1] != 0x1b) die ("%s.bed is not a PLINK bed file", root) ;
+  if (bed[2] != 0x01) die ("%s.bed is sample-major - only variant-major files are supported", root) ;
+  madvise (bed, st.st_size, MADV_SEQUENTIAL) ;
+
+  PBWT *p = pbwtCreate (2*arrayMax(samples), 0) ;
+  p->samples = arrayCreate (p->M, int) ;
+  for (i = 0 ; i < arrayMax(samples) ; ++i)
+    { array(p->samples, 2*i, int) = arr(samples, i, int) ;
+      array(p->samples, 2*i+1, int) = arr(samples, i, int) ;
+    }
+  arrayDestroy (samples) ;
+  p->sites = arrayCreate (4096, Site) ;
+
+  if (!bedNhet[2]) bedTableInit () ; /* byte 2 is one het and three A1/A1 */
+  int nBytes = (p->M/2 + 3) / 4 ;
+  long nRecords = (st.st_size - 3) / nBytes ;
+  uchar *x = myalloc (8*nBytes, uchar) ;
+  uchar *xMissing = myalloc (p->M+1, uchar) ; xMissing[p->M] = Y_SENTINEL ;
+  long nHet = 0, nMissing = 0 ;
+  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
+
+  if (!(fp = fopenTag (root, "bim", "r"))) die ("failed to open %s.bim", root) ;
+  BOOL isMore = FALSE ;		/* TRUE if the .bim continues onto another chromosome */
+  while (TRUE)
+    { char *word = fgetword (fp) ;	/* chromosome */
+      if (!*word) { if (feof (fp)) break ; getc (fp) ; continue ; }
+      if (!p->chrom) p->chrom = strdup (word) ;
+      else if (strcmp (word, p->chrom)) { isMore = TRUE ; break ; }
+      fgetword (fp) ; fgetword (fp) ;	/* variant id and genetic position */
+      int pos = atoi (fgetword (fp)) ;
+      char *a1 = strdup (fgetword (fp)), *a2 = fgetword (fp) ;
+      if (!*a1 || !*a2) die ("missing allele on line %d of %s.bim", p->N+1, root) ;
+      while (!feof (fp) && getc (fp) != '\n') ;
+      if (p->N >= nRecords) die ("%s.bed has fewer variants than %s.bim", root, root) ;
+
+      uchar *b = bed + 3 + (long)p->N * nBytes ;
+      int nHetSite = 0, nMissingSite = 0 ;
+      for (i = 0 ; i < nBytes ; ++i)
+	{ memcpy (x + 8*i, bedHap[b[i]], 8) ;
+	  nHetSite += bedNhet[b[i]] ; nMissingSite += bedNmissing[b[i]] ;
+	}
+      for (j = 0 ; j < p->M ; ++j) u->y[j] = x[u->a[j]] ;
+      pbwtCursorWriteForwards (u) ;
+
+      if (nMissingSite)		/* as storeMissing() in pbwtHtslib.c */
+	{ for (i = 0 ; i < p->M/2 ; ++i)
+	    xMissing[2*i] = xMissing[2*i+1] = (((b[i/4] >> 2*(i%4)) & 3) == 1) ;
+	  if (!p->zMissing)
+	    { p->zMissing = arrayCreate (10000, uchar) ;
+	      array(p->zMissing, 0, uchar) = 0 ; /* needed so missing[] has offset > 0 */
+	      p->missingOffset = arrayCreate (1024, long) ;
+	    }
+	  array(p->missingOffset, p->N, long) = arrayMax(p->zMissing) ;
+	  pack3arrayAdd (xMissing, p->M, p->zMissing) ;
+	}
+      else if (p->missingOffset)
+	array(p->missingOffset, p->N, long) = 0 ;
+      nHet += nHetSite ; nMissing += nMissingSite ;
+
+      Site *s = arrayp(p->sites, p->N, Site) ;
+      s->x = pos ;
+      char *var = myalloc (strlen (a1) + strlen (a2) + 2, char) ;
+      sprintf (var, "%s\t%s", a2, a1) ;
+      dictAdd (variationDict, var, &s->varD) ;
+      free (var) ; free (a1) ;
+      ++p->N ;
+      if (nCheckPoint && !(p->N % nCheckPoint)) pbwtCheckPoint (u, p) ;
+    }
+  fclose (fp) ;
+  if (!p->N) die ("no variants in %s.bim", root) ;
+  if (!isMore && p->N != nRecords) 
+    fprintf (logFile, "warning: %s.bed has %ld variants but %s.bim has %d\n", root, nRecords, root, p->N) ;
+  pbwtCursorToAFend (u, p) ;
+
+  fprintf (logFile, "read PLINK files %s with %d samples and %d sites on chromosome %s: M, N are %d, %d\n",
+	   root, p->M/2, p->N, p->chrom, p->M, p->N) ;
+  if (nHet) fprintf (logFile, "%ld heterozygous genotypes given arbitrary phase 0|1\n", nHet) ;
+  if (nMissing) fprintf (logFile, "%ld missing genotypes set to 0\n", nMissing) ;
+
+  munmap (bed, st.st_size) ;
+  free (x) ; free (xMissing) ; pbwtCursorDestroy (u) ;
+  return p ;
+}
+
 PBWT *pbwtReadPhase (FILE *fp) /* Li and Stephens PHASE format */
 {
   int nhaps=0,nsnps=0,ninds=0;
@@ -872,42 +1550,78 @@ PBWT *pbwtReadPhase (FILE *fp) /* Li and Stephens PHASE format */
 
 /*************** write haplotypes ******************/
 
+/* The text writers below fill whole rows in an OutBuf, scattering '0'+y straight
+   into the row through the cursor's a[], so there is no per-character stdio call
+   and no per-line flush.  If isWriteGzip is set the output is gzip compressed.
+*/
+
+BOOL isWriteGzip = FALSE ;
+
 void pbwtWriteHaplotypes (FILE *fp, PBWT *p)
 {
-  int i, j, n = 0, M = p->M ;
-  uchar *hap = myalloc (M, uchar) ;
+  int i, j, M = p->M ;
+  int step = isWriteImputeRef ? 2 : 1 ; /* impute reference haplotypes are space separated */
+  long rowLen = isWriteImputeRef ? 2L*M : M+1 ;
+  OutBuf *ob = outBufCreate (fp, isWriteGzip) ;
   PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
 
   for (i = 0 ; i < p->N ; ++i)
-    { for (j = 0 ; j < M ; ++j) hap[u->a[j]] = u->y[j] ;
-      for (j = 0 ; j < M ; ++j) 
-	{ if (isWriteImputeRef && j > 0) putc (' ', fp) ;
-	  putc (hap[j]?'1':'0', fp) ;
-	}
-      putc ('\n', fp) ; fflush (fp) ;
+    { char *row = outBufReserve (ob, rowLen) ;
+      if (step == 2) for (j = 1 ; j < rowLen ; j += 2) row[j] = ' ' ;
+      for (j = 0 ; j < M ; ++j) row[u->a[j]*step] = '0' + u->y[j] ;
+      row[rowLen-1] = '\n' ;
+      ob->cp += rowLen ;
       pbwtCursorForwardsRead (u) ;
     }
-  free (hap) ; pbwtCursorDestroy (u) ;
+  outBufDestroy (ob) ; pbwtCursorDestroy (u) ;
 
   fprintf (logFile, "written haplotype file: %d rows of %d\n", p->N, M) ;
 }
 
+typedef struct { OutBuf *ob ; int N ; } TransposedRows ;
+
+static void writeTransposedRow (void *arg, int j, uchar *hap)
+{
+  TransposedRows *r = (TransposedRows*) arg ;
+  int i, N = r->N ;
+  char *cp = outBufReserve (r->ob, N+1) ;
+  for (i = 0 ; i < N ; ++i) cp[i] = '0' + hap[i] ;
+  cp[N] = '\n' ;
+  r->ob->cp += N+1 ;
+}
+
+static void writeTransposed (PBWT *p, OutBuf *ob) /* memory bounded by pbwtMemoryBudget */
+{
+  TransposedRows r ; r.ob = ob ; r.N = p->N ;
+  pbwtTranspose (p, writeTransposedRow, &r) ;
+}
+
 void pbwtWriteTransposedHaplotypes (PBWT *p, FILE *fp)
 {
-  int i, j ;
-  uchar **hap = pbwtHaplotypes (p) ;
-  
-  for (j = 0 ; j < p->M ; ++j)
-    { for (i = 0 ; i < p->N ; ++i) 
-	putc (hap[j][i], fp) ;
-      putc ('\n', fp) ; fflush (fp) ;
-    }
-  
-  for (i = 0 ; j < p->M ; ++j) free(hap[j]) ;  free (hap) ;
+  OutBuf *ob = outBufCreate (fp, isWriteGzip) ;
+  writeTransposed (p, ob) ;
+  outBufDestroy (ob) ;
   
   fprintf (logFile, "written transposed haplotype file: %d rows of %d\n", p->M,p->N) ;
 }
 
+void pbwtWritePhase (PBWT *p, char *filename)
+{
+  FILE *fp ;
+  if (!p || !p->sites) die ("pbwtWritePhase called without sites") ;
+  if (!(fp = fopen (filename, "w"))) die ("failed to open %s",filename);
+  OutBuf *ob = outBufCreate (fp, isWriteGzip) ;
+  outBufInt (ob, p->M) ; outBufPutc (ob, '\n') ;
+  outBufInt (ob, p->N) ; outBufPuts (ob, "\nP") ;
+  int i ; for (i = 0 ; i < p->N ; i++)
+	    { outBufPutc (ob, ' ') ; outBufInt (ob, arrp(p->sites,i,Site)->x) ; }
+  outBufPutc (ob, '\n') ;
+  writeTransposed (p, ob) ;
+  outBufDestroy (ob) ; fclose (fp) ;
+
+  fprintf (logFile, "written phase file: %d haplotypes at %d sites\n", p->M, p->N) ;
+}
+
 /*************** write IMPUTE files ********************/
 
 void pbwtWriteImputeRef (PBWT *p, char *fileNameRoot)
@@ -931,42 +1645,57 @@ void pbwtWriteImputeHapsG (PBWT *p, FILE *fp)
   if (!p || !p->sites) die ("pbwtWriteImputeHaps called without sites") ;
 
   int i, j ;
-  uchar *hap = myalloc (p->M, uchar) ;
+  OutBuf *ob = outBufCreate (fp, isWriteGzip) ;
   PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
 
   for (i = 0 ; i < p->N ; ++i)
     { Site *s = arrp(p->sites, i, Site) ;
-      fprintf (fp, "site%d\tsite%d\t%d", i+1, i+1, s->x) ;
-      fprintf (fp, "\t%s", dictName (variationDict, s->varD)) ;
-      
-      for (j = 0 ; j < p->M ; ++j) hap[u->a[j]] = u->y[j] ;
-      for (j = 0 ; j < p->M ; ++j) putc (' ', fp), putc (hap[j]?'1':'0', fp) ;
-      putc ('\n', fp) ; fflush (fp) ;
+      char *var = dictName (variationDict, s->varD) ;
+      long n = strlen (var) ;
+      char *cp = outBufReserve (ob, 3*24 + n + 2*p->M + 1) ;
+      memcpy (cp, "site", 4) ; cp = outBufDigits (cp+4, i+1) ;
+      memcpy (cp, "\tsite", 5) ; cp = outBufDigits (cp+5, i+1) ;
+      *cp++ = '\t' ; cp = outBufDigits (cp, s->x) ;
+      *cp++ = '\t' ; memcpy (cp, var, n) ; cp += n ;
+      for (j = 1 ; j < 2*p->M ; j += 2) cp[j-1] = ' ' ;
+      for (j = 0 ; j < p->M ; ++j) cp[2*u->a[j]+1] = '0' + u->y[j] ;
+      cp += 2*p->M ; *cp++ = '\n' ;
+      ob->cp = cp ;
       pbwtCursorForwardsRead (u) ;
     }
 
-  free (hap) ; pbwtCursorDestroy (u) ;
+  outBufDestroy (ob) ; pbwtCursorDestroy (u) ;
 }
 
 void pbwtWriteGen (PBWT *p, FILE *fp)
 {
   if (!p || !p->sites) die ("pbwtWriteImputeHaps called without sites") ;
 
+  static char *genotype[3] = { " 1 0 0", " 0 1 0", " 0 0 1" } ;
   int i, j ;
   uchar *hap = myalloc (p->M, uchar) ;
+  OutBuf *ob = outBufCreate (fp, isWriteGzip) ;
   PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
   BOOL isDosage = p->dosageOffset ? TRUE : FALSE ;
   double *d = 0, *ad = isDosage ? myalloc (p->M, double) : NULL;
+  int chromLen = p->chrom ? strlen (p->chrom) : 6 ; /* "(null)" as printf gives */
+  char *chrom = p->chrom ? p->chrom : "(null)" ;
 
   for (i = 0 ; i < p->N ; ++i)
     { Site *s = arrp(p->sites, i, Site) ;
-      char *als = strdup( dictName(variationDict, s->varD) ), *ss = als ;
-      while ( *ss ) { if ( *ss=='\t' ) *ss = '_' ; ss++ ; }
-      fprintf (fp, "%s:%d_%s %s:%d_%s %d", p->chrom, s->x, als, p->chrom, s->x, als, s->x) ;
-      ss = als ;
-      while ( *ss ) { if ( *ss=='_' ) *ss = ' ' ; ss++ ; }
-      fprintf (fp, " %s", als) ;
-      free(als) ;
+      char *als = dictName (variationDict, s->varD) ;
+      long n = strlen (als) ;
+      char *cp = outBufReserve (ob, 2*chromLen + 3*n + 5*24) ; /* als in both ids and the alleles */
+      int k ; for (k = 0 ; k < 2 ; ++k)	/* the two id columns: chrom:pos_REF_ALT */
+		{ memcpy (cp, chrom, chromLen) ; cp += chromLen ; *cp++ = ':' ;
+		  cp = outBufDigits (cp, s->x) ; *cp++ = '_' ;
+		  char *c = als ; while (*c) { *cp++ = (*c == '\t') ? '_' : *c ; ++c ; }
+		  *cp++ = ' ' ;
+		}
+      cp = outBufDigits (cp, s->x) ;
+      *cp++ = ' ' ;
+      { char *c = als ; while (*c) { *cp++ = (*c == '\t' || *c == '_') ? ' ' : *c ; ++c ; } }
+      ob->cp = cp ;
       if (isDosage) d = pbwtDosageRetrieve (p, u, d, i) ;
       
       for (j = 0 ; j < p->M ; ++j)
@@ -974,19 +1703,25 @@ void pbwtWriteGen (PBWT *p, FILE *fp)
           if (isDosage) ad[u->a[j]] = d[j] ;
         }
       if (isDosage)
-          for (j = 0 ; j < p->M ; j+=2) 
-            fprintf (fp, " %f %f %f", (1-ad[j]) * (1-ad[j+1]), ad[j] + ad[j+1] - 2*ad[j]*ad[j+1], ad[j] * ad[j+1]) ;
+	for (j = 0 ; j < p->M ; j+=2) 
+	  { cp = outBufReserve (ob, 3*25) ;
+	    *cp++ = ' ' ; cp = outBufFixed6 (cp, (1-ad[j]) * (1-ad[j+1])) ;
+	    *cp++ = ' ' ; cp = outBufFixed6 (cp, ad[j] + ad[j+1] - 2*ad[j]*ad[j+1]) ;
+	    *cp++ = ' ' ; cp = outBufFixed6 (cp, ad[j] * ad[j+1]) ;
+	    ob->cp = cp ;
+	  }
       else
-          for (j = 0 ; j < p->M ; j+=2) 
-            if (hap[j] + hap[j+1] == 0) fprintf (fp, " 1 0 0") ;
-            else if (hap[j] + hap[j+1] == 1) fprintf (fp, " 0 1 0") ;
-            else fprintf (fp, " 0 0 1") ;
-      putc ('\n', fp) ; fflush (fp) ;
+	{ cp = outBufReserve (ob, 3*p->M) ;
+	  for (j = 0 ; j < p->M ; j+=2) 
+	    { memcpy (cp, genotype[hap[j] + hap[j+1]], 6) ; cp += 6 ; }
+	  ob->cp = cp ;
+	}
+      outBufPutc (ob, '\n') ;
       pbwtCursorForwardsRead (u) ;
     }
 
   if (ad) free(ad) ;
-  free (hap) ; pbwtCursorDestroy (u) ;
+  free (hap) ; outBufDestroy (ob) ; pbwtCursorDestroy (u) ;
 }
 
 /******************* end of file *******************/
@@ -257,24 +257,108 @@ static void phaseInit (int N)
     { z = exp (-i * 0.0001) ; logisticCache[i] = 1.0 / (1.0 + z) ; }
 }
 
-static inline double score0 (PbwtCursor *u, double *xp, int i)
+/* Within a site, the hets of each chunk of PHASE_CHUNK sample pairs are phased in order
+   by one thread, seeing the phasing so far of its own chunk, but for other chunks only
+   that at the start of the current pass, kept in xpOld.  So results do not depend on
+   nThreads, and are unchanged from sequential phasing when M <= 2*PHASE_CHUNK.
+   Each chunk keeps a list of its unresolved hets, so a pass only visits those.
+*/
+
+#define PHASE_CHUNK 4096
+
+typedef struct {
+  int M, nSparse, nChunks ;
+  PbwtCursor *uq, *ur, **uqq ;
+  int *bq, *br, **bqq ;		/* inverses of their a: pbwtCursorForwardsAD uses b as workspace */
+  double *xp, *xpOld ;		/* xpOld is xp at the start of this pass */
+  int *het, *nHet ;		/* per chunk, the unresolved hets, as index of first of pair */
+  int *done, *nDone ;		/* per chunk, the hets resolved in this pass */
+  double thresh ;
+  int k ;
+  BOOL isFinal ;		/* resolve all remaining hets using match lengths */
+} PhaseSweep ;
+
+static inline double xpAt (PhaseSweep *ps, int j, int lo, int hi)
+{ return (j >= lo && j < hi) ? ps->xp[j] : ps->xpOld[j] ; }
+
+static inline double score0 (PhaseSweep *ps, int *a, int *b, int i, int lo, int hi)
 {
   double s = 0.0 ;
-  int ubi = u->b[i] ;
-  if (ubi > 0) s += xp[u->a[ubi-1]] ;
-  if (ubi < u->M-1) s += xp[u->a[ubi+1]] ;
+  int ubi = b[i] ;
+  if (ubi > 0) s += xpAt (ps, a[ubi-1], lo, hi) ;
+  if (ubi < ps->M-1) s += xpAt (ps, a[ubi+1], lo, hi) ;
   return s ;
 }
 
-static inline double score1 (PbwtCursor *u, double *xp, int i, int k)
+static inline double score1 (PhaseSweep *ps, PbwtCursor *u, int *b, int i, int k, int lo, int hi)
 {
   double s = 0 ;
-  int ubi = u->b[i] ;
-  if (ubi > 0) s += xp[u->a[ubi-1]] * scoreBit[(k+1)-u->d[ubi]] ;
-  if (ubi < u->M-1) s += xp[u->a[ubi+1]] * scoreBit[(k+1)-u->d[ubi+1]] ;
+  int ubi = b[i] ;
+  if (ubi > 0) s += xpAt (ps, u->a[ubi-1], lo, hi) * scoreBit[(k+1)-u->d[ubi]] ;
+  if (ubi < ps->M-1) s += xpAt (ps, u->a[ubi+1], lo, hi) * scoreBit[(k+1)-u->d[ubi+1]] ;
   return s ;
 }
 
+static void phaseChunk (void *arg, int c, int thread)
+{
+  PhaseSweep *ps = (PhaseSweep*) arg ;
+  int lo = 2*c*PHASE_CHUNK, hi = lo + 2*PHASE_CHUNK ;
+  int *het = ps->het + c*PHASE_CHUNK, *done = ps->done + c*PHASE_CHUNK ;
+  int h, i, kk, n = 0, nDone = 0, k = ps->k ;
+  double s, *xp = ps->xp ;
+
+  if (hi > ps->M) hi = ps->M ;
+  for (h = 0 ; h < ps->nHet[c] ; ++h)
+    { i = het[h] ;
+      if (ps->isFinal)	/* phase using length, forwards only for now */
+	{ s = score1 (ps, ps->uq, ps->bq, i, k, lo, hi) - score1 (ps, ps->uq, ps->bq, i+1, k, lo, hi) ;
+	  for (kk = 0 ; kk < ps->nSparse ; ++kk)
+	    s += score1 (ps, ps->uqq[kk], ps->bqq[kk], i, k/ps->nSparse, lo, hi)
+	      - score1 (ps, ps->uqq[kk], ps->bqq[kk], i+1, k/ps->nSparse, lo, hi) ;
+	  if (s > 0) { xp[i] = 1 ; xp[i+1] = -1 ; }
+	  else { xp[i] = -1 ; xp[i+1] = 1 ; }
+	  continue ;
+	}
+      s = score0 (ps, ps->uq->a, ps->bq, i, lo, hi) - score0 (ps, ps->uq->a, ps->bq, i+1, lo, hi) ;
+      if (ps->ur) s += score0 (ps, ps->ur->a, ps->br, i, lo, hi) - score0 (ps, ps->ur->a, ps->br, i+1, lo, hi) ;
+      for (kk = 0 ; kk < ps->nSparse ; ++kk)
+	s += score0 (ps, ps->uqq[kk]->a, ps->bqq[kk], i, lo, hi) - score0 (ps, ps->uqq[kk]->a, ps->bqq[kk], i+1, lo, hi) ;
+      if (s > ps->thresh)  { xp[i] = 1 ; xp[i+1] = -1 ; done[nDone++] = i ; }
+      else if (s < -ps->thresh) { xp[i] = -1 ; xp[i+1] = 1 ; done[nDone++] = i ; }
+      else het[n++] = i ;
+    }
+  ps->nHet[c] = ps->isFinal ? 0 : n ;
+  ps->nDone[c] = nDone ;
+}
+
+static int phasePass (PhaseSweep *ps, int n2) /* returns number of hets still unresolved */
+{
+  int c, h ;
+  if (n2 > PHASE_CHUNK) pbwtParallelFor (ps->nChunks, phaseChunk, ps) ;
+  else for (c = 0 ; c < ps->nChunks ; ++c) phaseChunk (ps, c, 0) ; /* not worth the threads */
+  n2 = 0 ;
+  for (c = 0 ; c < ps->nChunks ; ++c)
+    { int *done = ps->done + c*PHASE_CHUNK ;
+      for (h = 0 ; h < ps->nDone[c] ; ++h)
+	{ ps->xpOld[done[h]] = ps->xp[done[h]] ; ps->xpOld[done[h]+1] = ps->xp[done[h]+1] ; }
+      n2 += ps->nHet[c] ;
+    }
+  return n2 ;
+}
+
+/* After a cursor update with values y, the sequences in the leading run of 0s and the
+   trailing run of 1s of y keep their positions, so only the span between changes.
+   Works both forwards, with y in the old order, and backwards, with y in the new order.
+*/
+
+static void phaseInverseUpdate (int *b, int *a, uchar *y, int M)
+{
+  int i = 0, iEnd = M ;
+  while (i < M && !y[i]) ++i ;
+  while (iEnd > i && y[iEnd-1]) --iEnd ;
+  for ( ; i < iEnd ; ++i) b[a[i]] = i ;
+}
+
 static inline double logistic (double x)
 { int i = x * 10000 ; 
   if (i < -99999) return 1.0 - logisticCache[99999] ;
@@ -287,87 +371,93 @@ static inline double logistic (double x)
 
 PBWT *phaseSweep (PBWT *p, PBWT *ref, BOOL isStart, PBWT *r, int nSparse)
 {
-  int    i, j, k, kk, kr = 0 ;
+  int    i, k, kk ;
   int    M = p->M, N = p->N ;
 
   if (ref && p->M > ref->M) die ("phaseSweep requires ref->M >= p->M") ;
 
   /* initialisation */
+  PhaseSweep ps ;
+  memset (&ps, 0, sizeof(PhaseSweep)) ;
+  ps.M = M ; ps.nSparse = nSparse ;
   PbwtCursor *up = pbwtCursorCreate (p, TRUE, isStart) ;
   PBWT *q = pbwtCreate (M, N) ; /* new pbwt */
-  PbwtCursor *ur, *uref ;
+  PbwtCursor *uref ;
   if (ref) uref = pbwtCursorCreate (ref, TRUE, isStart) ; 
   if (r) 
-    { ur = pbwtCursorCreate (r, TRUE, FALSE) ;
-      memcpy (ur->b, r->aRend, M*sizeof(int)) ; /* recover stored locations */
-      // for (i = 0 ; i < M ; ++i) ur->b[ur->a[i]] = i ; /* store inverse a in b */
+    { ps.ur = pbwtCursorCreate (r, TRUE, FALSE) ;
+      ps.br = myalloc (M, int) ;
+      memcpy (ps.br, r->aRend, M*sizeof(int)) ; /* recover stored locations */
       memcpy (q->aFstart, r->aFend, M*sizeof(int)) ; /* prime uq with final ur */
     }
-  PbwtCursor *uq = pbwtCursorCreate (q, TRUE, TRUE) ; 
-  for (i = 0 ; i < M ; ++i) uq->b[uq->a[i]] = i ; /* store inverse a in b */
-  PbwtCursor **uqq = myalloc (nSparse, PbwtCursor*) ;
+  ps.uq = pbwtCursorCreate (q, TRUE, TRUE) ; 
+  ps.bq = myalloc (M, int) ;
+  for (i = 0 ; i < M ; ++i) ps.bq[ps.uq->a[i]] = i ; /* store inverse a in bq */
+  ps.uqq = myalloc (nSparse, PbwtCursor*) ;
+  ps.bqq = myalloc (nSparse, int*) ;
   for (kk = 0 ; kk < nSparse ; ++kk)
-    { uqq[kk] = pbwtNakedCursorCreate (M, 0) ; 
-      for (i = 0 ; i < M ; ++i) uqq[kk]->b[uqq[kk]->a[i]] = i ;
+    { ps.uqq[kk] = pbwtNakedCursorCreate (M, 0) ; 
+      ps.bqq[kk] = myalloc (M, int) ;
+      for (i = 0 ; i < M ; ++i) ps.bqq[kk][ps.uqq[kk]->a[i]] = i ;
     }
+  ps.nChunks = (M/2 + PHASE_CHUNK - 1) / PHASE_CHUNK ;
+  ps.het = myalloc (M/2, int) ; ps.nHet = myalloc (ps.nChunks, int) ;
+  ps.done = myalloc (M/2, int) ; ps.nDone = myalloc (ps.nChunks, int) ;
 
   /* now loop through p phasing into q */
   uchar  *x = myalloc (M, uchar) ;  /* actual haplotypes in original order, from p */
-  double *xp = myalloc(M, double) ; /* 2*p(x=1)-1, so 1 if x=1, -1 if x=0, 0 if unknown */
+  ps.xp = myalloc(M, double) ; /* 2*p(x=1)-1, so 1 if x=1, -1 if x=0, 0 if unknown */
+  ps.xpOld = myalloc(M, double) ;
+  double *xp = ps.xp ;
   for (k = 0 ; k < N ; k++)
     { if (!isStart) pbwtCursorReadBackwards (up) ;
       for (i = 0 ; i < M ; ++i) x[up->a[i]] = up->y[i] ;  /* build x from up->y */
       if (isStart) pbwtCursorForwardsRead (up) ; 
       for (i = 0 ; i < M ; ++i) xp[i] = x[i] ? 1.0 : -1.0 ;
       int n2 = 0 ;
+      memset (ps.nHet, 0, ps.nChunks*sizeof(int)) ;
       for (i = 0 ; i < M ; i += 2) /* go through x in pairs */
-	if (x[i] != x[i+1]) { ++n2 ; xp[i] = xp[i+1] = 0.0 ; }  /* a het */
-      double s, thresh = ref ? 0.5 : 2*(nSparse + (r?2:1)) + 0.5 ;
+	if (x[i] != x[i+1])	/* a het */
+	  { int c = i / (2*PHASE_CHUNK) ;
+	    ++n2 ; xp[i] = xp[i+1] = 0.0 ;
+	    ps.het[c*PHASE_CHUNK + ps.nHet[c]++] = i ;
+	  }
+      memcpy (ps.xpOld, xp, M*sizeof(double)) ;
+      ps.k = k ;
+      double thresh = ref ? 0.5 : 2*(nSparse + (r?2:1)) + 0.5 ;
       while (n2 && thresh > 1.0)
-	{ int n2Old = n2 ; n2 = 0 ;
-	  for (i = 0 ; i < M ; i += 2) /* loop over genotype pairs in original order */
-	    if (!xp[i]) /* a het to phase */
-	      { s = score0 (uq, xp, i) - score0 (uq, xp, i+1) ;
-		if (r) s += score0 (ur, xp,i) - score0 (ur, xp, i+1) ;
-		for (kk = 0 ; kk < nSparse ; ++kk) 
-		  s += score0 (uqq[kk], xp, i) - score0 (uqq[kk], xp, i+1) ;
-		if (s > thresh)  { xp[i] = 1 ; xp[i+1] = -1 ; }
-		else if (s < -thresh) { xp[i] = -1 ; xp[i+1] = 1 ; }
-		else ++n2 ;
-	      }
-	  if (n2 == n2Old) { thresh -= 1.0 ; n2Old = M+1 ; }
+	{ int n2Old = n2 ;
+	  ps.thresh = thresh ;
+	  n2 = phasePass (&ps, n2) ;
+	  if (n2 == n2Old) thresh -= 1.0 ;
 	}
       if (n2)   /* some unresolved values - phase using length, forwards only for now */
-	for (i = 0 ; i < M ; i += 2)
-	  if (!xp[i]) 
-	    { s = score1 (uq, xp, i, k) - score1 (uq, xp, i+1, k) ;
-	      for (kk = 0 ; kk < nSparse ; ++kk) 
-		s += score1 (uqq[kk], xp, i, k/nSparse) - score1 (uqq[kk], xp, i+1, k/nSparse) ;
-	      if (s > 0) { xp[i] = 1 ; xp[i+1] = -1 ; }
-	      else { xp[i] = -1 ; xp[i+1] = 1 ; }
-	    }
+	{ ps.isFinal = TRUE ; phasePass (&ps, n2) ; ps.isFinal = FALSE ; }
 
       for (i = 0 ; i < M ; ++i)	x[i] = (xp[i] > 0.0) ? 1 : 0 ;
-      for (i = 0 ; i < M ; ++i)	uq->y[i] = x[uq->a[i]] ;
-      pbwtCursorWriteForwardsAD (uq, k) ; 
-      for (i = 0 ; i < M ; ++i) uq->b[uq->a[i]] = i ;
+      for (i = 0 ; i < M ; ++i)	ps.uq->y[i] = x[ps.uq->a[i]] ;
+      pbwtCursorWriteForwardsAD (ps.uq, k) ; 
+      phaseInverseUpdate (ps.bq, ps.uq->a, ps.uq->y, M) ;
       kk = k % nSparse ;	/* which of the sparse pbwts to update this time */
-      for (i = 0 ; i < M ; ++i) uqq[kk]->y[i] = x[uqq[kk]->a[i]] ;
-      pbwtCursorForwardsAD (uqq[kk], k/nSparse) ; 
-      for (i = 0 ; i < M ; ++i) uqq[kk]->b[uqq[kk]->a[i]] = i ;
+      PbwtCursor *u = ps.uqq[kk] ;
+      for (i = 0 ; i < M ; ++i) u->y[i] = x[u->a[i]] ;
+      pbwtCursorForwardsAD (u, k/nSparse) ; 
+      phaseInverseUpdate (ps.bqq[kk], u->a, u->y, M) ;
       if (r) 
-	{ pbwtCursorReadBackwards (ur) ; 
-	  for (i = 0 ; i < M ; ++i) ur->b[ur->a[i]] = i ;
+	{ pbwtCursorReadBackwards (ps.ur) ; 
+	  phaseInverseUpdate (ps.br, ps.ur->a, ps.ur->y, M) ;
 	}
     }
-  pbwtCursorToAFend (uq, q) ;
-  /* cache uq->b in aRend so we can retrieve from reverse on forwards pass */
-  q->aRend = myalloc (q->M, int) ; 
-  for (i = 0 ; i < q->M ; ++i) q->aRend[i] = uq->b[i] ;
+  pbwtCursorToAFend (ps.uq, q) ;
+  /* cache inverse of final uq->a in aRend so we can retrieve from reverse on forwards pass */
+  q->aRend = ps.bq ;
   /* clean up memory allocated */
-  free (x) ; free (xp) ;
-  pbwtCursorDestroy (up) ; pbwtCursorDestroy (uq) ; if (r) pbwtCursorDestroy (ur) ;
-  for (kk = 0 ; kk < nSparse ; ++kk) pbwtCursorDestroy (uqq[kk]) ; free (uqq) ;
+  free (x) ; free (ps.xp) ; free (ps.xpOld) ;
+  free (ps.het) ; free (ps.nHet) ; free (ps.done) ; free (ps.nDone) ;
+  pbwtCursorDestroy (up) ; pbwtCursorDestroy (ps.uq) ;
+  if (r) { pbwtCursorDestroy (ps.ur) ; free (ps.br) ; }
+  for (kk = 0 ; kk < nSparse ; ++kk) { pbwtCursorDestroy (ps.uqq[kk]) ; free (ps.bqq[kk]) ; }
+  free (ps.uqq) ; free (ps.bqq) ;
   return q ;
 }
 
@@ -381,7 +471,9 @@ PBWT *phase (PBWT *p, int nSparse) /* return rephased p */
   if (!p->aFend) pbwtBuildReverse (p) ;	/* needed for old PBWT format data */
   PBWT *r = phaseSweep (p, 0, FALSE, 0, 2) ; /* always reverse sweep wth nSparse 2 */
   if (isCheck)		/* flip p->zz round into p->yz and compare to r */
-    { Array yzStore = p->yz ; p->yz = p->zz ;
+    { if (!p->zz) pbwtBuildReverse (p) ;
+      pbwtLoadBlocks (p) ;	/* else cursors on p read yzBlocks, not yz */
+      Array yzStore = p->yz ; p->yz = p->zz ;
       int *aFstartStore = p->aFstart ; p->aFstart = p->aRstart ;
       fprintf (logFile, "After reverse pass: ") ; phaseCompare (p, r) ;
       p->yz = yzStore ; p->aFstart = aFstartStore ;
@@ -406,6 +498,7 @@ PBWT *referencePhase0 (PBWT *p, PBWT *pRef)
   PBWT *r = phaseSweep (p, pRef, FALSE, 0, 2) ; /* always reverse with nSparse 2 */
   if (isCheck)		/* flip p->zz round into p->yz and compare to r */
     { if (!p->zz) pbwtBuildReverse (p) ;
+      pbwtLoadBlocks (p) ;	/* else cursors on p read yzBlocks, not yz */
       Array yzStore = p->yz ; p->yz = p->zz ;
       int *aFstartStore = p->aFstart ; p->aFstart = p->aRstart ;
       fprintf (logFile, "After reverse pass: ") ; phaseCompare (p, r) ;
@@ -417,15 +510,11 @@ PBWT *referencePhase0 (PBWT *p, PBWT *pRef)
 
 /******* phase a new pbwt against the existing one as a reference *******/
 
-typedef struct { int jRef ; int start ; int end ; } MatchSegment ;
-/* matches are semi-open [start,end) so length is end-start */
-
-static Array *maxMatch = 0 ;	/* of MatchSegment */
+static __thread MatchLog *matchLog = 0 ; /* per thread for -imputeChunk windows */
 
 static void reportMatch (int iq, int jRef, int start, int end)
 {
-  MatchSegment *ms = arrayp (maxMatch[iq], arrayMax(maxMatch[iq]), MatchSegment) ;
-  ms->jRef = jRef ; ms->start = start ; ms->end = end ;
+  matchLogAdd (matchLog, iq, jRef, start, end) ;
 }
 
 /**************** referencePhase4 *************************************************/
@@ -1078,7 +1167,7 @@ PBWT *referencePhase (PBWT *pOld, char *fileNameRoot)
 {
   fprintf (logFile, "phase against reference %s\n", fileNameRoot) ;
   if (pOld->M % 2) die ("phase requires that M = %d is even", pOld->M) ;
-  if (!pOld || !pOld->yz || !pOld->sites) 
+  if (!pOld || !(pOld->yz || pOld->yzBlocks) || !pOld->sites) 
     die ("referencePhase called without existing pbwt with sites") ;
 
   PBWT *pRef = pbwtReadAll (fileNameRoot) ;
@@ -1107,37 +1196,261 @@ PBWT *referencePhase (PBWT *pOld, char *fileNameRoot)
 
 static double **pImp = 0 ;	/* use with stats to store p values */
 
-int matchSegmentCompare (const void *a, const void *b) /* for sorting */
-{
-  return ((MatchSegment*)a)->start - ((MatchSegment*)b)->start ;
-}
-
 /* overload a high-end bit of the ->end field of MatchSegment to record if match is sparse */
 static int SPARSE_BIT = 1 << 30 ;
 static int SPARSE_MASK = (1 << 30) - 1 ;
 
 static void reportMatchSparse (int iq, int jRef, int start, int end, BOOL isSparse)
 {
-  MatchSegment *ms = arrayp (maxMatch[iq], arrayMax(maxMatch[iq]), MatchSegment) ;
-  ms->jRef = jRef ; ms->start = start ; ms->end = end ;
-  if (isSparse) ms->end |= SPARSE_BIT ;
+  matchLogAdd (matchLog, iq, jRef, start, isSparse ? (end | SPARSE_BIT) : end) ;
 }
 
-static PBWT *referenceImpute3 (PBWT *pOld, PBWT *pRef, PBWT *pFrame, 
-			       int nSparse, double fSparse)
+/* At each reference site the query haplotypes are imputed independently, so they are
+   split into fixed chunks run across threads.  Partial sums for the info score are
+   kept per chunk and added in chunk order, so results do not depend on nThreads.
+*/
+
+#define IMPUTE_CHUNK 256
+
+/* The weight of a match segment at query site k is (k-start)*(end-k), a quadratic in k.
+   So the total weight of a set of segments is -a*k^2 + b*k - c, where a counts the
+   segments, b sums start+end and c sums start*end.  The incremental kernel keeps these
+   coefficients for the open segments of each query, and separately for those whose
+   reference haplotype carries allele 1 at the current reference site.  Segments are
+   opened and closed as the query site advances, and moved in or out of the allele 1 set
+   when their reference haplotype changes allele, found from lists of the open segments
+   on each reference haplotype.  So each site costs the number of segments that change
+   plus the number of reference haplotypes that change allele, rather than the total
+   number of open segments.  Integer coefficients make the weights exact, so results
+   match the scanning kernel.  This needs the segments of each query to be ordered in
+   both start and end, as matchSequencesSweep() reports them, and no sparse matches;
+   otherwise we scan the segments at every site as before.
+*/
+
+#define IMPUTE_RESCAN 16	/* rescan open segments if more than 1/16 of alleles change */
+
+typedef struct { long a, b, c ; } MatchPoly ;
+
+static inline void matchPolyAdd (MatchPoly *m, MatchSegment *ms, int sign)
+{
+  m->a += sign ;
+  m->b += sign * ((long)ms->start + ms->end) ;
+  m->c += sign * ((long)ms->start * ms->end) ;
+}
+
+static inline long matchPolyWeight (MatchPoly *m, long k) { return (m->b - m->a*k)*k - m->c ; }
+
+typedef struct { int next, prev, j ; } SegLink ; /* prev == -1 - jRef at the head of a list */
+
+typedef struct {
+  PBWT *pRef ;
+  BOOL isSelf ;			/* pOld == pFrame: only impute missing values */
+  int M, kOld, kRef ;
+  BOOL isAdvance ;		/* kOld has moved on, so move firstSeg on first */
+  double fSparse ;
+  uchar *yRef ; int *aRefInv ;	/* uRef->y and its inverse sort order */
+  MatchLog *matchLog ;		/* the caller's, as matchLog is thread local */
+  int *firstSeg ;
+  uchar *missing, *x ; double *xDosage ; /* x and xDosage are the results */
+  double *psum, *xsum, *pxsum ; int *n, *nConflicts ; /* per chunk */
+  /* the rest are for the incremental kernel, imputeSiteChunkIncremental() */
+  int MRef ;
+  uchar *allele ;		/* reference allele at this site in original order */
+  int *flip, nFlip ;		/* reference haplotypes whose allele changed at this site */
+  BOOL isRescan ;		/* so many changed that we rebuild the allele 1 weights */
+  int *nextSeg ;		/* first segment not yet opened, for each query */
+  MatchPoly *all, *one ;	/* weights of open segments, all and those on allele 1 */
+  int *segBase ;		/* first link of each query within its chunk */
+  int **head ;			/* per chunk, first open link on each reference haplotype */
+  SegLink **link ;		/* per chunk, links of the open segments on each reference haplotype */
+} ImputeSite ;
+
+static void imputeSiteChunk (void *arg, int c, int thread)
+{
+  ImputeSite *is = (ImputeSite*) arg ;
+  int j, jEnd = (c+1)*IMPUTE_CHUNK, kOld = is->kOld ;
+  double psum = 0, xsum = 0, pxsum = 0, refFreq = arrp(is->pRef->sites,is->kRef,Site)->refFreq ;
+  int n = 0, nConflicts = 0 ;
+  uchar *yRef = is->yRef, *x = is->x ;
+  int *aRefInv = is->aRefInv ;
+  MatchLog *ml = is->matchLog ;
+
+  if (jEnd > is->M) jEnd = is->M ;
+  for (j = c*IMPUTE_CHUNK ; j < jEnd ; ++j)	     /* j here is in original order */
+    { if (is->isAdvance)
+	while (kOld >= (matchLogSegs(ml,j)[is->firstSeg[j]].end & SPARSE_MASK)) ++is->firstSeg[j] ;
+      if (is->isSelf && !is->missing[j]) /* don't impute - copy from ref */
+	{ x[j] = yRef[aRefInv[j]] ;
+	  continue ;
+	}
+      /* impute from overlapping matches */
+      double bit = 0, sum = 0, score = 0 ;
+      MatchSegment *m = matchLogSegs(ml,j) + is->firstSeg[j] ;
+      MatchSegment *mStop = matchLogSegs(ml,j) + matchLogCount(ml,j) ;
+      while (m->start < kOld && m < mStop)
+	{ bit = (kOld - m->start) * ((m->end & SPARSE_MASK) - kOld) ;
+	  if (m->end & SPARSE_BIT) bit *= is->fSparse ;
+	  if (bit > 0)
+	    { sum += bit ;
+	      if (yRef[aRefInv[m->j]]) score += bit ;
+	    }
+	  ++m ;
+	}
+      if (sum == 0) 
+	{ x[j] = refFreq > 0.5 ? 1 : 0 ;
+	  is->xDosage[j] = refFreq ;
+	  if (isStats) pImp[is->kRef][j] = is->xDosage[j] ;
+	  ++nConflicts ;
+	}
+      else 
+	{ double p = score/sum ;
+	  x[j] = (p > 0.5) ? 1 : 0 ;
+	  is->xDosage[j] = p ;
+	  psum += p ;
+	  xsum += x[j] ;
+	  pxsum += p*x[j] ;
+	  if (isStats) pImp[is->kRef][j] = p ;
+	  ++n ;
+	}
+    }
+  is->psum[c] = psum ; is->xsum[c] = xsum ; is->pxsum[c] = pxsum ;
+  is->n[c] = n ; is->nConflicts[c] = nConflicts ;
+}
+
+static void segLinkInsert (ImputeSite *is, int c, int node, int jRef)
+{
+  int *head = is->head[c] ; SegLink *link = is->link[c] ;
+  link[node].prev = -1 - jRef ; link[node].next = head[jRef] ;
+  if (head[jRef] >= 0) link[head[jRef]].prev = node ;
+  head[jRef] = node ;
+}
+
+static void segLinkRemove (ImputeSite *is, int c, int node)
+{
+  SegLink *link = is->link[c] ;
+  if (link[node].prev >= 0) link[link[node].prev].next = link[node].next ;
+  else is->head[c][-1 - link[node].prev] = link[node].next ;
+  if (link[node].next >= 0) link[link[node].next].prev = link[node].prev ;
+}
+
+static void imputeSiteChunkIncremental (void *arg, int c, int thread)
+{
+  ImputeSite *is = (ImputeSite*) arg ;
+  int i, j, node, jStart = c*IMPUTE_CHUNK, jEnd = jStart + IMPUTE_CHUNK ;
+  long kOld = is->kOld ;
+  double psum = 0, xsum = 0, pxsum = 0, refFreq = arrp(is->pRef->sites,is->kRef,Site)->refFreq ;
+  int n = 0, nConflicts = 0 ;
+  uchar *allele = is->allele, *x = is->x ;
+  MatchLog *ml = is->matchLog ;
+  SegLink *link = is->link[c] ;
+
+  if (jEnd > is->M) jEnd = is->M ;
+  if (!is->isRescan)
+   for (i = 0 ; i < is->nFlip ; ++i)	/* move open segments on changed haplotypes */
+    { int jRef = is->flip[i], sign = allele[jRef] ? 1 : -1 ;
+      for (node = is->head[c][jRef] ; node >= 0 ; node = link[node].next)
+	{ j = link[node].j ;
+	  matchPolyAdd (&is->one[j], matchLogSegs(ml,j) + node - is->segBase[j], sign) ;
+	}
+    }
+  for (j = jStart ; j < jEnd ; ++j)	/* j here is in original order */
+    { if (is->isAdvance)
+	{ MatchSegment *ms ;	/* open the segments now started, then close those now ended */
+	  while ((ms = matchLogSegs(ml,j) + is->nextSeg[j])->start < kOld)
+	    { matchPolyAdd (&is->all[j], ms, 1) ;
+	      if (allele[ms->j] && !is->isRescan) matchPolyAdd (&is->one[j], ms, 1) ;
+	      node = is->segBase[j] + is->nextSeg[j]++ ;
+	      link[node].j = j ;
+	      segLinkInsert (is, c, node, ms->j) ;
+	    }
+	  while (is->firstSeg[j] < is->nextSeg[j] 
+		 && (ms = matchLogSegs(ml,j) + is->firstSeg[j])->end <= kOld)
+	    { matchPolyAdd (&is->all[j], ms, -1) ;
+	      if (allele[ms->j] && !is->isRescan) matchPolyAdd (&is->one[j], ms, -1) ;
+	      segLinkRemove (is, c, is->segBase[j] + is->firstSeg[j]++) ;
+	    }
+	}
+      if (is->isRescan)		/* cheaper to sum the open segments on allele 1 again */
+	{ MatchSegment *ms = matchLogSegs(ml,j) + is->firstSeg[j] ;
+	  MatchSegment *msEnd = matchLogSegs(ml,j) + is->nextSeg[j] ;
+	  memset (&is->one[j], 0, sizeof(MatchPoly)) ;
+	  for ( ; ms < msEnd ; ++ms) if (allele[ms->j]) matchPolyAdd (&is->one[j], ms, 1) ;
+	}
+      if (is->isSelf && !is->missing[j]) /* don't impute - copy from ref */
+	{ x[j] = allele[j] ;
+	  continue ;
+	}
+      double sum = matchPolyWeight (&is->all[j], kOld) ;
+      if (sum == 0) 
+	{ x[j] = refFreq > 0.5 ? 1 : 0 ;
+	  is->xDosage[j] = refFreq ;
+	  if (isStats) pImp[is->kRef][j] = is->xDosage[j] ;
+	  ++nConflicts ;
+	}
+      else 
+	{ double p = matchPolyWeight (&is->one[j], kOld) / sum ;
+	  x[j] = (p > 0.5) ? 1 : 0 ;
+	  is->xDosage[j] = p ;
+	  psum += p ;
+	  xsum += x[j] ;
+	  pxsum += p*x[j] ;
+	  if (isStats) pImp[is->kRef][j] = p ;
+	  ++n ;
+	}
+    }
+  is->psum[c] = psum ; is->xsum[c] = xsum ; is->pxsum[c] = pxsum ;
+  is->n[c] = n ; is->nConflicts[c] = nConflicts ;
+}
+
+static BOOL isIncrementalOrder (MatchLog *ml)
+/* segments ordered in both start and end, and none sparse; ignores the end marker */
+{
+  int i, j ;
+  for (j = 0 ; j < ml->M ; ++j)
+    { MatchSegment *ms = matchLogSegs(ml,j) ;
+      for (i = 0 ; i < matchLogCount(ml,j) - 1 ; ++i)
+	if ((ms[i].end & SPARSE_BIT) || 
+	    (i && (ms[i].start < ms[i-1].start || ms[i].end < ms[i-1].end)))
+	  return FALSE ;
+    }
+  return TRUE ;
+}
+
+/* Imputation of a target against the reference is split into setting up the target
+   (finding its matches into the frame), imputing one reference site, and finishing.
+   The work that depends only on the reference cursor at each site - aRefInv, or the
+   alleles that flip for the incremental kernel - is done once by imputeSweep() for
+   all the targets it is given, so a batch of targets shares one sweep of the reference.
+*/
+
+typedef struct {
+  PBWT *pOld, *pNew ;
+  Array frameSites ; int nFrame ; /* all that is used of pFrame once matches are found */
+  PbwtCursor *uOld, *uNew ;
+  ImputeSite is ;
+  int nChunks, kOld, nConflicts ;
+  BOOL isIncremental, isBuild ;
+  double *yDosage ;
+  VcfWriter *w ;
+  Array sites ;			/* receives refFreq and imputeInfo; pRef->sites unless in a batch */
+} ImputeTarget ;
+
+static ImputeTarget *imputeTargetCreate (PBWT *pOld, PBWT *pRef, PBWT *pFrame, 
+					 int nSparse, double fSparse, VcfWriter *w, BOOL isBuild)
 /* Require pOld and pFrame to have the same sites, a subset of sites of pRef, */
 /* and pRef and pFrame to have the same samples. */
 /* If pOld == pFrame then only impute missing sites in pRef, else take pRef. */
 /* Added nSparse to allow also matching at sparse positions - 171113 but this seems broken?! */
+/* If w is set each site is written to it as it is made; if !isBuild pNew is left empty. */
 {
-  int i, j, k ;
+  int i, j, c ;
+  ImputeTarget *t = mycalloc (1, ImputeTarget) ;
 
   fprintf (logFile, "Reference impute using maximal matches: ") ;
   if (nSparse > 1) fprintf (logFile, "(nSparse = %d, fSparse = %.2f) ", nSparse, fSparse) ;
 
   /* build the array of maximal matches into pFrame for each sequence in pOld */
-  maxMatch = myalloc (pOld->M, Array) ;
-  for (j = 0 ; j < pOld->M ; ++j) maxMatch[j] = arrayCreate (1024, MatchSegment) ;
+  matchLog = matchLogCreate (pOld->M) ;
   if (pOld == pFrame)		/* self-imputing - no sparse option yet */
     matchMaximalWithin (pFrame, reportMatch) ;
   else
@@ -1146,142 +1459,372 @@ static PBWT *referenceImpute3 (PBWT *pOld, PBWT *pRef, PBWT *pFrame,
       matchSequencesSweep (pFrame, pOld, reportMatch) ;
 
 
-  for (j = 0 ; j < pOld->M ; ++j)	/* add terminating element to arrays */
-    { if (nSparse > 1) /* can't guarantee order of sparse segments */
-#ifdef MERGESORT	
-	if (mergesort (arrp(maxMatch[j], 0, MatchSegment), arrayMax(maxMatch[j]), 
-		       sizeof(MatchSegment), matchSegmentCompare))
-	  die ("error %d in mergesort", errno) ;
-      /* mergesort() because they are close to being already sorted */
-#else
-        qsort (arrp(maxMatch[j], 0, MatchSegment), arrayMax(maxMatch[j]), 
-	       sizeof(MatchSegment), matchSegmentCompare) ;
-#endif
-      if (isCheck) fprintf (logFile, "%ld matches found to query %d\n", 
-			    arrayMax(maxMatch[j]), j) ;
-      /* add an end marker */
-      MatchSegment *ms = arrayp(maxMatch[j],arrayMax(maxMatch[j]),MatchSegment) ;
-      ms->jRef = ms[-1].jRef ; ms->end = pOld->N+1 ; ms->start = pOld->N ;
+  for (j = 0 ; j < pOld->M ; ++j)	/* add an end marker, which sorts last */
+    matchLogAdd (matchLog, j, 0, pOld->N, pOld->N+1) ;
+  matchLogIndex (matchLog, nSparse > 1) ; /* can't guarantee order of sparse segments */
+  if (isCheck)
+    for (j = 0 ; j < pOld->M ; ++j)
+      fprintf (logFile, "%d matches found to query %d\n", matchLogCount(matchLog,j) - 1, j) ;
+
+  t->pOld = pOld ; t->frameSites = pFrame->sites ; t->nFrame = pFrame->N ; t->w = w ; t->isBuild = isBuild ;
+  t->sites = pRef->sites ;
+  t->uOld = pbwtCursorCreate (pOld, TRUE, TRUE) ;
+  t->pNew = pbwtCreate (pOld->M, isBuild ? pRef->N : 0) ; /* this will hold the imputed sequence */
+  t->pNew->isRefFreq = TRUE ;
+  t->uNew = pbwtCursorCreate (t->pNew, TRUE, TRUE) ;
+  t->yDosage = myalloc (pOld->M, double) ;
+
+  if (isBuild)
+    { t->pNew->dosageBits = dosageBits ;
+      t->pNew->zDosage = arrayReCreate (t->pNew->zDosage, pRef->N*16, uchar) ; /* packed dosage data */
+      t->pNew->dosageOffset = arrayReCreate (t->pNew->dosageOffset, pRef->N, long) ; /* offsets per site into zDosage */
     }
 
-  PbwtCursor *uOld = pbwtCursorCreate (pOld, TRUE, TRUE) ;
+  ImputeSite *is = &t->is ;
+  is->pRef = pRef ; is->isSelf = (pOld == pFrame) ; is->fSparse = fSparse ;
+  is->M = pOld->M ; is->matchLog = matchLog ; matchLog = 0 ; /* the target owns it now */
+  is->firstSeg = mycalloc (pOld->M, int) ; /* position in matchLog to start looking at */
+  is->missing = (pOld == pFrame) ? mycalloc (pOld->M, uchar) : 0 ;
+  is->x = myalloc (pOld->M, uchar) ;	    /* uNew->y values in original sort order */
+  is->xDosage = myalloc (pOld->M, double) ;
+  is->isAdvance = FALSE ;
+  t->nChunks = (pOld->M + IMPUTE_CHUNK - 1) / IMPUTE_CHUNK ;
+  is->psum = myalloc (t->nChunks, double) ; is->xsum = myalloc (t->nChunks, double) ;
+  is->pxsum = myalloc (t->nChunks, double) ;
+  is->n = myalloc (t->nChunks, int) ; is->nConflicts = myalloc (t->nChunks, int) ;
+  t->isIncremental = isIncrementalOrder (is->matchLog) ;
+  if (t->isIncremental)
+    { is->MRef = pRef->M ;
+      is->nextSeg = mycalloc (pOld->M, int) ; is->segBase = myalloc (pOld->M, int) ;
+      is->all = mycalloc (pOld->M, MatchPoly) ; is->one = mycalloc (pOld->M, MatchPoly) ;
+      is->head = myalloc (t->nChunks, int*) ; is->link = myalloc (t->nChunks, SegLink*) ;
+      for (c = 0 ; c < t->nChunks ; ++c)
+	{ int nSeg = 0 ;
+	  for (j = c*IMPUTE_CHUNK ; j < pOld->M && j < (c+1)*IMPUTE_CHUNK ; ++j)
+	    { is->segBase[j] = nSeg ; nSeg += matchLogCount(is->matchLog,j) ; }
+	  is->link[c] = myalloc (nSeg, SegLink) ;
+	  is->head[c] = myalloc (pRef->M, int) ;
+	  for (i = 0 ; i < pRef->M ; ++i) is->head[c][i] = -1 ;
+	}
+    }
+  else
+    fprintf (logFile, "scanning match segments at each site ") ;
+
+  return t ;
+}
+
+static void imputeTargetSite (ImputeTarget *t, PbwtCursor *uRef, int kRef)
+/* impute reference site kRef, after imputeSweep() has set up is.aRefInv or is.allele for it */
+{
+  ImputeSite *is = &t->is ;
+  PBWT *pOld = t->pOld, *pRef = is->pRef ;
+  int j, c ;
+
+  if (t->kOld < t->nFrame 
+      && arrp(pRef->sites,kRef,Site)->x == arrp(t->frameSites,t->kOld,Site)->x
+      && arrp(pRef->sites,kRef,Site)->varD == arrp(t->frameSites,t->kOld,Site)->varD)
+    { pbwtCursorForwardsRead (t->uOld) ; ++t->kOld ;
+      is->isAdvance = TRUE ;
+    }
+  double psum = 0, xsum = 0, pxsum = 0 ; int n = 0 ;
+  if (is->isSelf)		/* find which samples are missing at this site */
+    { if (!arr(pRef->missingOffset, kRef, long)) bzero (is->missing, pRef->M) ;
+      else unpack3 (arrp(pRef->zMissing,arr(pRef->missingOffset,kRef,long), uchar), 
+		    pRef->M, is->missing, 0) ;
+    }
+  is->kOld = t->kOld ; is->kRef = kRef ; is->yRef = uRef->y ;
+  pbwtParallelFor (t->nChunks, t->isIncremental ? imputeSiteChunkIncremental : imputeSiteChunk, is) ;
+  is->isAdvance = FALSE ;
+  for (c = 0 ; c < t->nChunks ; ++c)
+    { psum += is->psum[c] ; xsum += is->xsum[c] ; pxsum += is->pxsum[c] ;
+      n += is->n[c] ; t->nConflicts += is->nConflicts[c] ;
+    }
+	  
+  if (t->isBuild)
+    { PbwtCursor *uNew = t->uNew ;
+      for (j = 0 ; j < pOld->M ; ++j) uNew->y[j] = is->x[uNew->a[j]] ; /* transfer to uNew */
+      /* need to sort the dosages into uNew cursor order as well */
+      for (j = 0 ; j < pOld->M ; ++j) t->yDosage[j] = is->xDosage[uNew->a[j]] ;
+      pbwtCursorWriteForwards (uNew) ; /* must come after calculating yDosage[] */
+      pbwtDosageStore (t->pNew, t->yDosage, kRef) ;
+    }
+      
+  Site *s = arrp(t->sites,kRef,Site) ;
+  s->refFreq = arrp(pRef->sites,kRef,Site)->refFreq ;
+  if (n) 
+    { psum /= n ; xsum /= n ; pxsum /= n ;
+      double varianceProduct = psum*(1.0-psum)*xsum*(1.0-xsum) ;
+      if (varianceProduct)
+	s->imputeInfo = (pxsum - psum*psum) / sqrt (varianceProduct) ;
+      else
+	s->imputeInfo = 1.0 ;
+    }
+  if (t->w) pbwtVcfWriterAdd (t->w, s, is->x, 0, is->xDosage) ;
+}
+
+static PBWT *imputeTargetFinish (ImputeTarget *t)
+{
+  ImputeSite *is = &t->is ;
+  PBWT *pNew = t->pNew ;
+  int c ;
+
+  pbwtCursorToAFend (t->uNew, pNew) ;
+
+  if (t->nConflicts) fprintf (logFile, "%d times where no overlapping matches because query does not match any reference - set imputed value to 0\n", t->nConflicts) ;
+
+  pbwtCursorDestroy (t->uOld) ; pbwtCursorDestroy (t->uNew) ;
+  free (is->firstSeg) ; free (is->x) ;
+  matchLogDestroy (is->matchLog) ;
+  free (is->xDosage) ; free (t->yDosage) ; if (is->missing) free (is->missing) ;
+  free (is->psum) ; free (is->xsum) ; free (is->pxsum) ; free (is->n) ; free (is->nConflicts) ;
+  if (t->isIncremental)
+    { for (c = 0 ; c < t->nChunks ; ++c) { free (is->head[c]) ; free (is->link[c]) ; }
+      free (is->head) ; free (is->link) ;
+      free (is->nextSeg) ; free (is->segBase) ; free (is->all) ; free (is->one) ;
+    }
+  free (t) ;
+  return pNew ;
+}
+
+static void imputeSweep (ImputeTarget **t, int nTargets, PBWT *pRef)
+/* one forwards sweep of pRef, imputing each site into all the targets */
+{
+  int i, it, kRef ;
+  BOOL isInv = FALSE, isFlip = FALSE ;
+  for (it = 0 ; it < nTargets ; ++it)
+    if (t[it]->isIncremental) isFlip = TRUE ; else isInv = TRUE ;
+
   PbwtCursor *uRef = pbwtCursorCreate (pRef, TRUE, TRUE) ;
-  PBWT *pNew = pbwtCreate (pOld->M, pRef->N) ;	/* this will hold the imputed sequence */
-  pNew->isRefFreq = TRUE ;
-  PbwtCursor *uNew = pbwtCursorCreate (pNew, TRUE, TRUE) ;
-  uchar *x = myalloc (pOld->M, uchar) ;     /* uNew->y values in original sort order */
-  double *p = myalloc (pOld->M, double) ;   /* estimated prob of uNew->y in original sort order */
-  int *aRefInv = myalloc (pRef->M, int) ;   /* holds the inverse mapping from uRef->a[i] -> i */
-  int *firstSeg = mycalloc (pOld->M, int) ; /* position in maxMatch to start looking at */
-  int nConflicts = 0 ;
-  uchar *missing = (pOld == pFrame) ? mycalloc (pOld->M, uchar) : 0 ;
-  double *xDosage = myalloc (pOld->M, double), *yDosage = myalloc (pOld->M, double) ;
-
-  pNew->zDosage = arrayReCreate (pNew->zDosage, pRef->N*16, uchar) ; /* packed dosage data */
-  pNew->dosageOffset = arrayReCreate (pNew->dosageOffset, pRef->N, long) ; /* offsets per site into zDosage */
-
-  int kOld = 0, kRef = 0 ;	/* kOld is site in target and frame, kRef is site in the reference panel */
-  while (kRef < pRef->N)
-    { if (arrp(pRef->sites,kRef,Site)->x == arrp(pFrame->sites,kOld,Site)->x
-	  && arrp(pRef->sites,kRef,Site)->varD == arrp(pFrame->sites,kOld,Site)->varD)
-	{ pbwtCursorForwardsRead (uOld) ; ++kOld ;
-	  for (j = 0 ; j < pOld->M ; ++j)
-	    while (kOld >= (arrp(maxMatch[j],firstSeg[j],MatchSegment)->end & SPARSE_MASK)) ++firstSeg[j] ;
+  int *aRefInv = isInv ? myalloc (pRef->M, int) : 0 ; /* holds the inverse mapping from uRef->a[i] -> i */
+  uchar *allele = isFlip ? mycalloc (pRef->M, uchar) : 0 ;
+  int *flip = isFlip ? myalloc (pRef->M, int) : 0, nFlip = 0 ;
+  for (it = 0 ; it < nTargets ; ++it)
+    { t[it]->is.aRefInv = aRefInv ; t[it]->is.allele = allele ; t[it]->is.flip = flip ; }
+
+  for (kRef = 0 ; kRef < pRef->N ; ++kRef)
+    { if (isFlip)
+	{ for (i = 0, nFlip = 0 ; i < pRef->M ; ++i)
+	    if (allele[uRef->a[i]] != uRef->y[i])
+	      { allele[uRef->a[i]] = uRef->y[i] ; flip[nFlip++] = uRef->a[i] ; }
 	}
-      for (i = 0 ; i < pRef->M ; ++i) aRefInv[uRef->a[i]] = i ;
-      double psum = 0, xsum = 0, pxsum = 0 ; int n = 0 ;
+      if (isInv)
+	for (i = 0 ; i < pRef->M ; ++i) aRefInv[uRef->a[i]] = i ;
       arrp(pRef->sites,kRef,Site)->refFreq = (uRef->M - uRef->c) / (double) pRef->M ;
-      if (pOld == pFrame)	/* find which samples are missing at this site */
-	{ if (!arr(pRef->missingOffset, kRef, long)) bzero (missing, pRef->M) ;
-	  else unpack3 (arrp(pRef->zMissing,arr(pRef->missingOffset,kRef,long), uchar), 
-			pRef->M, missing, 0) ;
+      for (it = 0 ; it < nTargets ; ++it)
+	{ t[it]->is.nFlip = nFlip ;
+	  t[it]->is.isRescan = (nFlip * IMPUTE_RESCAN > pRef->M) ;
+	  imputeTargetSite (t[it], uRef, kRef) ;
 	}
-      for (j = 0 ; j < pOld->M ; ++j)	     /* j here is in original order */
-	{ if (pOld == pFrame && !missing[j]) /* don't impute - copy from ref */
-	    { x[j] = uRef->y[aRefInv[j]] ;
-	      continue ;
-	    }
-	  /* impute from overlapping matches */
-	  double bit = 0, sum = 0, score = 0 ;
-	  MatchSegment *m = arrp(maxMatch[j],firstSeg[j],MatchSegment) ;
-	  MatchSegment *mStop = arrp(maxMatch[j],arrayMax(maxMatch[j]),MatchSegment) ;
-	  while (m->start < kOld && m < mStop)
-	    { bit = (kOld - m->start) * ((m->end & SPARSE_MASK) - kOld) ;
-	      if (m->end & SPARSE_BIT) bit *= fSparse ;
-	      if (bit > 0)
-		{ sum += bit ;
-		  if (uRef->y[aRefInv[m->jRef]]) score += bit ;
+      pbwtCursorForwardsRead (uRef) ;
+    }
+
+  pbwtCursorDestroy (uRef) ;
+  if (aRefInv) free (aRefInv) ;
+  if (allele) { free (allele) ; free (flip) ; }
+}
+
+static PBWT *referenceImpute3 (PBWT *pOld, PBWT *pRef, PBWT *pFrame, 
+			       int nSparse, double fSparse, VcfWriter *w, BOOL isBuild)
+/* see imputeTargetCreate() for the requirements */
+{
+  ImputeTarget *t = imputeTargetCreate (pOld, pRef, pFrame, nSparse, fSparse, w, isBuild) ;
+  imputeSweep (&t, 1, pRef) ;
+  return imputeTargetFinish (t) ;
+}
+
+/************* windowed imputation for -imputeChunk *****************/
+
+/* The frame sites are split into cores of imputeChunkSites, and each core is imputed
+   in a window extended by imputeOverlapSites frame sites either side, so that matches
+   crossing the core boundaries are still seen.  Each core takes the reference sites from
+   its first frame site up to the first frame site of the next core, so sites between
+   two frame sites go with the core of the earlier one.  Windows are cut from the reference, frame
+   and target in one forward sweep per round of nThreads windows, imputed in parallel
+   by referenceImpute3(), and the cores stitched together in order.  Only one round of
+   windows and their matches are held at once.
+   The stitcher gets each window's dosages back from its stored codec, so they are
+   quantized, unlike the full precision ones written to VCF without windows.  So when
+   writing VCF the windows use the 16 bit codec, within 1e-5 of full precision.
+*/
+
+int imputeChunkSites = 0 ;	/* if non-zero referenceImpute works in windows of this many target sites */
+int imputeOverlapSites = 0 ;	/* extra target sites either side of each window */
+
+static void splitWindows (PBWT *p, int nWin, int *start, int *end, PBWT **pw)
+/* pw[w] gets sites [start[w],end[w]) of p; windows ordered by start and by end */
+{
+  PbwtCursor *u = pbwtCursorSeek (p, start[0]) ; /* from a checkpoint if p is a prepared panel */
+  PbwtCursor **uw = myalloc (nWin, PbwtCursor*) ;
+  uchar *x = myalloc (p->M, uchar) ;
+  int j, k, w, wFirst = 0 ;
+
+  for (w = 0 ; w < nWin ; ++w)
+    { pw[w] = pbwtCreate (p->M, 0) ;
+      pw[w]->sites = arrayCreate (end[w] - start[w], Site) ;
+      uw[w] = pbwtCursorCreate (pw[w], TRUE, TRUE) ;
+    }
+  for (k = start[0] ; k < end[nWin-1] ; ++k)
+    { while (end[wFirst] <= k) ++wFirst ;
+      for (j = 0 ; j < p->M ; ++j) x[u->a[j]] = u->y[j] ;
+      for (w = wFirst ; w < nWin && start[w] <= k ; ++w)
+	{ for (j = 0 ; j < p->M ; ++j) uw[w]->y[j] = x[uw[w]->a[j]] ;
+	  pbwtCursorWriteForwards (uw[w]) ;
+	  array(pw[w]->sites, pw[w]->N++, Site) = arr(p->sites, k, Site) ;
+	}
+      pbwtCursorForwardsRead (u) ;
+    }
+  for (w = 0 ; w < nWin ; ++w)
+    { pbwtCursorToAFend (uw[w], pw[w]) ; pbwtCursorDestroy (uw[w]) ; }
+  free (uw) ; free (x) ; pbwtCursorDestroy (u) ;
+}
+
+typedef struct {
+  PBWT **pOld, **pRef, **pFrame, **pNew ;
+  int nSparse ;
+  double fSparse ;
+  int dosageBits ;		/* codec for the windows' dosages */
+} ImputeWindows ;
+
+static void imputeWindow (void *arg, int w, int thread)
+{
+  ImputeWindows *iw = (ImputeWindows*) arg ;
+  ImputeTarget *t = imputeTargetCreate (iw->pOld[w], iw->pRef[w], iw->pFrame[w], iw->nSparse, iw->fSparse, 0, TRUE) ;
+  t->pNew->dosageBits = iw->dosageBits ;
+  imputeSweep (&t, 1, iw->pRef[w]) ;
+  iw->pNew[w] = imputeTargetFinish (t) ;
+  pbwtDestroy (iw->pOld[w]) ; pbwtDestroy (iw->pFrame[w]) ; /* pRef[w] has the new site stats */
+}
+
+static PBWT *referenceImputeChunked (PBWT *pOld, PBWT *pRef, PBWT *pFrame, int nSparse, double fSparse,
+				     VcfWriter *vw, BOOL isBuild)
+/* same arguments and result as referenceImpute3() with pOld != pFrame */
+{
+  int nF = pFrame->N, nCore = imputeChunkSites, nOver = imputeOverlapSites ;
+  int nWin = (nF + nCore - 1) / nCore ;
+  int i, j, k, w ;
+
+  if (pOld->N != nF) die ("referenceImputeChunked needs target and frame to have the same sites") ;
+
+  /* refIndex[f] is the reference site of frame site f, refIndex[nF] = pRef->N */
+  int *refIndex = myalloc (nF+1, int) ;
+  for (k = 0, i = 0 ; k < pRef->N && i < nF ; ++k)
+    if (arrp(pRef->sites,k,Site)->x == arrp(pFrame->sites,i,Site)->x
+	&& arrp(pRef->sites,k,Site)->varD == arrp(pFrame->sites,i,Site)->varD)
+      refIndex[i++] = k ;
+  if (i < nF) die ("frame sites not all found in reference in referenceImputeChunked") ;
+  refIndex[nF] = pRef->N ;
+
+  fprintf (logFile, "Reference impute in %d windows of %d target sites with overlap %d\n", nWin, nCore, nOver) ;
+
+  int nRound = nThreads > 1 ? nThreads : 1 ;
+  int *fStart = myalloc (nRound, int), *fEnd = myalloc (nRound, int) ;
+  int *rStart = myalloc (nRound, int), *rEnd = myalloc (nRound, int) ;
+  ImputeWindows iw ;
+  iw.pOld = myalloc (nRound, PBWT*) ; iw.pFrame = myalloc (nRound, PBWT*) ;
+  iw.pRef = myalloc (nRound, PBWT*) ; iw.pNew = myalloc (nRound, PBWT*) ;
+  iw.nSparse = nSparse ; iw.fSparse = fSparse ;
+  iw.dosageBits = vw ? 16 : dosageBits ; /* pNew below stores with dosageBits */
+
+  PBWT *pNew = pbwtCreate (pOld->M, 0) ;
+  pNew->isRefFreq = TRUE ;
+  if (isBuild)
+    { pNew->dosageBits = dosageBits ;
+      pNew->zDosage = arrayCreate (pRef->N*16, uchar) ;
+      pNew->dosageOffset = arrayCreate (pRef->N, long) ;
+    }
+  PbwtCursor *uNew = pbwtCursorCreate (pNew, TRUE, TRUE) ;
+  uchar *x = myalloc (pOld->M, uchar) ;
+  double *d = 0, *xDosage = myalloc (pOld->M, double), *yDosage = myalloc (pOld->M, double) ;
+
+  int w0 ;
+  for (w0 = 0 ; w0 < nWin ; w0 += nRound)
+    { int n = (nWin - w0 < nRound) ? nWin - w0 : nRound ;
+      for (i = 0 ; i < n ; ++i)
+	{ int f0 = (w0+i) * nCore, f1 = f0 + nCore ; if (f1 > nF) f1 = nF ;
+	  fStart[i] = f0 > nOver ? f0 - nOver : 0 ;
+	  fEnd[i] = f1 + nOver < nF ? f1 + nOver : nF ;
+	  rStart[i] = fStart[i] ? refIndex[fStart[i]] : 0 ;
+	  rEnd[i] = refIndex[fEnd[i]] ;
+	}
+      splitWindows (pOld, n, fStart, fEnd, iw.pOld) ;
+      splitWindows (pFrame, n, fStart, fEnd, iw.pFrame) ;
+      splitWindows (pRef, n, rStart, rEnd, iw.pRef) ;
+      pbwtParallelFor (n, imputeWindow, &iw) ;
+
+      for (i = 0 ; i < n ; ++i)	/* stitch in the cores */
+	{ w = w0 + i ;
+	  int f0 = w * nCore, f1 = f0 + nCore ; if (f1 > nF) f1 = nF ;
+	  int kStart = w ? refIndex[f0] : 0, kEnd = refIndex[f1] ;
+	  PBWT *pw = iw.pNew[i] ;
+	  PbwtCursor *uw = pbwtCursorCreate (pw, TRUE, TRUE) ;
+	  for (k = rStart[i] ; k < kStart ; ++k) pbwtCursorForwardsRead (uw) ;
+	  for ( ; k < kEnd ; ++k)
+	    { d = pbwtDosageRetrieve (pw, uw, d, k - rStart[i]) ;
+	      for (j = 0 ; j < pw->M ; ++j) { x[uw->a[j]] = uw->y[j] ; xDosage[uw->a[j]] = d[j] ; }
+	      if (isBuild)
+		{ for (j = 0 ; j < pNew->M ; ++j)
+		    { uNew->y[j] = x[uNew->a[j]] ; yDosage[j] = xDosage[uNew->a[j]] ; }
+		  pbwtCursorWriteForwards (uNew) ; /* must come after calculating yDosage[] */
+		  pbwtDosageStore (pNew, yDosage, k) ;
+		  ++pNew->N ;
 		}
-	      ++m ;
+	      Site *s = arrp(iw.pRef[i]->sites, k - rStart[i], Site) ;
+	      arrp(pRef->sites,k,Site)->refFreq = s->refFreq ;
+	      arrp(pRef->sites,k,Site)->imputeInfo = s->imputeInfo ;
+	      if (vw) pbwtVcfWriterAdd (vw, arrp(pRef->sites,k,Site), x, 0, xDosage) ;
+	      pbwtCursorForwardsRead (uw) ;
 	    }
-	  if (sum == 0) 
-	    { x[j] = arrp(pRef->sites,kRef,Site)->refFreq > 0.5 ? 1 : 0 ;
-	      xDosage[j] = arrp(pRef->sites,kRef,Site)->refFreq ;
-	      if (isStats) pImp[kRef][j] = xDosage[j] ;
-	      ++nConflicts ;
-	    }
-	  else 
-	    { double p = score/sum ;
-	      x[j] = (p > 0.5) ? 1 : 0 ;
-	      xDosage[j] = p ;
-	      psum += p ;
-	      xsum += x[j] ;
-	      pxsum += p*x[j] ;
-	      if (isStats) pImp[kRef][j] = p ;
-	      ++n ;
-	    }
-	}
-	  
-      for (j = 0 ; j < pOld->M ; ++j) uNew->y[j] = x[uNew->a[j]] ; /* transfer to uNew */
-      /* need to sort the dosages into uNew cursor order as well */
-      for (j = 0 ; j < pOld->M ; ++j) yDosage[j] = xDosage[uNew->a[j]] ;
-      pbwtCursorWriteForwards (uNew) ; /* must come after calculating yDosage[] */
-      pbwtDosageStore (pNew, yDosage, kRef) ;
-      
-      if (n) 
-	{ psum /= n ; xsum /= n ; pxsum /= n ;
-	  double varianceProduct = psum*(1.0-psum)*xsum*(1.0-xsum) ;
-	  if (varianceProduct)
-	    arrp(pRef->sites,kRef,Site)->imputeInfo = 
-	      (pxsum - psum*psum) / sqrt (varianceProduct) ;
-	  else
-	    arrp(pRef->sites,kRef,Site)->imputeInfo = 1.0 ;
+	  pbwtCursorDestroy (uw) ;
+	  pbwtDestroy (pw) ; pbwtDestroy (iw.pRef[i]) ;
 	}
-      pbwtCursorForwardsRead (uRef) ; ++kRef ;
     }
   pbwtCursorToAFend (uNew, pNew) ;
+  if (isBuild && pNew->N != pRef->N) die ("stitched %d sites not %d in referenceImputeChunked", pNew->N, pRef->N) ;
 
-  if (nConflicts) fprintf (logFile, "%d times where no overlapping matches because query does not match any reference - set imputed value to 0\n", nConflicts) ;
-
-  pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uRef) ; pbwtCursorDestroy (uNew) ;
-  free (aRefInv) ; free (firstSeg) ;
-  for (j = 0 ; j < pOld->M ; ++j) free (maxMatch[j]) ; free (maxMatch) ;
-  free (xDosage) ; free (yDosage) ; if (missing) free (missing) ;
+  pbwtCursorDestroy (uNew) ;
+  free (x) ; free (d) ; free (xDosage) ; free (yDosage) ; free (refIndex) ;
+  free (fStart) ; free (fEnd) ; free (rStart) ; free (rEnd) ;
+  free (iw.pOld) ; free (iw.pFrame) ; free (iw.pRef) ; free (iw.pNew) ;
   return pNew ;
 }
 
 /*********************************************************************/
 
-  PBWT *referenceImpute (PBWT *pOld, char *fileNameRoot, int nSparse, double fSparse)
+PBWT *referenceImpute (PBWT *pOld, char *fileNameRoot, int nSparse, double fSparse)
+{
+  return referenceImputeVcf (pOld, fileNameRoot, nSparse, fSparse, 0, 0, 0, TRUE) ;
+}
+
+PBWT *referenceImputeVcf (PBWT *pOld, char *fileNameRoot, int nSparse, double fSparse,
+			  char *vcfFile, char *referenceFasta, char *mode, BOOL isBuild)
+/* If vcfFile is given the imputed sites are written to it as they are made.  Then
+   if !isBuild the imputed pbwt is never assembled, so memory does not grow with the
+   number of sites, and pOld is returned unchanged.
+*/
 {
   /* Preliminaries */
   fprintf (logFile, "impute against reference %s\n", fileNameRoot) ;
-  if (!pOld || !pOld->yz || !pOld->sites) 
+  if (!pOld || !(pOld->yz || pOld->yzBlocks) || !pOld->sites) 
     die ("referenceImpute called without existing pbwt with sites") ;
-  PBWT *pRef = pbwtReadAll (fileNameRoot) ;
+  PBWT *pRef = pbwtReadPanel (fileNameRoot) ; /* mapped, if it was prepared with -prepareReference */
+  if (!pRef) pRef = pbwtReadAll (fileNameRoot) ;
   if (!pRef->sites) die ("new pbwt %s in referencePhase has no sites", fileNameRoot) ;
   if (strcmp(pOld->chrom,pRef->chrom))
     die ("mismatching chrom in referenceImpute: old %s, new %s", pRef->chrom, pOld->chrom) ;
 
   /* identify the intersecting sites */
-  PBWT *pFrame = pbwtSelectSites (pRef, pOld->sites, TRUE) ; /* keep the full ref to impute to */
+  BOOL isChunked = imputeChunkSites && !isStats && !isCheck ; /* stats and checks need the whole panel */
+  PBWT *pFrame = pRef->panel ? pbwtPanelFrame (pRef, fileNameRoot, pOld->sites, !isChunked)
+                             : pbwtSelectSites (pRef, pOld->sites, TRUE) ; /* keep the full ref to impute to */
   if (pFrame->N == pRef->N)
     { fprintf (logFile, "No additional sites to impute in referenceImpute\n") ;
       pbwtDestroy (pFrame) ; pbwtDestroy (pRef) ;
+      if (vcfFile) pbwtWriteVcf (pOld, vcfFile, referenceFasta, mode) ;
       return pOld ;
     }
-  pbwtBuildReverse (pFrame) ;	/* we need the reverse reference pbwt below */
-  pOld = pbwtSelectSitesFillMissing (pOld, pRef->sites, FALSE) ;
+  if (!isChunked && !pFrame->zz) pbwtBuildReverse (pFrame) ; /* we need the reverse reference pbwt below */
+  PBWT *pTarget = pOld ;
+  pOld = pbwtSelectSitesFillMissing (pOld, pRef->sites, !isBuild) ;
   if (!pOld->N) die ("no overlapping sites in referenceImpute") ;
   if (!pOld->aFend) die ("pOld has no aFend in referenceImpute - your pbwt was made by a previous version of the code; buildReverse and resave the forwards pbwt") ;
 
@@ -1292,7 +1835,10 @@ static PBWT *referenceImpute3 (PBWT *pOld, PBWT *pRef, PBWT *pFrame,
       int k ; for (k = 0 ; k < pRef->N ; ++k) pImp[k] = myalloc (pOld->M, double) ;
     }
 
-  PBWT *pNew = referenceImpute3 (pOld, pRef, pFrame, nSparse, fSparse) ;
+  VcfWriter *w = vcfFile ? pbwtVcfWriterOpen (pOld, vcfFile, referenceFasta, mode, TRUE, TRUE) : 0 ;
+  PBWT *pNew = isChunked ? referenceImputeChunked (pOld, pRef, pFrame, nSparse, fSparse, w, isBuild)
+                         : referenceImpute3 (pOld, pRef, pFrame, nSparse, fSparse, w, isBuild) ;
+  if (w) pbwtVcfWriterClose (w) ;
   pNew->sites = pRef->sites ; pRef->sites = 0 ; 
   pNew->chrom = pRef->chrom ; pRef->chrom = 0 ;
   pNew->samples = pOld->samples ; pOld->samples = 0 ;
@@ -1315,11 +1861,98 @@ static PBWT *referenceImpute3 (PBWT *pOld, PBWT *pRef, PBWT *pFrame,
     }
 
   pbwtDestroy (pOld) ; pbwtDestroy (pFrame) ; pbwtDestroy (pRef) ;
+  if (!isBuild) { pbwtDestroy (pNew) ; return pTarget ; }
   return pNew ;
 }
 
 /*********************************************************************/
 
+/* Batch imputation: each line of the list file names a target, either a VCF/BCF file
+   or the root of a saved pbwt, and an output, either a VCF/BCF file written as sites
+   are imputed or a root for the imputed pbwt.  The reference is read once, and all the
+   targets are set up with their matches first, then imputed in one sweep of the
+   reference, so all their matches are held in memory together.  Each frame is
+   dropped, but for its sites, as soon as its matches are found.
+*/
+
+static BOOL isVcfName (char *name)
+{
+  int n = strlen (name) ;
+  return (n > 4 && (!strcmp (name+n-4, ".vcf") || !strcmp (name+n-4, ".bcf"))) ||
+    (n > 7 && !strcmp (name+n-7, ".vcf.gz")) ;
+}
+
+void referenceImputeBatch (char *fileNameRoot, FILE *fp, int nSparse, double fSparse, char *referenceFasta)
+{
+  if (isStats) die ("-referenceImputeBatch does not collect imputation stats") ;
+  fprintf (logFile, "batch impute against reference %s\n", fileNameRoot) ;
+  PBWT *pRef = pbwtReadPanel (fileNameRoot) ;
+  if (!pRef) pRef = pbwtReadAll (fileNameRoot) ;
+  if (!pRef->sites) die ("reference pbwt %s in referenceImputeBatch has no sites", fileNameRoot) ;
+  if (imputeChunkSites) fprintf (logFile, "-imputeChunk is ignored for batches, which share one sweep\n") ;
+
+  Array targets = arrayCreate (64, ImputeTarget*) ;
+  Array outputs = arrayCreate (64, char*) ;
+  Array frameSites = arrayCreate (64, Array) ;
+  char target[1024], output[1024] ;
+  int i, n ;
+  while (fscanf (fp, "%1023s %1023s", target, output) == 2)
+    { fprintf (logFile, "target %s to %s\n", target, output) ;
+      PBWT *pOld = isVcfName (target) ? pbwtReadVcfGT (target) : pbwtReadAll (target) ;
+      if (!pOld->sites) die ("target %s in referenceImputeBatch has no sites", target) ;
+      if (!pOld->chrom || !pRef->chrom || strcmp (pOld->chrom, pRef->chrom))
+	die ("mismatching chrom in referenceImputeBatch: target %s, reference %s", pOld->chrom, pRef->chrom) ;
+      PBWT *pFrame = pRef->panel ? pbwtPanelFrame (pRef, fileNameRoot, pOld->sites, TRUE)
+	                         : pbwtSelectSites (pRef, pOld->sites, TRUE) ;
+      if (!pFrame->zz) pbwtBuildReverse (pFrame) ;
+      pOld = pbwtSelectSitesFillMissing (pOld, pRef->sites, FALSE) ;
+      if (!pOld->N) die ("no overlapping sites for target %s in referenceImputeBatch", target) ;
+      if (!pOld->aFend) die ("target %s has no aFend - buildReverse and resave it", target) ;
+      BOOL isVcf = isVcfName (output) ;
+      VcfWriter *w = 0 ;
+      if (isVcf)
+	{ int len = strlen (output) ;
+	  w = pbwtVcfWriterOpen (pOld, output, referenceFasta, 
+				 !strcmp (output+len-4, ".bcf") ? "wb" : !strcmp (output+len-3, ".gz") ? "wz" : "w",
+				 TRUE, TRUE) ;
+	}
+      ImputeTarget *t = imputeTargetCreate (pOld, pRef, pFrame, nSparse, fSparse, w, !isVcf) ;
+      t->sites = arrayCopy (pRef->sites) ; /* each target has its own imputeInfo */
+      array(targets, arrayMax(targets), ImputeTarget*) = t ;
+      array(outputs, arrayMax(outputs), char*) = strdup (output) ;
+      array(frameSites, arrayMax(frameSites), Array) = pFrame->sites ; /* keep only these */
+      pFrame->sites = 0 ; pbwtDestroy (pFrame) ;
+      fprintf (logFile, "\n") ;
+    }
+  if (!(n = arrayMax(targets))) die ("no targets in referenceImputeBatch list") ;
+  fprintf (logFile, "Imputation preliminaries for %d targets: ", n) ; timeUpdate(logFile) ;
+
+  imputeSweep (arrp(targets, 0, ImputeTarget*), n, pRef) ;
+
+  for (i = 0 ; i < n ; ++i)
+    { ImputeTarget *t = arr(targets, i, ImputeTarget*) ;
+      PBWT *pOld = t->pOld ;
+      Array sites = t->sites ;
+      VcfWriter *w = t->w ;
+      PBWT *pNew = imputeTargetFinish (t) ;
+      if (w) pbwtVcfWriterClose (w) ;
+      else
+	{ pNew->sites = sites ; sites = 0 ;
+	  if (pRef->chrom) pNew->chrom = strdup (pRef->chrom) ;
+	  pNew->samples = pOld->samples ; pOld->samples = 0 ;
+	  pbwtWriteAll (pNew, arr(outputs, i, char*)) ;
+	}
+      if (sites) arrayDestroy (sites) ;
+      pbwtDestroy (pNew) ; pbwtDestroy (pOld) ; arrayDestroy (arr(frameSites, i, Array)) ;
+      free (arr(outputs, i, char*)) ;
+    }
+
+  arrayDestroy (targets) ; arrayDestroy (outputs) ; arrayDestroy (frameSites) ;
+  pbwtDestroy (pRef) ;
+}
+
+/*********************************************************************/
+
 PBWT *imputeMissing (PBWT *pOld)
 /* current strategy is for HRC: use framework of sites for which we have complete data */
 {
@@ -1362,7 +1995,7 @@ PBWT *imputeMissing (PBWT *pOld)
   arrayDestroy (completeSites) ;
 
   /* then impute, using a special mode of impute3() */
-  PBWT *pNew = referenceImpute3 (pFrame, pOld, pFrame, 1, 0) ;
+  PBWT *pNew = referenceImpute3 (pFrame, pOld, pFrame, 1, 0, 0, TRUE) ;
   pNew->sites = pOld->sites ; pOld->sites = 0 ;
   pNew->samples = pOld->samples ; pOld->samples = 0 ;
   pNew->chrom = pOld->chrom ; pOld->chrom = 0 ;
@@ -1375,7 +2008,7 @@ PBWT *imputeMissing (PBWT *pOld)
 void genotypeCompare (PBWT *p, char *fileNameRoot)
 {
   fprintf (logFile, "compare genotypes to reference %s\n", fileNameRoot) ;
-  if (!p || !p->yz || !p->sites) 
+  if (!p || !(p->yz || p->yzBlocks) || !p->sites) 
     die ("genotypeCompare called without existing pbwt with sites") ;
   PBWT *pRef = pbwtReadAll (fileNameRoot) ;
   if (strcmp(p->chrom,pRef->chrom)) die ("mismatch chrom %s to ref %f", p->chrom, pRef->chrom) ;
@@ -1501,7 +2134,7 @@ PBWT *pbwtCorruptSites (PBWT *pOld, double pSite, double pChange)
   PbwtCursor *uNew = pbwtCursorCreate (pNew, TRUE, TRUE) ;
   int nChange = 0 ;
 
-  if (!pOld || !pOld->yz) die ("corruptSites without an existing pbwt") ;
+  if (!pOld || !(pOld->yz || pOld->yzBlocks)) die ("corruptSites without an existing pbwt") ;
   if (pSite <= 0 || pSite > 1 || pChange <= 0 || pChange > 1)
     die ("pSite %f, pChange %f for corruptSites out of range\n", pSite, pChange) ;
 
@@ -1530,7 +2163,7 @@ PBWT *pbwtCorruptSites (PBWT *pOld, double pSite, double pChange)
   pNew->sites = pOld->sites ; pOld->sites = 0 ; 
   pNew->chrom = pOld->chrom ; pOld->chrom = 0 ;
   pNew->samples = pOld->samples ; pOld->samples = 0 ;
-  pbwtDestroy (pOld) ; pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ;
+  pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ; pbwtDestroy (pOld) ;
   free(x) ;
   return pNew ;
 }
@@ -1548,7 +2181,7 @@ PBWT *pbwtCorruptSamples (PBWT *pOld, double pSample, double pChange)
   BOOL *isCorrupt = myalloc (M, BOOL) ;
   int nChange = 0 ;
 
-  if (!pOld || !pOld->yz) die ("corruptSites without an existing pbwt") ;
+  if (!pOld || !(pOld->yz || pOld->yzBlocks)) die ("corruptSites without an existing pbwt") ;
   if (pSample <= 0 || pSample > 1 || pChange <= 0 || pChange > 1)
     die ("pSample %f, pChange %f for corruptSites out of range\n", pSample, pChange) ;
 
@@ -1578,14 +2211,14 @@ PBWT *pbwtCorruptSamples (PBWT *pOld, double pSample, double pChange)
   pNew->sites = pOld->sites ; pOld->sites = 0 ; 
   pNew->chrom = pOld->chrom ; pOld->chrom = 0 ;
   pNew->samples = pOld->samples ; pOld->samples = 0 ;
-  pbwtDestroy (pOld) ; pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ;
+  pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ; pbwtDestroy (pOld) ;
   free(x) ; free (isCorrupt) ;
   return pNew ;
 }
 
 PBWT *pbwtCopySamples (PBWT *pOld, int Mnew, double meanLength)
 {
-  if (!pOld || !pOld->yz) die ("copySample called without an existing pbwt") ;
+  if (!pOld || !(pOld->yz || pOld->yzBlocks)) die ("copySample called without an existing pbwt") ;
   PBWT *pNew = pbwtCreate (Mnew, pOld->N) ;
   if (meanLength < 1.0) die ("meanLength %f must be > 1 in pbwtCopySample", meanLength) ;
   int rSwitch = RAND_MAX/meanLength ;
@@ -1613,7 +2246,7 @@ PBWT *pbwtCopySamples (PBWT *pOld, int Mnew, double meanLength)
   pNew->sites = pOld->sites ; pOld->sites = 0 ; 
   pNew->chrom = pOld->chrom ; pOld->chrom = 0 ;
   pNew->samples = pOld->samples ; pOld->samples = 0 ;
-  pbwtDestroy (pOld) ; pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ;
+  pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ; pbwtDestroy (pOld) ;
   free(xOld) ; free (copy) ;
   return pNew ;
 }
@@ -1628,17 +2261,25 @@ PBWT *pbwtCopySamples (PBWT *pOld, int Mnew, double meanLength)
    gl[n][2] = d[2*n] * d[2*n+1]
 */
 
+/* All codecs store v = min(d, 1-d), the distance from the nearer hard call, run length
+   encoded in sort order, and give back y ? 1-v : v using the haplotype's y at the site.
+   With p->dosageBits == 0, the original codec, v is in 0.1 bins and a run is one byte.
+   With 8 or 16 bits v is quantized to 1/510 or 1/131070 and a run is the value in 1 or 2
+   bytes followed by the count as a varint.  Retrieval expands each run as a pair of
+   values selected by y, which the compiler can vectorize as a blend.  The codec is kept
+   in the .dosage file, which for the original codec is as before.
+*/
+
+int dosageBits = 0 ;		/* codec for dosages stored from now on: 0, 8 or 16 */
+
 static inline uchar dosageEncode (double d)
 { if (d > 0.5) d = 1.0 - d ;
   if (!d) return 0 ;
   else return (uchar) (10.0 * (d + 0.0999999)) ; /* value from 0..5 */
 }
 
-static inline double dosageDecode (uchar x, uchar y)
-{ static double value[16] = { 0.0, 0.05, 0.15, 0.25, 0.35, 0.45, 0.0, 0.0,
-			      1.0, 0.95, 0.85, 0.75, 0.65, 0.55, 1.0, 1.0 } ;
-  return value[x + (y<<3)] ;
-}
+static double dosageValue[16] = { 0.0, 0.05, 0.15, 0.25, 0.35, 0.45, 0.0, 0.0,
+				  1.0, 0.95, 0.85, 0.75, 0.65, 0.55, 1.0, 1.0 } ; /* [x + (y<<3)] */
 
 static inline uchar *dosageStore (uchar *z, uchar d, int count)
 { if (!d)
@@ -1656,26 +2297,68 @@ static inline uchar *dosageStore (uchar *z, uchar d, int count)
   return z ;
 }
 
+static inline double dosageScale (int bits) { return bits == 16 ? 131070.0 : 510.0 ; }
+
+static inline int dosageEncodeFine (double d, double scale, int max)
+{ if (d > 0.5) d = 1.0 - d ;
+  if (d <= 0) return 0 ;
+  int q = (int) (d * scale + 0.5) ;
+  return q > max ? max : q ;
+}
+
+static inline uchar *dosageStoreFine (uchar *z, int q, int count, int bits)
+{ *z++ = q & 0xff ;
+  if (bits == 16) *z++ = q >> 8 ;
+  while (count >= 0x80) { *z++ = (count & 0x7f) | 0x80 ; count >>= 7 ; }
+  *z++ = count ;
+  return z ;
+}
+
 void pbwtDosageStore (PBWT *p, double *dosage, int k)
 {
   if (!p->dosageOffset) die ("dosageStore called without p->dosageOffset") ;
   long max = arrayMax(p->zDosage) ;
   array(p->dosageOffset,k,long) = max ;
-  arrayExtend (p->zDosage, max + p->M) ; /* ensures enough space */
-  uchar *z = arrp(p->zDosage, max, uchar) ;
-  int i = 0, count = 0 ;
-  uchar dLast = 0xff ;
-  while (i < p->M)
-    { uchar d = dosageEncode (dosage[i]) ;
-      if (d != dLast)
-	{ if (dLast != 0xff) z = dosageStore (z, dLast, count) ;
-	  dLast = d ; count = 0 ;
+  int i = 0, count = 0, bits = p->dosageBits ;
+  if (!bits)
+    { arrayExtend (p->zDosage, max + p->M) ; /* ensures enough space */
+      uchar *z = arrp(p->zDosage, max, uchar) ;
+      uchar dLast = 0xff ;
+      while (i < p->M)
+	{ uchar d = dosageEncode (dosage[i]) ;
+	  if (d != dLast)
+	    { if (dLast != 0xff) z = dosageStore (z, dLast, count) ;
+	      dLast = d ; count = 0 ;
+	    }
+	  ++count ;
+	  ++i ;
+	}
+      z = dosageStore (z, dLast, count) ;
+      arrayMax(p->zDosage) += z - arrp(p->zDosage, max, uchar) ;
+    }
+  else
+    { arrayExtend (p->zDosage, max + 3*(long)p->M + 8) ; /* at most 2 value and 1 count byte per haplotype */
+      uchar *z = arrp(p->zDosage, max, uchar) ;
+      double scale = dosageScale (bits) ;
+      int qMax = bits == 16 ? 0xffff : 0xff, qLast = -1 ;
+      while (i < p->M)
+	{ int q = dosageEncodeFine (dosage[i], scale, qMax) ;
+	  if (q != qLast)
+	    { if (qLast >= 0) z = dosageStoreFine (z, qLast, count, bits) ;
+	      qLast = q ; count = 0 ;
+	    }
+	  ++count ;
+	  ++i ;
 	}
-      ++count ;
-      ++i ;
+      if (p->M) z = dosageStoreFine (z, qLast, count, bits) ;
+      arrayMax(p->zDosage) += z - arrp(p->zDosage, max, uchar) ;
     }
-  z = dosageStore (z, dLast, count) ;
-  arrayMax(p->zDosage) += z - arrp(p->zDosage, max, uchar) ;
+}
+
+static inline void dosageExpand (double *dosage, uchar *y, int count, double v0, double v1)
+/* branch free, so vectorizable: y ? v1 : v0 for each of count haplotypes */
+{ int i ;
+  for (i = 0 ; i < count ; ++i) dosage[i] = y[i] ? v1 : v0 ;
 }
 
 double *pbwtDosageRetrieve (PBWT *p, PbwtCursor *u, double *dosage, int k)
@@ -1683,17 +2366,29 @@ double *pbwtDosageRetrieve (PBWT *p, PbwtCursor *u, double *dosage, int k)
   if (!dosage) dosage = myalloc (p->M, double) ;
   if (!p->dosageOffset) die ("dosageRetrieve called without p->dosageOffset") ;
   uchar *z = arrp(p->zDosage, arr(p->dosageOffset,k,long), uchar) ;
-  int i = 0 ;
-  while (i < p->M)
-    { uchar x = *z >> 5 ;
-      int count = *z & 0x1f ;
-      if (x == 6) count <<= 5 ; else if (x == 7) count <<= 10 ;
-      while (count--)
-	{ /* if (i >= p->M) die ("problem in dosageRetrieve") ; */ 
-	  dosage[i] = dosageDecode (x, u->y[i]) ;
-	  ++i ;
+  int i = 0, bits = p->dosageBits ;
+  if (!bits)
+    while (i < p->M)
+      { uchar x = *z >> 5 ;
+	int count = *z & 0x1f ;
+	if (x == 6) count <<= 5 ; else if (x == 7) count <<= 10 ;
+	if (i + count > p->M) count = p->M - i ; /* guard against a corrupt file */
+	dosageExpand (dosage + i, u->y + i, count, dosageValue[x], dosageValue[x+8]) ;
+	i += count ;
+	++z ;
+      }
+  else
+    { double scale = 1.0 / dosageScale (bits) ;
+      while (i < p->M)
+	{ int q = *z++ ;
+	  if (bits == 16) q |= *z++ << 8 ;
+	  int count = 0, shift = 0 ;
+	  while (*z & 0x80) { count |= (*z++ & 0x7f) << shift ; shift += 7 ; }
+	  count |= *z++ << shift ;
+	  if (!count || i + count > p->M) die ("bad dosage run at site %d", k) ;
+	  dosageExpand (dosage + i, u->y + i, count, q * scale, 1.0 - q * scale) ;
+	  i += count ;
 	}
-      ++z ;
     }
 
   return dosage ;
@@ -342,6 +342,7 @@ static double alphaSearchFreqDropOne (double alpha)
 void pbwtFitAlphaBeta (PBWT *p, int model)
 {
   double LL ;
+  pbwtLoadBlocks (p) ;		/* need p->yz below */
   switch (model)
     {
     case 1:			/* alpha and beta drop one */
@@ -170,6 +170,74 @@ static void recordCommandLine (int argc, char *argv[])
 #define LCLOSE if (strcmp(argv[2], "-")) fclose(lp)
 #define LOGOPEN(name) if (!strcmp (argv[1], "-")) logFile = stderr ; else if (!(logFile = fopen (argv[1],"w"))) die ("failed to open %s file %s", name, argv[1])
 #define LOGCLOSE if (logFile && !(logFile==stderr)) fclose(logFile)
+#define GZWRITE(x) { int len = strlen(argv[1]) ; isWriteGzip = (len > 3 && !strcmp (argv[1]+len-3, ".gz")) ; x ; isWriteGzip = FALSE ; }
+
+/* commands that can run on a PBWT from -streamVcfGT without storing it all: forward
+   sweeps, and ones that need at most the sites; others materialize the stream first */
+
+static BOOL isStreamCommand (char *command)
+{
+  static char *streamCommands[] = { "-sfs", "-writeSites", "-writeSamples", "-log", "-stats", 
+				    "-threads", "-memory", 0 } ;
+  char **cp ;
+  for (cp = streamCommands ; *cp ; ++cp) if (!strcmp (command, *cp)) return TRUE ;
+  if (!isCheck && (!strcmp (command, "-maxWithin") || !strcmp (command, "-longWithin"))) return TRUE ;
+  return FALSE ;
+}
+
+/* two or more site and sample selections in a row are run as one pass */
+
+static int transformArgs (int argc, char *argv[]) /* number of args if a chainable transform, else 0 */
+{
+  if (!argc) return 0 ;
+  if ((!strcmp (argv[0], "-subsites") || !strcmp (argv[0], "-subrange") || 
+       !strcmp (argv[0], "-subsample")) && argc > 2) return 3 ;
+  if ((!strcmp (argv[0], "-selectSites") || !strcmp (argv[0], "-removeSites")) && argc > 1) return 2 ;
+  if (!strcmp (argv[0], "-selectSamples") && argc > 2) return 2 ; /* as in main() */
+  return 0 ;
+}
+
+static int transformChain (PBWT **pp, int argc, char *argv[]) /* returns args used, 0 if not a chain */
+{
+  FILE *fp ;
+  int n, nUsed = 0, i ;
+  PBWT *p = *pp ;
+
+  if (!(n = transformArgs (argc, argv)) || !transformArgs (argc-n, argv+n)) return 0 ;
+  PbwtTransform *t = pbwtTransformCreate (p) ;
+  while (argc && (n = transformArgs (argc, argv)))
+    { if (!strcmp (argv[0], "-subsites"))
+	pbwtTransformSubSites (t, atof(argv[1]), atof(argv[2])) ;
+      else if (!strcmp (argv[0], "-subrange"))
+	pbwtTransformSubRange (t, atoi(argv[1]), atoi(argv[2])) ;
+      else if (!strcmp (argv[0], "-subsample"))
+	{ int start = atoi(argv[1]), Mnew = atoi(argv[2]) ;
+	  if (start < 0 || Mnew <= 0) die ("bad start %d, Mnew %d in subsample", start, Mnew) ;
+	  Array select = arrayCreate (Mnew, int) ;
+	  for (i = 0 ; i < Mnew ; ++i) array(select, i, int) = start + i ;
+	  pbwtTransformSubSample (t, select) ;
+	  arrayDestroy (select) ;
+	}
+      else if (!strcmp (argv[0], "-selectSamples"))
+	{ Array samples = pbwtTransformSamples (t) ;
+	  if (!samples) die ("pbwtSelectSamples called without pre-existing sample names") ;
+	  FOPEN("selectSamples","r") ; Array select = pbwtSelectSamplesIndex (samples, fp) ; FCLOSE ;
+	  if (select) { pbwtTransformSubSample (t, select) ; arrayDestroy (select) ; }
+	  arrayDestroy (samples) ;
+	}
+      else			/* -selectSites or -removeSites */
+	{ BOOL isSelect = !strcmp (argv[0], "-selectSites") ;
+	  FOPEN(argv[0]+1,"r") ; char *chr = 0 ; Array sites = pbwtReadSitesFile (fp, &chr) ; FCLOSE ;
+	  if ((isSelect || p->chrom) && strcmp (chr, p->chrom)) die ("chromosome mismatch in %s", argv[0]+1) ;
+	  if (isSelect) pbwtTransformSelectSites (t, sites) ;
+	  else pbwtTransformRemoveSites (t, sites) ;
+	  free (chr) ;
+	}
+      argc -= n ; argv += n ; nUsed += n ;
+    }
+  *pp = pbwtTransformRun (t) ;
+  return nUsed ;
+}
 
 const char *pbwtCommitHash(void)
 {
@@ -184,6 +252,7 @@ int main (int argc, char *argv[])
   FILE *lp ;
   FILE *proj;
   PBWT *p = 0 ;
+  int nChain ;
   Array test ;
   char *referenceFasta = NULL;
 
@@ -204,14 +273,19 @@ int main (int argc, char *argv[])
       fprintf (stderr, "  -log <file>               log file; '-' for stderr\n") ;
       fprintf (stderr, "  -check                    do various checks\n") ;
       fprintf (stderr, "  -stats                    print stats depending on commands; writes to stdout\n") ;
+      fprintf (stderr, "  -threads <n>              use n threads where supported, e.g. VCF/BCF writing\n") ;
+      fprintf (stderr, "  -memory <MB>              memory budget for out-of-core steps such as transposed output, default 1024\n") ;
       fprintf (stderr, "  -read <file>              read pbwt file; '-' for stdin\n") ;
-      fprintf (stderr, "  -readSites <file>         read sites file; '-' for stdin\n") ;
+      fprintf (stderr, "  -readSites <file>         read sites file, text or binary; '-' for stdin\n") ;
       fprintf (stderr, "  -readSamples <file>       read samples file; '-' for stdin\n") ;
       fprintf (stderr, "  -readMissing <file>       read missing file; '-' for stdin\n") ;
       fprintf (stderr, "  -readDosage <file>        read dosage file; '-' for stdin\n") ;
       fprintf (stderr, "  -readReverse <file>       read reverse file; '-' for stdin\n") ;
       fprintf (stderr, "  -readAll <rootname>       read .pbwt and if present .sites, .samples, .missing - note not by default dosage\n") ;
       fprintf (stderr, "  -readVcfGT <file>         read GTs from vcf or bcf file; '-' for stdin vcf only ; biallelic sites only - require diploid!\n") ;
+      fprintf (stderr, "  -streamVcfGT <file>       as -readVcfGT, but a following -sfs, -maxWithin, -longWithin or -writeSites\n") ;
+      fprintf (stderr, "                            runs while the file is read, without storing the pbwt\n") ;
+      fprintf (stderr, "  -resumeVcfGT <root> <file> continue -readVcfGT from checkpoint root e.g. check_A; file must be indexed\n") ;
       fprintf (stderr, "  -readVcfPL <file>         read PLs from vcf or bcf file; '-' for stdin vcf only ; biallelic sites only - require diploid!\n") ;
       fprintf (stderr, "  -readMacs <file>          read MaCS output file; '-' for stdin\n") ;
       fprintf (stderr, "  -readVcfq <file>          read VCFQ file; '-' for stdin\n") ;
@@ -219,11 +293,22 @@ int main (int argc, char *argv[])
       fprintf (stderr, "  -readHap <file> <chrom>   read impute2 hap file - must set chrom\n") ;
       fprintf (stderr, "  -readHapLegend <hap_file> <legend_file> <chrom>\n") ;
       fprintf (stderr, "                            read impute2 hap and legend file - must set chrom\n") ;
+      fprintf (stderr, "  -readBed <root>           read PLINK binary root.bed, .bim, .fam; for homozygous data - hets are split 0|1\n") ;
+      fprintf (stderr, "  -readBgen <file>          read phased haplotypes from BGEN 1.2 file; '-' for stdin\n") ;
+      fprintf (stderr, "  -readBgenRegion <file> <chrom:start-end>  as -readBgen for one region\n") ;
       fprintf (stderr, "  -readPhase <file>         read Li and Stephens phase file\n") ;
-      fprintf (stderr, "  -checkpoint <n>           checkpoint every n sites while reading\n") ;
+      fprintf (stderr, "  -checkpoint <n>           checkpoint every n sites while reading, alternating check_A and check_B\n") ;
+      fprintf (stderr, "  -blockCompress <kb>       subsequent pbwt writes zlib compress in blocks of ~kb KB; 0 to turn off\n") ;
+      fprintf (stderr, "  -lazy                     subsequent reads of block compressed pbwt files decompress blocks on demand\n") ;
       fprintf (stderr, "  -merge <file> ...         merge two or more pbwt files\n") ;
+      fprintf (stderr, "  -mergeWrite <root> <file> ... merge pbwt files straight to root.pbwt and root.sites, leaving the current pbwt\n") ;
+      fprintf (stderr, "  -mergeSamples <root>      add the samples of root.pbwt etc., which must have the same sites\n") ;
+      fprintf (stderr, "  -concat <root>            append root.pbwt etc., with the same samples at later sites\n") ;
+      fprintf (stderr, "  -insertSamples <root>     insert the haplotypes of root.pbwt etc. in place, without rebuilding\n") ;
+      fprintf (stderr, "  -deleteSamples <file>     delete the samples named in file in place, without rebuilding\n") ;
       fprintf (stderr, "  -write <file>             write pbwt file; '-' for stdout\n") ;
       fprintf (stderr, "  -writeSites <file>        write sites file; '-' for stdout\n") ;
+      fprintf (stderr, "  -writeSitesBinary <file>  write compact binary sites file, read back by -readSites etc.; '-' for stdout\n") ;
       fprintf (stderr, "  -writeMatches <file>      write matches file; '-' for stdout\n") ;
       fprintf (stderr, "  -writeSamples <file>      write samples file; '-' for stdout\n") ;
       fprintf (stderr, "  -writeMissing <file>      write missing file; '-' for stdout\n") ;
@@ -233,9 +318,10 @@ int main (int argc, char *argv[])
       fprintf (stderr, "  -writeImputeRef <rootname> write .imputeHaps and .imputeLegend\n") ;
       fprintf (stderr, "  -writeImputeHapsG <file>  write haplotype file for IMPUTE -known_haps_g\n") ;
       fprintf (stderr, "  -writePhase <file>        write FineSTRUCTURE/ChromoPainter input format (Impute/ShapeIT output format) phase file\n") ;
-      fprintf (stderr, "  -writeTransposeHaplotypes <file>    write transposed haplotype file (one hap per row); '-' for stdout\n") ;
-      fprintf (stderr, "  -haps <file>              write haplotype file; '-' for stdout\n") ;
+      fprintf (stderr, "  -writeTransposedHaplotypes <file>   write transposed haplotype file (one hap per row); '-' for stdout\n") ;
+      fprintf (stderr, "  -haps <file>              write haplotype file; '-' for stdout; gzipped if <file> ends .gz (also -writeGen etc.)\n") ;
       fprintf (stderr, "  -writeGen <file>          write impute2 gen file; '-' for stdout\n") ;
+      fprintf (stderr, "  -writeBgen <file>         write BGEN 1.2 phased haplotypes, with dosages if present; '-' for stdout\n") ;
       fprintf (stderr, "  -writeVcf|-writeVcfGz|-writeBcf|-writeBcfGz <file>\n") ;
       fprintf (stderr, "                            write VCF or BCF; uncompressed or bgzip (Gz) compressed file; '-' for stdout\n") ;
       fprintf (stderr, "  -referenceFasta <file>    reference fasta filename for VCF/BCF writing (optional)\n") ;
@@ -248,6 +334,8 @@ int main (int argc, char *argv[])
       fprintf (stderr, "  -selectSites <file>       select sites as in sites file\n") ;
       fprintf (stderr, "  -removeSites <file>       remove sites as in sites file\n") ;
       fprintf (stderr, "  -selectSamples <file>     select samples as in samples file\n") ;
+      fprintf (stderr, "                            consecutive -subsites, -subsample, -subrange, -selectSites, -removeSites, -selectSamples\n") ;
+      fprintf (stderr, "                            are run together in a single pass\n") ;
       fprintf (stderr, "  -longWithin <L>           find matches within set longer than L\n") ;
       fprintf (stderr, "  -maxWithin                find maximal matches within set\n") ;
       fprintf (stderr, "  -matchNaive <file>        maximal match seqs in pbwt file to reference\n") ;
@@ -258,6 +346,25 @@ int main (int argc, char *argv[])
       fprintf (stderr, "  -referencePhase <root>    phase current pbwt against reference whose root name is the argument - only keeps shared sites\n") ;
       fprintf (stderr, "  -referenceImpute <root> [nSparse=1] [fSparse=1]  impute current pbwt into reference whose root name is the first argument;\n") ;
       fprintf (stderr, "                            does not rephase either pbwt; optional nSparse > 1 also does sparse matching, fSparse is relative weight\n") ;
+      fprintf (stderr, "  -imputeVcf <root> <file> [nSparse] [fSparse]  as -referenceImpute, but write imputed sites to VCF/BCF <file>\n") ;
+      fprintf (stderr, "                            as they are made, without building the imputed pbwt: the current pbwt is unchanged;\n") ;
+      fprintf (stderr, "                            compressed BCF if <file> ends .bcf, bgzip VCF if .gz, else VCF; '-' for stdout\n") ;
+      fprintf (stderr, "  -imputeVcfKeep <root> <file> [nSparse] [fSparse]  as -imputeVcf, but also keep the imputed pbwt\n") ;
+      fprintf (stderr, "  -referenceImputeBatch <root> <list> [nSparse] [fSparse]  impute each line 'target output' of file list\n") ;
+      fprintf (stderr, "                            into reference root in one sweep; target is a VCF/BCF file or pbwt root,\n") ;
+      fprintf (stderr, "                            output a VCF/BCF file or root to write the imputed pbwt; current pbwt unchanged\n") ;
+      fprintf (stderr, "  -prepareReference <root> [nCheck=1000]  write current pbwt as a reference panel for -referenceImpute <root>\n") ;
+      fprintf (stderr, "                            to map, with a site index and a cursor checkpoint every nCheck sites;\n") ;
+      fprintf (stderr, "                            frames for the target sites seen are then cached as <root>.frame.*\n") ;
+      fprintf (stderr, "  -imputeChunk <nSites> <nOverlap>  subsequent -referenceImpute imputes in windows of nSites target sites,\n") ;
+      fprintf (stderr, "                            extended by nOverlap sites each side, in parallel; 0 0 to turn off\n") ;
+      fprintf (stderr, "                            dosages written by -imputeVcf then pass through the 16 bit codec\n") ;
+      fprintf (stderr, "  -dosageBits <n>           store subsequent imputed or BGEN dosages with an 8 or 16 bit codec,\n") ;
+      fprintf (stderr, "                            or 0 for the original one in 0.1 steps (default)\n") ;
+      fprintf (stderr, "  -buildDosageIndex <file>  write the dosages of the current pbwt transposed, for -dosageQuery\n") ;
+      fprintf (stderr, "                            uncompressed: M*N bytes, or 2*M*N with -dosageBits 8 or 16\n") ;
+      fprintf (stderr, "  -dosageQuery <index> <samples> <from> <to>  print dosages from index file for the samples named\n") ;
+      fprintf (stderr, "                            in file samples at positions [from,to), a line per sample\n") ;
       fprintf (stderr, "  -genotypeCompare <root>   compare genotypes with those from reference whose root name is the argument - need compatible sites\n") ;
       fprintf (stderr, "  -imputeMissing            impute data marked as missing\n") ;
       fprintf (stderr, "  -fitAlphaBeta <model>     fit probabilistic model 1..3\n") ;
@@ -275,12 +382,21 @@ int main (int argc, char *argv[])
 
   timeUpdate(logFile) ;
   while (argc) {
+    if (p && p->yzStream && !isStreamCommand (argv[0])) pbwtStreamMaterialize (p) ;
     if (!(**argv == '-'))
       die ("not well formed command %s\nType pbwt without arguments for help", *argv) ;
     else if (!strcmp (argv[0], "-check"))
       { isCheck = TRUE ; argc -= 1 ; argv += 1 ; }
     else if (!strcmp (argv[0], "-stats"))
       { isStats = TRUE ; argc -= 1 ; argv += 1 ; }
+    else if (!strcmp (argv[0], "-threads") && argc > 1)
+      { nThreads = atoi (argv[1]) ; if (nThreads < 1) die ("bad -threads %s", argv[1]) ;
+	argc -= 2 ; argv += 2 ;
+      }
+    else if (!strcmp (argv[0], "-memory") && argc > 1)
+      { pbwtMemoryBudget = atol (argv[1]) << 20 ; if (pbwtMemoryBudget <= 0) die ("bad -memory %s", argv[1]) ;
+	argc -= 2 ; argv += 2 ;
+      }
     else if (!strcmp (argv[0], "-merge") && argc > 1)
     { 
         int i, nfiles = 0;
@@ -294,10 +410,31 @@ int main (int argc, char *argv[])
         free(files);
         argc -= nfiles+1 ; argv += nfiles+1 ; 
     }
+    else if (!strcmp (argv[0], "-mergeSamples") && argc > 1)
+      { p = pbwtMergeSamples (p, pbwtReadAll (argv[1])) ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-concat") && argc > 1)
+      { p = pbwtConcat (p, pbwtReadAll (argv[1])) ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-insertSamples") && argc > 1)
+      { p = pbwtInsertSamples (p, pbwtReadAll (argv[1])) ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-deleteSamples") && argc > 1)
+      { FOPEN("deleteSamples","r") ; p = pbwtDeleteSamples (p, fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-mergeWrite") && argc > 2)
+    { 
+        int i, nfiles = 0;
+        const char **files = calloc(argc, sizeof(char*));
+        for (i=2; i<argc; i++) 
+        {
+            if ( argv[i][0] == '-' ) break;
+            files[nfiles++] = argv[i];
+        }
+        if ( nfiles>1 ) pbwtMergeWrite(files, nfiles, argv[1]); 
+        free(files);
+        argc -= nfiles+2 ; argv += nfiles+2 ; 
+    }
     else if (!strcmp (argv[0], "-log") && argc > 1)
       { LOGCLOSE ; LOGOPEN("log") ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-haps") && argc > 1)
-      { FOPEN("haps","w") ; pbwtWriteHaplotypes (fp, p) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
+      { FOPEN("haps","w") ; GZWRITE(pbwtWriteHaplotypes (fp, p)) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-read") && argc > 1)
       { if (p) pbwtDestroy (p) ; FOPEN("read","r") ; p = pbwtRead (fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-readSites") && argc > 1)
@@ -314,8 +451,18 @@ int main (int argc, char *argv[])
       { p = pbwtReadAll (argv[1]) ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-readVcfGT") && argc > 1)
       { if (p) pbwtDestroy (p) ; p = pbwtReadVcfGT (argv[1]) ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-streamVcfGT") && argc > 1)
+      { if (p) pbwtDestroy (p) ; p = pbwtStreamVcfGT (argv[1]) ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-resumeVcfGT") && argc > 2)
+      { if (p) pbwtDestroy (p) ; p = pbwtResumeVcfGT (argv[1], argv[2]) ; argc -= 3 ; argv += 3 ; }
     else if (!strcmp (argv[0], "-readVcfPL") && argc > 1)
       { if (p) pbwtDestroy (p) ; p = pbwtReadVcfPL (argv[1]) ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-readBed") && argc > 1)
+      { if (p) pbwtDestroy (p) ; p = pbwtReadBed (argv[1]) ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-readBgen") && argc > 1)
+      { if (p) pbwtDestroy (p) ; FOPEN("readBgen","r") ; p = pbwtReadBgen (fp, 0) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-readBgenRegion") && argc > 2)
+      { if (p) pbwtDestroy (p) ; FOPEN("readBgen","r") ; p = pbwtReadBgen (fp, argv[2]) ; FCLOSE ; argc -= 3 ; argv += 3 ; }
     else if (!strcmp (argv[0], "-readMacs") && argc > 1)
       { if (p) pbwtDestroy (p) ; FOPEN("readMacs","r") ; p = pbwtReadMacs (fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-readVcfq") && argc > 1)
@@ -331,7 +478,10 @@ int main (int argc, char *argv[])
     else if (!strcmp (argv[0], "-write") && argc > 1)
       { FOPEN("write","w") ; pbwtWrite (p, fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-writeSites") && argc > 1)
-      { FOPEN("writeSites","w") ; pbwtWriteSites (p, fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
+      { if (p->yzStream) pbwtStreamDrain (p) ;
+	FOPEN("writeSites","w") ; pbwtWriteSites (p, fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-writeSitesBinary") && argc > 1)
+      { FOPEN("writeSitesBinary","w") ; pbwtWriteSitesBinary (p, fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-writeMatches") && argc > 1)
       {  UpdateMatchOutFile (p, argv[1]) ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-writeSamples") && argc > 1)
@@ -347,13 +497,15 @@ int main (int argc, char *argv[])
     else if (!strcmp (argv[0], "-writeImputeRef") && argc > 1)
       { pbwtWriteImputeRef (p, argv[1]) ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-writeImputeHapsG") && argc > 1)
-      { FOPEN("writeImputeHaps","w") ; pbwtWriteImputeHapsG (p, fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
+      { FOPEN("writeImputeHaps","w") ; GZWRITE(pbwtWriteImputeHapsG (p, fp)) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-writeBgen") && argc > 1)
+      { FOPEN("writeBgen","w") ; pbwtWriteBgen (p, fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-writeGen") && argc > 1)
-      { FOPEN("writeGen","w") ; pbwtWriteGen (p, fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
+      { FOPEN("writeGen","w") ; GZWRITE(pbwtWriteGen (p, fp)) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-writePhase") && argc > 1)
-      { pbwtWritePhase (p,argv[1]) ; argc -= 2 ; argv += 2 ; }
+      { GZWRITE(pbwtWritePhase (p,argv[1])) ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-writeTransposedHaplotypes") && argc > 1)
-      { FOPEN("writeTransposedHaplotypes",argv[0]) ; pbwtWriteTransposedHaplotypes (p, fp) ; argc -= 2 ; argv += 2 ; }
+      { FOPEN("writeTransposedHaplotypes","w") ; GZWRITE(pbwtWriteTransposedHaplotypes (p, fp)) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-referenceFasta") && argc > 1)
       { referenceFasta = strdup(argv[1]) ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-writeVcf") && argc > 1)
@@ -364,8 +516,14 @@ int main (int argc, char *argv[])
       { pbwtWriteVcf (p, argv[1], referenceFasta, "wbu") ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-writeBcfGz") && argc > 1)
       { pbwtWriteVcf (p, argv[1], referenceFasta, "wb") ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-blockCompress") && argc > 1)
+      { pbwtBlockSize = 1024 * atoi (argv[1]) ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-lazy"))
+      { isReadLazy = TRUE ; argc -= 1 ; argv += 1 ; }
     else if (!strcmp (argv[0], "-checkpoint") && argc > 1)
       { nCheckPoint = atoi (argv[1]) ; argc -= 2 ; argv += 2 ; }
+    else if ((nChain = transformChain (&p, argc, argv)))
+      { argc -= nChain ; argv += nChain ; }
     else if (!strcmp (argv[0], "-subsample") && argc > 2)
       { p = pbwtSubSampleInterval (p, atoi(argv[1]), atoi(argv[2])) ; argc -= 3 ; argv += 3 ; }
     else if (!strcmp (argv[0], "-selectSamples") && argc > 2)
@@ -424,9 +582,13 @@ int main (int argc, char *argv[])
       { p = phase (p, atoi(argv[1])) ; argc -= 2 ; argv += 2 ; }
     else if (!strcmp (argv[0], "-referencePhase") && argc > 1)
       { p = referencePhase (p, argv[1]) ; argc -= 2 ; argv += 2 ; }
-    else if (!strcmp (argv[0], "-referenceImpute") && argc > 1)
+    else if ((!strcmp (argv[0], "-referenceImpute") && argc > 1) ||
+	     ((!strcmp (argv[0], "-imputeVcf") || !strcmp (argv[0], "-imputeVcfKeep")) && argc > 2))
       { int nSparse = 1 ; double fSparse = 1.0 ;
-	char *fileNameRoot = argv[1] ;  argc -= 2 ; argv += 2 ;
+	char *vcfFile = 0 ; BOOL isBuild = strcmp (argv[0], "-imputeVcf") ;
+	char *fileNameRoot = argv[1] ;
+	if (strcmp (argv[0], "-referenceImpute")) { vcfFile = argv[2] ; --argc ; ++argv ; }
+	argc -= 2 ; argv += 2 ;
 	if (argc && argv[0][0] != '-')
 	  { if (!(nSparse = atoi(argv[0]))) die ("bad refImpute nSparse %s", argv[0]) ;
 	    else { --argc ; ++argv ; }
@@ -435,7 +597,59 @@ int main (int argc, char *argv[])
 	  { if (!(fSparse = atof(argv[0]))) die ("bad refImpute fSparse %s", argv[0]) ;
 	    else { --argc ; ++argv ; }
 	  }
-	p = referenceImpute (p, fileNameRoot, nSparse, fSparse) ;
+	if (vcfFile)
+	  { int n = strlen (vcfFile) ;	/* format from the file name */
+	    char *mode = (n > 4 && !strcmp (vcfFile+n-4, ".bcf")) ? "wb" : 
+	      (n > 3 && !strcmp (vcfFile+n-3, ".gz")) ? "wz" : "w" ;
+	    p = referenceImputeVcf (p, fileNameRoot, nSparse, fSparse, vcfFile, referenceFasta, mode, isBuild) ;
+	  }
+	else
+	  p = referenceImpute (p, fileNameRoot, nSparse, fSparse) ;
+      }
+    else if (!strcmp (argv[0], "-referenceImputeBatch") && argc > 2)
+      { int nSparse = 1 ; double fSparse = 1.0 ;
+	char *fileNameRoot = argv[1] ;
+	LOPEN("referenceImputeBatch list","r") ;
+	argc -= 3 ; argv += 3 ;
+	if (argc && argv[0][0] != '-')
+	  { if (!(nSparse = atoi(argv[0]))) die ("bad refImpute nSparse %s", argv[0]) ;
+	    else { --argc ; ++argv ; }
+	  }
+	if (argc && argv[0][0] != '-')
+	  { if (!(fSparse = atof(argv[0]))) die ("bad refImpute fSparse %s", argv[0]) ;
+	    else { --argc ; ++argv ; }
+	  }
+	referenceImputeBatch (fileNameRoot, lp, nSparse, fSparse, referenceFasta) ;
+	if (lp != stdin) fclose (lp) ;
+      }
+    else if (!strcmp (argv[0], "-prepareReference") && argc > 1)
+      { int checkStep = 1000 ;
+	char *fileNameRoot = argv[1] ;
+	argc -= 2 ; argv += 2 ;
+	if (argc && argv[0][0] != '-')
+	  { if ((checkStep = atoi(argv[0])) <= 0) die ("bad prepareReference nCheck %s", argv[0]) ;
+	    --argc ; ++argv ;
+	  }
+	pbwtWritePanel (p, fileNameRoot, checkStep) ;
+      }
+    else if (!strcmp (argv[0], "-imputeChunk") && argc > 2)
+      { imputeChunkSites = atoi (argv[1]) ; imputeOverlapSites = atoi (argv[2]) ;
+	if (imputeChunkSites < 0 || imputeOverlapSites < 0) die ("bad -imputeChunk sizes %s %s", argv[1], argv[2]) ;
+	argc -= 3 ; argv += 3 ;
+      }
+    else if (!strcmp (argv[0], "-dosageBits") && argc > 1)
+      { dosageBits = atoi (argv[1]) ;
+	if (dosageBits && dosageBits != 8 && dosageBits != 16) die ("-dosageBits must be 0, 8 or 16, not %s", argv[1]) ;
+	argc -= 2 ; argv += 2 ;
+      }
+    else if (!strcmp (argv[0], "-buildDosageIndex") && argc > 1)
+      { FOPEN("buildDosageIndex","w") ; pbwtWriteDosageIndex (p, fp) ; FCLOSE ; argc -= 2 ; argv += 2 ; }
+    else if (!strcmp (argv[0], "-dosageQuery") && argc > 4)
+      { DosageIndex *di = dosageIndexOpen (argv[1]) ;
+	LOPEN("dosageQuery samples","r") ;
+	dosageIndexQuery (di, lp, atoi (argv[3]), atoi (argv[4]), stdout) ;
+	LCLOSE ; dosageIndexDestroy (di) ;
+	argc -= 5 ; argv += 5 ;
       }
     else if (!strcmp (argv[0], "-genotypeCompare") && argc > 1)
       { genotypeCompare (p, argv[1]) ; argc -= 2 ; argv += 2 ; }
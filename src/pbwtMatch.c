@@ -153,10 +153,7 @@ void matchMaximalWithin (PBWT *p, void (*report)(int ai, int bi, int start, int
 
 void pbwtLongMatches (PBWT *p, int L) /* reporting threshold L - if 0 then maximal */
 {
-  int k ;
-  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
-
-  if (!p || !p->yz) die ("option -longWithin called without a PBWT") ;
+  if (!p || !(p->yz || p->yzBlocks || p->yzStream)) die ("option -longWithin called without a PBWT") ;
   if (L < 0) die ("L %d for longWithin must be >= 0", L) ;
 
   if (isCheck) { checkHapsA = checkHapsB = pbwtHaplotypes(p) ; Ncheck = p->N ; }
@@ -183,7 +180,6 @@ void pbwtLongMatches (PBWT *p, int L) /* reporting threshold L - if 0 then maxim
       fprintf (logFile, "Average length %.1f\n", hTot/(double)nTot) ;
     }
 
-  pbwtCursorDestroy (u) ;
   if (isCheck) 
     { int j ;
     for (j = 0 ; j < p->M ; ++j)
@@ -272,15 +268,13 @@ Array getSiteIndices (VCF *query, Array sites) {
     while (iq < query->N && is < arrayMax(sites))
     {
         if (sq->x < ss->x) {
-            ++iq;
-            ++sq;
-
-
+            iq = pbwtSitesSearch (query->sites, iq+1, ss->x) ;
+            sq = arrp(query->sites, iq, Site) ;
         }
         else if (sq->x > ss->x)
         {
-            ++is;
-            ++ss;
+            is = pbwtSitesSearch (sites, is+1, sq->x) ;
+            ss = arrp(sites, is, Site) ;
         }
         else
         {
@@ -864,4 +858,119 @@ void matchSequencesSweepSparse (PBWT *p, PBWT *q, int nSparse,
     }
 }
 
+/************** log of match segments for each query haplotype **************/
+
+/* Segments are appended to a chain of fixed size blocks for each query, taken from
+   large slabs, so there is no per-query reallocation.  matchLogIndex() then copies
+   each query's chain into one contiguous array and frees the slabs.  Each log must be
+   filled by a single thread; callers running in parallel use one log per thread.
+   Segments arrive from the sweeps nearly in order of start, so for sorting we merge
+   the runs that are already in order rather than sorting from scratch.
+*/
+
+#define MATCH_BLOCK 20		/* segments per block: 256 bytes with the header */
+#define MATCH_SLAB 4096		/* blocks per slab */
+
+struct MatchBlockStruct {
+  MatchBlock *next ;
+  int n ;
+  MatchSegment s[MATCH_BLOCK] ;
+} ;
+
+MatchLog *matchLogCreate (int M)
+{
+  MatchLog *ml = mycalloc (1, MatchLog) ;
+  ml->M = M ;
+  ml->head = mycalloc (M, MatchBlock*) ;
+  ml->tail = mycalloc (M, MatchBlock*) ;
+  ml->slabs = arrayCreate (64, MatchBlock*) ;
+  ml->slabUsed = MATCH_SLAB ;
+  return ml ;
+}
+
+static MatchBlock *matchBlockNew (MatchLog *ml)
+{
+  if (ml->slabUsed == MATCH_SLAB)
+    { array(ml->slabs, arrayMax(ml->slabs), MatchBlock*) = myalloc (MATCH_SLAB, MatchBlock) ;
+      ml->slabUsed = 0 ;
+    }
+  MatchBlock *b = arr(ml->slabs, arrayMax(ml->slabs)-1, MatchBlock*) + ml->slabUsed++ ;
+  b->next = 0 ; b->n = 0 ;
+  return b ;
+}
+
+void matchLogAdd (MatchLog *ml, int i, int j, int start, int end)
+{
+  MatchBlock *b = ml->tail[i] ;
+  if (!b || b->n == MATCH_BLOCK)
+    { MatchBlock *bNew = matchBlockNew (ml) ;
+      if (b) b->next = bNew ; else ml->head[i] = bNew ;
+      b = ml->tail[i] = bNew ;
+    }
+  MatchSegment *ms = &b->s[b->n++] ;
+  ms->j = j ; ms->start = start ; ms->end = end ;
+  ++ml->n ;
+}
+
+static void matchSegmentsMergeRuns (MatchSegment *a, int n, MatchSegment *tmp)
+/* stable sort by start, merging adjacent runs that are already in order */
+{
+  while (TRUE)
+    { int lo = 0, nRuns = 0 ;
+      while (lo < n)
+	{ int mid = lo + 1, hi ;
+	  while (mid < n && a[mid].start >= a[mid-1].start) ++mid ;
+	  ++nRuns ;
+	  if (mid == n) break ;
+	  for (hi = mid + 1 ; hi < n && a[hi].start >= a[hi-1].start ; ) ++hi ;
+	  int x = lo, y = mid, t = 0 ;
+	  while (x < mid && y < hi) tmp[t++] = (a[y].start < a[x].start) ? a[y++] : a[x++] ;
+	  while (x < mid) tmp[t++] = a[x++] ;
+	  while (y < hi) tmp[t++] = a[y++] ;
+	  memcpy (a + lo, tmp, t * sizeof(MatchSegment)) ;
+	  lo = hi ;
+	}
+      if (nRuns <= 1) return ;
+    }
+}
+
+void matchLogIndex (MatchLog *ml, BOOL isSort)
+{
+  int i, nMax = 0 ;
+  ml->seg = myalloc (ml->n + 1, MatchSegment) ; /* +1 so readers may look one past the end */
+  ml->index = myalloc (ml->M + 1, long) ;
+  MatchSegment *ms = ml->seg ;
+  for (i = 0 ; i < ml->M ; ++i)
+    { MatchBlock *b ;
+      ml->index[i] = ms - ml->seg ;
+      for (b = ml->head[i] ; b ; b = b->next)
+	{ memcpy (ms, b->s, b->n * sizeof(MatchSegment)) ; ms += b->n ; }
+      if (ms - ml->seg - ml->index[i] > nMax) nMax = ms - ml->seg - ml->index[i] ;
+    }
+  ml->index[ml->M] = ml->n ;
+  memset (ms, 0, sizeof(MatchSegment)) ;
+
+  for (i = 0 ; i < arrayMax(ml->slabs) ; ++i) free (arr(ml->slabs, i, MatchBlock*)) ;
+  arrayDestroy (ml->slabs) ; ml->slabs = 0 ;
+  free (ml->head) ; ml->head = 0 ; free (ml->tail) ; ml->tail = 0 ;
+
+  if (isSort)
+    { MatchSegment *tmp = myalloc (nMax+1, MatchSegment) ;
+      for (i = 0 ; i < ml->M ; ++i)
+	matchSegmentsMergeRuns (matchLogSegs(ml,i), matchLogCount(ml,i), tmp) ;
+      free (tmp) ;
+    }
+}
+
+void matchLogDestroy (MatchLog *ml)
+{
+  int i ;
+  if (ml->slabs)
+    { for (i = 0 ; i < arrayMax(ml->slabs) ; ++i) free (arr(ml->slabs, i, MatchBlock*)) ;
+      arrayDestroy (ml->slabs) ;
+    }
+  free (ml->head) ; free (ml->tail) ; free (ml->seg) ; free (ml->index) ;
+  free (ml) ;
+}
+
 /******************* end of file *******************/
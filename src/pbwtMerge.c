@@ -4,207 +4,419 @@
 #include <string.h>
 #include <errno.h>
 
-// Synced reading of multiple PBWTs. 
-// Note: all operations in-memory for now, buffered input in future?
+// Streaming synced reading of multiple PBWTs.
+// Each input holds just its header, a cursor and a buffer of packed columns a little
+// over M bytes long, and reads its text sites file a line at a time (binary sites files
+// are compact and read whole).  A min-heap on (position, alleles) gives the next site,
+// so memory is proportional to the sum of M rather than to the size of the inputs.
+typedef struct
+{
+	PBWT *p;			// header only: M, N, aFstart, chrom
+	PbwtCursor *u;		// a[] and y[] at the current site
+	BOOL isCursor;		// version 4 files are read through a lazy block cursor
+	FILE *fp;			// else the packed columns are read from here
+	long nzLeft;		// bytes of packed columns still in fp
+	uchar *buf;
+	int bufPos, bufEnd, bufSize;
+	FILE *sfp;			// text sites file, read a line at a time
+	Array sites;		// or all the sites from a binary file
+	Array varText;
+	int line;
+	int k;				// index of current site
+	Site site;			// current site
+	char *als;			// and its alleles
+}
+pbwt_stream_t;
+
 typedef struct
 {
-	// all operations in-memory for now, buffered input in future?
 	int n;				 // number of PBWTs
-	PBWT **pbwt;
-	int *cpos;		 // current position of each PBWT (site index)
-	int mpos;			 // minimum position across all PBWT (position)
-	char *mals;		 // alleles at the mpos (multiple records with different alleles can be present)
-	PbwtCursor **cursor;
-	int *unpacked;
+	pbwt_stream_t *in;
+	int *heap, nheap;	 // unfinished inputs, ordered by current (position, alleles)
 }
 pbwt_reader_t;
 
-static pbwt_reader_t *pbwt_reader_init(const char **fnames, int nfiles)
+static void stream_column(pbwt_stream_t *s)
 {
-	pbwt_reader_t *reader = calloc(1,sizeof(pbwt_reader_t));
-	reader->n        = nfiles;
-	reader->pbwt     = myalloc(nfiles,PBWT*);
-	reader->cpos     = myalloc(nfiles,int);
-	reader->cursor   = myalloc(nfiles,PbwtCursor*);
-	reader->unpacked = myalloc(nfiles,int);
-
-	int i;
-	for (i=0; i<nfiles; i++)
+	int M = s->p->M;
+	if ( s->bufEnd - s->bufPos < M && s->nzLeft )
 	{
-		FILE *fp = fopen(fnames[i],"r");
-		if ( !fp ) die("failed to open %s: %s\n", fnames[i], strerror(errno));
-		reader->pbwt[i] = pbwtRead(fp);
-		fclose(fp);
+		int n = s->bufEnd - s->bufPos;
+		memmove(s->buf, s->buf + s->bufPos, n);
+		long want = s->bufSize - n;
+		if ( want > s->nzLeft ) want = s->nzLeft;
+		if ( fread(s->buf + n, 1, want, s->fp) != want ) die("error reading packed data in merge");
+		s->nzLeft -= want;
+		s->bufPos = 0; s->bufEnd = n + want;
+	}
+	s->bufPos += unpack3(s->buf + s->bufPos, M, s->u->y, 0);
+	if ( s->bufPos > s->bufEnd ) die("truncated packed data in merge");
+}
 
-		int j = strlen(fnames[i]);
-		char *fname = malloc(sizeof(char)*(j+2));
-		memcpy(fname, fnames[i], j);
-		memcpy(fname+j-4,"sites",6);
-		fp = fopen(fname,"r");
-		if ( !fp ) die("failed to open %s: %s\n", fname, strerror(errno));
-		free(fname);
+static void stream_site(pbwt_stream_t *s)
+{
+	if ( s->sites ) s->site = arr(s->sites, s->k, Site);
+	else if ( !pbwtReadSiteNext(s->sfp, &s->p->chrom, &s->site, s->varText, &s->line) )
+		die("sites file has fewer than the %d sites in its pbwt", s->p->N);
+	s->als = dictName(variationDict, s->site.varD);
+}
 
-		pbwtReadSites(reader->pbwt[i], fp);
+static void stream_open(pbwt_stream_t *s, const char *fname)
+{
+	FILE *fp = fopen(fname,"r");
+	if ( !fp ) die("failed to open %s: %s\n", fname, strerror(errno));
+	long nz;
+	BOOL isLazy = isReadLazy;
+	isReadLazy = TRUE;			// version 4 files stay on disk
+	s->p = pbwtReadHeader(fp, &nz);
+	isReadLazy = isLazy;
+	if ( nz < 0 )
+	{
+		s->isCursor = TRUE;
+		s->u = pbwtCursorCreate(s->p, TRUE, TRUE);
 		fclose(fp);
+	}
+	else
+	{
+		s->fp = fp;
+		s->nzLeft = nz;
+		s->bufSize = s->p->M + (1<<16);
+		s->buf = myalloc(s->bufSize, uchar);
+		s->u = pbwtNakedCursorCreate(s->p->M, s->p->aFstart);
+		if ( s->p->N ) stream_column(s);
+	}
 
-		reader->cursor[i] = pbwtNakedCursorCreate(reader->pbwt[i]->M, 0);
-		reader->unpacked[i] = 0;
-		reader->cpos[i] = 0;
+	int j = strlen(fname);
+	char *sname = malloc(sizeof(char)*(j+2));
+	memcpy(sname, fname, j);
+	memcpy(sname+j-4,"sites",6);
+	s->sfp = fopen(sname,"r");
+	if ( !s->sfp ) die("failed to open %s: %s\n", sname, strerror(errno));
+	free(sname);
+	int c = getc(s->sfp);		// binary sites files start with '#'
+	if ( c != EOF ) ungetc(c, s->sfp);
+	if ( c == '#' )
+	{
+		s->sites = pbwtReadSitesFile(s->sfp, &s->p->chrom);
+		if ( arrayMax(s->sites) != s->p->N )
+			die("sites file contains %ld sites not %d as in pbwt", arrayMax(s->sites), s->p->N);
+		fclose(s->sfp); s->sfp = 0;
 	}
-	for (i=1; i<nfiles; i++)
+	else
 	{
-		if ( strcmp(reader->pbwt[0]->chrom,reader->pbwt[i]->chrom) ) 
-			die("Different chromosomes: %s in %s vs %s in %s\n", reader->pbwt[0]->chrom,fnames[0],reader->pbwt[i]->chrom,fnames[i]);
+		s->varText = arrayCreate(256, char);
+		s->line = 1;
 	}
-	return reader;
+	s->k = 0;
+	if ( s->p->N ) stream_site(s);
 }
 
-static void pbwt_reader_destroy(pbwt_reader_t *reader)
+static void stream_next(pbwt_stream_t *s)
 {
-	int i;
-	for (i=0; i<reader->n; i++)
+	if ( s->isCursor ) pbwtCursorForwardsRead(s->u);
+	else pbwtCursorForwardsA(s->u);
+	if ( ++s->k >= s->p->N ) return;
+	if ( !s->isCursor ) stream_column(s);
+	stream_site(s);
+}
+
+static void stream_close(pbwt_stream_t *s)
+{
+	if ( s->fp ) fclose(s->fp);
+	if ( s->sfp ) fclose(s->sfp);
+	if ( s->sites ) arrayDestroy(s->sites);
+	if ( s->varText ) arrayDestroy(s->varText);
+	free(s->buf);
+	pbwtCursorDestroy(s->u);
+	pbwtDestroy(s->p);
+}
+
+static int stream_cmp(pbwt_stream_t *a, pbwt_stream_t *b)
+{
+	if ( a->site.x != b->site.x ) return a->site.x < b->site.x ? -1 : 1;
+	return strcmp(a->als, b->als);
+}
+
+static void heap_down(pbwt_reader_t *reader, int i)
+{
+	int *h = reader->heap;
+	while ( 2*i+1 < reader->nheap )
 	{
-		pbwtDestroy(reader->pbwt[i]);
-		pbwtCursorDestroy(reader->cursor[i]);
+		int c = 2*i+1;
+		if ( c+1 < reader->nheap && stream_cmp(&reader->in[h[c+1]], &reader->in[h[c]]) < 0 ) c++;
+		if ( stream_cmp(&reader->in[h[c]], &reader->in[h[i]]) >= 0 ) break;
+		int t = h[c]; h[c] = h[i]; h[i] = t;
+		i = c;
 	}
-	free(reader->pbwt);
-	free(reader->cursor);
-	free(reader->unpacked);
-	free(reader->cpos);
-	free(reader);
 }
 
-// Return value: 0 if all PBWTs finished, otherwise the current position is returned
-static int pbwt_reader_next(pbwt_reader_t *reader, int nshared)
+static void heap_push(pbwt_reader_t *reader, int k)
 {
-	int i, min_pos = INT_MAX;
-	char *min_als  = NULL;
+	int *h = reader->heap, i = reader->nheap++;
+	h[i] = k;
+	while ( i && stream_cmp(&reader->in[h[i]], &reader->in[h[(i-1)/2]]) < 0 )
+	{
+		int t = h[i]; h[i] = h[(i-1)/2]; h[(i-1)/2] = t;
+		i = (i-1)/2;
+	}
+}
 
-	// advance all readers, first looking at coordinates only
-	for (i=0; i<reader->n; i++)
-	{  
-		PBWT *p = reader->pbwt[i];
-		int j		= reader->cpos[i];
-		if ( j>=p->N ) continue;		// no more sites in this pbwt
-
-		Site *site = arrp(p->sites, j, Site);
-		char *als  = dictName(variationDict, site->varD);
-
-		// assuming:
-		//	- one chromosome only (no checking sequence name)
-		//	- sorted alleles (strcmp() on als)
-		while ( j < p->N && site->x <= reader->mpos && (!reader->mals || strcmp(als,reader->mals)<=0) )
-		{
-			site = arrp(p->sites, j, Site);
-			als  = dictName(variationDict, site->varD);
-			reader->cpos[i] = j++;
-		}
-		if ( reader->cpos[i]+1 >= p->N && site->x == reader->mpos && (!reader->mals || !strcmp(als,reader->mals)) )
-		{
-			// this pbwt is positioned on the last site which has been read before
-			reader->cpos[i] = p->N;
-			continue;
-		}
+static int heap_pop(pbwt_reader_t *reader)
+{
+	int k = reader->heap[0];
+	reader->heap[0] = reader->heap[--reader->nheap];
+	heap_down(reader, 0);
+	return k;
+}
 
-		if ( reader->cpos[i] < p->N && site->x < min_pos )
-		{
-			min_pos = site->x;
-			min_als = als;
-		}
-		if ( site->x==min_pos && (!min_als || strcmp(als,min_als)<0) ) min_als = als;
-	}
-	if ( min_pos==INT_MAX )
+static pbwt_reader_t *pbwt_reader_init(const char **fnames, int nfiles)
+{
+	pbwt_reader_t *reader = calloc(1,sizeof(pbwt_reader_t));
+	reader->n    = nfiles;
+	reader->in   = mycalloc(nfiles, pbwt_stream_t);
+	reader->heap = myalloc(nfiles, int);
+
+	int i;
+	for (i=0; i<nfiles; i++)
 	{
-		reader->mpos = 0;
-		reader->mals = NULL;
+		stream_open(&reader->in[i], fnames[i]);
+		if ( reader->in[i].p->N ) heap_push(reader, i);
 	}
-	else
+	char *chrom = reader->in[0].p->chrom;
+	for (i=1; i<nfiles; i++)
 	{
-		reader->mpos = min_pos;
-		reader->mals = min_als;
+		char *chromi = reader->in[i].p->chrom;
+		if ( chrom && chromi && strcmp(chrom,chromi) )
+			die("Different chromosomes: %s in %s vs %s in %s\n", chrom,fnames[0],chromi,fnames[i]);
 	}
-	return reader->mpos;
+	return reader;
 }
 
-PBWT *pbwtMerge(const char **fnames, int nfiles)
+static void pbwt_reader_destroy(pbwt_reader_t *reader)
 {
-	pbwt_reader_t *reader = pbwt_reader_init(fnames, nfiles);
+	int i;
+	for (i=0; i<reader->n; i++) stream_close(&reader->in[i]);
+	free(reader->in);
+	free(reader->heap);
+	free(reader);
+}
 
-	int nhaps = 0, i;
-	for (i=0; i<nfiles; i++) nhaps += reader->pbwt[i]->M;
-	PBWT *out_pbwt     = pbwtCreate(nhaps, 0);
+// Take the inputs at the next (position, alleles) off the heap into next[], returning how many.
+// Return value 0 means all PBWTs are finished.
+static int pbwt_reader_next(pbwt_reader_t *reader, int *next)
+{
+	int n = 0;
+	if ( !reader->nheap ) return 0;
+	next[n++] = heap_pop(reader);
+	while ( reader->nheap && !stream_cmp(&reader->in[reader->heap[0]], &reader->in[next[0]]) )
+		next[n++] = heap_pop(reader);
+	return n;
+}
+
+// Merge sites shared by all files.  If fp is set the packed columns and sites are
+// written out as they are made, else they are kept in out.
+static void pbwt_merge(pbwt_reader_t *reader, PBWT *out, FILE *fp, FILE *sfp)
+{
+	int nfiles = reader->n, nhaps = out->M;
 	PbwtCursor *cursor = pbwtNakedCursorCreate(nhaps, 0);
 	uchar *yseq        = myalloc(nhaps, uchar);
-	out_pbwt->yz       = arrayCreate (1<<20, uchar) ;
-	out_pbwt->sites    = arrayReCreate(out_pbwt->sites, reader->pbwt[0]->N, Site);
-	out_pbwt->chrom = strdup(reader->pbwt[0]->chrom);
+	int *next          = myalloc(nfiles, int);
+	int *offset        = myalloc(nfiles, int);
+	long nz = 0;
+	int i, j, n;
 
-	int pos, j;
-	while ( (pos=pbwt_reader_next(reader, nfiles)) )
+	for (i=0, j=0; i<nfiles; i++) { offset[i] = j; j += reader->in[i].p->M; }
+
+	while ( (n = pbwt_reader_next(reader, next)) )
 	{
-		// Merge only records shared by all files
-		for (i=0; i<nfiles; i++)
+		pbwt_stream_t *s0 = &reader->in[next[0]];
+		if ( n==nfiles )
 		{
-			PBWT *p		 = reader->pbwt[i];
-			Site *site = arrp(p->sites, reader->cpos[i], Site);
+			for (i=0; i<n; i++)
+			{
+				pbwt_stream_t *s = &reader->in[next[i]];
+				PbwtCursor *c = s->u;
+				uchar *y = yseq + offset[next[i]];
+				for (j=0; j<s->p->M; j++) y[c->a[j]] = c->y[j];
+			}
 
-			// Both position and alleles must match. This requires that the records are sorted by alleles.
+			// pack merged haplotypes
+			for (j=0; j<nhaps; j++)
+				cursor->y[j] = yseq[cursor->a[j]];
+			pack3arrayAdd(cursor->y, nhaps, out->yz);
+			pbwtCursorForwardsA(cursor);
 
-			if ( site->x!=pos ) break;
-			char *als = dictName(variationDict, site->varD);
-			if ( strcmp(als,reader->mals) ) break;
-		}
-		if ( i!=nfiles ) 
-		{
-			// intersection: skip records which are not present in all files
-			for (i=0; i<nfiles; i++)
+			// insert new site
+			if ( fp )
 			{
-				PBWT *p    = reader->pbwt[i];
-				Site *site = arrp(p->sites, reader->cpos[i], Site);
-				if ( site->x!=pos ) continue;
-				char *als = dictName(variationDict, site->varD);
-				if ( strcmp(als,reader->mals) ) continue;
-
-				PbwtCursor *c = reader->cursor[i];
-				reader->unpacked[i] += unpack3(arrp(p->yz,reader->unpacked[i],uchar), p->M, c->y, 0);
-				pbwtCursorForwardsA(c);
+				if ( fwrite(arrp(out->yz,0,uchar), 1, arrayMax(out->yz), fp) != arrayMax(out->yz) )
+					die("error writing merged pbwt");
+				nz += arrayMax(out->yz);
+				arrayMax(out->yz) = 0;
+				fprintf(sfp, "%s\t%d\t%s\n", out->chrom ? out->chrom : ".", s0->site.x, s0->als);
 			}
-			continue;
+			else
+			{
+				Site *site = arrayp(out->sites, out->N, Site);
+				site->x    = s0->site.x;
+				site->varD = s0->site.varD;
+			}
+			out->N++;
 		}
+		// otherwise intersection: skip records which are not present in all files
 
-		// read and merge
-		int ihap = 0;
-		for (i=0; i<nfiles; i++)
+		for (i=0; i<n; i++)
 		{
-			PbwtCursor *c = reader->cursor[i];
-			PBWT *p       = reader->pbwt[i];
-			Site *site    = arrp(p->sites, reader->cpos[i], Site);
-			reader->unpacked[i] += unpack3(arrp(p->yz,reader->unpacked[i],uchar), p->M, c->y, 0);
-			for (j=0; j<p->M; j++) yseq[ihap + c->a[j]] = c->y[j];
-			pbwtCursorForwardsA(c);
-			ihap += p->M;
+			pbwt_stream_t *s = &reader->in[next[i]];
+			stream_next(s);
+			if ( s->k < s->p->N ) heap_push(reader, next[i]);
 		}
-
-		// pack merged haplotypes
-		for (j=0; j<nhaps; j++)
-			cursor->y[j] = yseq[cursor->a[j]];
-		pack3arrayAdd(cursor->y, out_pbwt->M, out_pbwt->yz);
-		pbwtCursorForwardsA(cursor);
-
-		// insert new site
-		arrayExtend(out_pbwt->sites, out_pbwt->N+1);
-		Site *site = arrayp(out_pbwt->sites, out_pbwt->N, Site);
-		site->x = pos;
-		dictAdd(variationDict, reader->mals, &site->varD);
-
-		out_pbwt->N++;
 	}
-	pbwtCursorToAFend (cursor, out_pbwt) ;
+	pbwtCursorToAFend (cursor, out) ;
+	if ( fp ) arrayMax(out->yz) = nz;	// so that the caller can report and patch the size
 
+	free(offset);
+	free(next);
 	free(yseq);
 	pbwtCursorDestroy(cursor);
+}
+
+static PBWT *merge_create(pbwt_reader_t *reader)
+{
+	int nhaps = 0, i;
+	for (i=0; i<reader->n; i++) nhaps += reader->in[i].p->M;
+	PBWT *out_pbwt  = pbwtCreate(nhaps, 0);
+	out_pbwt->yz    = arrayCreate (1<<20, uchar) ;
+	out_pbwt->sites = arrayCreate (4096, Site);
+	for (i=0; i<reader->n; i++)
+		if ( reader->in[i].p->chrom ) { out_pbwt->chrom = strdup(reader->in[i].p->chrom); break; }
+	return out_pbwt;
+}
+
+PBWT *pbwtMerge(const char **fnames, int nfiles)
+{
+	pbwt_reader_t *reader = pbwt_reader_init(fnames, nfiles);
+	PBWT *out_pbwt = merge_create(reader);
+
+	pbwt_merge(reader, out_pbwt, 0, 0);
+
 	pbwt_reader_destroy(reader);
+	fprintf (logFile, "merged %d pbwt files: M, N are %d, %d\n", nfiles, out_pbwt->M, out_pbwt->N) ;
 	return out_pbwt;
 }
 
+void pbwtMergeWrite(const char **fnames, int nfiles, char *root)
+{
+	pbwt_reader_t *reader = pbwt_reader_init(fnames, nfiles);
+	PBWT *out_pbwt = merge_create(reader);
+
+	// write a version 3 header with space for N, aFend and the size, which are filled in at the end
+	FILE *fp = fopenTag(root, "pbwt", "w");
+	FILE *sfp = fopenTag(root, "sites", "w");
+	if ( !fp || !sfp ) die("failed to open %s.pbwt and %s.sites for writing", root, root);
+	int M = out_pbwt->M;
+	long nz = 0;
+	out_pbwt->aFend = mycalloc(M, int);
+	if ( fwrite("PBW3", 1, 4, fp) != 4 || fwrite(&M, sizeof(int), 1, fp) != 1 ||
+		 fwrite(&out_pbwt->N, sizeof(int), 1, fp) != 1 ||
+		 fwrite(out_pbwt->aFstart, sizeof(int), M, fp) != M ||
+		 fwrite(out_pbwt->aFend, sizeof(int), M, fp) != M ||
+		 fwrite(&nz, sizeof(long), 1, fp) != 1 || fwrite("    ", 1, 4, fp) != 4 )
+		die("error writing merged pbwt header");
+
+	pbwt_merge(reader, out_pbwt, fp, sfp);
+
+	nz = arrayMax(out_pbwt->yz);
+	if ( fseek(fp, 8, SEEK_SET) || fwrite(&out_pbwt->N, sizeof(int), 1, fp) != 1 ||
+		 fseek(fp, 12 + (long)M*sizeof(int), SEEK_SET) ||
+		 fwrite(out_pbwt->aFend, sizeof(int), M, fp) != M ||
+		 fwrite(&nz, sizeof(long), 1, fp) != 1 )
+		die("error finishing merged pbwt file %s.pbwt", root);
+	if ( fclose(fp) ) die("error closing %s.pbwt", root);
+	if ( ferror(sfp) || fclose(sfp) ) die("error writing %s.sites", root);
+
+	fprintf (logFile, "merged %d pbwt files into %s.pbwt with %ld chars: M, N are %d, %d\n",
+			 nfiles, root, nz, M, out_pbwt->N) ;
+	pbwt_reader_destroy(reader);
+	pbwtDestroy(out_pbwt);
+}
+
+void pbwtCheckSameSites(PBWT *p, PBWT *q, char *op)
+{
+	if ( !p || !(p->yz || p->yzBlocks) || !q || !(q->yz || q->yzBlocks) )
+		die("%s called without two valid pbwts", op);
+	if ( p->N != q->N ) die("%s needs the same sites: %d sites vs %d", op, p->N, q->N);
+	if ( p->chrom && q->chrom && strcmp(p->chrom, q->chrom) )
+		die("Different chromosomes: %s vs %s", p->chrom, q->chrom);
+	int i;
+	if ( p->sites && q->sites )
+		for (i=0; i<p->N; i++)
+		{
+			Site *sp = arrp(p->sites, i, Site), *sq = arrp(q->sites, i, Site);
+			if ( sp->x != sq->x || sp->varD != sq->varD )
+				die("%s needs the same sites: site %d is %d %s vs %d %s", op, i,
+					sp->x, dictName(variationDict, sp->varD), sq->x, dictName(variationDict, sq->varD));
+		}
+	if ( p->missingOffset || q->missingOffset || p->dosageOffset || q->dosageOffset )
+		fprintf(logFile, "warning: missing and dosage data are not carried over by %s\n", op);
+}
+
+// Sample union of two PBWTs over the same sites.
+// Take the initial union order to be p's aFstart followed by q's.  At each site the new
+// order is a stable partition of the old by y, so restricted to p's haplotypes it is
+// p's own order, and likewise for q.  Hence a bit per position saying which input it
+// comes from is enough to interleave the two columns, and the bits are partitioned
+// along with y.  Each site costs O(M) and haplotypes are never decoded.
+PBWT *pbwtMergeSamples(PBWT *p, PBWT *q)
+{
+	pbwtCheckSameSites(p, q, "mergeSamples");
+	int i, j;
+
+	int Mp = p->M, M = p->M + q->M;
+	PBWT *out = pbwtCreate(M, p->N);
+	for (j=0; j<Mp; j++) out->aFstart[j] = p->aFstart[j];
+	for (j=0; j<q->M; j++) out->aFstart[Mp+j] = Mp + q->aFstart[j];
+	out->yz = arrayCreate(1<<20, uchar);
+	if ( p->sites ) out->sites = arrayCopy(p->sites);
+	else if ( q->sites ) out->sites = arrayCopy(q->sites);
+	if ( p->chrom || q->chrom ) out->chrom = strdup(p->chrom ? p->chrom : q->chrom);
+	if ( p->samples && q->samples )
+	{
+		out->samples = arrayCopy(p->samples);
+		for (j=0; j<arrayMax(q->samples); j++)
+			array(out->samples, arrayMax(out->samples), int) = arr(q->samples, j, int);
+	}
+	out->isUnphased = p->isUnphased || q->isUnphased;
 
+	uchar *src = myalloc(M, uchar), *src2 = myalloc(M, uchar), *y = myalloc(M+1, uchar);
+	y[M] = Y_SENTINEL;
+	memset(src, 0, Mp); memset(src+Mp, 1, q->M);
+	PbwtCursor *up = pbwtCursorCreate(p, TRUE, TRUE), *uq = pbwtCursorCreate(q, TRUE, TRUE);
+	for (i=0; i<p->N; i++)
+	{
+		int ip = 0, iq = 0, n0 = 0;
+		for (j=0; j<M; j++)
+		{
+			y[j] = src[j] ? uq->y[iq++] : up->y[ip++];
+			n0 += !y[j];
+		}
+		pack3arrayAdd(y, M, out->yz);
+		int k0 = 0, k1 = n0;
+		for (j=0; j<M; j++)
+			if ( y[j] ) src2[k1++] = src[j]; else src2[k0++] = src[j];
+		uchar *t = src; src = src2; src2 = t;
+		pbwtCursorForwardsRead(up); pbwtCursorForwardsRead(uq);
+	}
+	out->aFend = myalloc(M, int);
+	{
+		int ip = 0, iq = 0;
+		for (j=0; j<M; j++)
+			out->aFend[j] = src[j] ? Mp + uq->a[iq++] : up->a[ip++];
+	}
+
+	free(src); free(src2); free(y);
+	pbwtCursorDestroy(up); pbwtCursorDestroy(uq);
+	fprintf(logFile, "merged samples: M is %d + %d = %d at %d sites\n", Mp, q->M, M, out->N);
+	pbwtDestroy(p); pbwtDestroy(q);
+	return out;
+}
@@ -26,12 +26,9 @@
 #include "pbwt.h"
 //#include "dynamiclist.h"
 
-typedef struct { int j ; int start ; int end ; } MatchSegment ;
-/* matches are semi-open [start,end) so length is end-start */
-static Array *maxMatch = 0 ;	/* arrays of MatchSegment */
+static MatchLog *matchLog = 0 ;	/* of MatchSegment for each haplotype */
 static void reportMatch (int i, int j, int start, int end)
-{ MatchSegment *ms = arrayp (maxMatch[i], arrayMax(maxMatch[i]), MatchSegment) ;
-  ms->j = j ; ms->start = start ; ms->end = end ;
+{ matchLogAdd (matchLog, i, j, start, end) ;
 }
 
 static inline int isprevind(int i,int *map_indhap){
@@ -80,18 +77,18 @@ void paintAncestryMatrix (PBWT *p, char* fileRoot,int chunksperregion)
     }
   memset (nregions, 0, sizeof(double)*Ninds) ;
 
-  maxMatch = myalloc (p->M, Array) ;
-  for (i = 0 ; i < p->M ; ++i) maxMatch[i] = arrayCreate (1024, MatchSegment) ;
-  matchMaximalWithin (p, reportMatch) ;  /* store maximal matches in maxMatch */
+  matchLog = matchLogCreate (p->M) ;
+  matchMaximalWithin (p, reportMatch) ;  /* store maximal matches in matchLog */
+  matchLogIndex (matchLog, FALSE) ;
   double *partCounts = myalloc (Ninds, double) ;
   /* now weight per site based on distance from ends */
 
   for (i = 0 ; i < p->M ; ++i)
     { 
       //      printf("Processing individual %i (haplotype %i)\n",i/ploidy,i);
-      MatchSegment *m1 = arrp(maxMatch[i],0,MatchSegment), *m ;
+      MatchSegment *m1 = matchLogSegs(matchLog,i), *m ;
       int n1 = 1 ;		/* so don't have an empty chunk to start with! */
-      MatchSegment *mStop = arrp(maxMatch[i], arrayMax(maxMatch[i])-1, MatchSegment) ;
+      MatchSegment *mStop = matchLogSegs(matchLog,i) + matchLogCount(matchLog,i) - 1 ;
       memset (partCounts, 0, sizeof(double)*Ninds) ;
       for (k = 1 ; k < p->N ; k++)
 	{ double sum = 0 ;
@@ -120,6 +117,7 @@ void paintAncestryMatrix (PBWT *p, char* fileRoot,int chunksperregion)
   
   free(map_indhap);
   free (partCounts) ;
+  matchLogDestroy (matchLog) ; matchLog = 0 ;
 
   /* report results */
   FILE *fc = fopenTag (fileRoot, "chunkcounts.out", "w") ;
@@ -194,9 +192,9 @@ void paintAncestryMatrixSparse (PBWT *p, char* fileRoot,int chunksperregion,int
   double *t_counts3 = myalloc (Ninds,double);
   double *t_totlengths = myalloc (Ninds,double);
 
-  maxMatch = myalloc (p->M, Array) ;
-  for (i = 0 ; i < p->M ; ++i) maxMatch[i] = arrayCreate (1024, MatchSegment) ;
-  matchMaximalWithin (p, reportMatch) ;  /* store maximal matches in maxMatch */
+  matchLog = matchLogCreate (p->M) ;
+  matchMaximalWithin (p, reportMatch) ;  /* store maximal matches in matchLog */
+  matchLogIndex (matchLog, FALSE) ;
 
   double *partCounts = myalloc (Ninds, double) ; 
 
@@ -205,11 +203,11 @@ void paintAncestryMatrixSparse (PBWT *p, char* fileRoot,int chunksperregion,int
   for (i = 0 ; i < p->M ; ++i)
     {
       //      printf("Processing Individual %i in haplotype %i\n",i/ploidy,i);
-      MatchSegment *m1 = arrp(maxMatch[i],0,MatchSegment);      // m1 is a SEGMENT that matches at SNP i
+      MatchSegment *m1 = matchLogSegs(matchLog,i);      // m1 is a SEGMENT that matches at SNP i
       MatchSegment *m ;// m is another segment
       int n1 = 1 ; // number of chunks found so far. 1 so don't have an empty chunk to start with! 
 
-      MatchSegment *mStop = arrp(maxMatch[i], arrayMax(maxMatch[i])-1, MatchSegment) ;//
+      MatchSegment *mStop = matchLogSegs(matchLog,i) + matchLogCount(matchLog,i) - 1 ;//
       
       // Clear records if we have a new individual
       if(!isprevind(i,map_indhap)){
@@ -267,6 +265,7 @@ void paintAncestryMatrixSparse (PBWT *p, char* fileRoot,int chunksperregion,int
   free (t_totlengths) ;
 
   free (partCounts) ;
+  matchLogDestroy (matchLog) ; matchLog = 0 ;
   free (nregions) ;
   free(map_indhap);
 
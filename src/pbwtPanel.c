@@ -0,0 +1,416 @@
+/*  File: pbwtPanel.c
+ *  Copyright (C) Genome Research Limited, 2013-
+ *-------------------------------------------------------------------
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *-------------------------------------------------------------------
+ * Description: prepared reference panels for imputation, mapped rather than read
+ * Exported functions: pbwtWritePanel, pbwtReadPanel, pbwtPanelDestroy, pbwtPanelFrame, pbwtCursorSeek
+ * HISTORY:
+ * Created: Sun Oct 18 2026
+ *-------------------------------------------------------------------
+ */
+
+#include "pbwt.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A prepared panel is written once from a reference pbwt as root.refpanel, alongside the
+   usual root.sites and root.samples.  It holds the uncompressed yz at a page aligned
+   offset so that it can be mapped and read by cursors without decompression or copying,
+   a hash index from position to first site for intersecting target sites, and every
+   checkStep sites a checkpoint of the yz offset and sort order, so that a cursor can
+   start near any site instead of sweeping from the beginning.
+   Frames - the reference restricted to the sites shared with a target - are cached on
+   disk as root.frame.<key>, where the key hashes the panel and the list of shared sites,
+   so a second target typed on the same sites skips building the frame and its reverse.
+*/
+
+#define PAGE 4096
+
+static char *panelTag = "PBR1" ;
+
+typedef struct {
+  char tag[4] ;
+  int M, N ;
+  int nHash ;			/* size of hash table, a power of 2 */
+  int checkStep, nCheck ;
+  int pad ;
+  long nz ;			/* size of uncompressed yz */
+  long hashOffset, checkOffset, yzOffset ; /* file offsets; the last two page aligned */
+  unsigned long id ;		/* hash of the contents, part of frame cache keys */
+} PanelHeader ;
+
+struct PbwtPanelStruct {
+  unsigned long id ;
+  int nHash ;
+  int *hash ;			/* first site index at a position, -1 if empty */
+  int checkStep, nCheck ;
+  int *checkA ;			/* nCheck sort orders of M, mapped */
+  long *checkN ;		/* nCheck yz offsets, mapped */
+  void *checkMap ; long checkLen ;
+} ;
+
+static inline unsigned long fnvAdd (unsigned long h, void *data, long n)
+{
+  uchar *cp = (uchar*) data ;
+  while (n--) { h ^= *cp++ ; h *= 0x100000001b3UL ; }
+  return h ;
+}
+#define FNV_START 0xcbf29ce484222325UL
+
+static inline unsigned int hashX (int x, int nHash) { return ((unsigned int)x * 2654435761U) & (nHash-1) ; }
+
+static long pageAlign (long n) { return (n + PAGE - 1) & ~(long)(PAGE - 1) ; }
+
+static void padTo (FILE *fp, long n) { while (ftell (fp) < n) putc (0, fp) ; }
+
+/******************* writing *******************/
+
+/* Files are written under a temporary name and renamed into place, so a job that has
+   mapped the old .refpanel, or is reading a cached frame, never sees a partial file.
+*/
+
+static char *tmpTagName (char *root, char *tag)
+{
+  char *tmpName = myalloc (strlen (root) + 64, char) ;
+  sprintf (tmpName, "%s.%s.tmp%d", root, tag, (int) getpid ()) ;
+  return tmpName ;
+}
+
+static long tmpTagCommit (FILE *fp, char *root, char *tag)
+/* close fp, opened on tmpTagName(), and rename it into place as root.tag; returns size, or -1 on failure */
+{
+  char *tmpName = tmpTagName (root, tag) ;
+  char *fileName = myalloc (strlen (root) + 32, char) ;
+  sprintf (fileName, "%s.%s", root, tag) ;
+  long size = ftell (fp) ;
+  if (ferror (fp) | fclose (fp) || rename (tmpName, fileName)) { unlink (tmpName) ; size = -1 ; }
+  free (tmpName) ; free (fileName) ;
+  return size ;
+}
+
+static void panelFileWrite (PBWT *p, char *root, char *tag, void (*writeFunc)(PBWT*, FILE*))
+{
+  char *tmpName = tmpTagName (root, tag) ;
+  FILE *fp = fopen (tmpName, "w") ;
+  if (!fp) die ("failed to open %s", tmpName) ;
+  (*writeFunc) (p, fp) ;
+  if (tmpTagCommit (fp, root, tag) < 0) die ("error writing %s", tmpName) ;
+  free (tmpName) ;
+}
+
+void pbwtWritePanel (PBWT *p, char *root, int checkStep)
+{
+  if (!p || !p->sites) die ("pbwtWritePanel called without a pbwt with sites") ;
+  if (checkStep <= 0) die ("bad checkpoint interval %d for reference panel", checkStep) ;
+  if (p->yzStream) pbwtStreamMaterialize (p) ;
+  pbwtLoadBlocks (p) ;
+  if (!p->yz) die ("pbwtWritePanel called without a stored pbwt") ;
+  if (!p->aFend) die ("pbwt has no aFend in pbwtWritePanel - made by a previous version of the code") ;
+
+  int i, k ;
+  for (k = 1 ; k < p->N ; ++k)
+    if (arrp(p->sites,k,Site)->x < arrp(p->sites,k-1,Site)->x)
+      die ("reference panel sites must be sorted: site %d is out of order", k) ;
+
+  PanelHeader h ;
+  memset (&h, 0, sizeof(PanelHeader)) ;
+  memcpy (h.tag, panelTag, 4) ;
+  h.M = p->M ; h.N = p->N ; h.nz = arrayMax(p->yz) ;
+  for (h.nHash = 16 ; h.nHash < 2*p->N ; h.nHash *= 2) ;
+  h.checkStep = checkStep ; h.nCheck = p->N ? (p->N - 1) / checkStep + 1 : 0 ;
+  h.hashOffset = sizeof(PanelHeader) + 2*p->M*sizeof(int) ;
+  h.checkOffset = pageAlign (h.hashOffset + h.nHash*sizeof(int)) ;
+  long checkNOffset = h.checkOffset + (((long)h.nCheck*p->M*sizeof(int) + 7) & ~7L) ;
+  h.yzOffset = pageAlign (checkNOffset + h.nCheck*sizeof(long)) ;
+
+  h.id = fnvAdd (FNV_START, &h.M, 2*sizeof(int)) ;
+  h.id = fnvAdd (h.id, arrp(p->yz,0,uchar), h.nz) ;
+
+  int *hash = myalloc (h.nHash, int) ;
+  for (i = 0 ; i < h.nHash ; ++i) hash[i] = -1 ;
+  for (k = 0 ; k < p->N ; ++k)
+    { int x = arrp(p->sites,k,Site)->x ;
+      if (k && x == arrp(p->sites,k-1,Site)->x) continue ; /* keep the first site at x */
+      for (i = hashX (x, h.nHash) ; hash[i] >= 0 ; i = (i+1) & (h.nHash-1)) ;
+      hash[i] = k ;
+    }
+
+  char *tmpName = tmpTagName (root, "refpanel") ;
+  FILE *fp = fopen (tmpName, "w") ;
+  if (!fp) die ("failed to open %s", tmpName) ;
+  fwrite (&h, sizeof(PanelHeader), 1, fp) ;
+  fwrite (p->aFstart, sizeof(int), p->M, fp) ;
+  fwrite (p->aFend, sizeof(int), p->M, fp) ;
+  fwrite (hash, sizeof(int), h.nHash, fp) ;
+  padTo (fp, h.checkOffset) ;
+
+  long *checkN = myalloc (h.nCheck+1, long) ;
+  PbwtCursor *u = pbwtCursorCreate (p, TRUE, TRUE) ;
+  for (k = 0 ; k < p->N ; ++k)
+    { if (!(k % checkStep))
+	{ checkN[k / checkStep] = u->nBlockStart ;
+	  fwrite (u->a, sizeof(int), p->M, fp) ;
+	}
+      pbwtCursorForwardsRead (u) ;
+    }
+  pbwtCursorDestroy (u) ;
+  padTo (fp, checkNOffset) ;
+  fwrite (checkN, sizeof(long), h.nCheck, fp) ;
+  padTo (fp, h.yzOffset) ;
+  fwrite (arrp(p->yz,0,uchar), 1, h.nz, fp) ;
+  panelFileWrite (p, root, "sites", pbwtWriteSites) ;
+  if (p->samples) panelFileWrite (p, root, "samples", pbwtWriteSamples) ;
+  if (tmpTagCommit (fp, root, "refpanel") < 0) die ("error writing %s", tmpName) ; /* last */
+  free (tmpName) ;
+
+  fprintf (logFile, "prepared reference panel %s.refpanel: M, N are %d, %d, %ld bytes of pbwt, %d checkpoints\n",
+	   root, p->M, p->N, h.nz, h.nCheck) ;
+
+  free (hash) ; free (checkN) ;
+}
+
+/******************* reading *******************/
+
+PBWT *pbwtReadPanel (char *root)
+{
+  FILE *fp = fopenTag (root, "refpanel", "r") ;
+  if (!fp) return 0 ;
+
+  PanelHeader h ;
+  if (fread (&h, sizeof(PanelHeader), 1, fp) != 1 || strncmp (h.tag, panelTag, 4))
+    die ("%s.refpanel is not a reference panel written by this version of pbwt", root) ;
+  PBWT *p = pbwtCreate (h.M, h.N) ;
+  p->aFend = myalloc (h.M, int) ;
+  if (fread (p->aFstart, sizeof(int), h.M, fp) != h.M ||
+      fread (p->aFend, sizeof(int), h.M, fp) != h.M)
+    die ("error reading start and end orders in %s.refpanel", root) ;
+
+  PbwtPanel *rp = mycalloc (1, PbwtPanel) ;
+  p->panel = rp ;
+  rp->id = h.id ;
+  rp->nHash = h.nHash ;
+  rp->hash = myalloc (h.nHash, int) ;
+  if (fseek (fp, h.hashOffset, SEEK_SET) || fread (rp->hash, sizeof(int), h.nHash, fp) != h.nHash)
+    die ("error reading site index in %s.refpanel", root) ;
+
+  rp->checkStep = h.checkStep ; rp->nCheck = h.nCheck ;
+  rp->checkLen = h.yzOffset - h.checkOffset ;
+  if (h.nCheck)
+    { rp->checkMap = mmap (0, rp->checkLen, PROT_READ, MAP_SHARED, fileno (fp), h.checkOffset) ;
+      if (rp->checkMap == MAP_FAILED) die ("failed to map checkpoints in %s.refpanel", root) ;
+      rp->checkA = (int*) rp->checkMap ;
+      rp->checkN = (long*) ((char*) rp->checkMap + (((long)h.nCheck*h.M*sizeof(int) + 7) & ~7L)) ;
+    }
+
+  if (h.nz)
+    { if (!(p->yzBlocks = pbwtBlocksMap (fileno (fp), h.yzOffset, h.nz, h.M)))
+	die ("failed to map pbwt in %s.refpanel", root) ;
+    }
+  else
+    p->yz = arrayCreate (1, uchar) ;
+  fclose (fp) ;			/* the mappings stay valid */
+
+  if ((fp = fopenTag (root, "sites", "r"))) { pbwtReadSites (p, fp) ; fclose (fp) ; }
+  else die ("failed to open %s.sites for reference panel", root) ;
+  if ((fp = fopenTag (root, "samples", "r"))) { pbwtReadSamples (p, fp) ; fclose (fp) ; }
+
+  fprintf (logFile, "mapped reference panel %s.refpanel: M, N are %d, %d, %d checkpoints\n",
+	   root, p->M, p->N, rp->nCheck) ;
+  return p ;
+}
+
+void pbwtPanelDestroy (PbwtPanel *rp)
+{
+  if (rp->checkMap) munmap (rp->checkMap, rp->checkLen) ;
+  free (rp->hash) ;
+  free (rp) ;
+}
+
+PbwtCursor *pbwtCursorSeek (PBWT *p, int k)
+{
+  if (k < 0 || k > p->N) die ("pbwtCursorSeek to site %d out of range", k) ;
+  PbwtPanel *rp = p->panel ;
+  PbwtCursor *u ;
+  int kAt = 0 ;
+  if (rp && rp->nCheck && k >= rp->checkStep)
+    { int i = k / rp->checkStep ;
+      if (i >= rp->nCheck) i = rp->nCheck - 1 ;
+      u = pbwtCursorCreateAt (p, rp->checkA + (long)i*p->M, rp->checkN[i]) ;
+      kAt = i * rp->checkStep ;
+    }
+  else
+    u = pbwtCursorCreate (p, TRUE, TRUE) ;
+  for ( ; kAt < k ; ++kAt) pbwtCursorForwardsRead (u) ;
+  return u ;
+}
+
+/******************* frames *******************/
+
+static Array panelSelect (PBWT *pRef, Array sites)
+/* indices of the sites of pRef that selectSitesLocal() would keep, found through the index */
+{
+  PbwtPanel *rp = pRef->panel ;
+  Array select = arrayCreate (arrayMax(sites), int) ;
+  int ia = 0, i ;
+  while (ia < arrayMax(sites))
+    { int x = arrp(sites,ia,Site)->x, iaEnd = ia ;
+      while (iaEnd < arrayMax(sites) && arrp(sites,iaEnd,Site)->x == x) ++iaEnd ;
+      for (i = hashX (x, rp->nHash) ; rp->hash[i] >= 0 ; i = (i+1) & (rp->nHash-1))
+	if (arrp(pRef->sites,rp->hash[i],Site)->x == x) break ;
+      int ip = rp->hash[i] ;
+      if (ip >= 0)		/* merge the sites at x as selectSitesLocal() does */
+	while (ip < pRef->N && ia < iaEnd)
+	  { Site *sp = arrp(pRef->sites,ip,Site), *sa = arrp(sites,ia,Site) ;
+	    if (sp->x != x) break ;
+	    char *sa_als = dictName (variationDict, sa->varD) ;
+	    char *sp_als = dictName (variationDict, sp->varD) ;
+	    BOOL noAlt = sa_als[strlen(sa_als)-1] == '.' || sp_als[strlen(sp_als)-1] == '.' ;
+	    if (!noAlt && sp->varD < sa->varD) ++ip ;
+	    else if (!noAlt && sp->varD > sa->varD) ++ia ;
+	    else { array(select, arrayMax(select), int) = ip ; ++ip ; ++ia ; }
+	  }
+      ia = iaEnd ;
+    }
+  return select ;
+}
+
+/* A cached frame is the usual pbwt files under frameRoot, plus a .frame file listing
+   each of them with its size.  Each file is written under a temporary name then renamed
+   into place, the .frame file last, so readers never see a partial file, and jobs
+   writing the same frame at once write the same contents.  A frame whose files are
+   missing or the wrong size is treated as absent.
+*/
+
+static long frameFileSize (char *frameRoot, char *tag)
+{
+  char *fileName = myalloc (strlen (frameRoot) + 32, char) ;
+  struct stat st ;
+  sprintf (fileName, "%s.%s", frameRoot, tag) ;
+  long size = stat (fileName, &st) ? -1 : st.st_size ;
+  free (fileName) ;
+  return size ;
+}
+
+static PBWT *frameRead (char *frameRoot)
+/* as pbwtReadAll(), but leaves checking the sites to isFrameValid() */
+{
+  FILE *fp ;
+  char tag[32] ;
+  long size ;
+  BOOL isPbwt = FALSE, isSites = FALSE, isOK = TRUE ;
+
+  if (!(fp = fopenTag (frameRoot, "frame", "r"))) return 0 ;
+  while (fscanf (fp, "%31s %ld", tag, &size) == 2)
+    { if (frameFileSize (frameRoot, tag) != size) isOK = FALSE ;
+      if (!strcmp (tag, "pbwt")) isPbwt = TRUE ;
+      if (!strcmp (tag, "sites")) isSites = TRUE ;
+    }
+  fclose (fp) ;
+  if (!isOK || !isPbwt || !isSites)
+    { fprintf (logFile, "cached frame %s is incomplete - rebuilding it\n", frameRoot) ;
+      return 0 ;
+    }
+
+  if (!(fp = fopenTag (frameRoot, "pbwt", "r"))) return 0 ;
+  PBWT *p = pbwtRead (fp) ; fclose (fp) ;
+  if ((fp = fopenTag (frameRoot, "sites", "r"))) { p->sites = pbwtReadSitesFile (fp, &p->chrom) ; fclose (fp) ; }
+  if ((fp = fopenTag (frameRoot, "samples", "r"))) { pbwtReadSamples (p, fp) ; fclose (fp) ; }
+  if ((fp = fopenTag (frameRoot, "reverse", "r"))) { pbwtReadReverse (p, fp) ; fclose (fp) ; }
+  return p ;
+}
+
+static BOOL frameFileWrite (PBWT *p, char *frameRoot, char *tag, void (*writeFunc)(PBWT*, FILE*), FILE *fList)
+{
+  char *tmpName = tmpTagName (frameRoot, tag) ;
+  FILE *fp = fopen (tmpName, "w") ;
+  free (tmpName) ;
+  if (!fp) return FALSE ;
+  (*writeFunc) (p, fp) ;
+  long size = tmpTagCommit (fp, frameRoot, tag) ;
+  if (size < 0) return FALSE ;
+  fprintf (fList, "%s %ld\n", tag, size) ;
+  return TRUE ;
+}
+
+static void frameWrite (PBWT *p, char *frameRoot)
+{
+  char *tmpName = tmpTagName (frameRoot, "frame") ;
+  FILE *fList = fopen (tmpName, "w") ;
+  free (tmpName) ;
+  BOOL isOK = fList
+    && frameFileWrite (p, frameRoot, "sites", pbwtWriteSites, fList)
+    && (!p->samples || frameFileWrite (p, frameRoot, "samples", pbwtWriteSamples, fList))
+    && (!p->zz || frameFileWrite (p, frameRoot, "reverse", pbwtWriteReverse, fList))
+    && frameFileWrite (p, frameRoot, "pbwt", pbwtWrite, fList) ;
+  if (isOK) isOK = tmpTagCommit (fList, frameRoot, "frame") >= 0 ; /* the list goes last */
+  else if (fList) { fclose (fList) ; unlink (tmpName = tmpTagName (frameRoot, "frame")) ; free (tmpName) ; }
+  if (!isOK) fprintf (logFile, "can't write cached frame %s - carrying on without it\n", frameRoot) ;
+}
+
+static BOOL isFrameValid (PBWT *pFrame, PBWT *pRef, Array select)
+{
+  int k ;
+  if (pFrame->M != pRef->M || pFrame->N != arrayMax(select) || 
+      !pFrame->sites || arrayMax(pFrame->sites) != pFrame->N) return FALSE ;
+  for (k = 0 ; k < pFrame->N ; ++k)
+    { Site *sf = arrp(pFrame->sites,k,Site), *sr = arrp(pRef->sites,arr(select,k,int),Site) ;
+      if (sf->x != sr->x || sf->varD != sr->varD) return FALSE ;
+    }
+  return TRUE ;
+}
+
+PBWT *pbwtPanelFrame (PBWT *pRef, char *root, Array sites, BOOL isReverse)
+{
+  PBWT *pFrame ;
+  if (!pRef->panel)
+    { pFrame = pbwtSelectSites (pRef, sites, TRUE) ;
+      if (isReverse) pbwtBuildReverse (pFrame) ;
+      return pFrame ;
+    }
+
+  Array select = panelSelect (pRef, sites) ;
+  unsigned long key = fnvAdd (FNV_START, &pRef->panel->id, sizeof(unsigned long)) ;
+  if (arrayMax(select)) key = fnvAdd (key, arrp(select,0,int), arrayMax(select)*sizeof(int)) ;
+  char *frameRoot = myalloc (strlen(root) + 32, char) ;
+  sprintf (frameRoot, "%s.frame.%016lx", root, key) ;
+
+  if ((pFrame = frameRead (frameRoot)))
+    { if (isFrameValid (pFrame, pRef, select))
+	{ fprintf (logFile, "%d sites selected from %d, read from cached frame %s\n",
+		   pFrame->N, pRef->N, frameRoot) ;
+	  if (isReverse && !pFrame->zz)
+	    { pbwtBuildReverse (pFrame) ;
+	      frameWrite (pFrame, frameRoot) ; /* so the list includes the reverse */
+	    }
+	}
+      else
+	{ warn ("cached frame %s does not match reference - rebuilding it", frameRoot) ;
+	  pbwtDestroy (pFrame) ; pFrame = 0 ;
+	}
+    }
+  if (!pFrame)
+    { Array selSites = arrayCreate (arrayMax(select), Site) ;
+      int i ;
+      for (i = 0 ; i < arrayMax(select) ; ++i)
+	array(selSites, i, Site) = arr(pRef->sites, arr(select,i,int), Site) ;
+      pFrame = pbwtSelectSites (pRef, selSites, TRUE) ;
+      arrayDestroy (selSites) ;
+      if (isReverse) pbwtBuildReverse (pFrame) ;
+      frameWrite (pFrame, frameRoot) ;
+    }
+
+  free (frameRoot) ; arrayDestroy (select) ;
+  return pFrame ;
+}
+
+/******************* end of file *******************/
@@ -59,7 +59,7 @@ char* popName (Sample *s) { return dictName (populationDict, s->popD) ; }
 PBWT *pbwtSubSample (PBWT *pOld, Array select)
 /* select[i] is the position in old of the i'th position in new */
 {
-  if (!pOld || !pOld->yz) die ("subSample called without valid pbwt") ;
+  if (!pOld || !(pOld->yz || pOld->yzBlocks)) die ("subSample called without valid pbwt") ;
 
   PBWT *pNew = pbwtCreate (arrayMax(select), pOld->N) ;
   int i, j, nOld = 0 ;
@@ -86,9 +86,10 @@ PBWT *pbwtSubSample (PBWT *pOld, Array select)
     }
   pNew->chrom = pOld->chrom ; pOld->chrom = 0 ;
   pNew->sites = pOld->sites ; pOld->sites = 0 ;
+  pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ;
   pbwtDestroy (pOld) ; /* destroy will free old samples */
 
-  free(x) ; free(ainv) ; pbwtCursorDestroy (uOld) ; pbwtCursorDestroy (uNew) ;
+  free(x) ; free(ainv) ;
   return pNew ;
 }
 
@@ -116,30 +117,41 @@ PBWT *pbwtReadProjections (PBWT *pOld, FILE *fp)
 }
 
 
-PBWT *pbwtSelectSamples (PBWT *pOld, FILE *fp)
+Array pbwtSelectSamplesIndex (Array oldSamples, FILE *fp)
+/* positions in oldSamples of the haplotypes of the samples in fp, in file order; 0 if none */
 {
-  if (!pOld || !pOld->samples) die ("pbwtSelectSamples called without pre-existing sample names") ;
   int i, j ;
 
   Array newSamples = pbwtReadSamplesFile (fp) ;
 
-  if (!arrayMax(newSamples)) return pOld ;
+  if (!arrayMax(newSamples)) { arrayDestroy (newSamples) ; return 0 ; }
 
   Array oldStart = arrayCreate (arrayMax(samples), int) ; /* start of each sample in old */
   Array oldCount = arrayCreate (arrayMax(samples), int) ; /* how many of each sample in old */
-  for (i = 0 ; i < pOld->M ; ++i)
-    { if (!array(oldCount, arr(pOld->samples,i,int), int))
-	array(oldStart, arr(pOld->samples,i,int), int) = i ;
-      ++arr(oldCount, arr(pOld->samples,i,int), int) ;
+  for (i = 0 ; i < arrayMax(oldSamples) ; ++i)
+    { if (!array(oldCount, arr(oldSamples,i,int), int))
+	array(oldStart, arr(oldSamples,i,int), int) = i ;
+      ++arr(oldCount, arr(oldSamples,i,int), int) ;
     }
 
-  Array select = arrayCreate (pOld->M, int) ;
+  Array select = arrayCreate (arrayMax(oldSamples), int) ;
   for (i = 0 ; i < arrayMax(newSamples) ; ++i)
     for (j = 0 ; j < array(oldCount,arr(newSamples,i,int),int) ; ++j)
       array(select,arrayMax(select),int) = arr(oldStart,arr(newSamples,i,int),int)++ ;
 
+  arrayDestroy (oldCount) ; arrayDestroy (oldStart) ; arrayDestroy (newSamples) ;
+  return select ;
+}
+
+PBWT *pbwtSelectSamples (PBWT *pOld, FILE *fp)
+{
+  if (!pOld || !pOld->samples) die ("pbwtSelectSamples called without pre-existing sample names") ;
+
+  Array select = pbwtSelectSamplesIndex (pOld->samples, fp) ;
+  if (!select) return pOld ;
+
   PBWT *pNew = pbwtSubSample (pOld, select) ;
-  arrayDestroy (select) ; arrayDestroy (oldCount) ; arrayDestroy (oldStart) ;
+  arrayDestroy (select) ;
   return pNew ;
 }
 
@@ -0,0 +1,280 @@
+/*  File: pbwtStream.c
+ *  Copyright (C) Genome Research Limited, 2013-
+ *-------------------------------------------------------------------
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *-------------------------------------------------------------------
+ * Description: PBWT whose columns arrive from a reader thread while commands run
+ * Exported functions: pbwtStreamCreate/Put/Close/Destroy/Start/Max/Fetch, pbwtStreamMaterialize/Drain
+ * HISTORY:
+ * Created: Sun Oct 18 2026
+ *-------------------------------------------------------------------
+ */
+
+#include "pbwt.h"
+#include <pthread.h>
+
+/* A producer thread parses input and packs each column as it goes, handing the
+   packed bytes with the site over a bounded queue.  The PBWT it feeds has p->yzStream
+   set and no yz.  A forwards cursor on it pulls columns off the queue as it moves,
+   adding each site to p->sites and incrementing p->N as its column arrives, so loops
+   over p->N in forward sweeps see the sites they need in time.  Only the current and
+   previous columns are held, as for lazily read block files.  Anything else first
+   calls pbwtStreamMaterialize(), which builds yz from the rest of the queue; that is
+   only possible if no cursor has started on the stream.
+*/
+
+#define QUEUE_SIZE 256
+
+typedef struct {
+  uchar *z ; int nz ;		/* packed column */
+  uchar *zMissing ; int nzMissing ; /* packed missing data in natural order, 0 if none */
+  int x ;			/* position */
+  char *var ;			/* "REF\tALT" */
+} StreamColumn ;
+
+typedef struct {
+  StreamColumn *col ;
+  long start ;			/* offset in the virtual yz */
+} StreamSlot ;
+
+struct PbwtStreamStruct {
+  PBWT *p ;
+  pthread_t thread ;
+  pthread_mutex_t lock ;
+  pthread_cond_t notEmpty, notFull ;
+  StreamColumn *queue[QUEUE_SIZE] ;
+  int head, nQueue ;
+  BOOL isClosed ;		/* producer has finished */
+  BOOL isAbort ;		/* consumer has gone away */
+  int *aEnd ;			/* final order from the producer */
+  char *chrom ;			/* set by producer before first put */
+  /* consumer side */
+  StreamSlot prev, cur, next ;
+  BOOL isNextRead ;		/* next has been taken from the queue; if next.col is 0 we are done */
+  BOOL isStarted ;		/* a cursor has taken columns */
+  BOOL isDone ;
+  void (*producer)(PbwtStream *zs, void *arg) ;
+  void *arg ;
+} ;
+
+static void *streamThread (void *arg)
+{
+  PbwtStream *zs = (PbwtStream*) arg ;
+  (*zs->producer) (zs, zs->arg) ;
+  return 0 ;
+}
+
+PbwtStream *pbwtStreamCreate (PBWT *p, void (*producer)(PbwtStream *zs, void *arg), void *arg)
+{
+  PbwtStream *zs = mycalloc (1, PbwtStream) ;
+  zs->p = p ;
+  zs->producer = producer ; zs->arg = arg ;
+  pthread_mutex_init (&zs->lock, 0) ;
+  pthread_cond_init (&zs->notEmpty, 0) ;
+  pthread_cond_init (&zs->notFull, 0) ;
+  p->yzStream = zs ;
+  if (!p->sites) p->sites = arrayCreate (10000, Site) ;
+  if (pthread_create (&zs->thread, 0, streamThread, zs)) die ("failed to start stream thread") ;
+  return zs ;
+}
+
+static void columnDestroy (StreamColumn *c)
+{
+  if (!c) return ;
+  free (c->z) ; if (c->zMissing) free (c->zMissing) ; free (c->var) ; free (c) ;
+}
+
+/************ producer side ************/
+
+BOOL pbwtStreamPut (PbwtStream *zs, uchar *z, int nz, uchar *zMissing, int nzMissing, int x, char *var)
+/* copies its arguments; returns FALSE if the consumer has gone and the producer should stop */
+{
+  StreamColumn *c = mycalloc (1, StreamColumn) ;
+  c->z = myalloc (nz, uchar) ; memcpy (c->z, z, nz) ; c->nz = nz ;
+  if (nzMissing)
+    { c->zMissing = myalloc (nzMissing, uchar) ; memcpy (c->zMissing, zMissing, nzMissing) ;
+      c->nzMissing = nzMissing ;
+    }
+  c->x = x ;
+  c->var = strdup (var) ;
+
+  pthread_mutex_lock (&zs->lock) ;
+  while (zs->nQueue == QUEUE_SIZE && !zs->isAbort) pthread_cond_wait (&zs->notFull, &zs->lock) ;
+  BOOL isOK = !zs->isAbort ;
+  if (isOK)
+    { zs->queue[(zs->head + zs->nQueue++) % QUEUE_SIZE] = c ;
+      pthread_cond_signal (&zs->notEmpty) ;
+    }
+  pthread_mutex_unlock (&zs->lock) ;
+  if (!isOK) columnDestroy (c) ;
+  return isOK ;
+}
+
+void pbwtStreamClose (PbwtStream *zs, char *chrom, int *aEnd)
+/* end of data; aEnd is the final sort order, chrom may be 0 if there were no sites */
+{
+  pthread_mutex_lock (&zs->lock) ;
+  if (chrom && !zs->chrom) zs->chrom = strdup (chrom) ;
+  zs->aEnd = myalloc (zs->p->M, int) ; memcpy (zs->aEnd, aEnd, zs->p->M*sizeof(int)) ;
+  zs->isClosed = TRUE ;
+  pthread_cond_signal (&zs->notEmpty) ;
+  pthread_mutex_unlock (&zs->lock) ;
+}
+
+void pbwtStreamSetChrom (PbwtStream *zs, char *chrom)
+{
+  pthread_mutex_lock (&zs->lock) ;
+  if (!zs->chrom) zs->chrom = strdup (chrom) ;
+  pthread_mutex_unlock (&zs->lock) ;
+}
+
+/************ consumer side ************/
+
+static StreamColumn *streamPop (PbwtStream *zs) /* 0 at end */
+{
+  StreamColumn *c = 0 ;
+  pthread_mutex_lock (&zs->lock) ;
+  while (!zs->nQueue && !zs->isClosed) pthread_cond_wait (&zs->notEmpty, &zs->lock) ;
+  if (zs->nQueue)
+    { c = zs->queue[zs->head] ;
+      zs->head = (zs->head + 1) % QUEUE_SIZE ; --zs->nQueue ;
+      pthread_cond_signal (&zs->notFull) ;
+    }
+  if (!zs->p->chrom && zs->chrom) zs->p->chrom = strdup (zs->chrom) ;
+  pthread_mutex_unlock (&zs->lock) ;
+  return c ;
+}
+
+static void streamAccept (PbwtStream *zs, StreamColumn *c)
+/* add the site and missing data for c, in the main thread because of variationDict */
+{
+  PBWT *p = zs->p ;
+  if (c->zMissing)
+    { if (!p->zMissing)
+	{ p->zMissing = arrayCreate (10000, uchar) ;
+	  array(p->zMissing, 0, uchar) = 0 ; /* needed so missing[] has offset > 0 */
+	  p->missingOffset = arrayCreate (1024, long) ;
+	}
+      long off = arrayMax(p->zMissing) ;
+      array(p->missingOffset, p->N, long) = off ;
+      memcpy (arrayBlock(p->zMissing, off, c->nzMissing, uchar), c->zMissing, c->nzMissing) ;
+      arrayMax(p->zMissing) = off + c->nzMissing ;
+    }
+  else if (p->missingOffset)
+    array(p->missingOffset, p->N, long) = 0 ;
+  Site *s = arrayp(p->sites, p->N++, Site) ;
+  s->x = c->x ;
+  dictAdd (variationDict, c->var, &s->varD) ;
+}
+
+static void streamFinish (PbwtStream *zs)
+{
+  PBWT *p = zs->p ;
+  pthread_join (zs->thread, 0) ;
+  if (!p->chrom && zs->chrom) p->chrom = strdup (zs->chrom) ;
+  if (!p->aFend) p->aFend = myalloc (p->M, int) ;
+  memcpy (p->aFend, zs->aEnd, p->M*sizeof(int)) ;
+  zs->isDone = TRUE ;
+  fprintf (logFile, "stream finished with %d sites on chromosome %s: M, N are %d, %d\n",
+	   p->N, p->chrom, p->M, p->N) ;
+}
+
+void pbwtStreamStart (PbwtStream *zs) /* called when a cursor is made: only one can read */
+{
+  if (zs->isStarted)
+    die ("the stream has already been read by an earlier command: use -readVcfGT to keep the data") ;
+  zs->isStarted = TRUE ;
+}
+
+long pbwtStreamMax (PbwtStream *zs)
+/* size of the bytes seen so far, including the next column; waits for it if needed */
+{
+  if (!zs->isNextRead && !zs->isDone)
+    { zs->next.col = streamPop (zs) ;
+      zs->isNextRead = TRUE ;
+      if (!zs->next.col) streamFinish (zs) ;
+    }
+  long end = zs->cur.col ? zs->cur.start + zs->cur.col->nz : 0 ;
+  return zs->next.col ? end + zs->next.col->nz : end ;
+}
+
+uchar *pbwtStreamFetch (PbwtStream *zs, long n)
+/* pointer to byte n; the current and previous columns stay valid */
+{
+  if (zs->cur.col && n >= zs->cur.start && n < zs->cur.start + zs->cur.col->nz)
+    return zs->cur.col->z + (n - zs->cur.start) ;
+  if (zs->prev.col && n >= zs->prev.start && n < zs->prev.start + zs->prev.col->nz)
+    return zs->prev.col->z + (n - zs->prev.start) ;
+  long end = zs->cur.col ? zs->cur.start + zs->cur.col->nz : 0 ;
+  if (n != end) die ("stream cursors can only move forwards: byte %ld requested at %ld", n, end) ;
+  if (!zs->isNextRead) pbwtStreamMax (zs) ;
+  if (!zs->next.col) die ("read past the end of a stream") ;
+  columnDestroy (zs->prev.col) ;
+  zs->prev = zs->cur ;
+  zs->cur.col = zs->next.col ; zs->cur.start = end ;
+  zs->next.col = 0 ; zs->isNextRead = FALSE ;
+  streamAccept (zs, zs->cur.col) ;
+  return zs->cur.col->z ;
+}
+
+void pbwtStreamMaterialize (PBWT *p)
+/* turn p into an ordinary PBWT by storing the rest of the stream in p->yz */
+{
+  PbwtStream *zs = p->yzStream ;
+  if (!zs) return ;
+  pbwtStreamStart (zs) ;
+  StreamColumn *c ;
+  p->yz = arrayCreate (1<<20, uchar) ;
+  while ((c = streamPop (zs)))
+    { long off = arrayMax(p->yz) ;
+      memcpy (arrayBlock(p->yz, off, c->nz, uchar), c->z, c->nz) ;
+      arrayMax(p->yz) = off + c->nz ;
+      streamAccept (zs, c) ;
+      columnDestroy (c) ;
+    }
+  streamFinish (zs) ;
+  pbwtStreamDestroy (zs) ;
+  p->yzStream = 0 ;
+}
+
+void pbwtStreamDrain (PBWT *p)
+/* read to the end keeping the sites but not the columns */
+{
+  PbwtStream *zs = p->yzStream ;
+  if (!zs || zs->isDone) return ;
+  zs->isStarted = TRUE ;
+  StreamColumn *c ;
+  if (zs->next.col) { streamAccept (zs, zs->next.col) ; columnDestroy (zs->next.col) ; zs->next.col = 0 ; }
+  while ((c = streamPop (zs))) { streamAccept (zs, c) ; columnDestroy (c) ; }
+  zs->isNextRead = TRUE ;
+  streamFinish (zs) ;
+}
+
+void pbwtStreamDestroy (PbwtStream *zs)
+{
+  if (!zs->isDone)		/* stop the producer */
+    { pthread_mutex_lock (&zs->lock) ;
+      zs->isAbort = TRUE ;
+      pthread_cond_signal (&zs->notFull) ;
+      pthread_mutex_unlock (&zs->lock) ;
+      pthread_join (zs->thread, 0) ;
+    }
+  while (zs->nQueue) { columnDestroy (zs->queue[zs->head]) ; zs->head = (zs->head + 1) % QUEUE_SIZE ; --zs->nQueue ; }
+  columnDestroy (zs->prev.col) ; columnDestroy (zs->cur.col) ; columnDestroy (zs->next.col) ;
+  if (zs->aEnd) free (zs->aEnd) ;
+  if (zs->chrom) free (zs->chrom) ;
+  pthread_mutex_destroy (&zs->lock) ;
+  pthread_cond_destroy (&zs->notEmpty) ; pthread_cond_destroy (&zs->notFull) ;
+  if (zs->p->yzStream == zs) zs->p->yzStream = 0 ;
+  free (zs) ;
+}
+
+/******************* end of file *******************/
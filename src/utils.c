@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <math.h>
 #include "utils.h"
 
 void die (char *format, ...)
@@ -135,6 +136,169 @@ char *fgetword (FILE *f)	// pass NULL to free alloced memory
   return buf ;
 }
 
+/***************** buffered output ******************/
+
+/* Text exporters format whole rows into a large buffer and hand it over in one go.
+   If gzip is requested, compression runs in a background thread on one buffer while
+   the caller fills the other.
+*/
+
+#include <unistd.h>
+
+#define OUTBUF_SIZE (1 << 22)
+
+static void outBufWrite (OutBuf *ob, char *buf, long n)
+{
+  if (ob->gz)
+    { if (n && gzwrite (ob->gz, buf, n) != n) die ("gzip write failure") ; }
+  else if (n && fwrite (buf, 1, n, ob->fp) != n) die ("write failure") ;
+}
+
+static void *outBufThread (void *arg)
+{
+  OutBuf *ob = (OutBuf*) arg ;
+  pthread_mutex_lock (&ob->lock) ;
+  while (TRUE)
+    { while (!ob->nPending && !ob->isDone) pthread_cond_wait (&ob->ready, &ob->lock) ;
+      if (!ob->nPending && ob->isDone) break ;
+      pthread_mutex_unlock (&ob->lock) ;
+      outBufWrite (ob, ob->pending, ob->nPending) ;
+      pthread_mutex_lock (&ob->lock) ;
+      ob->nPending = 0 ;
+      pthread_cond_signal (&ob->written) ;
+    }
+  pthread_mutex_unlock (&ob->lock) ;
+  return 0 ;
+}
+
+OutBuf *outBufCreate (FILE *fp, BOOL isGzip)
+{
+  OutBuf *ob = mycalloc (1, OutBuf) ;
+  ob->fp = fp ;
+  ob->size = OUTBUF_SIZE ;
+  ob->buf = myalloc (ob->size, char) ;
+  ob->cp = ob->buf ; ob->end = ob->buf + ob->size ;
+  if (isGzip)
+    { fflush (fp) ;
+      if (!(ob->gz = gzdopen (dup (fileno (fp)), "wb"))) die ("failed to open gzip output") ;
+      ob->pending = myalloc (ob->size, char) ;
+      pthread_mutex_init (&ob->lock, 0) ;
+      pthread_cond_init (&ob->ready, 0) ;
+      pthread_cond_init (&ob->written, 0) ;
+      if (pthread_create (&ob->thread, 0, outBufThread, ob)) die ("failed to create output thread") ;
+    }
+  return ob ;
+}
+
+void outBufFlush (OutBuf *ob)
+{
+  long n = ob->cp - ob->buf ;
+  if (ob->gz)			/* swap buffers with the compression thread */
+    { pthread_mutex_lock (&ob->lock) ;
+      while (ob->nPending) pthread_cond_wait (&ob->written, &ob->lock) ;
+      char *t = ob->pending ; ob->pending = ob->buf ; ob->buf = t ;
+      ob->nPending = n ;
+      pthread_cond_signal (&ob->ready) ;
+      pthread_mutex_unlock (&ob->lock) ;
+    }
+  else
+    outBufWrite (ob, ob->buf, n) ;
+  ob->cp = ob->buf ; ob->end = ob->buf + ob->size ;
+}
+
+char *outBufReserveSlow (OutBuf *ob, long n)
+{
+  outBufFlush (ob) ;
+  if (n > ob->end - ob->cp)	/* a single row bigger than the buffer: grow it */
+    { long size = n + OUTBUF_SIZE ;
+      free (ob->buf) ; ob->buf = myalloc (size, char) ;
+      if (ob->gz)		/* keep both buffers the same size, so the swap is safe */
+	{ pthread_mutex_lock (&ob->lock) ;
+	  while (ob->nPending) pthread_cond_wait (&ob->written, &ob->lock) ;
+	  free (ob->pending) ; ob->pending = myalloc (size, char) ;
+	  pthread_mutex_unlock (&ob->lock) ;
+	}
+      ob->size = size ;
+      ob->cp = ob->buf ; ob->end = ob->buf + size ;
+    }
+  return ob->cp ;
+}
+
+void outBufDestroy (OutBuf *ob)	/* flushes, finishes any compression; does not close ob->fp */
+{
+  outBufFlush (ob) ;
+  if (ob->gz)
+    { pthread_mutex_lock (&ob->lock) ;
+      ob->isDone = TRUE ;
+      pthread_cond_signal (&ob->ready) ;
+      pthread_mutex_unlock (&ob->lock) ;
+      pthread_join (ob->thread, 0) ;
+      if (gzclose (ob->gz) != Z_OK) die ("failed to close gzip output") ;
+      free (ob->pending) ;
+      pthread_mutex_destroy (&ob->lock) ;
+      pthread_cond_destroy (&ob->ready) ; pthread_cond_destroy (&ob->written) ;
+    }
+  else
+    fflush (ob->fp) ;
+  if (ferror (ob->fp)) die ("error writing output") ;
+  free (ob->buf) ;
+  free (ob) ;
+}
+
+void outBufPrintf (OutBuf *ob, char *format, ...)
+{
+  va_list args ;
+  int n ;
+
+  va_start (args, format) ;
+  n = vsnprintf (ob->cp, ob->end - ob->cp, format, args) ;
+  va_end (args) ;
+  if (n >= ob->end - ob->cp)	/* didn't fit - make space and redo */
+    { outBufReserve (ob, n+1) ;
+      va_start (args, format) ;
+      vsnprintf (ob->cp, n+1, format, args) ;
+      va_end (args) ;
+    }
+  ob->cp += n ;
+}
+
+static char digitPairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899" ;
+
+char *outBufDigits (char *cp, unsigned long n) /* write decimal n at cp, return end */
+{
+  char tmp[24], *tp = tmp + sizeof(tmp) ;
+  while (n >= 100) { tp -= 2 ; memcpy (tp, digitPairs + 2*(n % 100), 2) ; n /= 100 ; }
+  if (n >= 10) { tp -= 2 ; memcpy (tp, digitPairs + 2*n, 2) ; }
+  else *--tp = '0' + n ;
+  n = tmp + sizeof(tmp) - tp ;
+  memcpy (cp, tp, n) ;
+  return cp + n ;
+}
+
+void outBufInt (OutBuf *ob, long n)
+{
+  char *cp = outBufReserve (ob, 24) ;
+  if (n < 0) { *cp++ = '-' ; n = -n ; }
+  ob->cp = outBufDigits (cp, n) ;
+}
+
+char *outBufFixed6 (char *cp, double x) /* as printf "%f"; cp needs 24 bytes */
+{
+  double y = fabs (x) * 1e6 ;
+  if (!(y < 1e9) || fabs (y - floor (y) - 0.5) < 1e-6) /* large, nan, or near a rounding tie */
+    return cp + snprintf (cp, 24, "%f", x) ;
+  unsigned long v = floor (y + 0.5) ;
+  if (signbit (x)) *cp++ = '-' ;	/* printf also gives "-0.000000" for small negatives */
+  cp = outBufDigits (cp, v / 1000000) ;
+  *cp++ = '.' ;
+  v %= 1000000 ;
+  int i ; for (i = 6 ; i-- ; ) { cp[i] = '0' + v % 10 ; v /= 10 ; }
+  return cp + 6 ;
+}
+
 /***************** rusage for timing information ******************/
 
 #include <sys/resource.h>
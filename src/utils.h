@@ -31,6 +31,7 @@
 #include <string.h>		/* memset() */
 #include <limits.h>		/* INT_MAX etc. */
 #include <errno.h>
+#include <pthread.h>
 #include "zlib.h"
 
 #ifndef BOOL_DEFINED
@@ -53,6 +54,37 @@ void *_mycalloc (long number, int size) ;
 FILE *fopenTag (char* root, char* tag, char* mode) ;
 gzFile gzopenTag (char* root, char* tag, char* mode) ;
 char *fgetword (FILE *f) ;	/* not threadsafe */
+
+/* buffered text output, optionally gzip compressed in a background thread */
+#ifndef OUTBUF_DEFINED
+#define OUTBUF_DEFINED
+typedef struct OutBufStruct {
+  char *buf, *cp, *end ;	/* fill from cp up to end */
+  long size ;
+  FILE *fp ;
+  gzFile gz ;
+  char *pending ;		/* buffer being compressed */
+  long nPending ;
+  BOOL isDone ;
+  pthread_t thread ;
+  pthread_mutex_t lock ;
+  pthread_cond_t ready, written ;
+} OutBuf ;
+OutBuf *outBufCreate (FILE *fp, BOOL isGzip) ;
+void outBufDestroy (OutBuf *ob) ; /* flush and finish compression, but don't close fp */
+void outBufFlush (OutBuf *ob) ;
+char *outBufReserveSlow (OutBuf *ob, long n) ;
+static inline char *outBufReserve (OutBuf *ob, long n) /* get space for n chars at ob->cp */
+{ return (ob->end - ob->cp >= n) ? ob->cp : outBufReserveSlow (ob, n) ; }
+static inline void outBufPutc (OutBuf *ob, char c)
+{ if (ob->cp == ob->end) outBufFlush (ob) ; *ob->cp++ = c ; }
+static inline void outBufPuts (OutBuf *ob, char *s)
+{ long n = strlen (s) ; memcpy (outBufReserve (ob, n), s, n) ; ob->cp += n ; }
+void outBufPrintf (OutBuf *ob, char *format, ...) ;
+void outBufInt (OutBuf *ob, long n) ;
+char *outBufDigits (char *cp, unsigned long n) ; /* write n in decimal at cp, return new end */
+char *outBufFixed6 (char *cp, double x) ; /* same text as printf "%f"; needs 24 chars at cp */
+#endif
 void timeUpdate (FILE *f) ;	/* report to stderr resources used since last called */
 
 /************************/
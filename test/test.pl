@@ -0,0 +1,65 @@
+#!/usr/bin/env perl
+#
+# Regression tests for pbwt: each test runs pbwt on small generated inputs and
+# checks the output.  Run from the top level directory, as "make test" does;
+# set PBWT to test a binary other than ./pbwt.
+
+use strict ;
+use warnings ;
+use File::Temp qw(tempdir) ;
+
+my $pbwt = $ENV{PBWT} // './pbwt' ;
+die "no pbwt binary $pbwt - build it first\n" unless -x $pbwt ;
+my $dir = tempdir (CLEANUP => 1) ;
+my ($nPass, $nFail) = (0, 0) ;
+
+test_gen_long_alleles () ;
+
+print "$nPass passed, $nFail failed\n" ;
+exit ($nFail ? 1 : 0) ;
+
+sub check
+{
+  my ($name, $ok, $msg) = @_ ;
+  if ($ok) { ++$nPass ; print "ok: $name\n" ; }
+  else { ++$nFail ; print "FAILED: $name - $msg\n" ; }
+}
+
+sub write_file
+{
+  my ($file, $text) = @_ ;
+  open (my $fh, '>', $file) or die "can't write $file: $!\n" ;
+  print $fh $text ;
+  close ($fh) ;
+}
+
+# -writeGen puts the alleles in both id columns and the allele column, so long
+# indel alleles need three times their length in each row.  With alleles of
+# about 3/16 of the 4MB output buffer, the second row starts with more than
+# twice but less than three times the allele length free at the buffer end.
+
+sub test_gen_long_alleles
+{
+  my $name = 'writeGen with long indel alleles' ;
+  my ($nSites, $len) = (4, 750000) ;
+  my (@legend, @hap, @expect) = ("id position a0 a1\n") ;
+  for my $i (1 .. $nSites)
+    { my $pos = 1000 * $i ;
+      my $ref = 'A' . substr ('ACGT' x ($len/4 + 1), $i % 4, $len + $i % 7) ;
+      push @legend, "rs$i $pos $ref A\n" ;
+      push @hap, ($i % 2) ? "0 1 1 1\n" : "1 1 0 0\n" ;
+      my $g = ($i % 2) ? "0 1 0 0 0 1" : "0 0 1 1 0 0" ;
+      push @expect, "20:${pos}_${ref}_A 20:${pos}_${ref}_A $pos $ref A $g\n" ;
+    }
+  write_file ("$dir/long.legend", join ('', @legend)) ;
+  write_file ("$dir/long.hap", join ('', @hap)) ;
+  my $status = system ("$pbwt -readHapLegend $dir/long.hap $dir/long.legend 20 -writeGen $dir/long.gen 2> $dir/long.log") ;
+  if ($status) { check ($name, 0, "pbwt exited with status $status") ; return ; }
+  open (my $fh, '<', "$dir/long.gen") or die "can't read $dir/long.gen: $!\n" ;
+  my @got = <$fh> ;
+  close ($fh) ;
+  my $i = 0 ;
+  ++$i while ($i < @expect && $i < @got && $got[$i] eq $expect[$i]) ;
+  check ($name, $i == @expect && @got == @expect,
+	 "output differs at line " . ($i+1) . " of " . scalar(@expect)) ;
+}